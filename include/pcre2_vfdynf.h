@@ -20,6 +20,12 @@ extern "C"
 
 typedef PVOID PCRE2_HANDLE;
 typedef PCRE2_HANDLE* PPCRE2_HANDLE;
+typedef PVOID PCRE2_THREAD_HANDLE;
+typedef PCRE2_THREAD_HANDLE* PPCRE2_THREAD_HANDLE;
+
+BOOLEAN Pcre2JitAvailable(
+    VOID
+    );
 
 VOID Pcre2Close(
     _In_ PCRE2_HANDLE Pcre2Handle
@@ -31,16 +37,63 @@ NTSTATUS Pcre2Compile(
     _In_ PUNICODE_STRING Pattern
     );
 
+//
+// Sets the match and depth limits of every match, zero leaves the library
+// default. Must be set before any thread context is created. A match which
+// exceeds a limit fails with STATUS_QUOTA_EXCEEDED.
+//
+
+VOID Pcre2SetMatchLimits(
+    _In_ ULONG MatchLimit,
+    _In_ ULONG DepthLimit
+    );
+
+//
+// A thread context holds the state used to match on one thread, such as the
+// JIT stack. A thread context must not be used by more than one thread at a
+// time. Matching without one borrows a context from a shared pool for the
+// duration of the match.
+//
+
+_Must_inspect_result_
+NTSTATUS Pcre2CreateThreadContext(
+    _Out_ PPCRE2_THREAD_HANDLE ThreadHandle
+    );
+
+VOID Pcre2FreeThreadContext(
+    _In_ PCRE2_THREAD_HANDLE ThreadHandle
+    );
+
 _Must_inspect_result_
 NTSTATUS Pcre2MatchEx(
     _In_ PCRE2_HANDLE Pcre2Handle,
     _In_ PUNICODE_STRING String,
+    _In_opt_ PCRE2_THREAD_HANDLE ThreadHandle,
     _Out_ PBOOLEAN Match
     );
 
 BOOLEAN Pcre2Match(
     _In_ PCRE2_HANDLE Pcre2Handle,
-    _In_ PUNICODE_STRING String
+    _In_ PUNICODE_STRING String,
+    _In_opt_ PCRE2_THREAD_HANDLE ThreadHandle
+    );
+
+_Must_inspect_result_
+NTSTATUS Pcre2Serialize(
+    _In_ PCRE2_HANDLE Pcre2Handle,
+    _Outptr_result_bytebuffer_(*Length) PVOID* Buffer,
+    _Out_ PSIZE_T Length
+    );
+
+VOID Pcre2SerializeFree(
+    _In_ PVOID Buffer
+    );
+
+_Must_inspect_result_
+NTSTATUS Pcre2Deserialize(
+    _Out_ PPCRE2_HANDLE Pcre2Handle,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ SIZE_T Length
     );
 
 #ifdef __cplusplus
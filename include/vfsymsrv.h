@@ -0,0 +1,136 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#ifndef _VFSYMSRV_H_
+#define _VFSYMSRV_H_
+
+//
+// Protocol between vfdynf and the out-of-process symbol broker (vfsymsrv).
+//
+// The client writes one request message to the broker pipe and reads one
+// response message back. A request is a header followed by the module table
+// and then the frames. Frames identify a module by index into the module table
+// and an RVA into that module. Modules are identified by their on disk path,
+// time date stamp, and size of image so the broker can share loaded symbols
+// between processes.
+//
+// The response is a header followed by one entry per frame. Each entry is
+// the length, in bytes, of the symbol name followed by the name itself, not
+// terminated. A length of zero means the broker did not resolve the frame.
+//
+
+#define VFSYMSRV_MAGIC              0x6d797376ul // 'vsym'
+#define VFSYMSRV_VERSION            1ul
+#define VFSYMSRV_DEFAULT_PIPE_NAME  L"vfsymsrv"
+#define VFSYMSRV_MAX_FRAMES         250
+#define VFSYMSRV_MAX_MODULE_PATH    260
+#define VFSYMSRV_MAX_NAME           1024
+#define VFSYMSRV_NO_MODULE          0xfffffffful
+
+typedef struct _VFSYMSRV_REQUEST_HEADER
+{
+    ULONG Magic;
+    ULONG Version;
+    ULONG ModuleCount;
+    ULONG FrameCount;
+} VFSYMSRV_REQUEST_HEADER, *PVFSYMSRV_REQUEST_HEADER;
+
+typedef struct _VFSYMSRV_MODULE
+{
+    ULONG TimeDateStamp;
+    ULONG SizeOfImage;
+    WCHAR FullName[VFSYMSRV_MAX_MODULE_PATH];
+} VFSYMSRV_MODULE, *PVFSYMSRV_MODULE;
+
+typedef struct _VFSYMSRV_FRAME
+{
+    ULONG ModuleIndex;
+    ULONG Rva;
+} VFSYMSRV_FRAME, *PVFSYMSRV_FRAME;
+
+typedef struct _VFSYMSRV_RESPONSE_HEADER
+{
+    ULONG Magic;
+    ULONG Version;
+    ULONG FrameCount;
+    ULONG Reserved;
+} VFSYMSRV_RESPONSE_HEADER, *PVFSYMSRV_RESPONSE_HEADER;
+
+#define VFSYMSRV_MAX_REQUEST_SIZE                                             \
+    (sizeof(VFSYMSRV_REQUEST_HEADER) +                                        \
+     (VFSYMSRV_MAX_FRAMES * sizeof(VFSYMSRV_MODULE)) +                        \
+     (VFSYMSRV_MAX_FRAMES * sizeof(VFSYMSRV_FRAME)))
+
+#define VFSYMSRV_MAX_RESPONSE_SIZE                                            \
+    (sizeof(VFSYMSRV_RESPONSE_HEADER) +                                       \
+     (VFSYMSRV_MAX_FRAMES * (sizeof(USHORT) +                                 \
+                             (VFSYMSRV_MAX_NAME * sizeof(WCHAR)))))
+
+//
+// Fault log written by vfdynf when the FaultLogPath property is set, and
+// symbolized offline in batch by vfsymsrv (vfsymsrv.exe -log), or on any host
+// by vflogsym. The verified process records only module identities and RVAs,
+// it never loads symbols.
+//
+// A log is a header followed by records. Every record begins with a record
+// header giving its type and total length, readers skip record types they do
+// not understand. A module record is written the first time a frame lands in
+// a module and assigns the module an index. Fault records refer to frames by
+// module index and RVA using the same frame layout as the broker protocol.
+// Indices are never reused, a module which is unloaded and loaded again is
+// described by a new module record.
+// All fields are little endian and records are padded to eight bytes.
+//
+
+#define VFSYMSRV_LOG_MAGIC          0x676f6c76ul // 'vlog'
+#define VFSYMSRV_LOG_VERSION        1ul
+#define VFSYMSRV_LOG_RECORD_MODULE  1
+#define VFSYMSRV_LOG_RECORD_FAULT   2
+
+typedef struct _VFSYMSRV_LOG_HEADER
+{
+    ULONG Magic;
+    ULONG Version;
+    ULONG ProcessId;
+    ULONG Reserved;
+    LARGE_INTEGER StartTime;
+} VFSYMSRV_LOG_HEADER, *PVFSYMSRV_LOG_HEADER;
+
+typedef struct _VFSYMSRV_LOG_RECORD
+{
+    USHORT Type;
+    USHORT Reserved;
+    ULONG Length;
+} VFSYMSRV_LOG_RECORD, *PVFSYMSRV_LOG_RECORD;
+
+typedef struct _VFSYMSRV_LOG_MODULE
+{
+    VFSYMSRV_LOG_RECORD Record;
+    ULONG Index;
+    ULONG TimeDateStamp;
+    ULONG SizeOfImage;
+    USHORT NameLength;
+    USHORT Reserved;
+    WCHAR FullName[ANYSIZE_ARRAY];
+} VFSYMSRV_LOG_MODULE, *PVFSYMSRV_LOG_MODULE;
+
+typedef struct _VFSYMSRV_LOG_FAULT
+{
+    VFSYMSRV_LOG_RECORD Record;
+    ULONG FaultType;
+    ULONG StackHash;
+    ULONG ThreadId;
+    ULONG FrameCount;
+    LARGE_INTEGER Time;
+    VFSYMSRV_FRAME Frames[ANYSIZE_ARRAY];
+} VFSYMSRV_LOG_FAULT, *PVFSYMSRV_LOG_FAULT;
+
+#define VFSYMSRV_LOG_MAX_MODULE_SIZE                                          \
+    (FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName) +                            \
+     (VFSYMSRV_MAX_MODULE_PATH * sizeof(WCHAR)))
+
+#define VFSYMSRV_LOG_MAX_FAULT_SIZE                                           \
+    (FIELD_OFFSET(VFSYMSRV_LOG_FAULT, Frames) +                               \
+     (VFSYMSRV_MAX_FRAMES * sizeof(VFSYMSRV_FRAME)))
+
+#endif
@@ -9,6 +9,127 @@
 
 #include <pcre2_vfdynf.h>
 
+#define PCRE2_JIT_STACK_START_SIZE (32 * 1024)
+#define PCRE2_JIT_STACK_MAX_SIZE   (1024 * 1024)
+
+//
+// State for matching on a single thread. The JIT stack is not shareable
+// between threads that match concurrently, so each thread brings its own.
+// The match data is reused for every match on the thread, only whether a
+// pattern matched is reported so a single ovector pair suffices for any
+// pattern. The interpreter keeps its backtracking frames in the match data
+// and they are retained between matches.
+//
+typedef struct _PCRE2_THREAD_CONTEXT
+{
+    SLIST_ENTRY PoolEntry;
+    pcre2_match_context* MatchContext;
+    pcre2_jit_stack* JitStack;
+    pcre2_match_data* MatchData;
+} PCRE2_THREAD_CONTEXT, *PPCRE2_THREAD_CONTEXT;
+
+static LONG Pcre2JitState = -1;
+
+//
+// Thread contexts lent to matches made without one. A context is taken for
+// the duration of a match and returned after, the pool grows to the number of
+// such matches made concurrently and its contexts are not freed.
+//
+static SLIST_HEADER Pcre2ContextPool;
+
+//
+// Limits applied to every match, zero leaves the library default. These are
+// set once before any thread context is created.
+//
+static ULONG Pcre2MatchLimit = 0;
+static ULONG Pcre2DepthLimit = 0;
+
+//
+// N.B. PCRE2 allocates from a private heap rather than the process heap. The
+// process heap is the heap being verified and instrumented in the target and
+// regular expressions are evaluated on the paths which are instrumenting it.
+//
+static PVOID Pcre2Heap = NULL;
+static pcre2_general_context* Pcre2GeneralContext = NULL;
+
+void* Pcre2Malloc(
+    _In_ size_t Size,
+    _In_ void* MemoryData
+    )
+{
+    return RtlAllocateHeap(MemoryData, 0, Size);
+}
+
+void Pcre2Free(
+    _In_opt_ void* Block,
+    _In_ void* MemoryData
+    )
+{
+    if (Block)
+    {
+        RtlFreeHeap(MemoryData, 0, Block);
+    }
+}
+
+_Ret_maybenull_
+pcre2_general_context* Pcre2GetGeneralContext(
+    VOID
+    )
+{
+    PVOID heap;
+    PVOID existing;
+    pcre2_general_context* context;
+
+    context = ReadPointerAcquire((PVOID*)&Pcre2GeneralContext);
+    if (context)
+    {
+        return context;
+    }
+
+    //
+    // Another thread may have raced to create the heap or the context, the
+    // first one published is used. The heap is published before the context.
+    //
+    heap = ReadPointerAcquire(&Pcre2Heap);
+    if (!heap)
+    {
+        heap = RtlCreateHeap(HEAP_GROWABLE | HEAP_CLASS_1,
+                             NULL,
+                             0,
+                             0,
+                             NULL,
+                             NULL);
+        if (!heap)
+        {
+            return NULL;
+        }
+
+        existing = InterlockedCompareExchangePointer(&Pcre2Heap, heap, NULL);
+        if (existing)
+        {
+            RtlDestroyHeap(heap);
+            heap = existing;
+        }
+    }
+
+    context = pcre2_general_context_create(Pcre2Malloc, Pcre2Free, heap);
+    if (!context)
+    {
+        return NULL;
+    }
+
+    existing = InterlockedCompareExchangePointer((PVOID*)&Pcre2GeneralContext,
+                                                 context,
+                                                 NULL);
+    if (existing)
+    {
+        pcre2_general_context_free(context);
+        return existing;
+    }
+
+    return context;
+}
+
 NTSTATUS Pcre2ErrorToNtStatus(
     _In_ int ErrorCode
     )
@@ -58,12 +179,10 @@ NTSTATUS Pcre2ErrorToNtStatus(
         case PCRE2_ERROR_DFA_WSSIZE:
         case PCRE2_ERROR_JIT_BADOPTION:
         case PCRE2_ERROR_JIT_STACKLIMIT:
-        case PCRE2_ERROR_MATCHLIMIT:
         case PCRE2_ERROR_NOSUBSTRING:
         case PCRE2_ERROR_NOUNIQUESUBSTRING:
         case PCRE2_ERROR_NULL:
         case PCRE2_ERROR_RECURSELOOP:
-        case PCRE2_ERROR_DEPTHLIMIT: // PCRE2_ERROR_RECURSIONLIMIT
         case PCRE2_ERROR_UNAVAILABLE:
         case PCRE2_ERROR_UNSET:
         case PCRE2_ERROR_BADOFFSETLIMIT:
@@ -77,6 +196,9 @@ NTSTATUS Pcre2ErrorToNtStatus(
         case PCRE2_ERROR_INTERNAL_DUPMATCH:
         case PCRE2_ERROR_DFA_UINVALID_UTF:
             return STATUS_BAD_DATA;
+        case PCRE2_ERROR_MATCHLIMIT:
+        case PCRE2_ERROR_DEPTHLIMIT: // PCRE2_ERROR_RECURSIONLIMIT
+            return STATUS_QUOTA_EXCEEDED;
         case PCRE2_ERROR_HEAPLIMIT:
         case PCRE2_ERROR_NOMEMORY:
             return STATUS_INSUFFICIENT_RESOURCES;
@@ -91,6 +213,58 @@ NTSTATUS Pcre2ErrorToNtStatus(
     }
 }
 
+BOOLEAN Pcre2JitAvailable(
+    VOID
+    )
+{
+    LONG state;
+    uint32_t jit;
+
+    state = ReadNoFence(&Pcre2JitState);
+    if (state < 0)
+    {
+        //
+        // N.B. JIT support is decided when the library is built and may be
+        // unavailable at runtime, e.g. when executable memory is prohibited.
+        //
+        if (pcre2_config(PCRE2_CONFIG_JIT, &jit) < 0)
+        {
+            jit = 0;
+        }
+
+        state = (jit ? 1 : 0);
+
+        WriteNoFence(&Pcre2JitState, state);
+    }
+
+    return (state != 0);
+}
+
+VOID Pcre2JitCompile(
+    _In_ pcre2_code* Code
+    )
+{
+    int rc;
+
+    if (!Pcre2JitAvailable())
+    {
+        return;
+    }
+
+    //
+    // A pattern which fails to JIT compile is still matched by the
+    // interpreter, pcre2_match selects the JIT code only when it exists.
+    //
+    rc = pcre2_jit_compile(Code, PCRE2_JIT_COMPLETE);
+    if (rc == PCRE2_ERROR_NOMEMORY)
+    {
+        //
+        // Executable memory is not available to this process. Stop trying.
+        //
+        WriteNoFence(&Pcre2JitState, 0);
+    }
+}
+
 VOID Pcre2Close(
     _In_ PCRE2_HANDLE Pcre2Handle
     )
@@ -104,58 +278,240 @@ NTSTATUS Pcre2Compile(
     _In_ PUNICODE_STRING Pattern
     )
 {
+    pcre2_general_context* generalContext;
+    pcre2_compile_context* compileContext;
     pcre2_code* code;
     int errorCode;
     size_t errorOffset;
 
     *Pcre2Handle = NULL;
 
+    generalContext = Pcre2GetGeneralContext();
+    if (!generalContext)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    compileContext = pcre2_compile_context_create(generalContext);
+    if (!compileContext)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
     code = pcre2_compile((PCRE2_SPTR16)Pattern->Buffer,
                          Pattern->Length / sizeof(WCHAR),
                          PCRE2_DOTALL,
                          &errorCode,
                          &errorOffset,
-                         NULL);
+                         compileContext);
+
+    pcre2_compile_context_free(compileContext);
+
     if (!code)
     {
         return Pcre2ErrorToNtStatus(errorCode);
     }
 
+    Pcre2JitCompile(code);
+
     *Pcre2Handle = (PCRE2_HANDLE)code;
 
     return STATUS_SUCCESS;
 }
 
+VOID Pcre2SetMatchLimits(
+    _In_ ULONG MatchLimit,
+    _In_ ULONG DepthLimit
+    )
+{
+    Pcre2MatchLimit = MatchLimit;
+    Pcre2DepthLimit = DepthLimit;
+}
+
+_Ret_maybenull_
+pcre2_match_context* Pcre2CreateMatchContext(
+    _In_ pcre2_general_context* GeneralContext
+    )
+{
+    pcre2_match_context* matchContext;
+
+    matchContext = pcre2_match_context_create(GeneralContext);
+    if (!matchContext)
+    {
+        return NULL;
+    }
+
+    //
+    // N.B. The depth limit only applies to the interpreter, the JIT code is
+    // bounded by the match limit and the size of its stack.
+    //
+    if (Pcre2MatchLimit)
+    {
+        pcre2_set_match_limit(matchContext, Pcre2MatchLimit);
+    }
+
+    if (Pcre2DepthLimit)
+    {
+        pcre2_set_depth_limit(matchContext, Pcre2DepthLimit);
+    }
+
+    return matchContext;
+}
+
+_Must_inspect_result_
+NTSTATUS Pcre2CreateThreadContext(
+    _Out_ PPCRE2_THREAD_HANDLE ThreadHandle
+    )
+{
+    pcre2_general_context* generalContext;
+    PPCRE2_THREAD_CONTEXT context;
+
+    *ThreadHandle = NULL;
+
+    generalContext = Pcre2GetGeneralContext();
+    if (!generalContext)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    context = RtlAllocateHeap(Pcre2Heap,
+                              HEAP_ZERO_MEMORY,
+                              sizeof(PCRE2_THREAD_CONTEXT));
+    if (!context)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    context->MatchData = pcre2_match_data_create(1, generalContext);
+    if (!context->MatchData)
+    {
+        RtlFreeHeap(Pcre2Heap, 0, context);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (Pcre2JitAvailable() || Pcre2MatchLimit || Pcre2DepthLimit)
+    {
+        context->MatchContext = Pcre2CreateMatchContext(generalContext);
+    }
+
+    if (Pcre2JitAvailable())
+    {
+        context->JitStack = pcre2_jit_stack_create(PCRE2_JIT_STACK_START_SIZE,
+                                                   PCRE2_JIT_STACK_MAX_SIZE,
+                                                   generalContext);
+
+        //
+        // Without a JIT stack the JIT code uses a small region of the machine
+        // stack, matches that exhaust it fall back to the interpreter.
+        //
+        if (context->MatchContext && context->JitStack)
+        {
+            pcre2_jit_stack_assign(context->MatchContext,
+                                   NULL,
+                                   context->JitStack);
+        }
+    }
+
+    *ThreadHandle = (PCRE2_THREAD_HANDLE)context;
+
+    return STATUS_SUCCESS;
+}
+
+VOID Pcre2FreeThreadContext(
+    _In_ PCRE2_THREAD_HANDLE ThreadHandle
+    )
+{
+    PPCRE2_THREAD_CONTEXT context;
+
+    context = (PPCRE2_THREAD_CONTEXT)ThreadHandle;
+
+    if (context->JitStack)
+    {
+        pcre2_jit_stack_free(context->JitStack);
+    }
+
+    if (context->MatchContext)
+    {
+        pcre2_match_context_free(context->MatchContext);
+    }
+
+    pcre2_match_data_free(context->MatchData);
+
+    RtlFreeHeap(Pcre2Heap, 0, context);
+}
+
 _Must_inspect_result_
 NTSTATUS Pcre2MatchEx(
     _In_ PCRE2_HANDLE Pcre2Handle,
     _In_ PUNICODE_STRING String,
+    _In_opt_ PCRE2_THREAD_HANDLE ThreadHandle,
     _Out_ PBOOLEAN Match
     )
 {
     pcre2_code* code;
+    PPCRE2_THREAD_CONTEXT context;
+    PSLIST_ENTRY entry;
+    NTSTATUS status;
+    pcre2_match_context* matchContext;
     pcre2_match_data* matchData;
     int offset;
 
     *Match = FALSE;
 
     code = (pcre2_code*)Pcre2Handle;
+    context = (PPCRE2_THREAD_CONTEXT)ThreadHandle;
 
-    matchData = pcre2_match_data_create_from_pattern(code, NULL);
-    if (!matchData)
+    if (!context)
     {
-        return STATUS_INSUFFICIENT_RESOURCES;
+        entry = RtlInterlockedPopEntrySList(&Pcre2ContextPool);
+        if (entry)
+        {
+            context = CONTAINING_RECORD(entry, PCRE2_THREAD_CONTEXT, PoolEntry);
+        }
+        else
+        {
+            status = Pcre2CreateThreadContext((PPCRE2_THREAD_HANDLE)&context);
+            if (!NT_SUCCESS(status))
+            {
+                return status;
+            }
+        }
     }
 
+    matchContext = context->MatchContext;
+    matchData = context->MatchData;
+
     offset = pcre2_match(code,
                          (PCRE2_SPTR16)String->Buffer,
                          String->Length / sizeof(WCHAR),
                          0,
                          0,
                          matchData,
-                         NULL);
+                         matchContext);
+    if (offset == PCRE2_ERROR_JIT_STACKLIMIT)
+    {
+        //
+        // The JIT stack could not grow enough for this subject. The
+        // interpreter keeps its backtracking frames on the heap.
+        //
+        offset = pcre2_match(code,
+                             (PCRE2_SPTR16)String->Buffer,
+                             String->Length / sizeof(WCHAR),
+                             0,
+                             PCRE2_NO_JIT,
+                             matchData,
+                             matchContext);
+    }
 
-    pcre2_match_data_free(matchData);
+    if (!ThreadHandle)
+    {
+        RtlInterlockedPushEntrySList(&Pcre2ContextPool, &context->PoolEntry);
+    }
+
+    if ((offset < 0) && (offset != PCRE2_ERROR_NOMATCH))
+    {
+        return Pcre2ErrorToNtStatus(offset);
+    }
 
     *Match = (offset >= 0);
 
@@ -165,15 +521,120 @@ NTSTATUS Pcre2MatchEx(
 
 BOOLEAN Pcre2Match(
     _In_ PCRE2_HANDLE Pcre2Handle,
-    _In_ PUNICODE_STRING String
+    _In_ PUNICODE_STRING String,
+    _In_opt_ PCRE2_THREAD_HANDLE ThreadHandle
     )
 {
     BOOLEAN match;
 
-    if (NT_SUCCESS(Pcre2MatchEx(Pcre2Handle, String, &match)))
+    if (NT_SUCCESS(Pcre2MatchEx(Pcre2Handle, String, ThreadHandle, &match)))
     {
         return match;
     }
 
     return FALSE;
 }
+
+_Must_inspect_result_
+NTSTATUS Pcre2Serialize(
+    _In_ PCRE2_HANDLE Pcre2Handle,
+    _Outptr_result_bytebuffer_(*Length) PVOID* Buffer,
+    _Out_ PSIZE_T Length
+    )
+{
+    pcre2_general_context* generalContext;
+    const pcre2_code* code;
+    uint8_t* bytes;
+    PCRE2_SIZE size;
+    int32_t count;
+
+    *Buffer = NULL;
+    *Length = 0;
+
+    generalContext = Pcre2GetGeneralContext();
+    if (!generalContext)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    code = (const pcre2_code*)Pcre2Handle;
+
+    count = pcre2_serialize_encode(&code,
+                                   1,
+                                   &bytes,
+                                   &size,
+                                   generalContext);
+    if (count < 0)
+    {
+        return Pcre2ErrorToNtStatus(count);
+    }
+
+    *Buffer = bytes;
+    *Length = size;
+
+    return STATUS_SUCCESS;
+}
+
+VOID Pcre2SerializeFree(
+    _In_ PVOID Buffer
+    )
+{
+    pcre2_serialize_free((uint8_t*)Buffer);
+}
+
+_Must_inspect_result_
+NTSTATUS Pcre2Deserialize(
+    _Out_ PPCRE2_HANDLE Pcre2Handle,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ SIZE_T Length
+    )
+{
+    pcre2_general_context* generalContext;
+    pcre2_code* code;
+    int32_t count;
+
+    *Pcre2Handle = NULL;
+
+    //
+    // N.B. The serialized data is self describing, PCRE2 validates the magic,
+    // version, and configuration but does not bound the reads by a length.
+    // The caller is responsible for verifying the integrity of the buffer.
+    //
+    UNREFERENCED_PARAMETER(Length);
+
+    count = pcre2_serialize_get_number_of_codes((const uint8_t*)Buffer);
+    if (count < 0)
+    {
+        return Pcre2ErrorToNtStatus(count);
+    }
+
+    if (count != 1)
+    {
+        return STATUS_BAD_DATA;
+    }
+
+    generalContext = Pcre2GetGeneralContext();
+    if (!generalContext)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    count = pcre2_serialize_decode(&code,
+                                   1,
+                                   (const uint8_t*)Buffer,
+                                   generalContext);
+    if (count < 0)
+    {
+        return Pcre2ErrorToNtStatus(count);
+    }
+
+    //
+    // N.B. JIT code is not part of the serialized form, it is generated again
+    // for each process.
+    //
+    Pcre2JitCompile(code);
+
+    *Pcre2Handle = (PCRE2_HANDLE)code;
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,119 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include "fuzzcls_host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+//
+// Throughput of each classifier kernel this host can run, over buffers the
+// size of a large file read. The buffers are classified whole, without the
+// 1 KiB blocks of AVrfpFuzzBuffer, so the numbers are per byte.
+//
+// usage: bench_fuzzcls [iterations]
+//
+
+#define FUZZCLS_BENCH_LENGTH     (4 * 1024 * 1024)
+#define FUZZCLS_BENCH_ITERATIONS 64
+
+static double FuzzClsNow(
+    void
+    )
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((double)now.tv_sec + ((double)now.tv_nsec / 1e9));
+}
+
+int main(
+    int argc,
+    char* argv[]
+    )
+{
+    static const char* fills[] = { "text", "binary", "unicode" };
+    FUZZCLS_KERNEL_ENTRY kernels[FUZZCLS_MAX_KERNELS];
+    ULONG count;
+    ULONG iterations;
+    PBYTE buffer;
+    uint64_t state;
+    volatile SIZE_T sink;
+
+    iterations = ((argc > 1) ? (ULONG)strtoul(argv[1], NULL, 0) : FUZZCLS_BENCH_ITERATIONS);
+    if (!iterations)
+    {
+        iterations = 1;
+    }
+
+    buffer = malloc(FUZZCLS_BENCH_LENGTH);
+    if (!buffer)
+    {
+        return 1;
+    }
+
+    count = FuzzClsQueryKernels(kernels);
+    state = 0x2545f4914f6cdd1dull;
+    sink = 0;
+
+    for (SIZE_T f = 0; f < (sizeof(fills) / sizeof(fills[0])); f++)
+    {
+        for (SIZE_T i = 0; i < FUZZCLS_BENCH_LENGTH; i++)
+        {
+            BYTE value;
+
+            state ^= (state << 13);
+            state ^= (state >> 7);
+            state ^= (state << 17);
+
+            value = (BYTE)state;
+
+            //
+            // No sentinel runs, the whole buffer is scanned.
+            //
+            if (f == 0)
+            {
+                value = (BYTE)(0x20 + (value % 0x5e));
+                buffer[i] = ((value == VFDYNF_FUZZ_SENTINEL) ? ' ' : value);
+            }
+            else if (f == 1)
+            {
+                buffer[i] = ((value == VFDYNF_FUZZ_SENTINEL) ? 0 : value);
+            }
+            else
+            {
+                value = (BYTE)(0x20 + (value % 0x5e));
+                buffer[i] = ((i & 1) ? 0 : ((value == VFDYNF_FUZZ_SENTINEL) ? ' ' : value));
+            }
+        }
+
+        for (ULONG k = 0; k < count; k++)
+        {
+            double start;
+            double elapsed;
+
+            start = FuzzClsNow();
+
+            for (ULONG i = 0; i < iterations; i++)
+            {
+                SIZE_T length;
+
+                length = FUZZCLS_BENCH_LENGTH;
+                sink += kernels[k].Kernel(buffer, &length);
+            }
+
+            elapsed = (FuzzClsNow() - start);
+
+            printf("%-8s %-7s %10.1f MiB/s\n",
+                   fills[f],
+                   kernels[k].Name,
+                   (((double)FUZZCLS_BENCH_LENGTH * iterations) / (1024.0 * 1024.0)) / elapsed);
+        }
+    }
+
+    free(buffer);
+
+    return (sink ? 0 : 1);
+}
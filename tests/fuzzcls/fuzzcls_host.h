@@ -0,0 +1,78 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#pragma once
+
+//
+// Builds the classifier kernels of vfdynf/fuzzcls.h on a host without the
+// Windows headers. Only what the kernels use is defined.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t BYTE, *PBYTE;
+typedef uint8_t BOOLEAN;
+typedef uint32_t ULONG;
+typedef size_t SIZE_T, *PSIZE_T;
+
+#define TRUE  1
+#define FALSE 0
+
+#define FORCEINLINE static inline
+
+#define _In_
+#define _Inout_
+#define _In_reads_bytes_(Size)
+
+//
+// N.B. Must match vfdynf.h.
+//
+#define VFDYNF_FUZZ_SENTINEL '#'
+
+#include <fuzzcls.h>
+
+typedef SIZE_T (*PFUZZCLS_KERNEL)(
+    _In_reads_bytes_(*Length) PBYTE Buffer,
+    _Inout_ PSIZE_T Length
+    );
+
+typedef struct _FUZZCLS_KERNEL_ENTRY
+{
+    const char* Name;
+    PFUZZCLS_KERNEL Kernel;
+} FUZZCLS_KERNEL_ENTRY, *PFUZZCLS_KERNEL_ENTRY;
+
+//
+// Fills Kernels with the kernels this host can run, the scalar kernel first.
+//
+static inline ULONG FuzzClsQueryKernels(
+    PFUZZCLS_KERNEL_ENTRY Kernels
+    )
+{
+    ULONG count;
+
+    count = 0;
+
+    Kernels[count].Name = "scalar";
+    Kernels[count++].Kernel = AVrfpFuzzCountPrintable;
+
+#if defined(VFDYNF_FUZZ_CLASSIFY_SSE2)
+    Kernels[count].Name = "sse2";
+    Kernels[count++].Kernel = AVrfpFuzzCountPrintableSse2;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        Kernels[count].Name = "avx2";
+        Kernels[count++].Kernel = AVrfpFuzzCountPrintableAvx2;
+    }
+#elif defined(VFDYNF_FUZZ_CLASSIFY_NEON)
+    Kernels[count].Name = "neon";
+    Kernels[count++].Kernel = AVrfpFuzzCountPrintableNeon;
+#endif
+
+    return count;
+}
+
+#define FUZZCLS_MAX_KERNELS 4
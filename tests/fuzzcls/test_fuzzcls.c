@@ -0,0 +1,321 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include "fuzzcls_host.h"
+
+#include <stdio.h>
+#include <string.h>
+
+//
+// Checks that every vector kernel gives exactly the result of the scalar
+// classifier, the printable count and the clamped length, and that the scalar
+// classifier agrees with a plain reading of its definition. Buffers start at
+// every offset within a vector so both the head and the tail are unaligned,
+// and the bytes past the end are sentinels so a kernel which reads past the
+// length is caught.
+//
+
+#define FUZZCLS_TEST_MAX_LENGTH 4096
+#define FUZZCLS_TEST_MAX_OFFSET 32
+#define FUZZCLS_TEST_PADDING    64
+#define FUZZCLS_TEST_RANDOM     20000
+
+typedef enum _FUZZCLS_FILL
+{
+    FuzzClsFillRandom,
+    FuzzClsFillPrintable,
+    FuzzClsFillSparseSentinels,
+    FuzzClsFillSentinels,
+    FuzzClsFillUnicode,
+    FuzzClsFillCount
+} FUZZCLS_FILL;
+
+static const char* FuzzClsFillNames[FuzzClsFillCount] =
+{
+    "random",
+    "printable",
+    "sparse sentinels",
+    "sentinels",
+    "unicode",
+};
+
+static const SIZE_T FuzzClsEdgeLengths[] =
+{
+    0, 1, 2, 4, 5, 6, 15, 16, 17, 31, 32, 33, 47, 48, 49, 63, 64, 65,
+    95, 96, 97, 127, 128, 129, 1023, 1024, 1025,
+};
+
+static uint64_t FuzzClsRandomState = 0x9e3779b97f4a7c15ull;
+static BYTE FuzzClsArena[FUZZCLS_TEST_MAX_OFFSET + FUZZCLS_TEST_MAX_LENGTH + FUZZCLS_TEST_PADDING];
+static FUZZCLS_KERNEL_ENTRY FuzzClsKernels[FUZZCLS_MAX_KERNELS];
+static ULONG FuzzClsKernelCount;
+static ULONG FuzzClsCases;
+static ULONG FuzzClsFailures;
+
+static uint64_t FuzzClsRandom(
+    void
+    )
+{
+    uint64_t x;
+
+    x = FuzzClsRandomState;
+    x ^= (x << 13);
+    x ^= (x >> 7);
+    x ^= (x << 17);
+    FuzzClsRandomState = x;
+
+    return x;
+}
+
+static BYTE FuzzClsRandomPrintable(
+    void
+    )
+{
+    return (BYTE)(0x20 + (FuzzClsRandom() % (0x7f - 0x20)));
+}
+
+static void FuzzClsFill(
+    PBYTE Buffer,
+    SIZE_T Length,
+    FUZZCLS_FILL Fill
+    )
+{
+    for (SIZE_T i = 0; i < Length; i++)
+    {
+        switch (Fill)
+        {
+            case FuzzClsFillRandom:
+            {
+                Buffer[i] = (BYTE)FuzzClsRandom();
+                break;
+            }
+            case FuzzClsFillPrintable:
+            {
+                Buffer[i] = FuzzClsRandomPrintable();
+                break;
+            }
+            case FuzzClsFillSparseSentinels:
+            {
+                Buffer[i] = (((FuzzClsRandom() % 4) == 0) ?
+                             VFDYNF_FUZZ_SENTINEL :
+                             FuzzClsRandomPrintable());
+                break;
+            }
+            case FuzzClsFillSentinels:
+            {
+                Buffer[i] = VFDYNF_FUZZ_SENTINEL;
+                break;
+            }
+            case FuzzClsFillUnicode:
+            {
+                Buffer[i] = ((i & 1) ? 0 : FuzzClsRandomPrintable());
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+    }
+}
+
+//
+// The classifier as described, independent of AVrfpFuzzCountStep. The length
+// is clamped to the start of the first run of sentinels and only the bytes
+// before it are counted.
+//
+static SIZE_T FuzzClsReference(
+    PBYTE Buffer,
+    SIZE_T* Length
+    )
+{
+    SIZE_T end;
+    SIZE_T run;
+    SIZE_T printable;
+
+    end = *Length;
+    run = 0;
+
+    for (SIZE_T i = 0; i < *Length; i++)
+    {
+        run = ((Buffer[i] == VFDYNF_FUZZ_SENTINEL) ? (run + 1) : 0);
+        if (run == VFDYNF_FUZZ_CLASSIFY_SENTINELS)
+        {
+            end = ((i + 1) - VFDYNF_FUZZ_CLASSIFY_SENTINELS);
+            break;
+        }
+    }
+
+    printable = 0;
+
+    for (SIZE_T i = 0; i < end; i++)
+    {
+        if (((Buffer[i] >= 0x20) && (Buffer[i] <= 0x7e)) ||
+            (Buffer[i] == '\t') ||
+            (Buffer[i] == '\n') ||
+            (Buffer[i] == '\r'))
+        {
+            printable++;
+        }
+    }
+
+    *Length = end;
+
+    return printable;
+}
+
+static void FuzzClsCheck(
+    PBYTE Buffer,
+    SIZE_T Length,
+    const char* Description
+    )
+{
+    SIZE_T expectedLength;
+    SIZE_T expected;
+
+    //
+    // Anything read past the end looks like the start of a sentinel run.
+    //
+    memset(&Buffer[Length], VFDYNF_FUZZ_SENTINEL, FUZZCLS_TEST_PADDING);
+
+    expectedLength = Length;
+    expected = FuzzClsReference(Buffer, &expectedLength);
+
+    for (ULONG i = 0; i < FuzzClsKernelCount; i++)
+    {
+        SIZE_T length;
+        SIZE_T printable;
+
+        length = Length;
+        printable = FuzzClsKernels[i].Kernel(Buffer, &length);
+
+        FuzzClsCases++;
+
+        if ((printable != expected) || (length != expectedLength))
+        {
+            FuzzClsFailures++;
+
+            if (FuzzClsFailures <= 20)
+            {
+                printf("FAIL %s: %s length %zu offset %zu: printable %zu length %zu, expected %zu and %zu\n",
+                       FuzzClsKernels[i].Name,
+                       Description,
+                       Length,
+                       (SIZE_T)(Buffer - FuzzClsArena),
+                       printable,
+                       length,
+                       expected,
+                       expectedLength);
+            }
+        }
+    }
+}
+
+static void FuzzClsTestEdgeLengths(
+    void
+    )
+{
+    for (SIZE_T i = 0; i < (sizeof(FuzzClsEdgeLengths) / sizeof(FuzzClsEdgeLengths[0])); i++)
+    {
+        for (SIZE_T offset = 0; offset < FUZZCLS_TEST_MAX_OFFSET; offset++)
+        {
+            for (int fill = 0; fill < FuzzClsFillCount; fill++)
+            {
+                PBYTE buffer;
+
+                buffer = &FuzzClsArena[offset];
+
+                FuzzClsFill(buffer, FuzzClsEdgeLengths[i], (FUZZCLS_FILL)fill);
+                FuzzClsCheck(buffer, FuzzClsEdgeLengths[i], FuzzClsFillNames[fill]);
+            }
+        }
+    }
+}
+
+static void FuzzClsTestSentinelRuns(
+    void
+    )
+{
+    static const SIZE_T runs[] = { 1, 4, 5, 6, 9, 17, 33 };
+    static const SIZE_T lengths[] = { 33, 64, 100 };
+
+    //
+    // Runs which begin and end on every position around the vector widths,
+    // short runs do not clamp and long ones clamp where they begin.
+    //
+    for (SIZE_T l = 0; l < (sizeof(lengths) / sizeof(lengths[0])); l++)
+    {
+        for (SIZE_T r = 0; r < (sizeof(runs) / sizeof(runs[0])); r++)
+        {
+            for (SIZE_T position = 0; position < lengths[l]; position++)
+            {
+                for (SIZE_T offset = 0; offset < FUZZCLS_TEST_MAX_OFFSET; offset += 7)
+                {
+                    PBYTE buffer;
+                    SIZE_T end;
+
+                    buffer = &FuzzClsArena[offset];
+
+                    FuzzClsFill(buffer, lengths[l], FuzzClsFillPrintable);
+
+                    //
+                    // Keep the run apart from any sentinel the fill made.
+                    //
+                    for (SIZE_T i = 0; i < lengths[l]; i++)
+                    {
+                        if (buffer[i] == VFDYNF_FUZZ_SENTINEL)
+                        {
+                            buffer[i] = 'a';
+                        }
+                    }
+
+                    end = ((position + runs[r]) < lengths[l]) ? (position + runs[r]) : lengths[l];
+                    memset(&buffer[position], VFDYNF_FUZZ_SENTINEL, end - position);
+
+                    FuzzClsCheck(buffer, lengths[l], "sentinel run");
+                }
+            }
+        }
+    }
+}
+
+static void FuzzClsTestRandom(
+    void
+    )
+{
+    for (ULONG i = 0; i < FUZZCLS_TEST_RANDOM; i++)
+    {
+        PBYTE buffer;
+        SIZE_T length;
+        FUZZCLS_FILL fill;
+
+        buffer = &FuzzClsArena[FuzzClsRandom() % FUZZCLS_TEST_MAX_OFFSET];
+        length = (SIZE_T)(FuzzClsRandom() % (FUZZCLS_TEST_MAX_LENGTH + 1));
+        fill = (FUZZCLS_FILL)(FuzzClsRandom() % FuzzClsFillCount);
+
+        FuzzClsFill(buffer, length, fill);
+        FuzzClsCheck(buffer, length, FuzzClsFillNames[fill]);
+    }
+}
+
+int main(
+    void
+    )
+{
+    FuzzClsKernelCount = FuzzClsQueryKernels(FuzzClsKernels);
+
+    printf("kernels:");
+    for (ULONG i = 0; i < FuzzClsKernelCount; i++)
+    {
+        printf(" %s", FuzzClsKernels[i].Name);
+    }
+    printf("\n");
+
+    FuzzClsTestEdgeLengths();
+    FuzzClsTestSentinelRuns();
+    FuzzClsTestRandom();
+
+    printf("%u cases, %u failures\n", FuzzClsCases, FuzzClsFailures);
+
+    return (FuzzClsFailures ? 1 : 0);
+}
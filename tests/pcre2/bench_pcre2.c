@@ -0,0 +1,280 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#define PCRE2_CODE_UNIT_WIDTH 16
+#include <pcre2.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//
+// Matches per second of the interpreter and of the JIT code for the kinds of
+// expressions vfdynf evaluates, compiled and matched as pcre2_vfdynf.c does:
+// 16-bit code units, PCRE2_DOTALL, one ovector pair and a JIT stack growing
+// from 32 KiB to 1 MiB. The stacks are the symbolized stack text, one
+// "module!symbol" line per frame. Both paths must agree on every match.
+//
+// usage: bench_pcre2 [iterations]
+//
+
+#define PCRE2_BENCH_ITERATIONS 20000
+#define PCRE2_BENCH_MAX_TEXT   4096
+
+typedef struct _PCRE2_BENCH_CASE
+{
+    const char* Name;
+    const char* Pattern;
+    const char* Subject;
+} PCRE2_BENCH_CASE;
+
+#define PCRE2_BENCH_STACK_HEAD                                                \
+    "testdynf.exe!heap_alloc_dbg_internal\n"                                  \
+    "testdynf.exe!heap_alloc_dbg\n"                                           \
+    "testdynf.exe!_malloc_dbg\n"                                              \
+    "testdynf.exe!malloc\n"                                                   \
+    "testdynf.exe!operator new\n"                                             \
+    "testdynf.exe!std::_Default_allocate_traits::_Allocate\n"                 \
+    "testdynf.exe!std::_Allocate<16,std::_Default_allocate_traits,0>\n"
+
+#define PCRE2_BENCH_STACK_TAIL                                                \
+    "testdynf.exe!main\n"                                                     \
+    "testdynf.exe!invoke_main\n"                                              \
+    "testdynf.exe!__scrt_common_main_seh\n"                                   \
+    "testdynf.exe!__scrt_common_main\n"                                       \
+    "testdynf.exe!mainCRTStartup\n"                                           \
+    "KERNEL32.dll!BaseThreadInitThunk\n"                                      \
+    "ntdll.dll!RtlUserThreadStart\n"
+
+#define PCRE2_BENCH_EXCLUSION                                                 \
+    "\\s.*!.*_Alloc_proxy<.*>\\s.*!std::basic_string<.*>::basic_string<.*>\\s"
+
+static const PCRE2_BENCH_CASE Pcre2BenchCases[] =
+{
+    {
+        "exclusion, matching stack",
+        PCRE2_BENCH_EXCLUSION,
+        PCRE2_BENCH_STACK_HEAD
+        "testdynf.exe!std::allocator<std::_Container_proxy>::allocate\n"
+        "testdynf.exe!std::_Container_base12::_Alloc_proxy<std::allocator<std::_Container_proxy> >\n"
+        "testdynf.exe!std::basic_string<char,std::char_traits<char>,std::allocator<char> >::basic_string<char,std::char_traits<char>,std::allocator<char> >\n"
+        PCRE2_BENCH_STACK_TAIL
+    },
+    {
+        "exclusion, other stack",
+        PCRE2_BENCH_EXCLUSION,
+        PCRE2_BENCH_STACK_HEAD
+        "testdynf.exe!std::allocator<std::_Container_proxy>::allocate\n"
+        "testdynf.exe!std::_Container_base12::_Alloc_proxy<std::allocator<std::_Container_proxy> >\n"
+        "testdynf.exe!std::vector<char,std::allocator<char> >::vector<char,std::allocator<char> >\n"
+        PCRE2_BENCH_STACK_TAIL
+    },
+    {
+        "frame expression",
+        "!std::basic_string<.*>::basic_string<",
+        "testdynf.exe!std::basic_string<char,std::char_traits<char>,std::allocator<char> >::basic_string<char,std::char_traits<char>,std::allocator<char> >"
+    },
+    {
+        "module include",
+        "^(?:testdynf\\.exe|testdll\\.dll)$",
+        "KERNELBASE.dll"
+    },
+};
+
+typedef struct _PCRE2_BENCH_TEXT
+{
+    PCRE2_UCHAR16 Buffer[PCRE2_BENCH_MAX_TEXT];
+    PCRE2_SIZE Length;
+} PCRE2_BENCH_TEXT;
+
+static double Pcre2BenchNow(
+    void
+    )
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((double)now.tv_sec + ((double)now.tv_nsec / 1e9));
+}
+
+static void Pcre2BenchWiden(
+    const char* String,
+    PCRE2_BENCH_TEXT* Text
+    )
+{
+    Text->Length = 0;
+
+    while (String[Text->Length] && (Text->Length < PCRE2_BENCH_MAX_TEXT))
+    {
+        Text->Buffer[Text->Length] = (PCRE2_UCHAR16)(unsigned char)String[Text->Length];
+        Text->Length++;
+    }
+}
+
+//
+// Returns the matches per second, or a negative value if the result of a
+// match is not the expected one.
+//
+static double Pcre2BenchRun(
+    pcre2_code* Code,
+    const PCRE2_BENCH_TEXT* Subject,
+    uint32_t Options,
+    unsigned Iterations,
+    pcre2_match_data* MatchData,
+    pcre2_match_context* MatchContext,
+    int* Result
+    )
+{
+    double start;
+
+    *Result = pcre2_match(Code,
+                          Subject->Buffer,
+                          Subject->Length,
+                          0,
+                          Options,
+                          MatchData,
+                          MatchContext);
+
+    start = Pcre2BenchNow();
+
+    for (unsigned i = 0; i < Iterations; i++)
+    {
+        int rc;
+
+        rc = pcre2_match(Code,
+                         Subject->Buffer,
+                         Subject->Length,
+                         0,
+                         Options,
+                         MatchData,
+                         MatchContext);
+        if (rc != *Result)
+        {
+            return -1.0;
+        }
+    }
+
+    return ((double)Iterations / (Pcre2BenchNow() - start));
+}
+
+int main(
+    int argc,
+    char* argv[]
+    )
+{
+    static PCRE2_BENCH_TEXT pattern;
+    static PCRE2_BENCH_TEXT subject;
+    unsigned iterations;
+    uint32_t jit;
+    pcre2_match_data* matchData;
+    pcre2_match_context* matchContext;
+    pcre2_jit_stack* jitStack;
+    int exitCode;
+
+    iterations = ((argc > 1) ? (unsigned)strtoul(argv[1], NULL, 0) : PCRE2_BENCH_ITERATIONS);
+    if (!iterations)
+    {
+        iterations = 1;
+    }
+
+    if (pcre2_config(PCRE2_CONFIG_JIT, &jit) < 0)
+    {
+        jit = 0;
+    }
+
+    if (!jit)
+    {
+        printf("the PCRE2 library was built without JIT support\n");
+    }
+
+    matchData = pcre2_match_data_create(1, NULL);
+    matchContext = pcre2_match_context_create(NULL);
+    jitStack = pcre2_jit_stack_create(32 * 1024, 1024 * 1024, NULL);
+    if (!matchData || !matchContext || !jitStack)
+    {
+        return 1;
+    }
+
+    pcre2_jit_stack_assign(matchContext, NULL, jitStack);
+
+    exitCode = 0;
+
+    printf("%-28s %14s %14s %8s\n", "", "interpreter/s", "jit/s", "speedup");
+
+    for (size_t i = 0; i < (sizeof(Pcre2BenchCases) / sizeof(Pcre2BenchCases[0])); i++)
+    {
+        pcre2_code* code;
+        int errorCode;
+        PCRE2_SIZE errorOffset;
+        double interpreter;
+        double jitted;
+        int interpreterResult;
+        int jitResult;
+
+        Pcre2BenchWiden(Pcre2BenchCases[i].Pattern, &pattern);
+        Pcre2BenchWiden(Pcre2BenchCases[i].Subject, &subject);
+
+        code = pcre2_compile(pattern.Buffer,
+                             pattern.Length,
+                             PCRE2_DOTALL,
+                             &errorCode,
+                             &errorOffset,
+                             NULL);
+        if (!code)
+        {
+            printf("%s: compile failed (%d)\n", Pcre2BenchCases[i].Name, errorCode);
+            exitCode = 1;
+            continue;
+        }
+
+        interpreter = Pcre2BenchRun(code,
+                                    &subject,
+                                    PCRE2_NO_JIT,
+                                    iterations,
+                                    matchData,
+                                    matchContext,
+                                    &interpreterResult);
+
+        if (!jit || (pcre2_jit_compile(code, PCRE2_JIT_COMPLETE) != 0))
+        {
+            printf("%-28s %14.0f %14s\n", Pcre2BenchCases[i].Name, interpreter, "-");
+            pcre2_code_free(code);
+            continue;
+        }
+
+        jitted = Pcre2BenchRun(code,
+                               &subject,
+                               0,
+                               iterations,
+                               matchData,
+                               matchContext,
+                               &jitResult);
+
+        if ((interpreter < 0) || (jitted < 0) || (interpreterResult != jitResult))
+        {
+            printf("%s: results differ (%d, %d)\n",
+                   Pcre2BenchCases[i].Name,
+                   interpreterResult,
+                   jitResult);
+            exitCode = 1;
+        }
+        else
+        {
+            printf("%-28s %14.0f %14.0f %7.1fx\n",
+                   Pcre2BenchCases[i].Name,
+                   interpreter,
+                   jitted,
+                   jitted / interpreter);
+        }
+
+        pcre2_code_free(code);
+    }
+
+    pcre2_jit_stack_free(jitStack);
+    pcre2_match_context_free(matchContext);
+    pcre2_match_data_free(matchData);
+
+    return exitCode;
+}
@@ -0,0 +1,21 @@
+#
+# Runs vflogsym on the sample log and compares its report with the expected
+# one. Run from the test directory so the report names the log as given.
+#
+#   cmake -DVFLOGSYM=<path> -DSOURCE_DIR=<dir> -P check_vflogsym.cmake
+#
+execute_process(
+    COMMAND ${VFLOGSYM} symbols sample.vlog
+    WORKING_DIRECTORY ${SOURCE_DIR}
+    OUTPUT_VARIABLE actual
+    RESULT_VARIABLE result)
+
+file(READ ${SOURCE_DIR}/sample.txt expected)
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "vflogsym failed (${result}):\n${actual}")
+endif()
+
+if(NOT actual STREQUAL expected)
+    message(FATAL_ERROR "unexpected report:\n${actual}\nexpected:\n${expected}")
+endif()
@@ -0,0 +1,550 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <vflog.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Tests of the fault log reader and the stand-in symbol directory. The sample
+// log in this directory is parsed as written by vfdynf, other logs are built
+// in memory to cover the records a reader must skip or reject.
+//
+// usage: test_vflog <sample log> <symbol directory>
+//
+
+#define VFLOG_TEST_MAX_EVENTS 32
+#define VFLOG_TEST_MAX_LOG    4096
+
+typedef struct _VFLOG_TEST_EVENT
+{
+    USHORT Type;
+    BOOLEAN Invalid;
+    ULONG Offset;
+    VFLOG_MODULE Module;
+    VFLOG_FAULT Fault;
+} VFLOG_TEST_EVENT, *PVFLOG_TEST_EVENT;
+
+typedef struct _VFLOG_TEST_EVENTS
+{
+    ULONG Count;
+    VFLOG_TEST_EVENT Events[VFLOG_TEST_MAX_EVENTS];
+} VFLOG_TEST_EVENTS, *PVFLOG_TEST_EVENTS;
+
+typedef struct _VFLOG_TEST_LOG
+{
+    SIZE_T Length;
+    BYTE Buffer[VFLOG_TEST_MAX_LOG];
+} VFLOG_TEST_LOG, *PVFLOG_TEST_LOG;
+
+static ULONG VfLogTestChecks;
+static ULONG VfLogTestFailures;
+
+#define VFLOG_CHECK(Condition)                                                \
+    VfLogTestCheck((Condition) ? TRUE : FALSE, #Condition, __LINE__)
+
+static VOID VfLogTestCheck(
+    BOOLEAN Passed,
+    PCSTR Condition,
+    int Line
+    )
+{
+    VfLogTestChecks++;
+
+    if (!Passed)
+    {
+        VfLogTestFailures++;
+        printf("FAIL line %d: %s\n", Line, Condition);
+    }
+}
+
+static PVFLOG_TEST_EVENT VfLogTestNextEvent(
+    PVOID Context
+    )
+{
+    PVFLOG_TEST_EVENTS events;
+
+    events = Context;
+
+    if (events->Count == VFLOG_TEST_MAX_EVENTS)
+    {
+        return NULL;
+    }
+
+    return &events->Events[events->Count++];
+}
+
+static VOID VfLogTestOnModule(
+    PVOID Context,
+    PCVFLOG_MODULE Module
+    )
+{
+    PVFLOG_TEST_EVENT event;
+
+    event = VfLogTestNextEvent(Context);
+    if (event)
+    {
+        event->Type = VFSYMSRV_LOG_RECORD_MODULE;
+        event->Module = *Module;
+    }
+}
+
+static VOID VfLogTestOnFault(
+    PVOID Context,
+    PCVFLOG_FAULT Fault
+    )
+{
+    PVFLOG_TEST_EVENT event;
+
+    event = VfLogTestNextEvent(Context);
+    if (event)
+    {
+        event->Type = VFSYMSRV_LOG_RECORD_FAULT;
+        event->Fault = *Fault;
+    }
+}
+
+static VOID VfLogTestOnInvalid(
+    PVOID Context,
+    USHORT Type,
+    ULONG Offset
+    )
+{
+    PVFLOG_TEST_EVENT event;
+
+    event = VfLogTestNextEvent(Context);
+    if (event)
+    {
+        event->Type = Type;
+        event->Invalid = TRUE;
+        event->Offset = Offset;
+    }
+}
+
+static const VFLOG_CALLBACKS VfLogTestCallbacks =
+{
+    .Module = VfLogTestOnModule,
+    .Fault = VfLogTestOnFault,
+    .Invalid = VfLogTestOnInvalid,
+};
+
+static VOID VfLogTestPut(
+    PVFLOG_TEST_LOG Log,
+    uint64_t Value,
+    ULONG Size
+    )
+{
+    for (ULONG i = 0; i < Size; i++)
+    {
+        Log->Buffer[Log->Length++] = (BYTE)(Value >> (i * 8));
+    }
+}
+
+static VOID VfLogTestPad(
+    PVFLOG_TEST_LOG Log
+    )
+{
+    while (Log->Length % 8)
+    {
+        Log->Buffer[Log->Length++] = 0;
+    }
+}
+
+static VOID VfLogTestHeader(
+    PVFLOG_TEST_LOG Log,
+    ULONG Magic,
+    ULONG Version
+    )
+{
+    Log->Length = 0;
+    VfLogTestPut(Log, Magic, 4);
+    VfLogTestPut(Log, Version, 4);
+    VfLogTestPut(Log, 77, 4);
+    VfLogTestPut(Log, 0, 4);
+    VfLogTestPut(Log, 0x0123456789abcdefull, 8);
+}
+
+static VOID VfLogTestModule(
+    PVFLOG_TEST_LOG Log,
+    ULONG Index,
+    PCSTR Name,
+    USHORT NameLength
+    )
+{
+    SIZE_T start;
+    SIZE_T length;
+
+    start = Log->Length;
+    length = strlen(Name);
+
+    VfLogTestPut(Log, VFSYMSRV_LOG_RECORD_MODULE, 2);
+    VfLogTestPut(Log, 0, 2);
+    VfLogTestPut(Log, 0, 4);
+    VfLogTestPut(Log, Index, 4);
+    VfLogTestPut(Log, 0x5A1B2C3D, 4);
+    VfLogTestPut(Log, 0x2000, 4);
+    VfLogTestPut(Log, NameLength, 2);
+    VfLogTestPut(Log, 0, 2);
+
+    for (SIZE_T i = 0; i < length; i++)
+    {
+        VfLogTestPut(Log, (BYTE)Name[i], 2);
+    }
+
+    VfLogTestPad(Log);
+
+    length = (Log->Length - start);
+    Log->Buffer[start + 4] = (BYTE)length;
+    Log->Buffer[start + 5] = (BYTE)(length >> 8);
+}
+
+static VOID VfLogTestFault(
+    PVFLOG_TEST_LOG Log,
+    ULONG FrameCount,
+    ULONG Length
+    )
+{
+    VfLogTestPut(Log, VFSYMSRV_LOG_RECORD_FAULT, 2);
+    VfLogTestPut(Log, 0, 2);
+    VfLogTestPut(Log, Length, 4);
+    VfLogTestPut(Log, 0x10, 4);
+    VfLogTestPut(Log, 0xabcd1234, 4);
+    VfLogTestPut(Log, 99, 4);
+    VfLogTestPut(Log, FrameCount, 4);
+    VfLogTestPut(Log, 0x1122334455667788ull, 8);
+
+    //
+    // The record holds as many frames as its length says, whatever the count.
+    //
+    for (ULONG i = 0; i < ((Length - 32) / 8); i++)
+    {
+        VfLogTestPut(Log, 0, 4);
+        VfLogTestPut(Log, 0x100 + i, 4);
+    }
+}
+
+static VOID VfLogTestUnknown(
+    PVFLOG_TEST_LOG Log,
+    USHORT Type,
+    ULONG Length
+    )
+{
+    VfLogTestPut(Log, Type, 2);
+    VfLogTestPut(Log, 0, 2);
+    VfLogTestPut(Log, Length, 4);
+
+    for (ULONG i = 8; i < Length; i++)
+    {
+        VfLogTestPut(Log, 0xcc, 1);
+    }
+}
+
+static BOOLEAN VfLogTestModuleNameIs(
+    PCVFLOG_MODULE Module,
+    PCSTR Name
+    )
+{
+    CHAR buffer[VFSYMSRV_MAX_MODULE_PATH * 4];
+
+    VfLogToUtf8(Module->FullName, Module->NameLength, buffer, sizeof(buffer));
+
+    return (strcmp(buffer, Name) == 0);
+}
+
+static PCBYTE VfLogTestReadFile(
+    PCSTR FileName,
+    PSIZE_T Length
+    )
+{
+    FILE* file;
+    static BYTE buffer[VFLOG_TEST_MAX_LOG];
+
+    file = fopen(FileName, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+
+    *Length = fread(buffer, 1, sizeof(buffer), file);
+
+    fclose(file);
+
+    return buffer;
+}
+
+static VOID VfLogTestSample(
+    PCSTR FileName
+    )
+{
+    static VFLOG_TEST_EVENTS events;
+    VFLOG_SUMMARY summary;
+    PCBYTE buffer;
+    SIZE_T length;
+    CHAR baseName[64];
+
+    buffer = VfLogTestReadFile(FileName, &length);
+    VFLOG_CHECK(buffer != NULL);
+    if (!buffer)
+    {
+        return;
+    }
+
+    memset(&events, 0, sizeof(events));
+
+    VFLOG_CHECK(VfLogParse(buffer, length, &VfLogTestCallbacks, &events, &summary));
+    VFLOG_CHECK(summary.ProcessId == 4242);
+    VFLOG_CHECK(summary.StartTime == 0x01db2c3d4e5f6070ll);
+    VFLOG_CHECK(summary.Modules == 3);
+    VFLOG_CHECK(summary.Faults == 2);
+    VFLOG_CHECK(summary.Unknown == 2);
+    VFLOG_CHECK(summary.Invalid == 0);
+    VFLOG_CHECK(!summary.Truncated);
+
+    //
+    // The records of unknown types are skipped, the rest arrive in order.
+    //
+    VFLOG_CHECK(events.Count == 5);
+    VFLOG_CHECK(events.Events[0].Type == VFSYMSRV_LOG_RECORD_MODULE);
+    VFLOG_CHECK(events.Events[0].Module.Index == 0);
+    VFLOG_CHECK(events.Events[0].Module.TimeDateStamp == 0x5A1B2C3D);
+    VFLOG_CHECK(events.Events[0].Module.SizeOfImage == 0x2a0000);
+    VFLOG_CHECK(VfLogTestModuleNameIs(&events.Events[0].Module,
+                                      "C:\\Windows\\System32\\KERNELBASE.dll"));
+
+    VfLogModuleBaseName(&events.Events[0].Module, baseName, sizeof(baseName));
+    VFLOG_CHECK(strcmp(baseName, "KERNELBASE.dll") == 0);
+
+    VFLOG_CHECK(events.Events[1].Type == VFSYMSRV_LOG_RECORD_MODULE);
+    VFLOG_CHECK(events.Events[1].Module.Index == 1);
+    VFLOG_CHECK(VfLogTestModuleNameIs(&events.Events[1].Module, "C:\\tests\\testapp.exe"));
+
+    VFLOG_CHECK(events.Events[2].Type == VFSYMSRV_LOG_RECORD_FAULT);
+    VFLOG_CHECK(events.Events[2].Fault.FaultType == 4);
+    VFLOG_CHECK(events.Events[2].Fault.StackHash == 0x1badb002);
+    VFLOG_CHECK(events.Events[2].Fault.ThreadId == 1234);
+    VFLOG_CHECK(events.Events[2].Fault.Time == 0x01db2c3d4e5f7000ll);
+    VFLOG_CHECK(events.Events[2].Fault.FrameCount == 6);
+    VFLOG_CHECK(events.Events[2].Fault.Frames[0].ModuleIndex == 0);
+    VFLOG_CHECK(events.Events[2].Fault.Frames[0].Rva == 0x1234);
+    VFLOG_CHECK(events.Events[2].Fault.Frames[5].ModuleIndex == 5);
+    VFLOG_CHECK(events.Events[2].Fault.Frames[5].Rva == 0x10);
+
+    VFLOG_CHECK(events.Events[3].Type == VFSYMSRV_LOG_RECORD_MODULE);
+    VFLOG_CHECK(events.Events[3].Module.Index == 2);
+
+    VFLOG_CHECK(events.Events[4].Type == VFSYMSRV_LOG_RECORD_FAULT);
+    VFLOG_CHECK(events.Events[4].Fault.FaultType == 0x100);
+    VFLOG_CHECK(events.Events[4].Fault.FrameCount == 4);
+    VFLOG_CHECK(events.Events[4].Fault.Frames[3].Rva == 0x2a0000);
+
+    VFLOG_CHECK(VfLogMaxModules(length) == (length / 24));
+}
+
+static VOID VfLogTestRecords(
+    VOID
+    )
+{
+    static VFLOG_TEST_LOG log;
+    static VFLOG_TEST_EVENTS events;
+    VFLOG_SUMMARY summary;
+    SIZE_T invalidModule;
+    SIZE_T invalidFault;
+    SIZE_T truncated;
+
+    //
+    // Unknown records of any length are skipped, including one which is only
+    // a record header, and malformed known records are reported and skipped
+    // without losing the records after them.
+    //
+    VfLogTestHeader(&log, VFSYMSRV_LOG_MAGIC, VFSYMSRV_LOG_VERSION);
+    VfLogTestModule(&log, 0, "C:\\a\\one.dll", 24);
+    VfLogTestUnknown(&log, 3, 8);
+    VfLogTestUnknown(&log, 0xffff, 40);
+    invalidModule = log.Length;
+    VfLogTestModule(&log, 1, "C:\\a\\two.dll", 200);
+    VfLogTestFault(&log, 2, 32 + (2 * 8));
+    invalidFault = log.Length;
+    VfLogTestFault(&log, 2, 32 + (3 * 8));
+    VfLogTestFault(&log, VFSYMSRV_MAX_FRAMES + 1, 32);
+    VfLogTestFault(&log, 0, 32);
+    truncated = log.Length;
+    VfLogTestModule(&log, 2, "C:\\a\\three.dll", 28);
+    log.Length -= 8;
+
+    memset(&events, 0, sizeof(events));
+
+    VFLOG_CHECK(VfLogParse(log.Buffer, log.Length, &VfLogTestCallbacks, &events, &summary));
+    VFLOG_CHECK(summary.ProcessId == 77);
+    VFLOG_CHECK(summary.Modules == 1);
+    VFLOG_CHECK(summary.Faults == 2);
+    VFLOG_CHECK(summary.Unknown == 2);
+    VFLOG_CHECK(summary.Invalid == 3);
+    VFLOG_CHECK(summary.Truncated);
+    VFLOG_CHECK(summary.TruncatedOffset == truncated);
+
+    VFLOG_CHECK(events.Count == 6);
+    VFLOG_CHECK(events.Events[0].Type == VFSYMSRV_LOG_RECORD_MODULE);
+    VFLOG_CHECK(VfLogTestModuleNameIs(&events.Events[0].Module, "C:\\a\\one.dll"));
+    VFLOG_CHECK(events.Events[1].Invalid);
+    VFLOG_CHECK(events.Events[1].Type == VFSYMSRV_LOG_RECORD_MODULE);
+    VFLOG_CHECK(events.Events[1].Offset == invalidModule);
+    VFLOG_CHECK(events.Events[2].Type == VFSYMSRV_LOG_RECORD_FAULT);
+    VFLOG_CHECK(!events.Events[2].Invalid);
+    VFLOG_CHECK(events.Events[2].Fault.FrameCount == 2);
+    VFLOG_CHECK(events.Events[2].Fault.Frames[1].Rva == 0x101);
+    VFLOG_CHECK(events.Events[2].Fault.Time == 0x1122334455667788ll);
+    VFLOG_CHECK(events.Events[3].Invalid);
+    VFLOG_CHECK(events.Events[3].Type == VFSYMSRV_LOG_RECORD_FAULT);
+    VFLOG_CHECK(events.Events[3].Offset == invalidFault);
+    VFLOG_CHECK(events.Events[4].Invalid);
+    VFLOG_CHECK(events.Events[5].Type == VFSYMSRV_LOG_RECORD_FAULT);
+    VFLOG_CHECK(!events.Events[5].Invalid);
+    VFLOG_CHECK(events.Events[5].Fault.FrameCount == 0);
+
+    //
+    // A log ending part way through a record header, and records whose
+    // length is too short to be a record.
+    //
+    VfLogTestHeader(&log, VFSYMSRV_LOG_MAGIC, VFSYMSRV_LOG_VERSION);
+    VfLogTestFault(&log, 0, 32);
+    VfLogTestPut(&log, VFSYMSRV_LOG_RECORD_FAULT, 2);
+
+    VFLOG_CHECK(VfLogParse(log.Buffer, log.Length, NULL, NULL, &summary));
+    VFLOG_CHECK(summary.Faults == 1);
+    VFLOG_CHECK(summary.Truncated);
+    VFLOG_CHECK(summary.TruncatedOffset == (24 + 32));
+
+    VfLogTestHeader(&log, VFSYMSRV_LOG_MAGIC, VFSYMSRV_LOG_VERSION);
+    VfLogTestUnknown(&log, 9, 4);
+
+    VFLOG_CHECK(VfLogParse(log.Buffer, log.Length, NULL, NULL, &summary));
+    VFLOG_CHECK(summary.Unknown == 0);
+    VFLOG_CHECK(summary.Truncated);
+    VFLOG_CHECK(summary.TruncatedOffset == 24);
+
+    //
+    // An empty log is valid, a bad header is not.
+    //
+    VfLogTestHeader(&log, VFSYMSRV_LOG_MAGIC, VFSYMSRV_LOG_VERSION);
+
+    VFLOG_CHECK(VfLogParse(log.Buffer, log.Length, NULL, NULL, &summary));
+    VFLOG_CHECK(!summary.Truncated && !summary.Faults && !summary.Modules);
+    VFLOG_CHECK(!VfLogParse(log.Buffer, log.Length - 1, NULL, NULL, &summary));
+
+    VfLogTestHeader(&log, VFSYMSRV_MAGIC, VFSYMSRV_LOG_VERSION);
+    VFLOG_CHECK(!VfLogParse(log.Buffer, log.Length, NULL, NULL, &summary));
+
+    VfLogTestHeader(&log, VFSYMSRV_LOG_MAGIC, VFSYMSRV_LOG_VERSION + 1);
+    VFLOG_CHECK(!VfLogParse(log.Buffer, log.Length, NULL, NULL, &summary));
+}
+
+static VOID VfLogTestUtf8(
+    VOID
+    )
+{
+    static const WCHAR name[] = { L'a', 0xe9, 0x20ac, 0xd83d, 0xde00, 0xdc00, L'z' };
+    CHAR buffer[32];
+    SIZE_T length;
+
+    length = VfLogToUtf8(name, 7, buffer, sizeof(buffer));
+    VFLOG_CHECK(length == 14);
+    VFLOG_CHECK(memcmp(buffer,
+                       "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\xef\xbf\xbdz",
+                       15) == 0);
+
+    //
+    // Truncation never splits a character.
+    //
+    length = VfLogToUtf8(name, 7, buffer, 5);
+    VFLOG_CHECK(length == 3);
+    VFLOG_CHECK(strcmp(buffer, "a\xc3\xa9") == 0);
+
+    VFLOG_CHECK(VfLogToUtf8(name, 7, buffer, 1) == 0);
+    VFLOG_CHECK(buffer[0] == '\0');
+}
+
+static VOID VfLogTestSymDir(
+    PCSTR Path
+    )
+{
+    PVFSYMDIR symDir;
+    PCVFSYMDIR_MAP map;
+    PCSTR name;
+    ULONG disp;
+
+    symDir = VfSymDirOpen(Path);
+    VFLOG_CHECK(symDir != NULL);
+    if (!symDir)
+    {
+        return;
+    }
+
+    //
+    // The directory is lower case, the module is found by its lower case name.
+    //
+    map = VfSymDirLoadModule(symDir, "KERNELBASE.dll", 0x5A1B2C3D, 0x2a0000);
+    VFLOG_CHECK(map != NULL);
+    VFLOG_CHECK(VfSymDirLoadModule(symDir, "KERNELBASE.dll", 0x5A1B2C3D, 0x2a0000) == map);
+    VFLOG_CHECK(VfSymDirLookup(map, 0x1000, &name, &disp) &&
+                (strcmp(name, "CreateFileW") == 0) && (disp == 0));
+    VFLOG_CHECK(VfSymDirLookup(map, 0x13ff, &name, &disp) &&
+                (strcmp(name, "CreateFileW") == 0) && (disp == 0x3ff));
+    VFLOG_CHECK(VfSymDirLookup(map, 0x1400, &name, &disp) &&
+                (strcmp(name, "CreateFileInternal") == 0) && (disp == 0));
+    VFLOG_CHECK(!VfSymDirLookup(map, 0xfff, &name, &disp));
+    VFLOG_CHECK(!VfSymDirLookup(map, 0x1600, &name, &disp));
+
+    //
+    // A different build of the module has no symbols.
+    //
+    VFLOG_CHECK(VfSymDirLoadModule(symDir, "KERNELBASE.dll", 0x5A1B2C3E, 0x2a0000) == NULL);
+    VFLOG_CHECK(VfSymDirLoadModule(symDir, "kernelbase.dll", 0x5A1B2C3D, 0x2a1000) == NULL);
+    VFLOG_CHECK(VfSymDirLoadModule(symDir, "missing.dll", 0x5A1B2C3D, 0x2a0000) == NULL);
+    VFLOG_CHECK(!VfSymDirLookup(NULL, 0x1000, &name, &disp));
+
+    //
+    // Nested symbols resolve to the innermost, unsized symbols extend to the
+    // next symbol and the last to the end of the image.
+    //
+    map = VfSymDirLoadModule(symDir, "testapp.exe", 0x60000001, 0x5000);
+    VFLOG_CHECK(map != NULL);
+    VFLOG_CHECK(VfSymDirLookup(map, 0x1004, &name, &disp) &&
+                (strcmp(name, "main") == 0) && (disp == 4));
+    VFLOG_CHECK(VfSymDirLookup(map, 0x1017, &name, &disp) &&
+                (strcmp(name, "main$inline_OpenConfig") == 0) && (disp == 0xf));
+    VFLOG_CHECK(VfSymDirLookup(map, 0x1018, &name, &disp) &&
+                (strcmp(name, "main") == 0) && (disp == 0x18));
+    VFLOG_CHECK(!VfSymDirLookup(map, 0x1800, &name, &disp));
+    VFLOG_CHECK(VfSymDirLookup(map, 0x2fff, &name, &disp) &&
+                (strcmp(name, "ParseConfig") == 0) && (disp == 0xfff));
+    VFLOG_CHECK(VfSymDirLookup(map, 0x3000, &name, &disp) &&
+                (strcmp(name, "WriteReport") == 0) && (disp == 0));
+    VFLOG_CHECK(VfSymDirLookup(map, 0x4fff, &name, &disp) &&
+                (strcmp(name, "CleanupAndExit") == 0) && (disp == 0xff));
+    VFLOG_CHECK(!VfSymDirLookup(map, 0x5000, &name, &disp));
+
+    VfSymDirClose(symDir);
+}
+
+int main(
+    int argc,
+    char* argv[]
+    )
+{
+    if (argc < 3)
+    {
+        printf("usage: test_vflog <sample log> <symbol directory>\n");
+        return 1;
+    }
+
+    VfLogTestSample(argv[1]);
+    VfLogTestRecords();
+    VfLogTestUtf8();
+    VfLogTestSymDir(argv[2]);
+
+    printf("%u checks, %u failures\n", VfLogTestChecks, VfLogTestFailures);
+
+    return (VfLogTestFailures ? 1 : 0);
+}
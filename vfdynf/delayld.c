@@ -32,6 +32,7 @@ static AVRF_DELAY_LOAD_ENTRY AVrfpDelayLoadDbgHelp[] =
     AVRF_DELAY_LOAD(SymSetOptions),
     AVRF_DELAY_LOAD(SymLoadModuleExW),
     AVRF_DELAY_LOAD(SymUnloadModule64),
+    AVRF_DELAY_LOAD(SymEnumSymbolsW),
     { RTL_CONSTANT_STRING(""), NULL }
 };
 
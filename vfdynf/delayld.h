@@ -109,6 +109,17 @@ SymLoadModuleExW, (
     _In_opt_ DWORD Flags
     ));
 
+VFDYNF_DECLARE_DELAYLD(
+BOOL,
+IMAGEAPI,
+SymEnumSymbolsW, (
+    _In_ HANDLE hProcess,
+    _In_ ULONG64 BaseOfDll,
+    _In_opt_ PCWSTR Mask,
+    _In_ PSYM_ENUMERATESYMBOLS_CALLBACKW EnumSymbolsCallback,
+    _In_opt_ PVOID UserContext
+    ));
+
 VFDYNF_DECLARE_DELAYLD(
 BOOL,
 IMAGEAPI,
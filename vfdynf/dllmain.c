@@ -12,9 +12,9 @@ VFDYNF_PROPERTIES AVrfProperties =
 {
     .GracePeriod = 5000,
     .SymbolSearchPath = { L'\0' },
-    .StopRegex = { L'\0' },
-    .IncludeRegex = { L'\0' },
-    .ExclusionsRegex = { L'\0' },
+    .StopRegex = NULL,
+    .IncludeRegex = NULL,
+    .ExclusionsRegex = NULL,
     .DynamicFaultPeroid = 30000,
     .EnableFaultMask = VFDYNF_FAULT_DEFAULT_MASK,
     .FaultProbability = 1000000,
@@ -22,6 +22,9 @@ VFDYNF_PROPERTIES AVrfProperties =
     .FuzzSeed = 0,
     .FuzzCorruptionBlocks = 100,
     .FuzzChaosProbability = 250000,
+    .FuzzMutationDensity = 0,
+    .FuzzMutationLimit = 4096,
+    .FuzzMMapLazyFill = FALSE,
     .FuzzSizeTruncateProbability = 250000,
     .HeapReasonableAllocLimit = (1 << 30), // 1 GiB
     .EnableFaultsInLdrPath = FALSE,
@@ -29,10 +32,28 @@ VFDYNF_PROPERTIES AVrfProperties =
     .SymResolvePriority = THREAD_PRIORITY_HIGHEST,
     .SymResolveTimeout = 1000,
     .SymAbandonedThreshold = 200,
+    .SymWorkerCount = 1,
+    .RegexCachePath = { L'\0' },
+    .SymBrokerPipeName = { L'\0' },
+    .FaultLogPath = { L'\0' },
+    .SymExportResolve = VFDYNF_SYM_EXPORT_RESOLVE_DISABLED,
+    .SymExclusionRanges = FALSE,
+    .SymWarmUp = FALSE,
+    .RegexMatchLimit = 0,
+    .RegexDepthLimit = 0,
+    .RegexCostThreshold = 0,
     .TypeIncludeRegex = { 0 },
     .TypeExclusionsRegex = { 0 },
 };
 
+#define VFDYNF_IFEO_KEY_NAME \
+    L"\\Registry\\Machine\\SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Image File Execution Options\\"
+#define VFDYNF_PROPERTY_DISPLAY_SIZE (16 * 1024 * sizeof(WCHAR))
+
+//
+// N.B. Descriptors for dynamic properties have no address or size. The
+// parameter is the destination buffer pointer, see AVrfpPropertyCallback.
+//
 static AVRF_PROPERTY_DESCRIPTOR AVrfpPropertyDescriptors[] =
 {
     {
@@ -55,21 +76,21 @@ static AVRF_PROPERTY_DESCRIPTOR AVrfpPropertyDescriptors[] =
     {
         AVRF_PROPERTY_SZ,
         L"IncludeRegex",
-        &AVrfProperties.IncludeRegex,
-        sizeof(AVrfProperties.IncludeRegex),
+        NULL,
+        0,
         L"Includes fault injection for the immediate calling module when this "
         L"regular expression matches the module name. When not provided all "
         L"modules are included.",
-        NULL
+        &AVrfProperties.IncludeRegex
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"ExclusionsRegex",
-        &AVrfProperties.ExclusionsRegex,
-        sizeof(AVrfProperties.ExclusionsRegex),
+        NULL,
+        0,
         L"Excludes stack from fault injection when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.ExclusionsRegex
     },
     {
         AVRF_PROPERTY_DWORD,
@@ -135,6 +156,37 @@ static AVRF_PROPERTY_DESCRIPTOR AVrfpPropertyDescriptors[] =
         L"techniques are applied to the buffer in a less chaotic manner.",
         NULL
     },
+    {
+        AVRF_PROPERTY_DWORD,
+        L"FuzzMutationDensity",
+        &AVrfProperties.FuzzMutationDensity,
+        sizeof(AVrfProperties.FuzzMutationDensity),
+        L"Number of mutations to apply per MiB of a fuzzed buffer. When "
+        L"non-zero, positions are sampled across the buffer and only the "
+        L"regions around them are corrupted, rather than corrupting every "
+        L"block of the buffer. Zero uses FuzzCorruptionBlocks.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_DWORD,
+        L"FuzzMutationLimit",
+        &AVrfProperties.FuzzMutationLimit,
+        sizeof(AVrfProperties.FuzzMutationLimit),
+        L"Maximum number of mutations applied to a single fuzzed buffer when "
+        L"FuzzMutationDensity is set. Zero removes the limit.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_BOOLEAN,
+        L"FuzzMMapLazyFill",
+        &AVrfProperties.FuzzMMapLazyFill,
+        sizeof(AVrfProperties.FuzzMMapLazyFill),
+        L"Copies and fuzzes each page of a fuzzed section mapping when the "
+        L"application first touches it rather than when the view is mapped. "
+        L"Pages not yet touched are inaccessible to the system, passing them "
+        L"directly to a system call fails the call.",
+        NULL
+    },
     {
         AVRF_PROPERTY_DWORD,
         L"FuzzSizeTruncateProbability",
@@ -212,263 +264,377 @@ static AVRF_PROPERTY_DESCRIPTOR AVrfpPropertyDescriptors[] =
         L"resolution is slow.",
         NULL
     },
+    {
+        AVRF_PROPERTY_DWORD,
+        L"SymWorkerCount",
+        &AVrfProperties.SymWorkerCount,
+        sizeof(AVrfProperties.SymWorkerCount),
+        L"Number of symbol resolution worker threads, from 1 to 8. Workers "
+        L"resolve stacks in parallel from the cache, export tables, and "
+        L"symbol broker. Lookups which require dbghelp are serialized since "
+        L"it is not thread safe.",
+        NULL
+    },
     {
         AVRF_PROPERTY_SZ,
         L"StopRegex",
-        &AVrfProperties.StopRegex,
-        sizeof(AVrfProperties.StopRegex),
+        NULL,
+        0,
         L"Regular expression to check against the immediate caller module name "
         L"when a verifier stop is about to be raised. If the module does not "
         L"match this regular expression the verifier stop does not occur. "
         L"Defaults to matching only the application module.",
+        &AVrfProperties.StopRegex
+    },
+    {
+        AVRF_PROPERTY_SZ,
+        L"RegexCachePath",
+        &AVrfProperties.RegexCachePath,
+        sizeof(AVrfProperties.RegexCachePath),
+        L"Directory used to cache compiled regular expressions between runs. "
+        L"When provided, compiled patterns are serialized to this directory "
+        L"keyed by a hash of the pattern and reused on later launches to "
+        L"avoid compilation. When not provided nothing is cached.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_SZ,
+        L"SymBrokerPipeName",
+        &AVrfProperties.SymBrokerPipeName,
+        sizeof(AVrfProperties.SymBrokerPipeName),
+        L"Name of the pipe of an out-of-process symbol broker (vfsymsrv). When "
+        L"provided, frames are first sent to the broker for symbol resolution "
+        L"and only frames it does not resolve fall back to the in-process "
+        L"symbol provider. When not provided symbols are resolved in-process.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_SZ,
+        L"FaultLogPath",
+        &AVrfProperties.FaultLogPath,
+        sizeof(AVrfProperties.FaultLogPath),
+        L"Directory to write a binary log of injected faults to, one file per "
+        L"process. Each fault is recorded as the fault type, thread, time, and "
+        L"the module identity and RVA of every frame, without resolving "
+        L"symbols. The logs are symbolized offline with vfsymsrv -log, or on "
+        L"any host with vflogsym <symbol directory> <log files...>. The format "
+        L"is described in include/vfsymsrv.h. When not provided no log is "
+        L"written.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_DWORD,
+        L"SymExportResolve",
+        &AVrfProperties.SymExportResolve,
+        sizeof(AVrfProperties.SymExportResolve),
+        L"Resolves frames to the nearest exported function using the module "
+        L"export tables. This avoids loading symbols which can be slow when "
+        L"symbols are not available. When 0 export tables are not used. When "
+        L"1 export tables are used first and frames they do not resolve fall "
+        L"back to full symbols. When 2 only export tables are used.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_BOOLEAN,
+        L"SymExclusionRanges",
+        &AVrfProperties.SymExclusionRanges,
+        sizeof(AVrfProperties.SymExclusionRanges),
+        L"Compiles exclusion expressions which name single frames into address "
+        L"ranges when modules are loaded. The symbols of each module are "
+        L"matched once and stacks are then classified by a range check per "
+        L"frame. Expressions which may span frames are still matched against "
+        L"the full stack.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_BOOLEAN,
+        L"SymWarmUp",
+        &AVrfProperties.SymWarmUp,
+        sizeof(AVrfProperties.SymWarmUp),
+        L"Loads the symbols of included modules in the background when they "
+        L"are loaded rather than on the first fault decision. Fault injection "
+        L"is skipped for callers in a module which is still warming when "
+        L"exclusion expressions are in use.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_DWORD,
+        L"RegexMatchLimit",
+        &AVrfProperties.RegexMatchLimit,
+        sizeof(AVrfProperties.RegexMatchLimit),
+        L"Limits the work of a single regular expression match. A match which "
+        L"exceeds the limit has no verdict. A stack an exclusion expression "
+        L"has no verdict for is treated as excluded, a module an include "
+        L"expression has no verdict for is not included, and the verdict is "
+        L"not cached. When 0 the PCRE2 default is used.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_DWORD,
+        L"RegexDepthLimit",
+        &AVrfProperties.RegexDepthLimit,
+        sizeof(AVrfProperties.RegexDepthLimit),
+        L"Limits the backtracking depth of a single regular expression match "
+        L"when it is not JIT compiled. A match which exceeds the limit has no "
+        L"verdict, as for RegexMatchLimit. When 0 the PCRE2 default is used.",
+        NULL
+    },
+    {
+        AVRF_PROPERTY_DWORD,
+        L"RegexCostThreshold",
+        &AVrfProperties.RegexCostThreshold,
+        sizeof(AVrfProperties.RegexCostThreshold),
+        L"Disables a regular expression when its average match time exceeds "
+        L"this many microseconds. A disabled expression has no verdict, as for "
+        L"RegexMatchLimit. When 0 expressions are never disabled.",
         NULL
     },
     {
         AVRF_PROPERTY_SZ,
         L"WaitIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_WAIT],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_WAIT]),
+        NULL,
+        0,
         L"Includes wait fault injection for the immediate calling module when "
         L"this regular expression matches the module name. When not provided "
         L"all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_WAIT]
     },
     {
         AVRF_PROPERTY_SZ,
         L"HeapIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_HEAP],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_HEAP]),
+        NULL,
+        0,
         L"Includes heap fault injection for the immediate calling module when "
         L"this regular expression matches the module name. When not provided "
         L"all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_HEAP]
     },
     {
         AVRF_PROPERTY_SZ,
         L"VMemIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_VMEM],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_VMEM]),
+        NULL,
+        0,
         L"Includes virtual memory fault injection for the immediate calling "
         L"module when this regular expression matches the module name. When "
         L"not provided all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_VMEM]
     },
     {
         AVRF_PROPERTY_SZ,
         L"RegIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_REG],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_REG]),
+        NULL,
+        0,
         L"Includes registry fault injection for the immediate calling module "
         L"when this regular expression matches the module name.When not "
         L"provided all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_REG]
     },
     {
         AVRF_PROPERTY_SZ,
         L"FileIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FILE],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FILE]),
+        NULL,
+        0,
         L"Includes file fault injection for the immediate calling module when "
         L"this regular expression matches the module name.When not provided "
         L"all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FILE]
     },
     {
         AVRF_PROPERTY_SZ,
         L"EventIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_EVENT],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_EVENT]),
+        NULL,
+        0,
         L"Includes event fault injection for the immediate calling module when "
         L"this regular expression matches the module name.When not provided "
         L"all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_EVENT]
     },
     {
         AVRF_PROPERTY_SZ,
         L"SectionIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_SECTION],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_SECTION]),
+        NULL,
+        0,
         L"Includes section fault injection for the immediate calling module "
         L"when this regular expression matches the module name.When not "
         L"provided all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_SECTION]
     },
     {
         AVRF_PROPERTY_SZ,
         L"OleIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_OLE],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_OLE]),
+        NULL,
+        0,
         L"Includes OLE fault injection for the immediate calling module when "
         L"this regular expression matches the module name.When not provided "
         L"all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_OLE]
     },
     {
         AVRF_PROPERTY_SZ,
         L"InPageIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_INPAGE],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_INPAGE]),
+        NULL,
+        0,
         L"Includes in-page fault injection for the immediate calling module "
         L"when this regular expression matches the module name.When not "
         L"provided all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_INPAGE]
     },
     {
         AVRF_PROPERTY_SZ,
         L"FuzzRegIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_REG],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_REG]),
+        NULL,
+        0,
         L"Includes registry fuzzing for the immediate calling module when this "
         L"regular expression matches the module name.When not provided all "
         L"modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_REG]
     },
     {
         AVRF_PROPERTY_SZ,
         L"FuzzFileIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_FILE],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_FILE]),
+        NULL,
+        0,
         L"Includes file fuzzing for the immediate calling module when this "
         L"regular expression matches the module name.When not provided all "
         L"modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_FILE]
     },
     {
         AVRF_PROPERTY_SZ,
         L"FuzzMMapIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_MMAP],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_MMAP]),
+        NULL,
+        0,
         L"Includes section map fuzzing for the immediate calling module when "
         L"this regular expression matches the module name.When not provided "
         L"all modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_MMAP]
     },
     {
         AVRF_PROPERTY_SZ,
         L"FuzzNetIncludeRegex",
-        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET],
-        sizeof(AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET]),
+        NULL,
+        0,
         L"Includes network fuzzing for the immediate calling module when this "
         L"regular expression matches the module name.When not provided all "
         L"modules are included.",
-        NULL
+        &AVrfProperties.TypeIncludeRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"WaitExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_WAIT],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_WAIT]),
+        NULL,
+        0,
         L"Excludes stack from wait fault injection when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_WAIT]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"HeapExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_HEAP],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_HEAP]),
+        NULL,
+        0,
         L"Excludes stack from heap fault injection when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_HEAP]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"VMemExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_VMEM],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_VMEM]),
+        NULL,
+        0,
         L"Excludes stack from virtual memory fault injection when one of "
         L"these regular expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_VMEM]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"RegExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_REG],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_REG]),
+        NULL,
+        0,
         L"Excludes stack from registry fault injection when one of these "
         L"regular expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_REG]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"FileExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FILE],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FILE]),
+        NULL,
+        0,
         L"Excludes stack from file fault injection when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FILE]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"EventExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_EVENT],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_EVENT]),
+        NULL,
+        0,
         L"Excludes stack from event fault injection when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_EVENT]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"SectionExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_SECTION],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_SECTION]),
+        NULL,
+        0,
         L"Excludes stack from section fault injection when one of these "
         L"regular expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_SECTION]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"OleExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_OLE],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_OLE]),
+        NULL,
+        0,
         L"Excludes stack from OLE fault injection when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_OLE]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"InPageExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_INPAGE],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_INPAGE]),
+        NULL,
+        0,
         L"Excludes stack from section in-page fault injection when one of "
         L"these regular expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_INPAGE]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"FuzzRegExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_REG],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_REG]),
+        NULL,
+        0,
         L"Excludes stack from registry fuzzing when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_REG]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"FuzzFileExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_FILE],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_FILE]),
+        NULL,
+        0,
         L"Excludes stack from file fuzzing when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_FILE]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"FuzzMMapExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_MMAP],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_MMAP]),
+        NULL,
+        0,
         L"Excludes stack from section map fuzzing when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_MMAP]
     },
     {
         AVRF_PROPERTY_MULTI_SZ,
         L"FuzzNetExclusionsRegex",
-        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET],
-        sizeof(AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET]),
+        NULL,
+        0,
         L"Excludes stack from network fuzzing when one of these regular "
         L"expression matches the stack.",
-        NULL
+        &AVrfProperties.TypeExclusionsRegex[VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET]
     },
     { AVRF_PROPERTY_NONE, NULL, NULL, 0, NULL, NULL }
 };
@@ -882,6 +1048,7 @@ VOID NTAPI AVrfpDllUnlodCallback(
 
     AVrfpUnTrackModule(DllName, DllBase, DllSize);
     AVrfSymDllUnload(DllName, DllBase, DllSize);
+    AVrfFaultLogDllUnload(DllName, DllBase, DllSize);
 }
 
 VOID NTAPI AVrfpNtdllHeapFreeCallback(
@@ -908,11 +1075,306 @@ static RTL_VERIFIER_PROVIDER_DESCRIPTOR AVrfpProviderDescriptor =
     AVrfpNtdllHeapFreeCallback
 };
 
+_Must_inspect_result_
+NTSTATUS AVrfpOpenLayerKey(
+    _Out_ PHANDLE KeyHandle
+    )
+{
+    NTSTATUS status;
+    PUNICODE_STRING imagePath;
+    UNICODE_STRING imageName;
+    WCHAR buffer[MAX_PATH * 2];
+    UNICODE_STRING keyName;
+    OBJECT_ATTRIBUTES objectAttributes;
+
+    *KeyHandle = NULL;
+
+    imagePath = &NtCurrentPeb()->ProcessParameters->ImagePathName;
+
+    imageName = *imagePath;
+    for (USHORT i = (imagePath->Length / sizeof(WCHAR)); i > 0; i--)
+    {
+        if (imagePath->Buffer[i - 1] == L'\\')
+        {
+            imageName.Buffer = &imagePath->Buffer[i];
+            imageName.Length = (imagePath->Length - (i * sizeof(WCHAR)));
+            imageName.MaximumLength = imageName.Length;
+            break;
+        }
+    }
+
+    keyName.Buffer = buffer;
+    keyName.Length = 0;
+    keyName.MaximumLength = sizeof(buffer);
+
+    status = RtlAppendUnicodeToString(&keyName, VFDYNF_IFEO_KEY_NAME);
+    if (NT_SUCCESS(status))
+    {
+        status = RtlAppendUnicodeStringToString(&keyName, &imageName);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = RtlAppendUnicodeToString(&keyName, L"\\");
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = RtlAppendUnicodeToString(&keyName,
+                                          AVrfLayerDescriptor.LayerGuidString);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    InitializeObjectAttributes(&objectAttributes,
+                               &keyName,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    return NtOpenKey(KeyHandle, KEY_QUERY_VALUE, &objectAttributes);
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpReadDynamicProperty(
+    _In_ HANDLE KeyHandle,
+    _In_ PAVRF_PROPERTY_DESCRIPTOR Property
+    )
+{
+    NTSTATUS status;
+    UNICODE_STRING valueName;
+    PKEY_VALUE_PARTIAL_INFORMATION info;
+    ULONG length;
+    PWCHAR value;
+    PWCHAR* destination;
+
+    info = NULL;
+    value = NULL;
+    destination = Property->Param;
+
+    RtlInitUnicodeString(&valueName, Property->Name);
+
+    status = NtQueryValueKey(KeyHandle,
+                             &valueName,
+                             KeyValuePartialInformation,
+                             NULL,
+                             0,
+                             &length);
+    if ((status != STATUS_BUFFER_TOO_SMALL) &&
+        (status != STATUS_BUFFER_OVERFLOW))
+    {
+        goto Exit;
+    }
+
+    info = RtlAllocateHeap(RtlProcessHeap(), 0, length);
+    if (!info)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    status = NtQueryValueKey(KeyHandle,
+                             &valueName,
+                             KeyValuePartialInformation,
+                             info,
+                             length,
+                             &length);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    if ((info->Type != REG_SZ) &&
+        (info->Type != REG_EXPAND_SZ) &&
+        (info->Type != REG_MULTI_SZ))
+    {
+        status = STATUS_OBJECT_TYPE_MISMATCH;
+        goto Exit;
+    }
+
+    //
+    // The stored data need not be terminated. Always double terminate so
+    // the buffer is valid as both a string and a multi-string.
+    //
+    value = RtlAllocateHeap(RtlProcessHeap(),
+                            HEAP_ZERO_MEMORY,
+                            info->DataLength + (2 * sizeof(WCHAR)));
+    if (!value)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    RtlCopyMemory(value, info->Data, info->DataLength);
+
+    if (*destination)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, *destination);
+    }
+
+    *destination = value;
+    value = NULL;
+
+Exit:
+
+    if (value)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, value);
+    }
+
+    if (info)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, info);
+    }
+
+    return status;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpLoadDynamicProperty(
+    _In_ PAVRF_PROPERTY_DESCRIPTOR Property
+    )
+{
+    NTSTATUS status;
+    HANDLE keyHandle;
+
+    status = AVrfpOpenLayerKey(&keyHandle);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    status = AVrfpReadDynamicProperty(keyHandle, Property);
+
+    NtClose(keyHandle);
+
+    return status;
+}
+
+VOID AVrfpLoadDynamicProperties(
+    VOID
+    )
+{
+    NTSTATUS status;
+    HANDLE keyHandle;
+
+    status = AVrfpOpenLayerKey(&keyHandle);
+    if (!NT_SUCCESS(status))
+    {
+        //
+        // Expected when no properties have been configured for the layer.
+        //
+        return;
+    }
+
+    for (PAVRF_PROPERTY_DESCRIPTOR property = AVrfpPropertyDescriptors;
+         property->Type != AVRF_PROPERTY_NONE;
+         property++)
+    {
+        if (!property->Param || *(PWCHAR*)property->Param)
+        {
+            continue;
+        }
+
+        status = AVrfpReadDynamicProperty(keyHandle, property);
+        if (!NT_SUCCESS(status) && (status != STATUS_OBJECT_NAME_NOT_FOUND))
+        {
+            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                         "failed to read property %ls (0x%08x)",
+                         property->Name,
+                         status);
+        }
+    }
+
+    NtClose(keyHandle);
+}
+
+VOID AVrfpFreeDynamicProperties(
+    VOID
+    )
+{
+    for (PAVRF_PROPERTY_DESCRIPTOR property = AVrfpPropertyDescriptors;
+         property->Type != AVRF_PROPERTY_NONE;
+         property++)
+    {
+        PWCHAR* value;
+
+        if (!property->Param)
+        {
+            continue;
+        }
+
+        value = property->Param;
+        if (*value)
+        {
+            RtlFreeHeap(RtlProcessHeap(), 0, *value);
+            *value = NULL;
+        }
+    }
+}
+
+BOOLEAN AVrfpInitDisplayProperties(
+    VOID
+    )
+{
+    //
+    // When loaded only to describe the layer there are no consumers of the
+    // dynamic properties. Give verifier fixed storage for them so they can be
+    // displayed and edited the same as any other property.
+    //
+    for (PAVRF_PROPERTY_DESCRIPTOR property = AVrfpPropertyDescriptors;
+         property->Type != AVRF_PROPERTY_NONE;
+         property++)
+    {
+        PWCHAR* value;
+
+        if (!property->Param)
+        {
+            continue;
+        }
+
+        value = property->Param;
+
+        *value = RtlAllocateHeap(RtlProcessHeap(),
+                                 HEAP_ZERO_MEMORY,
+                                 VFDYNF_PROPERTY_DISPLAY_SIZE);
+        if (!*value)
+        {
+            return FALSE;
+        }
+
+        property->Address = *value;
+        property->Size = VFDYNF_PROPERTY_DISPLAY_SIZE;
+    }
+
+    return TRUE;
+}
+
 ULONG NTAPI AVrfpPropertyCallback(
     _In_ PAVRF_PROPERTY_DESCRIPTOR Property
     )
 {
-    UNREFERENCED_PARAMETER(Property);
+    NTSTATUS status;
+
+    //
+    // Dynamic properties have no storage for verifier to read into, they are
+    // identified by the destination in the descriptor parameter. Read them
+    // into a buffer of the right size instead.
+    //
+    if (!AVrfpLoadedAsVerifier || !Property->Param)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    status = AVrfpLoadDynamicProperty(Property);
+    if (!NT_SUCCESS(status) && (status != STATUS_OBJECT_NAME_NOT_FOUND))
+    {
+        return RtlNtStatusToDosError(status);
+    }
+
     return ERROR_SUCCESS;
 }
 
@@ -984,6 +1446,13 @@ BOOLEAN AVrfpProviderProcessAttach(
 
     AVrfLinkHooks();
 
+    if (!AVrfpLoadedAsVerifier && !AVrfpInitDisplayProperties())
+    {
+        AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "failed to allocate property storage");
+
+        return FALSE;
+    }
+
     err = VerifierRegisterLayerEx(Module,
                                   &AVrfLayerDescriptor,
                                   AVRF_LAYER_FLAG_TLS_SLOT);
@@ -1006,8 +1475,22 @@ BOOLEAN AVrfpProviderProcessAttach(
         return TRUE;
     }
 
+    //
+    // Pick up any dynamic properties the property callback was not invoked
+    // for before the consumers are initialized.
+    //
+    AVrfpLoadDynamicProperties();
+
     AVrfpInitModulesList();
 
+    if (!AVrfRegexProcessAttach())
+    {
+        AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "failed to setup regex");
+
+        __debugbreak();
+        return FALSE;
+    }
+
     if (!AVrfSymProcessAttach())
     {
         AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "failed to setup symbol provider");
@@ -1056,13 +1539,17 @@ VOID AVrfpProviderProcessDetach(
     )
 {
     AVrfFaultProcessDetach();
+    AVrfFaultLogProcessDetach();
     AVrfExceptProcessDetach();
     AVrfFuzzProcessDetach();
     AVrfStopProcessDetach();
     AVrfSymProcessDetach();
+    AVrfRegexProcessDetach();
     AVrfpDeleteModuleList();
 
     VerifierUnregisterLayer(Module, &AVrfLayerDescriptor);
+
+    AVrfpFreeDynamicProperties();
 }
 
 _Maybenull_
@@ -1114,6 +1601,11 @@ VOID AVrfpCleanupTls(
     tls = VerifierTlsGetValue(AVrfLayerDescriptor.TlsIndex);
     if (tls)
     {
+        if (tls->RegexThread)
+        {
+            Pcre2FreeThreadContext(tls->RegexThread);
+        }
+
         RtlFreeHeap(RtlProcessHeap(), 0, tls);
     }
 }
@@ -146,6 +146,21 @@ LONG NTAPI AVrfpVectoredExceptionHandler(
             ExceptionInfo->ExceptionRecord->ExceptionCode = (DWORD)EXCEPTION_IN_PAGE_ERROR;
         }
     }
+    else if (ExceptionInfo->ExceptionRecord->ExceptionCode == EXCEPTION_ACCESS_VIOLATION)
+    {
+        PVOID address;
+
+        address = (PVOID)ExceptionInfo->ExceptionRecord->ExceptionInformation[1];
+
+        //
+        // Pages of fuzzed mappings are filled when first touched.
+        //
+        if (AVrfFuzzMemoryMappingFault(address,
+                                       ExceptionInfo->ExceptionRecord->ExceptionInformation[0]))
+        {
+            return EXCEPTION_CONTINUE_EXECUTION;
+        }
+    }
 
     return EXCEPTION_CONTINUE_SEARCH;
 }
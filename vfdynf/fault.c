@@ -6,6 +6,12 @@
 
 #define VFDYNF_FAULT_STACK_FRAMES 250
 #define VFDYNF_FAULT_STACKS_COUNT 32
+#define VFDYNF_FAULT_VERDICT_COUNT 4096
+#define VFDYNF_FAULT_VERDICT_PROBE 8
+
+#define VFDYNF_REGEX_STATE_PENDING 0
+#define VFDYNF_REGEX_STATE_READY   1
+#define VFDYNF_REGEX_STATE_FAILED  2
 
 typedef struct _VFDYNF_FAULT_ENUM_MODULES_CONTEXT
 {
@@ -17,7 +23,12 @@ typedef struct _VFDYNF_FAULT_ENUM_MODULES_CONTEXT
 typedef struct _VFDYNF_EXCLUSION_REGEX
 {
     ULONG Count;
+    ULONG FrameLocalCount;
     PPCRE2_HANDLE Regex;
+    PBOOLEAN FrameLocal;
+    PVFDYNF_REGEX_PREFILTER Prefilter;
+    ULONG FramePatternCount;
+    PVFDYNF_FRAME_PATTERN* FramePatterns;
 } VFDYNF_EXCLUSION_REGEX, *PVFDYNF_EXCLUSION_REGEX;
 
 typedef struct _VFDYNF_FAULT_COUNT
@@ -26,6 +37,17 @@ typedef struct _VFDYNF_FAULT_COUNT
     volatile LONG True;
 } VFDYNF_FAULT_COUNT, *PVFDYNF_FAULT_COUNT;
 
+//
+// The exclusion verdicts of a symbolic stack, see AVrfpQueryStackVerdict.
+// A fingerprint of zero marks an unused slot.
+//
+typedef struct _VFDYNF_FAULT_VERDICT
+{
+    ULONG64 Fingerprint;
+    ULONG Evaluated;
+    ULONG Excluded;
+} VFDYNF_FAULT_VERDICT, *PVFDYNF_FAULT_VERDICT;
+
 typedef struct _VFDYNF_FAULT_STACK
 {
     ULONG StackHash;
@@ -42,14 +64,18 @@ typedef struct _VFDYNF_FAULT_CONTEXT
     RTL_CRITICAL_SECTION CriticalSection;
     ULONG64 LastClear;
     AVRF_STACK_TABLE StackTable;
-    BOOLEAN RegexInitialized;
+    RTL_CRITICAL_SECTION RegexCriticalSection;
+    LONG RegexState;
     PCRE2_HANDLE IncludeRegex;
     VFDYNF_EXCLUSION_REGEX Exclusions;
     VFDYNF_FAULT_COUNT TypeCount[VFDYNF_FAULT_TYPE_COUNT];
+    volatile LONG TypeRegexState[VFDYNF_FAULT_TYPE_COUNT];
     PCRE2_HANDLE TypeIncludeRegex[VFDYNF_FAULT_TYPE_COUNT];
     VFDYNF_EXCLUSION_REGEX TypeExclusions[VFDYNF_FAULT_TYPE_COUNT];
     volatile LONG LastFaultStacksIndex;
     VFDYNF_FAULT_STACK LastFaultStacks[VFDYNF_FAULT_STACKS_COUNT];
+    RTL_SRWLOCK VerdictLock;
+    VFDYNF_FAULT_VERDICT Verdicts[VFDYNF_FAULT_VERDICT_COUNT];
 } VFDYNF_FAULT_CONTEXT, *PVFDYNF_FAULT_CONTEXT;
 
 static VFDYNF_FAULT_CONTEXT AVrfpFaultContext =
@@ -61,14 +87,18 @@ static VFDYNF_FAULT_CONTEXT AVrfpFaultContext =
     .CriticalSection = { 0 },
     .LastClear = 0,
     .StackTable = { 0 },
-    .RegexInitialized = FALSE,
+    .RegexCriticalSection = { 0 },
+    .RegexState = VFDYNF_REGEX_STATE_PENDING,
     .IncludeRegex = { 0 },
     .Exclusions = { 0 },
     .TypeCount = { 0 },
+    .TypeRegexState = { 0 },
     .TypeIncludeRegex = { 0 },
     .TypeExclusions = { 0 },
     .LastFaultStacksIndex = 0,
     .LastFaultStacks = { 0 },
+    .VerdictLock = RTL_SRWLOCK_INIT,
+    .Verdicts = { 0 },
 };
 
 ULONG AVrfpFaultTypeIndex(
@@ -88,225 +118,1006 @@ ULONG AVrfpFaultTypeClass(
 {
     AVRF_ASSERT(AVrfpFaultContext.TypeBase != ULONG_MAX);
 
-    return (AVrfpFaultContext.TypeBase + AVrfpFaultTypeIndex(FaultType));
+    return (AVrfpFaultContext.TypeBase + AVrfpFaultTypeIndex(FaultType));
+}
+
+BOOLEAN AVrfpIsFrameLocalPattern(
+    _In_ PCUNICODE_STRING Pattern
+    )
+{
+    ULONG length;
+
+    //
+    // A pattern is frame local when nothing in it can match or assert on a
+    // line break, so it can only ever match within a single frame of the stack
+    // string. This is deliberately conservative, anything which might refer
+    // to the stack as a whole (anchors, inline options, negated classes,
+    // whitespace classes, and most escapes) is left to the full stack match.
+    //
+    // N.B. The "." in a frame local pattern is evaluated within one frame
+    // when matched against individual symbols, see symexcl.c.
+    //
+
+    length = (Pattern->Length / sizeof(WCHAR));
+
+    for (ULONG i = 0; i < length; i++)
+    {
+        WCHAR c;
+
+        c = Pattern->Buffer[i];
+
+        switch (c)
+        {
+            case L'\\':
+            {
+                if (++i >= length)
+                {
+                    return FALSE;
+                }
+
+                c = Pattern->Buffer[i];
+
+                if (((c >= L'a') && (c <= L'z')) ||
+                    ((c >= L'A') && (c <= L'Z')) ||
+                    ((c >= L'0') && (c <= L'9')))
+                {
+                    if ((c != L'd') && (c != L'w') && (c != L'b') &&
+                        (c != L'B') && (c != L'Q') && (c != L'E') &&
+                        (c != L't'))
+                    {
+                        return FALSE;
+                    }
+                }
+
+                break;
+            }
+            case L'[':
+            {
+                if (((i + 1) < length) && (Pattern->Buffer[i + 1] == L'^'))
+                {
+                    return FALSE;
+                }
+
+                break;
+            }
+            case L'(':
+            {
+                if (((i + 1) < length) && (Pattern->Buffer[i + 1] == L'?'))
+                {
+                    return FALSE;
+                }
+
+                break;
+            }
+            case L'^':
+            case L'$':
+            case L'\r':
+            case L'\n':
+            {
+                return FALSE;
+            }
+            default:
+            {
+                break;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+VOID AVrfpInitExclusionsPrefilter(
+    _In_ PWCHAR Pattern,
+    _Inout_ PVFDYNF_EXCLUSION_REGEX Exclusion
+    )
+{
+    NTSTATUS status;
+    PUNICODE_STRING patterns;
+    ULONG offset;
+
+    //
+    // Literals required by the patterns are compiled into one automaton so a
+    // single scan of a subject selects which patterns need to be run. Without
+    // the prefilter every pattern is run, so a failure here is not fatal.
+    //
+    patterns = RtlAllocateHeap(RtlProcessHeap(),
+                               0,
+                               Exclusion->Count * sizeof(UNICODE_STRING));
+    if (!patterns)
+    {
+        return;
+    }
+
+    //
+    // N.B. Frame patterns are kept apart from the expressions, the indices of
+    // the prefilter are those of the expressions.
+    //
+    offset = 0;
+    for (ULONG i = 0; i < Exclusion->Count;)
+    {
+        RtlInitUnicodeString(&patterns[i], &Pattern[offset]);
+
+        offset += ((patterns[i].Length / sizeof(WCHAR)) + 1);
+
+        if (!AVrfIsFramePattern(&patterns[i]))
+        {
+            i++;
+        }
+    }
+
+    status = AVrfCreateRegexPrefilter(patterns,
+                                      Exclusion->Count,
+                                      &Exclusion->Prefilter);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                     "failed to create regex prefilter (0x%08x)",
+                     status);
+
+        Exclusion->Prefilter = NULL;
+    }
+
+    RtlFreeHeap(RtlProcessHeap(), 0, patterns);
+}
+
+BOOLEAN AVrfpInitExclusionsRegex(
+    _In_opt_ PWCHAR Pattern,
+    _Out_ PVFDYNF_EXCLUSION_REGEX Exclusion
+    )
+{
+    ULONG offset;
+    ULONG count;
+    ULONG frameCount;
+
+    //
+    // The exclusions regular expressions is a REG_MULTI_SZ read by the
+    // property callback. Parse each block of the multi terminated string into
+    // the regex vector. We do this so we don't have to construct the regex
+    // object every time. Blocks with the frame pattern prefix are compiled
+    // into frame patterns instead, see framepat.c.
+    //
+
+    offset = 0;
+    count = 0;
+    frameCount = 0;
+    while (Pattern)
+    {
+        UNICODE_STRING pattern;
+
+        RtlInitUnicodeString(&pattern, &Pattern[offset]);
+        if (!pattern.Length)
+        {
+            break;
+        }
+
+        if (AVrfIsFramePattern(&pattern))
+        {
+            frameCount++;
+        }
+        else
+        {
+            count++;
+        }
+
+        offset += ((pattern.Length / sizeof(WCHAR)) + 1);
+    }
+
+    Exclusion->Count = 0;
+    Exclusion->FrameLocalCount = 0;
+    Exclusion->Regex = NULL;
+    Exclusion->FrameLocal = NULL;
+    Exclusion->Prefilter = NULL;
+    Exclusion->FramePatternCount = 0;
+    Exclusion->FramePatterns = NULL;
+
+    if (!count && !frameCount)
+    {
+        return TRUE;
+    }
+
+    if (count)
+    {
+        Exclusion->Regex = RtlAllocateHeap(RtlProcessHeap(),
+                                           HEAP_ZERO_MEMORY,
+                                           count * (sizeof(PCRE2_HANDLE) + sizeof(BOOLEAN)));
+        if (!Exclusion->Regex)
+        {
+            AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "failed to allocate exclusion regex");
+
+            return FALSE;
+        }
+
+        Exclusion->Count = count;
+        Exclusion->FrameLocal = Add2Ptr(Exclusion->Regex, count * sizeof(PCRE2_HANDLE));
+    }
+
+    if (frameCount)
+    {
+        Exclusion->FramePatterns = RtlAllocateHeap(RtlProcessHeap(),
+                                                   HEAP_ZERO_MEMORY,
+                                                   frameCount * sizeof(PVFDYNF_FRAME_PATTERN));
+        if (!Exclusion->FramePatterns)
+        {
+            AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "failed to allocate frame patterns");
+
+            return FALSE;
+        }
+
+        Exclusion->FramePatternCount = frameCount;
+    }
+
+    offset = 0;
+    count = 0;
+    frameCount = 0;
+    for (;;)
+    {
+        NTSTATUS status;
+        UNICODE_STRING pattern;
+        PCRE2_HANDLE regex;
+
+        RtlInitUnicodeString(&pattern, &Pattern[offset]);
+        if (!pattern.Length)
+        {
+            break;
+        }
+
+        if (AVrfIsFramePattern(&pattern))
+        {
+            AVRF_ASSERT(frameCount < Exclusion->FramePatternCount);
+
+            status = AVrfCompileFramePattern(&pattern,
+                                             &Exclusion->FramePatterns[frameCount]);
+            if (!NT_SUCCESS(status))
+            {
+                AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                             "frame pattern failed to compile (0x%08x) %wZ",
+                             status,
+                             &pattern);
+
+                return FALSE;
+            }
+
+            frameCount++;
+
+            offset += ((pattern.Length / sizeof(WCHAR)) + 1);
+            continue;
+        }
+
+        status = AVrfCompileRegex(&regex, &pattern);
+        if (!NT_SUCCESS(status))
+        {
+            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                         "regex failed to compile (0x%08x) %wZ",
+                         status,
+                         &pattern);
+
+            return FALSE;
+        }
+
+        AVRF_ASSERT(count < Exclusion->Count);
+
+        if (AVrfProperties.SymExclusionRanges &&
+            AVrfpIsFrameLocalPattern(&pattern))
+        {
+            Exclusion->FrameLocal[count] = TRUE;
+            Exclusion->FrameLocalCount++;
+        }
+
+        Exclusion->Regex[count++] = regex;
+
+        offset += ((pattern.Length / sizeof(WCHAR)) + 1);
+    }
+
+    if (Exclusion->Count)
+    {
+        AVrfpInitExclusionsPrefilter(Pattern, Exclusion);
+    }
+
+    return TRUE;
+}
+
+VOID AVrfpFreeExclusionsRegex(
+    _Inout_ PVFDYNF_EXCLUSION_REGEX Exclusion
+    )
+{
+    if (Exclusion->FramePatterns)
+    {
+        for (ULONG i = 0; i < Exclusion->FramePatternCount; i++)
+        {
+            if (Exclusion->FramePatterns[i])
+            {
+                AVrfFreeFramePattern(Exclusion->FramePatterns[i]);
+            }
+        }
+
+        RtlFreeHeap(RtlProcessHeap(), 0, Exclusion->FramePatterns);
+
+        Exclusion->FramePatterns = NULL;
+        Exclusion->FramePatternCount = 0;
+    }
+
+    if (!Exclusion->Regex)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < Exclusion->Count; i++)
+    {
+        if (Exclusion->Regex[i])
+        {
+            AVrfCloseRegex(Exclusion->Regex[i]);
+        }
+    }
+
+    RtlFreeHeap(RtlProcessHeap(), 0, Exclusion->Regex);
+
+    if (Exclusion->Prefilter)
+    {
+        AVrfFreeRegexPrefilter(Exclusion->Prefilter);
+        Exclusion->Prefilter = NULL;
+    }
+
+    Exclusion->Regex = NULL;
+    Exclusion->FrameLocal = NULL;
+    Exclusion->Count = 0;
+    Exclusion->FrameLocalCount = 0;
+}
+
+BOOLEAN AVrfpInitIncludeRegex(
+    _In_opt_ PWCHAR Pattern,
+    _Out_ PPCRE2_HANDLE Regex
+    )
+{
+    NTSTATUS status;
+    UNICODE_STRING pattern;
+
+    *Regex = NULL;
+
+    RtlInitUnicodeString(&pattern, Pattern);
+
+    if (!pattern.Length)
+    {
+        return TRUE;
+    }
+
+    status = AVrfCompileRegex(Regex, &pattern);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                     "regex failed to compile (0x%08x) %wZ",
+                     status,
+                     &pattern);
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOLEAN AVrfpInitGlobalRegex(
+    VOID
+    )
+{
+    if (!AVrfpInitIncludeRegex(AVrfProperties.IncludeRegex,
+                               &AVrfpFaultContext.IncludeRegex))
+    {
+        return FALSE;
+    }
+
+    if (!AVrfpInitExclusionsRegex(AVrfProperties.ExclusionsRegex,
+                                  &AVrfpFaultContext.Exclusions))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOLEAN AVrfpInitTypeRegex(
+    _In_ ULONG TypeIndex
+    )
+{
+    if (!AVrfpInitIncludeRegex(AVrfProperties.TypeIncludeRegex[TypeIndex],
+                               &AVrfpFaultContext.TypeIncludeRegex[TypeIndex]))
+    {
+        return FALSE;
+    }
+
+    if (!AVrfpInitExclusionsRegex(AVrfProperties.TypeExclusionsRegex[TypeIndex],
+                                  &AVrfpFaultContext.TypeExclusions[TypeIndex]))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOLEAN AVrfpEnsureRegex(
+    _In_ ULONG FaultType
+    )
+{
+    ULONG typeIndex;
+    LONG state;
+
+    //
+    // Compiling every expression at process attach is expensive with large
+    // exclusion lists and delays the application from starting. Instead the
+    // expressions for a fault type are compiled the first time the type is
+    // evaluated. The global expressions are compiled along with the first
+    // type evaluated.
+    //
+
+    typeIndex = AVrfpFaultTypeIndex(FaultType);
+
+    state = ReadAcquire(&AVrfpFaultContext.TypeRegexState[typeIndex]);
+    if (state != VFDYNF_REGEX_STATE_PENDING)
+    {
+        return (state == VFDYNF_REGEX_STATE_READY);
+    }
+
+    AVrfEnterCriticalSection(&AVrfpFaultContext.RegexCriticalSection);
+
+    if (AVrfpFaultContext.RegexCriticalSection.RecursionCount > 1)
+    {
+        //
+        // Do not evaluate the type if we're recursing while compiling.
+        //
+        state = VFDYNF_REGEX_STATE_FAILED;
+        goto Exit;
+    }
+
+    state = ReadAcquire(&AVrfpFaultContext.TypeRegexState[typeIndex]);
+    if (state != VFDYNF_REGEX_STATE_PENDING)
+    {
+        goto Exit;
+    }
+
+    if (AVrfpFaultContext.RegexState == VFDYNF_REGEX_STATE_PENDING)
+    {
+        if (AVrfpInitGlobalRegex())
+        {
+            AVrfpFaultContext.RegexState = VFDYNF_REGEX_STATE_READY;
+        }
+        else
+        {
+            AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "failed to initialize regex");
+
+            AVrfpFaultContext.RegexState = VFDYNF_REGEX_STATE_FAILED;
+            __debugbreak();
+        }
+    }
+
+    if (AVrfpFaultContext.RegexState != VFDYNF_REGEX_STATE_READY)
+    {
+        state = VFDYNF_REGEX_STATE_FAILED;
+    }
+    else if (AVrfpInitTypeRegex(typeIndex))
+    {
+        state = VFDYNF_REGEX_STATE_READY;
+    }
+    else
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                     "failed to initialize regex for fault type %lu",
+                     typeIndex);
+
+        state = VFDYNF_REGEX_STATE_FAILED;
+        __debugbreak();
+    }
+
+    WriteRelease(&AVrfpFaultContext.TypeRegexState[typeIndex], state);
+
+Exit:
+
+    AVrfLeaveCriticalSection(&AVrfpFaultContext.RegexCriticalSection);
+
+    return (state == VFDYNF_REGEX_STATE_READY);
+}
+
+BOOLEAN AVrfpHasAnyExclusionExpressions(
+    _In_ ULONG FaultType
+    )
+{
+    AVRF_ASSERT(AVrfpFaultContext.TypeRegexState[AVrfpFaultTypeIndex(FaultType)]
+                == VFDYNF_REGEX_STATE_READY);
+
+    PVFDYNF_EXCLUSION_REGEX typeExclusions;
+
+    typeExclusions = &AVrfpFaultContext.TypeExclusions[AVrfpFaultTypeIndex(FaultType)];
+
+    if (AVrfpFaultContext.Exclusions.Count ||
+        AVrfpFaultContext.Exclusions.FramePatternCount ||
+        typeExclusions->Count ||
+        typeExclusions->FramePatternCount)
+    {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN AVrfpHasAnyStackExclusionExpressions(
+    _In_ ULONG FaultType
+    )
+{
+    PVFDYNF_EXCLUSION_REGEX typeExclusions;
+
+    typeExclusions = &AVrfpFaultContext.TypeExclusions[AVrfpFaultTypeIndex(FaultType)];
+
+    if ((AVrfpFaultContext.Exclusions.Count > AVrfpFaultContext.Exclusions.FrameLocalCount) ||
+        (typeExclusions->Count > typeExclusions->FrameLocalCount) ||
+        AVrfpFaultContext.Exclusions.FramePatternCount ||
+        typeExclusions->FramePatternCount)
+    {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN AVrfpIsExcludedByFramePattern(
+    _In_ PVFDYNF_EXCLUSION_REGEX Exclusion,
+    _In_ PVFDYNF_SYM_STACK Stack,
+    _Inout_ PBOOLEAN Cacheable
+    )
+{
+    BOOLEAN failed;
+
+    failed = FALSE;
+
+    for (ULONG i = 0; i < Exclusion->FramePatternCount; i++)
+    {
+        BOOLEAN match;
+
+        if (!NT_SUCCESS(AVrfMatchFramePattern(Exclusion->FramePatterns[i],
+                                              Stack,
+                                              &match)))
+        {
+            failed = TRUE;
+            continue;
+        }
+
+        if (match)
+        {
+            return TRUE;
+        }
+    }
+
+    if (failed)
+    {
+        //
+        // See AVrfpIsExcludedByRegex.
+        //
+        *Cacheable = FALSE;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN AVrfpIsExcludedByRegex(
+    _In_ PVFDYNF_EXCLUSION_REGEX Exclusion,
+    _In_ PCUNICODE_STRING String,
+    _In_ BOOLEAN FrameLocal,
+    _Inout_ PBOOLEAN Cacheable
+    )
+{
+    ULONG candidates[VFDYNF_REGEX_PREFILTER_BITMAP_SIZE];
+    BOOLEAN failed;
+
+    if (FrameLocal ?
+        !Exclusion->FrameLocalCount :
+        (Exclusion->Count == Exclusion->FrameLocalCount))
+    {
+        return FALSE;
+    }
+
+    //
+    // One pass over the subject finds which patterns have their required
+    // literal in it, only those are run.
+    //
+    if (Exclusion->Prefilter)
+    {
+        AVrfRegexPrefilterScan(Exclusion->Prefilter, String, candidates);
+    }
+
+    failed = FALSE;
+
+    for (ULONG i = 0; i < Exclusion->Count; i++)
+    {
+        BOOLEAN match;
+
+        if (Exclusion->FrameLocal[i] != FrameLocal)
+        {
+            continue;
+        }
+
+        if (Exclusion->Prefilter &&
+            !AVrfRegexPrefilterIsCandidate(Exclusion->Prefilter, candidates, i))
+        {
+            continue;
+        }
+
+        if (!NT_SUCCESS(AVrfMatchRegex(Exclusion->Regex[i], String, &match)))
+        {
+            failed = TRUE;
+            continue;
+        }
+
+        if (match)
+        {
+            return TRUE;
+        }
+    }
+
+    if (failed)
+    {
+        //
+        // An expression which exceeded the match limits or was disabled has
+        // no verdict. Treat the subject as excluded rather than inject a
+        // fault the user may have excluded, and do not keep the verdict, the
+        // next match may complete.
+        //
+        *Cacheable = FALSE;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN AVrfpIsFrameOverriddenByRegex(
+    _In_ VFDYNF_SYM_ID Symbol,
+    _In_ ULONG FaultType,
+    _In_ BOOLEAN Memoize,
+    _Inout_ PBOOLEAN Cacheable
+    )
+{
+    UNICODE_STRING symbol;
+    ULONG mask;
+
+    //
+    // Frame local patterns only ever see one frame. Their verdict for each
+    // enabled fault type is a function of the symbol alone and is kept with
+    // the interned symbol.
+    //
+    if (Memoize && AVrfSymInternQueryMask(Symbol, &mask))
+    {
+        return BooleanFlagOn(mask, FaultType);
+    }
+
+    AVrfSymInternGetSymbol(Symbol, &symbol);
+
+    if (Memoize)
+    {
+        BOOLEAN cacheable;
+
+        mask = AVrfFaultFrameExclusionMask(&symbol, &cacheable);
+
+        if (cacheable)
+        {
+            AVrfSymInternSetMask(Symbol, mask);
+        }
+        else
+        {
+            *Cacheable = FALSE;
+        }
+
+        return BooleanFlagOn(mask, FaultType);
+    }
+
+    if (AVrfpIsExcludedByRegex(&AVrfpFaultContext.Exclusions, &symbol, TRUE, Cacheable) ||
+        AVrfpIsExcludedByRegex(&AVrfpFaultContext.TypeExclusions[AVrfpFaultTypeIndex(FaultType)],
+                               &symbol,
+                               TRUE,
+                               Cacheable))
+    {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN AVrfpIsStackOverriddenByRegex(
+    _In_ PVFDYNF_SYM_STACK Stack,
+    _In_ ULONG FaultType,
+    _In_ BOOLEAN SkipFrameLocal,
+    _Out_ PBOOLEAN Cacheable
+    )
+{
+    NTSTATUS status;
+    PVFDYNF_EXCLUSION_REGEX typeExclusions;
+    PCUNICODE_STRING text;
+
+    *Cacheable = TRUE;
+
+    AVRF_ASSERT(AVrfpFaultContext.TypeRegexState[AVrfpFaultTypeIndex(FaultType)]
+                == VFDYNF_REGEX_STATE_READY);
+
+    typeExclusions = &AVrfpFaultContext.TypeExclusions[AVrfpFaultTypeIndex(FaultType)];
+
+    //
+    // Frame local patterns are checked per frame unless the per-frame ranges
+    // were already checked for every frame, see AVrfSymExclCheckStack.
+    //
+    if (!SkipFrameLocal &&
+        (AVrfpFaultContext.Exclusions.FrameLocalCount ||
+         typeExclusions->FrameLocalCount))
+    {
+        BOOLEAN memoize;
+        BOOLEAN hasFrameExclusions;
+
+        //
+        // N.B. The verdicts can only be kept once the expressions of every
+        // enabled type are compiled.
+        //
+        memoize = AVrfFaultPrepareFrameExclusions(&hasFrameExclusions);
+
+        for (ULONG i = 0; i < Stack->Count; i++)
+        {
+            if (AVrfpIsFrameOverriddenByRegex(Stack->Symbols[i],
+                                              FaultType,
+                                              memoize,
+                                              Cacheable))
+            {
+                return TRUE;
+            }
+        }
+    }
+
+    //
+    // Frame patterns are evaluated over the interned symbols directly, the
+    // stack text is not needed for them.
+    //
+    if (AVrfpIsExcludedByFramePattern(&AVrfpFaultContext.Exclusions, Stack, Cacheable) ||
+        AVrfpIsExcludedByFramePattern(typeExclusions, Stack, Cacheable))
+    {
+        return TRUE;
+    }
+
+    if ((AVrfpFaultContext.Exclusions.Count == AVrfpFaultContext.Exclusions.FrameLocalCount) &&
+        (typeExclusions->Count == typeExclusions->FrameLocalCount))
+    {
+        return FALSE;
+    }
+
+    //
+    // Patterns which span frames are matched against the text of the whole
+    // stack. This is the easiest way to enable an author of overrides to
+    // write expressions for an entire stack.
+    //
+    status = AVrfSymGetStackText(Stack, &text);
+    if (!NT_SUCCESS(status))
+    {
+        //
+        // The stack can not be classified, treat it as overridden rather than
+        // inject a fault which may have been excluded.
+        //
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                     "failed to build stack text (0x%08x)",
+                     status);
+
+        *Cacheable = FALSE;
+        return TRUE;
+    }
+
+    if (AVrfpIsExcludedByRegex(&AVrfpFaultContext.Exclusions, text, FALSE, Cacheable) ||
+        AVrfpIsExcludedByRegex(typeExclusions, text, FALSE, Cacheable))
+    {
+        return TRUE;
+    }
+
+    return FALSE;
 }
 
-BOOLEAN AVrfpInitExclusionsRegexInternal(
-    _In_ PWCHAR Pattern,
-    _Out_ PVFDYNF_EXCLUSION_REGEX Exclusion
+BOOLEAN AVrfpQueryStackVerdict(
+    _In_ ULONG64 Fingerprint,
+    _In_ ULONG FaultType,
+    _Out_ PBOOLEAN Excluded
     )
 {
-    ULONG offset;
-    ULONG count;
+    BOOLEAN result;
+    ULONG index;
 
-    offset = 0;
-    count = 0;
-    for (;;)
+    //
+    // Many raw stacks symbolize to the same symbols, for example the same
+    // code reached through different load addresses or inlined frames. The
+    // expressions only ever see the symbols so their verdict is kept by the
+    // fingerprint of the symbolic stack, for each fault type. The expressions
+    // never change once compiled, the verdicts are kept for the life of the
+    // process and are not cleared with the fault period.
+    //
+    *Excluded = FALSE;
+    result = FALSE;
+
+    index = (ULONG)(Fingerprint & (VFDYNF_FAULT_VERDICT_COUNT - 1));
+
+    RtlAcquireSRWLockShared(&AVrfpFaultContext.VerdictLock);
+
+    for (ULONG i = 0; i < VFDYNF_FAULT_VERDICT_PROBE; i++)
     {
-        UNICODE_STRING pattern;
+        PVFDYNF_FAULT_VERDICT verdict;
 
-        RtlInitUnicodeString(&pattern, &Pattern[offset]);
-        if (!pattern.Length)
+        verdict = &AVrfpFaultContext.Verdicts[(index + i) & (VFDYNF_FAULT_VERDICT_COUNT - 1)];
+
+        if (verdict->Fingerprint == Fingerprint)
         {
+            if (BooleanFlagOn(verdict->Evaluated, FaultType))
+            {
+                *Excluded = BooleanFlagOn(verdict->Excluded, FaultType);
+                result = TRUE;
+            }
+
             break;
         }
 
-        count++;
-
-        offset += ((pattern.Length / sizeof(WCHAR)) + 1);
+        if (!verdict->Fingerprint)
+        {
+            break;
+        }
     }
 
-    if (!count)
-    {
-        Exclusion->Count = 0;
-        Exclusion->Regex = NULL;
-        return TRUE;
-    }
+    RtlReleaseSRWLockShared(&AVrfpFaultContext.VerdictLock);
 
-    Exclusion->Count = count;
-    Exclusion->Regex = RtlAllocateHeap(RtlProcessHeap(),
-                                       0,
-                                       count * sizeof(PCRE2_HANDLE));
-    if (!Exclusion->Regex)
-    {
-        AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "failed to allocate exclusion regex");
+    return result;
+}
 
-        __debugbreak();
-        return FALSE;
-    }
+VOID AVrfpSetStackVerdict(
+    _In_ ULONG64 Fingerprint,
+    _In_ ULONG FaultType,
+    _In_ BOOLEAN Excluded
+    )
+{
+    PVFDYNF_FAULT_VERDICT verdict;
+    ULONG index;
 
-    offset = 0;
-    count = 0;
-    for (;;)
+    index = (ULONG)(Fingerprint & (VFDYNF_FAULT_VERDICT_COUNT - 1));
+
+    RtlAcquireSRWLockExclusive(&AVrfpFaultContext.VerdictLock);
+
+    verdict = NULL;
+
+    for (ULONG i = 0; i < VFDYNF_FAULT_VERDICT_PROBE; i++)
     {
-        NTSTATUS status;
-        UNICODE_STRING pattern;
-        PCRE2_HANDLE regex;
+        PVFDYNF_FAULT_VERDICT entry;
 
-        RtlInitUnicodeString(&pattern, &Pattern[offset]);
-        if (!pattern.Length)
+        entry = &AVrfpFaultContext.Verdicts[(index + i) & (VFDYNF_FAULT_VERDICT_COUNT - 1)];
+
+        if (entry->Fingerprint == Fingerprint)
         {
+            verdict = entry;
             break;
         }
 
-        status = Pcre2Compile(&regex, &pattern);
-        if (!NT_SUCCESS(status))
+        if (!entry->Fingerprint)
         {
-            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
-                         "regex failed to compile (0x%08x)",
-                         status);
-
-            __debugbreak();
-            return FALSE;
+            verdict = entry;
+            verdict->Fingerprint = Fingerprint;
+            break;
         }
-
-        AVRF_ASSERT(count < Exclusion->Count);
-
-        Exclusion->Regex[count++] = regex;
-
-        offset += ((pattern.Length / sizeof(WCHAR)) + 1);
     }
 
-    return TRUE;
-}
+    if (!verdict)
+    {
+        //
+        // The probe sequence is full, replace the first entry of it.
+        //
+        verdict = &AVrfpFaultContext.Verdicts[index];
+        verdict->Fingerprint = Fingerprint;
+        verdict->Evaluated = 0;
+        verdict->Excluded = 0;
+    }
 
-BOOLEAN AVrfpInitExclusionsRegex(
-    VOID
-    )
-{
-    //
-    // The exclusions regular expressions is a REG_MULTI_SZ from the properties
-    // verifier loads on our behalf. Parse each block of the multi terminated
-    // string into the regex vector. We do this so we don't have to construct
-    // the regex object every time.
-    //
+    SetFlag(verdict->Evaluated, FaultType);
 
-    if (!AVrfpInitExclusionsRegexInternal(AVrfProperties.ExclusionsRegex,
-                                          &AVrfpFaultContext.Exclusions))
+    if (Excluded)
     {
-        return FALSE;
+        SetFlag(verdict->Excluded, FaultType);
     }
-
-    for (ULONG i = 0; i < VFDYNF_FAULT_TYPE_COUNT; i++)
+    else
     {
-        if (!AVrfpInitExclusionsRegexInternal(AVrfProperties.TypeExclusionsRegex[i],
-                                              &AVrfpFaultContext.TypeExclusions[i]))
-        {
-            return FALSE;
-        }
+        ClearFlag(verdict->Excluded, FaultType);
     }
 
-    return TRUE;
+    RtlReleaseSRWLockExclusive(&AVrfpFaultContext.VerdictLock);
 }
 
-BOOLEAN AVrfpInitIncludeRegex(
-    VOID
+BOOLEAN AVrfFaultPrepareFrameExclusions(
+    _Out_ PBOOLEAN HasFrameExclusions
     )
 {
-    NTSTATUS status;
-    UNICODE_STRING pattern;
-
-    RtlInitUnicodeString(&pattern, AVrfProperties.IncludeRegex);
+    BOOLEAN ready;
 
-    if (pattern.Length)
-    {
-        status = Pcre2Compile(&AVrfpFaultContext.IncludeRegex, &pattern);
-        if (!NT_SUCCESS(status))
-        {
-            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
-                         "regex failed to compile (0x%08x)",
-                         status);
+    *HasFrameExclusions = FALSE;
 
-            __debugbreak();
-            return FALSE;
-        }
-    }
+    //
+    // Symbols are classified for every enabled fault type at once so the
+    // expressions of all enabled types must be compiled.
+    //
+    ready = FALSE;
 
     for (ULONG i = 0; i < VFDYNF_FAULT_TYPE_COUNT; i++)
     {
-        RtlInitUnicodeString(&pattern, AVrfProperties.TypeIncludeRegex[i]);
+        ULONG faultType;
 
-        if (!pattern.Length)
+        faultType = (1ul << i);
+
+        if (!BooleanFlagOn(AVrfProperties.EnableFaultMask, faultType))
         {
             continue;
         }
 
-        status = Pcre2Compile(&AVrfpFaultContext.TypeIncludeRegex[i], &pattern);
-        if (!NT_SUCCESS(status))
+        if (!AVrfpEnsureRegex(faultType))
         {
-            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
-                         "regex failed to compile (0x%08x)",
-                         status);
-
-            __debugbreak();
             return FALSE;
         }
-    }
-
-    return TRUE;
-}
 
-BOOLEAN AVrfpInitRegex(
-    VOID
-    )
-{
-    AVRF_ASSERT(!AVrfpFaultContext.RegexInitialized);
+        ready = TRUE;
 
-    if (!AVrfpInitIncludeRegex())
-    {
-        return FALSE;
+        if (AVrfpFaultContext.TypeExclusions[i].FrameLocalCount)
+        {
+            *HasFrameExclusions = TRUE;
+        }
     }
 
-    if (!AVrfpInitExclusionsRegex())
+    if (AVrfpFaultContext.Exclusions.FrameLocalCount)
     {
-        return FALSE;
+        *HasFrameExclusions = TRUE;
     }
 
-    AVrfpFaultContext.RegexInitialized = TRUE;
-
-    return TRUE;
+    return ready;
 }
 
-BOOLEAN AVrfpHasAnyExclusionExpressions(
-    _In_ ULONG FaultType
+ULONG AVrfFaultFrameExclusionMask(
+    _In_ PCUNICODE_STRING Symbol,
+    _Out_ PBOOLEAN Cacheable
     )
 {
-    if ((AVrfProperties.ExclusionsRegex[0]) != L'\0' ||
-        (AVrfProperties.TypeExclusionsRegex[AVrfpFaultTypeIndex(FaultType)] != L'\0'))
-    {
-        return TRUE;
-    }
+    ULONG mask;
 
-    return FALSE;
-}
+    //
+    // N.B. The caller must have called AVrfFaultPrepareFrameExclusions.
+    //
 
-BOOLEAN AVrfpIsStackOverriddenByRegex(
-    _In_ PUNICODE_STRING StackSymbols,
-    _In_ ULONG FaultType
-    )
-{
-    PVFDYNF_EXCLUSION_REGEX typeExclusions;
+    *Cacheable = TRUE;
+
+    if (AVrfpIsExcludedByRegex(&AVrfpFaultContext.Exclusions, Symbol, TRUE, Cacheable))
+    {
+        return VFDYNF_FAULT_VALID_MASK;
+    }
 
-    AVRF_ASSERT(AVrfpFaultContext.RegexInitialized);
+    mask = 0;
 
-    for (ULONG i = 0; i < AVrfpFaultContext.Exclusions.Count; i++)
+    for (ULONG i = 0; i < VFDYNF_FAULT_TYPE_COUNT; i++)
     {
-        if (Pcre2Match(AVrfpFaultContext.Exclusions.Regex[i], StackSymbols))
+        if (AVrfpIsExcludedByRegex(&AVrfpFaultContext.TypeExclusions[i],
+                                   Symbol,
+                                   TRUE,
+                                   Cacheable))
         {
-            return TRUE;
+            SetFlag(mask, (1ul << i));
         }
     }
 
-    typeExclusions = &AVrfpFaultContext.TypeExclusions[AVrfpFaultTypeIndex(FaultType)];
-    for (ULONG i = 0; i < typeExclusions->Count; i++)
+    return mask;
+}
+
+BOOLEAN AVrfpIsModuleMatch(
+    _In_ PCRE2_HANDLE Regex,
+    _In_ PCUNICODE_STRING BaseName
+    )
+{
+    BOOLEAN match;
+
+    //
+    // A module the include expression has no verdict for is not included,
+    // faults are only injected where they were asked for.
+    //
+    if (!NT_SUCCESS(AVrfMatchRegex(Regex, BaseName, &match)))
     {
-        if (Pcre2Match(typeExclusions->Regex[i], StackSymbols))
-        {
-            return TRUE;
-        }
+        return FALSE;
     }
 
-    return FALSE;
+    return match;
 }
 
 _Function_class_(AVRF_MODULE_ENUM_CALLBACK)
@@ -324,7 +1135,7 @@ BOOLEAN NTAPI AVrfpFaultModuleEnumCallback(
     {
         if (AVrfpFaultContext.IncludeRegex)
         {
-            if (Pcre2Match(AVrfpFaultContext.IncludeRegex, &Module->BaseName))
+            if (AVrfpIsModuleMatch(AVrfpFaultContext.IncludeRegex, &Module->BaseName))
             {
                 context->Result = TRUE;
                 return TRUE;
@@ -333,7 +1144,7 @@ BOOLEAN NTAPI AVrfpFaultModuleEnumCallback(
 
         if (context->Regex)
         {
-            if (Pcre2Match(context->Regex, &Module->BaseName))
+            if (AVrfpIsModuleMatch(context->Regex, &Module->BaseName))
             {
                 context->Result = TRUE;
                 return TRUE;
@@ -368,7 +1179,10 @@ BOOLEAN AVrfIsCallerIncluded(
         return FALSE;
     }
 
-    AVRF_ASSERT(AVrfpFaultContext.RegexInitialized);
+    if (!AVrfpEnsureRegex(FaultType))
+    {
+        return FALSE;
+    }
 
     context.Regex = AVrfpFaultContext.TypeIncludeRegex[AVrfpFaultTypeIndex(FaultType)];
 
@@ -385,6 +1199,58 @@ BOOLEAN AVrfIsCallerIncluded(
     return context.Result;
 }
 
+BOOLEAN AVrfFaultIsModuleIncluded(
+    _In_ PCUNICODE_STRING BaseName
+    )
+{
+    if (!AVrfpFaultContext.Initialized)
+    {
+        return FALSE;
+    }
+
+    //
+    // A module is included when any enabled fault type may be injected for
+    // callers in it.
+    //
+    for (ULONG i = 0; i < VFDYNF_FAULT_TYPE_COUNT; i++)
+    {
+        ULONG faultType;
+        PCRE2_HANDLE regex;
+
+        faultType = (1ul << i);
+
+        if (!BooleanFlagOn(AVrfProperties.EnableFaultMask, faultType))
+        {
+            continue;
+        }
+
+        if (!AVrfpEnsureRegex(faultType))
+        {
+            continue;
+        }
+
+        regex = AVrfpFaultContext.TypeIncludeRegex[i];
+
+        if (!AVrfpFaultContext.IncludeRegex && !regex)
+        {
+            return TRUE;
+        }
+
+        if (AVrfpFaultContext.IncludeRegex &&
+            AVrfpIsModuleMatch(AVrfpFaultContext.IncludeRegex, BaseName))
+        {
+            return TRUE;
+        }
+
+        if (regex && AVrfpIsModuleMatch(regex, BaseName))
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 BOOLEAN AVrfpShouldFaultInjectCached(
     _In_ ULONG FaultType,
     _In_ ULONG StackHash,
@@ -586,8 +1452,11 @@ BOOLEAN AVrfShouldFaultInject(
     ULONG stackHash;
     PVOID frames[VFDYNF_FAULT_STACK_FRAMES];
     USHORT count;
-    PUNICODE_STRING stackSymbols;
+    PVFDYNF_SYM_STACK stack;
     LARGE_INTEGER symTimeout;
+    BOOLEAN skipFrameLocal;
+    BOOLEAN excluded;
+    BOOLEAN cacheable;
 
     result = FALSE;
     faultCount = NULL;
@@ -625,6 +1494,18 @@ BOOLEAN AVrfShouldFaultInject(
         goto Exit;
     }
 
+    if (AVrfProperties.SymWarmUp &&
+        AVrfpHasAnyExclusionExpressions(FaultType) &&
+        !AVrfSymIsModuleWarm(CallerAddress))
+    {
+        //
+        // The symbols for the caller are still loading in the background, the
+        // exclusions can not be checked without blocking on them. Nothing is
+        // cached, the decision is made again once the module is warm.
+        //
+        goto Exit;
+    }
+
     if (!VerifierShouldFaultInject(AVrfpFaultTypeClass(FaultType), CallerAddress))
     {
         goto Exit;
@@ -655,16 +1536,54 @@ BOOLEAN AVrfShouldFaultInject(
         goto Exit;
     }
 
+    skipFrameLocal = FALSE;
+
+    if (AVrfProperties.SymExclusionRanges)
+    {
+        //
+        // Frame local exclusions were compiled into address ranges when the
+        // modules were loaded. When every frame is covered the verdict for
+        // those patterns is a range check per frame.
+        //
+        switch (AVrfSymExclCheckStack(frames, count, FaultType))
+        {
+            case VFDYNF_SYM_EXCL_EXCLUDED:
+            {
+                AVrfpCacheFaultInjectResult(FALSE, stackHash);
+                goto Exit;
+            }
+            case VFDYNF_SYM_EXCL_INCLUDED:
+            {
+                if (!AVrfpHasAnyStackExclusionExpressions(FaultType))
+                {
+                    AVrfpCacheFaultInjectResult(FaultType, stackHash);
+                    result = TRUE;
+                    goto Exit;
+                }
+
+                skipFrameLocal = TRUE;
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+    }
+
     //
-    // Classify the stack. Check for overrides by symbols/etc. We build a
-    // complete string representation of the stack enabling the regex to span
-    // multiple frames. This is the easiest way to enable an author of
-    // overrides to write expressions for an entire stack.
+    // Classify the stack. Check for overrides by symbols/etc. The frames are
+    // resolved to interned symbols, a complete string representation of the
+    // stack is built only when an expression spanning frames needs it.
     //
 
     symTimeout.QuadPart = (-10000LL * AVrfProperties.SymResolveTimeout);
 
-    status = AVrfSymGetSymbols(frames, count, &stackSymbols, &symTimeout);
+    status = AVrfSymGetSymbols(frames,
+                               count,
+                               stackHash,
+                               &stack,
+                               &symTimeout);
     if (status == STATUS_DEVICE_NOT_READY)
     {
         //
@@ -685,7 +1604,26 @@ BOOLEAN AVrfShouldFaultInject(
         goto Exit;
     }
 
-    if (AVrfpIsStackOverriddenByRegex(stackSymbols, FaultType))
+    //
+    // N.B. When the frame local patterns were skipped the address ranges
+    // already found none of them in the stack. The ranges were classified
+    // from the names dbghelp enumerates, the export tier or the broker may
+    // name the same frames differently, so that verdict is not kept by the
+    // symbolic stack.
+    //
+    if (!AVrfpQueryStackVerdict(stack->Fingerprint, FaultType, &excluded))
+    {
+        excluded = AVrfpIsStackOverriddenByRegex(stack,
+                                                 FaultType,
+                                                 skipFrameLocal,
+                                                 &cacheable);
+        if (cacheable && !skipFrameLocal)
+        {
+            AVrfpSetStackVerdict(stack->Fingerprint, FaultType, excluded);
+        }
+    }
+
+    if (excluded)
     {
         AVrfpCacheFaultInjectResult(FALSE, stackHash);
     }
@@ -698,7 +1636,7 @@ BOOLEAN AVrfShouldFaultInject(
         result = TRUE;
     }
 
-    AVrfSymFreeSymbols(stackSymbols);
+    AVrfSymFreeSymbols(stack);
 
 Exit:
 
@@ -709,6 +1647,12 @@ Exit:
         if (result)
         {
             AVrfpRecordLastFaultStack(stackHash, frames, count);
+            AVrfFaultLogRecord(FaultType, stackHash, frames, count);
+
+            if (BooleanFlagOn(FaultType, VFDYNF_FAULT_FUZZ_MASK))
+            {
+                AVrfFuzzBeginEvent(FaultType, frames, count);
+            }
         }
     }
 
@@ -748,14 +1692,7 @@ BOOLEAN AVrfFaultProcessAttach(
 
     AVrfInitializeStackTable(&AVrfpFaultContext.StackTable);
 
-    if (!AVrfpInitRegex())
-    {
-        AVrfDbgPuts(DPFLTR_ERROR_LEVEL,
-                    "failed to initialize exclusions regex");
-
-        __debugbreak();
-        return FALSE;
-    }
+    AVrfInitializeCriticalSection(&AVrfpFaultContext.RegexCriticalSection);
 
     err = VerifierRegisterFaultInjectProvider(VFDYNF_FAULT_TYPE_COUNT,
                                               &AVrfpFaultContext.TypeBase);
@@ -863,52 +1800,23 @@ VOID AVrfFaultProcessDetach(
     AVrfpFaultContext.Initialized = FALSE;
 
     AVrfDeleteCriticalSection(&AVrfpFaultContext.CriticalSection);
+    AVrfDeleteCriticalSection(&AVrfpFaultContext.RegexCriticalSection);
 
-    if (AVrfpFaultContext.Exclusions.Regex)
-    {
-        for (ULONG i = 0; i < AVrfpFaultContext.Exclusions.Count; i++)
-        {
-            if (AVrfpFaultContext.Exclusions.Regex[i])
-            {
-                Pcre2Close(AVrfpFaultContext.Exclusions.Regex[i]);
-            }
-        }
-
-        RtlFreeHeap(RtlProcessHeap(), 0, AVrfpFaultContext.Exclusions.Regex);
-
-        AVrfpFaultContext.Exclusions.Regex = NULL;
-        AVrfpFaultContext.Exclusions.Count = 0;
-    }
+    AVrfpFreeExclusionsRegex(&AVrfpFaultContext.Exclusions);
 
-    for (ULONG i = 0; i < VFDYNF_FAULT_TYPE_COUNT; i++)
+    if (AVrfpFaultContext.IncludeRegex)
     {
-        PVFDYNF_EXCLUSION_REGEX entry;
-
-        entry = &AVrfpFaultContext.TypeExclusions[i];
-
-        if (entry->Regex)
-        {
-            for (ULONG j = 0; j < entry->Count; j++)
-            {
-                if (entry->Regex[j])
-                {
-                    Pcre2Close(&entry->Regex[j]);
-                }
-            }
-
-            RtlFreeHeap(RtlProcessHeap(), 0, entry->Regex);
-            entry->Regex = NULL;
-            entry->Count = 0;
-        }
+        AVrfCloseRegex(AVrfpFaultContext.IncludeRegex);
+        AVrfpFaultContext.IncludeRegex = NULL;
     }
 
-    Pcre2Close(AVrfpFaultContext.IncludeRegex);
-
     for (ULONG i = 0; i < VFDYNF_FAULT_TYPE_COUNT; i++)
     {
+        AVrfpFreeExclusionsRegex(&AVrfpFaultContext.TypeExclusions[i]);
+
         if (AVrfpFaultContext.TypeIncludeRegex[i])
         {
-            Pcre2Close(AVrfpFaultContext.TypeIncludeRegex[i]);
+            AVrfCloseRegex(AVrfpFaultContext.TypeIncludeRegex[i]);
             AVrfpFaultContext.TypeIncludeRegex[i] = NULL;
         }
     }
@@ -0,0 +1,395 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <vfdynf.h>
+#include <vfsymsrv.h>
+
+#define VFDYNF_FAULT_LOG_MAX_MODULES 512
+
+typedef struct _VFDYNF_FAULT_LOG_MODULE
+{
+    PVOID BaseAddress;
+    PVOID EndAddress;
+    ULONG Index;
+} VFDYNF_FAULT_LOG_MODULE, *PVFDYNF_FAULT_LOG_MODULE;
+
+typedef struct _VFDYNF_FAULT_LOG_ENUM_CONTEXT
+{
+    PVOID Frame;
+    PVFDYNF_FAULT_LOG_MODULE Module;
+    PVFSYMSRV_LOG_MODULE Record;
+} VFDYNF_FAULT_LOG_ENUM_CONTEXT, *PVFDYNF_FAULT_LOG_ENUM_CONTEXT;
+
+//
+// N.B. Records are written through to the file as faults are injected so the
+// log is complete up to the last fault when the process crashes.
+//
+typedef struct _VFDYNF_FAULT_LOG_CONTEXT
+{
+    RTL_SRWLOCK Lock;
+    BOOLEAN Failed;
+    HANDLE FileHandle;
+    ULONG NextIndex;
+    ULONG ModuleCount;
+    VFDYNF_FAULT_LOG_MODULE Modules[VFDYNF_FAULT_LOG_MAX_MODULES];
+    DECLSPEC_ALIGN(8) BYTE ModuleBuffer[VFSYMSRV_LOG_MAX_MODULE_SIZE];
+    DECLSPEC_ALIGN(8) BYTE FaultBuffer[VFSYMSRV_LOG_MAX_FAULT_SIZE];
+} VFDYNF_FAULT_LOG_CONTEXT, *PVFDYNF_FAULT_LOG_CONTEXT;
+
+static VFDYNF_FAULT_LOG_CONTEXT AVrfpFaultLogContext =
+{
+    .Lock = RTL_SRWLOCK_INIT,
+    .Failed = FALSE,
+    .FileHandle = NULL,
+    .NextIndex = 0,
+    .ModuleCount = 0,
+    .Modules = { 0 },
+    .ModuleBuffer = { 0 },
+    .FaultBuffer = { 0 },
+};
+
+_Requires_exclusive_lock_held_(AVrfpFaultLogContext.Lock)
+_Must_inspect_result_
+NTSTATUS AVrfpFaultLogWrite(
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+    )
+{
+    NTSTATUS status;
+    IO_STATUS_BLOCK ioStatusBlock;
+
+    status = NtWriteFile(AVrfpFaultLogContext.FileHandle,
+                         NULL,
+                         NULL,
+                         NULL,
+                         &ioStatusBlock,
+                         Buffer,
+                         Length,
+                         NULL,
+                         NULL);
+    if (NT_SUCCESS(status) && (ioStatusBlock.Information != Length))
+    {
+        status = STATUS_DISK_FULL;
+    }
+
+    return status;
+}
+
+_Requires_exclusive_lock_held_(AVrfpFaultLogContext.Lock)
+_Must_inspect_result_
+NTSTATUS AVrfpFaultLogOpen(
+    VOID
+    )
+{
+    NTSTATUS status;
+    LARGE_INTEGER systemTime;
+    WCHAR path[MAX_PATH];
+    UNICODE_STRING ntPath;
+    OBJECT_ATTRIBUTES objectAttributes;
+    IO_STATUS_BLOCK ioStatusBlock;
+    VFSYMSRV_LOG_HEADER header;
+
+    NtQuerySystemTime(&systemTime);
+
+    status = StringCchPrintfW(path,
+                              ARRAYSIZE(path),
+                              L"%ls\\vfdynf_%lu_%016llx.vflog",
+                              AVrfProperties.FaultLogPath,
+                              HandleToULong(NtCurrentProcessId()),
+                              systemTime.QuadPart);
+    if (FAILED(status))
+    {
+        return STATUS_NAME_TOO_LONG;
+    }
+
+    status = RtlDosPathNameToNtPathName_U_WithStatus(path, &ntPath, NULL, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    InitializeObjectAttributes(&objectAttributes,
+                               &ntPath,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    status = NtCreateFile(&AVrfpFaultLogContext.FileHandle,
+                          FILE_GENERIC_WRITE,
+                          &objectAttributes,
+                          &ioStatusBlock,
+                          NULL,
+                          FILE_ATTRIBUTE_NORMAL,
+                          FILE_SHARE_READ,
+                          FILE_OVERWRITE_IF,
+                          FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+                          NULL,
+                          0);
+
+    RtlFreeUnicodeString(&ntPath);
+
+    if (!NT_SUCCESS(status))
+    {
+        AVrfpFaultLogContext.FileHandle = NULL;
+        return status;
+    }
+
+    header.Magic = VFSYMSRV_LOG_MAGIC;
+    header.Version = VFSYMSRV_LOG_VERSION;
+    header.ProcessId = HandleToULong(NtCurrentProcessId());
+    header.Reserved = 0;
+    header.StartTime = systemTime;
+
+    status = AVrfpFaultLogWrite(&header, sizeof(header));
+    if (!NT_SUCCESS(status))
+    {
+        NtClose(AVrfpFaultLogContext.FileHandle);
+        AVrfpFaultLogContext.FileHandle = NULL;
+        return status;
+    }
+
+    AVrfDbgPrint(DPFLTR_INFO_LEVEL, "fault log %ls", path);
+
+    return STATUS_SUCCESS;
+}
+
+_Function_class_(AVRF_MODULE_ENUM_CALLBACK)
+BOOLEAN NTAPI AVrfpFaultLogModuleEnumCallback(
+    _In_ PAVRF_MODULE_ENTRY Module,
+    _In_ PVOID Context
+    )
+{
+    PVFDYNF_FAULT_LOG_ENUM_CONTEXT context;
+    PIMAGE_NT_HEADERS ntHeaders;
+    USHORT nameLength;
+
+    context = Context;
+
+    if ((context->Frame < Module->BaseAddress) ||
+        (context->Frame >= Module->EndAddress))
+    {
+        return FALSE;
+    }
+
+    if (!NT_SUCCESS(RtlImageNtHeaderEx(0,
+                                       Module->BaseAddress,
+                                       PtrOffset(Module->BaseAddress,
+                                                 Module->EndAddress),
+                                       &ntHeaders)))
+    {
+        return FALSE;
+    }
+
+    nameLength = (USHORT)min(Module->FullName.Length,
+                             ((VFSYMSRV_MAX_MODULE_PATH - 1) * sizeof(WCHAR)));
+
+    context->Module->BaseAddress = Module->BaseAddress;
+    context->Module->EndAddress = Module->EndAddress;
+
+    context->Record->Record.Type = VFSYMSRV_LOG_RECORD_MODULE;
+    context->Record->Record.Reserved = 0;
+    context->Record->Record.Length = ALIGN_UP_BY((FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName) +
+                                                  nameLength),
+                                                 8);
+    context->Record->TimeDateStamp = ntHeaders->FileHeader.TimeDateStamp;
+    context->Record->SizeOfImage = ntHeaders->OptionalHeader.SizeOfImage;
+    context->Record->NameLength = nameLength;
+    context->Record->Reserved = 0;
+
+    RtlZeroMemory(context->Record->FullName,
+                  (context->Record->Record.Length -
+                   FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName)));
+    RtlCopyMemory(context->Record->FullName, Module->FullName.Buffer, nameLength);
+
+    return TRUE;
+}
+
+_Requires_exclusive_lock_held_(AVrfpFaultLogContext.Lock)
+ULONG AVrfpFaultLogLookupModule(
+    _In_ PVOID Frame,
+    _Out_ PULONG Rva
+    )
+{
+    NTSTATUS status;
+    VFDYNF_FAULT_LOG_ENUM_CONTEXT context;
+    PVFDYNF_FAULT_LOG_MODULE module;
+
+    *Rva = 0;
+
+    for (ULONG i = 0; i < AVrfpFaultLogContext.ModuleCount; i++)
+    {
+        module = &AVrfpFaultLogContext.Modules[i];
+
+        if ((Frame >= module->BaseAddress) && (Frame < module->EndAddress))
+        {
+            *Rva = PtrOffset(module->BaseAddress, Frame);
+            return module->Index;
+        }
+    }
+
+    if (AVrfpFaultLogContext.ModuleCount >= ARRAYSIZE(AVrfpFaultLogContext.Modules))
+    {
+        //
+        // Forget the modules and describe them again when next seen. Indices
+        // are never reused, so earlier records remain valid.
+        //
+        AVrfpFaultLogContext.ModuleCount = 0;
+    }
+
+    module = &AVrfpFaultLogContext.Modules[AVrfpFaultLogContext.ModuleCount];
+
+    context.Frame = Frame;
+    context.Module = module;
+    context.Record = (PVFSYMSRV_LOG_MODULE)AVrfpFaultLogContext.ModuleBuffer;
+
+    if (!AVrfEnumLoadedModules(AVrfpFaultLogModuleEnumCallback, &context))
+    {
+        return VFSYMSRV_NO_MODULE;
+    }
+
+    module->Index = AVrfpFaultLogContext.NextIndex;
+    context.Record->Index = module->Index;
+
+    //
+    // The module record must precede the first fault record referring to it.
+    //
+    status = AVrfpFaultLogWrite(context.Record, context.Record->Record.Length);
+    if (!NT_SUCCESS(status))
+    {
+        return VFSYMSRV_NO_MODULE;
+    }
+
+    AVrfpFaultLogContext.NextIndex++;
+    AVrfpFaultLogContext.ModuleCount++;
+
+    *Rva = PtrOffset(module->BaseAddress, Frame);
+    return module->Index;
+}
+
+BOOLEAN AVrfFaultLogEnabled(
+    VOID
+    )
+{
+    return (AVrfProperties.FaultLogPath[0] != L'\0');
+}
+
+VOID AVrfFaultLogRecord(
+    _In_ ULONG FaultType,
+    _In_ ULONG StackHash,
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount
+    )
+{
+    NTSTATUS status;
+    PVFSYMSRV_LOG_FAULT record;
+
+    if (!AVrfFaultLogEnabled())
+    {
+        return;
+    }
+
+    FramesCount = min(FramesCount, VFSYMSRV_MAX_FRAMES);
+
+    RtlAcquireSRWLockExclusive(&AVrfpFaultLogContext.Lock);
+
+    if (AVrfpFaultLogContext.Failed)
+    {
+        goto Exit;
+    }
+
+    if (!AVrfpFaultLogContext.FileHandle)
+    {
+        status = AVrfpFaultLogOpen();
+        if (!NT_SUCCESS(status))
+        {
+            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                         "failed to create fault log (0x%08x)",
+                         status);
+
+            AVrfpFaultLogContext.Failed = TRUE;
+            goto Exit;
+        }
+    }
+
+    record = (PVFSYMSRV_LOG_FAULT)AVrfpFaultLogContext.FaultBuffer;
+
+    for (ULONG i = 0; i < FramesCount; i++)
+    {
+        record->Frames[i].ModuleIndex = AVrfpFaultLogLookupModule(Frames[i],
+                                                                  &record->Frames[i].Rva);
+    }
+
+    record->Record.Type = VFSYMSRV_LOG_RECORD_FAULT;
+    record->Record.Reserved = 0;
+    record->Record.Length = (FIELD_OFFSET(VFSYMSRV_LOG_FAULT, Frames) +
+                             (FramesCount * sizeof(VFSYMSRV_FRAME)));
+    record->FaultType = FaultType;
+    record->StackHash = StackHash;
+    record->ThreadId = HandleToULong(NtCurrentThreadId());
+    record->FrameCount = FramesCount;
+
+    NtQuerySystemTime(&record->Time);
+
+    status = AVrfpFaultLogWrite(record, record->Record.Length);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                     "failed to write fault log (0x%08x)",
+                     status);
+
+        AVrfpFaultLogContext.Failed = TRUE;
+    }
+
+Exit:
+
+    RtlReleaseSRWLockExclusive(&AVrfpFaultLogContext.Lock);
+}
+
+VOID AVrfFaultLogDllUnload(
+    _In_z_ PCWSTR DllName,
+    _In_ PVOID DllBase,
+    _In_ SIZE_T DllSize
+    )
+{
+    UNREFERENCED_PARAMETER(DllName);
+    UNREFERENCED_PARAMETER(DllSize);
+
+    if (!AVrfFaultLogEnabled())
+    {
+        return;
+    }
+
+    //
+    // Another module may load in the same range, it is given a new index.
+    //
+    RtlAcquireSRWLockExclusive(&AVrfpFaultLogContext.Lock);
+
+    for (ULONG i = 0; i < AVrfpFaultLogContext.ModuleCount; i++)
+    {
+        if (AVrfpFaultLogContext.Modules[i].BaseAddress == DllBase)
+        {
+            AVrfpFaultLogContext.ModuleCount--;
+            AVrfpFaultLogContext.Modules[i] = AVrfpFaultLogContext.Modules[AVrfpFaultLogContext.ModuleCount];
+            break;
+        }
+    }
+
+    RtlReleaseSRWLockExclusive(&AVrfpFaultLogContext.Lock);
+}
+
+VOID AVrfFaultLogProcessDetach(
+    VOID
+    )
+{
+    RtlAcquireSRWLockExclusive(&AVrfpFaultLogContext.Lock);
+
+    if (AVrfpFaultLogContext.FileHandle)
+    {
+        NtClose(AVrfpFaultLogContext.FileHandle);
+        AVrfpFaultLogContext.FileHandle = NULL;
+    }
+
+    AVrfpFaultLogContext.Failed = TRUE;
+
+    RtlReleaseSRWLockExclusive(&AVrfpFaultLogContext.Lock);
+}
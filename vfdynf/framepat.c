@@ -0,0 +1,364 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <vfdynf.h>
+
+//
+// Frame patterns describe a stack as a sequence of expressions, one for each
+// frame, rather than one expression over the text of the whole stack:
+//
+//   frames: <expr> => <expr> ~> <expr>
+//
+// The elements are listed in stack order, innermost frame first, as in the
+// stack text. "=>" requires the next element to match the very next frame
+// (the caller), "~>" allows any number of frames in between. An operator must
+// be surrounded by whitespace, whitespace around each element is ignored. An
+// element matches when its expression matches anywhere in the symbol of one
+// frame.
+//
+// A pattern is compiled to a bit-parallel automaton over the frames. Bit K of
+// the state is set when elements [0, K) have matched ending at the previous
+// frame, so a stack is classified in one pass over its frames. An element is
+// only evaluated for a frame when its state bit is set, and the verdict of an
+// element for a symbol is kept with the interned symbol. Each distinct symbol
+// is matched against an element at most once.
+//
+
+#define VFDYNF_FRAME_PATTERN_NO_CACHE ULONG_MAX
+
+typedef struct _VFDYNF_FRAME_PATTERN_ELEMENT
+{
+    PCRE2_HANDLE Regex;
+    ULONG CacheIndex;
+} VFDYNF_FRAME_PATTERN_ELEMENT, *PVFDYNF_FRAME_PATTERN_ELEMENT;
+
+typedef struct _VFDYNF_FRAME_PATTERN
+{
+    ULONG Count;
+    ULONG GapMask;
+    VFDYNF_FRAME_PATTERN_ELEMENT Elements[VFDYNF_FRAME_PATTERN_MAX_ELEMENTS];
+} VFDYNF_FRAME_PATTERN;
+
+//
+// N.B. Cache indices are handed out for the life of the process, the
+// expressions are compiled once. Elements past the bits available in the
+// symbol cache are evaluated every time.
+//
+static volatile LONG AVrfpFramePatternNextCacheIndex = 0;
+
+BOOLEAN AVrfIsFramePattern(
+    _In_ PCUNICODE_STRING Pattern
+    )
+{
+    UNICODE_STRING prefix;
+
+    RtlInitUnicodeString(&prefix, VFDYNF_FRAME_PATTERN_PREFIX);
+
+    return RtlPrefixUnicodeString(&prefix, Pattern, FALSE);
+}
+
+BOOLEAN AVrfpFramePatternIsSpace(
+    _In_ WCHAR Char
+    )
+{
+    return ((Char == L' ') || (Char == L'\t'));
+}
+
+BOOLEAN AVrfpFramePatternIsOperator(
+    _In_ PCUNICODE_STRING Pattern,
+    _In_ ULONG Index,
+    _Out_ PBOOLEAN Gap
+    )
+{
+    ULONG length;
+    WCHAR c;
+
+    *Gap = FALSE;
+
+    length = (Pattern->Length / sizeof(WCHAR));
+
+    if ((Index == 0) ||
+        ((Index + 2) >= length) ||
+        !AVrfpFramePatternIsSpace(Pattern->Buffer[Index - 1]) ||
+        !AVrfpFramePatternIsSpace(Pattern->Buffer[Index + 2]) ||
+        (Pattern->Buffer[Index + 1] != L'>'))
+    {
+        return FALSE;
+    }
+
+    c = Pattern->Buffer[Index];
+
+    if (c == L'~')
+    {
+        *Gap = TRUE;
+        return TRUE;
+    }
+
+    return (c == L'=');
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpCompileFramePatternElement(
+    _Inout_ PVFDYNF_FRAME_PATTERN FramePattern,
+    _In_ PCUNICODE_STRING Pattern,
+    _In_ ULONG Start,
+    _In_ ULONG End
+    )
+{
+    NTSTATUS status;
+    UNICODE_STRING element;
+    PVFDYNF_FRAME_PATTERN_ELEMENT entry;
+    LONG cacheIndex;
+
+    while ((Start < End) && AVrfpFramePatternIsSpace(Pattern->Buffer[Start]))
+    {
+        Start++;
+    }
+
+    while ((End > Start) && AVrfpFramePatternIsSpace(Pattern->Buffer[End - 1]))
+    {
+        End--;
+    }
+
+    if (Start == End)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FramePattern->Count >= VFDYNF_FRAME_PATTERN_MAX_ELEMENTS)
+    {
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    element.Buffer = &Pattern->Buffer[Start];
+    element.Length = (USHORT)((End - Start) * sizeof(WCHAR));
+    element.MaximumLength = element.Length;
+
+    entry = &FramePattern->Elements[FramePattern->Count];
+
+    status = AVrfCompileRegex(&entry->Regex, &element);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                     "frame pattern element failed to compile (0x%08x) %wZ",
+                     status,
+                     &element);
+
+        entry->Regex = NULL;
+        return status;
+    }
+
+    cacheIndex = (InterlockedIncrement(&AVrfpFramePatternNextCacheIndex) - 1);
+
+    if (cacheIndex < VFDYNF_SYM_INTERN_FRAME_BITS)
+    {
+        entry->CacheIndex = (ULONG)cacheIndex;
+    }
+    else
+    {
+        entry->CacheIndex = VFDYNF_FRAME_PATTERN_NO_CACHE;
+    }
+
+    FramePattern->Count++;
+
+    return STATUS_SUCCESS;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfCompileFramePattern(
+    _In_ PCUNICODE_STRING Pattern,
+    _Outptr_ PVFDYNF_FRAME_PATTERN* FramePattern
+    )
+{
+    NTSTATUS status;
+    PVFDYNF_FRAME_PATTERN framePattern;
+    UNICODE_STRING prefix;
+    ULONG length;
+    ULONG start;
+    ULONG i;
+
+    *FramePattern = NULL;
+
+    if (!AVrfIsFramePattern(Pattern))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    framePattern = RtlAllocateHeap(RtlProcessHeap(),
+                                   HEAP_ZERO_MEMORY,
+                                   sizeof(VFDYNF_FRAME_PATTERN));
+    if (!framePattern)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlInitUnicodeString(&prefix, VFDYNF_FRAME_PATTERN_PREFIX);
+
+    length = (Pattern->Length / sizeof(WCHAR));
+    start = (prefix.Length / sizeof(WCHAR));
+
+    for (i = start; i < length; i++)
+    {
+        BOOLEAN gap;
+
+        if (!AVrfpFramePatternIsOperator(Pattern, i, &gap))
+        {
+            continue;
+        }
+
+        status = AVrfpCompileFramePatternElement(framePattern, Pattern, start, i);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+
+        //
+        // The operator precedes the next element, a gap lets the state of the
+        // next element carry over frames which do not match it.
+        //
+        if (gap && (framePattern->Count < VFDYNF_FRAME_PATTERN_MAX_ELEMENTS))
+        {
+            framePattern->GapMask |= (1ul << framePattern->Count);
+        }
+
+        start = (i + 2);
+        i++;
+    }
+
+    status = AVrfpCompileFramePatternElement(framePattern, Pattern, start, length);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    *FramePattern = framePattern;
+    framePattern = NULL;
+
+Exit:
+
+    if (framePattern)
+    {
+        AVrfFreeFramePattern(framePattern);
+    }
+
+    return status;
+}
+
+VOID AVrfFreeFramePattern(
+    _In_ PVFDYNF_FRAME_PATTERN FramePattern
+    )
+{
+    for (ULONG i = 0; i < FramePattern->Count; i++)
+    {
+        if (FramePattern->Elements[i].Regex)
+        {
+            AVrfCloseRegex(FramePattern->Elements[i].Regex);
+        }
+    }
+
+    RtlFreeHeap(RtlProcessHeap(), 0, FramePattern);
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpFramePatternMatchElement(
+    _In_ PVFDYNF_FRAME_PATTERN_ELEMENT Element,
+    _In_ VFDYNF_SYM_ID Symbol,
+    _Out_ PBOOLEAN Match
+    )
+{
+    NTSTATUS status;
+    UNICODE_STRING symbol;
+
+    if (AVrfSymInternQueryFrameMatch(Symbol, Element->CacheIndex, Match))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (!AVrfSymInternGetSymbol(Symbol, &symbol))
+    {
+        *Match = FALSE;
+        return STATUS_SUCCESS;
+    }
+
+    status = AVrfMatchRegex(Element->Regex, &symbol, Match);
+    if (!NT_SUCCESS(status))
+    {
+        //
+        // No verdict, it is not kept with the symbol.
+        //
+        return status;
+    }
+
+    AVrfSymInternSetFrameMatch(Symbol, Element->CacheIndex, *Match);
+
+    return STATUS_SUCCESS;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfMatchFramePattern(
+    _In_ PVFDYNF_FRAME_PATTERN FramePattern,
+    _In_ PVFDYNF_SYM_STACK Stack,
+    _Out_ PBOOLEAN Match
+    )
+{
+    NTSTATUS result;
+    ULONG accept;
+    ULONG active;
+
+    *Match = FALSE;
+    result = STATUS_SUCCESS;
+
+    accept = (1ul << FramePattern->Count);
+
+    //
+    // Bit zero is always set, the pattern may begin at any frame.
+    //
+    active = 1;
+
+    for (ULONG i = 0; i < Stack->Count; i++)
+    {
+        ULONG matched;
+        ULONG pending;
+
+        matched = 0;
+        pending = active;
+
+        while (pending)
+        {
+            NTSTATUS status;
+            BOOLEAN match;
+            ULONG k;
+
+            _BitScanForward(&k, pending);
+            pending &= (pending - 1);
+
+            status = AVrfpFramePatternMatchElement(&FramePattern->Elements[k],
+                                                   Stack->Symbols[i],
+                                                   &match);
+            if (!NT_SUCCESS(status))
+            {
+                //
+                // Carry on as if the element did not match, the pattern may
+                // still match the stack. Otherwise there is no verdict.
+                //
+                result = status;
+                continue;
+            }
+
+            if (match)
+            {
+                matched |= (1ul << k);
+            }
+        }
+
+        active = (1 | (matched << 1) | (active & FramePattern->GapMask));
+
+        if (active & accept)
+        {
+            *Match = TRUE;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return result;
+}
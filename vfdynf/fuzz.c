@@ -3,22 +3,37 @@
 */
 #include <vfdynf.h>
 #include <delayld.h>
+#include <fuzzcls.h>
 
 #define VFDYNF_FUZZ_BLOCK_SIZE            (0x1000 / 4)
+#define VFDYNF_FUZZ_DENSITY_UNIT          (1024 * 1024)
 #define VFDYNF_RAND_VECTOR_SIZE           0x4000
 #define VFDYNF_FUZZ_MMAP_COUNT            512
+#define VFDYNF_FUZZ_MMAP_PAGE_SIZE        0x1000
 #define VFDYNF_FUZZED_BUFFERS_COUNT       512
 #define VFDYNF_FUZZ_CLASSIFY_MIN_LENGTH   (sizeof(ULONG64) * 2)
-#define VFDYNF_FUZZ_CLASSIFY_SENTINELS    5
 #define VFDYNF_POSSIBLY_FUZZED_MIN_LENGTH 9
 #define VFDYNF_POSSIBLY_FUZZED_SENTINELS  5
+#define VFDYNF_FUZZ_OCCURRENCE_COUNT      4096
 
 C_ASSERT(VFDYNF_POSSIBLY_FUZZED_MIN_LENGTH >= VFDYNF_POSSIBLY_FUZZED_SENTINELS);
 
+//
+// A fuzzed mapping is a view of a reserved page file backed section. It is
+// filled when it is mapped unless FuzzMMapLazyFill is set, then it faults
+// until touched. The same section is also mapped to a staging view, which a
+// fuzzed page is written through before it is made accessible in the fuzzed
+// view, see AVrfFuzzMemoryMappingFault.
+//
 typedef struct _VFDYNF_FUZZ_MMAP_ENTRY
 {
     PVOID OriginalBaseAddress;
     PVOID FuzzedBaseAddress;
+    PVOID StagingBaseAddress;
+    SIZE_T RegionSize;
+    ULONG64 Seed;
+    ULONG64 PageMutations; // expected per page, in 1/VFDYNF_FUZZ_DENSITY_UNIT
+    RTL_BITMAP Pages;
 } VFDYNF_FUZZ_MMAP_ENTRY, *PVFDYNF_FUZZ_MMAP_ENTRY;
 
 typedef struct _VFDYNF_FUZZED_BUFFER_ENTRY
@@ -28,6 +43,15 @@ typedef struct _VFDYNF_FUZZED_BUFFER_ENTRY
     SIZE_T Size;
 } VFDYNF_FUZZED_BUFFER_ENTRY, *PVFDYNF_FUZZED_BUFFER_ENTRY;
 
+//
+// N.B. An identity of zero marks an unused slot.
+//
+typedef struct _VFDYNF_FUZZ_OCCURRENCE
+{
+    volatile LONG64 Identity;
+    volatile LONG Count;
+} VFDYNF_FUZZ_OCCURRENCE, *PVFDYNF_FUZZ_OCCURRENCE;
+
 typedef enum _VFDYNF_FUZZ_BUFFER_CLASS
 {
     VFDynfBufferData,
@@ -38,15 +62,18 @@ typedef enum _VFDYNF_FUZZ_BUFFER_CLASS
 typedef struct _VFDYNF_FUZZ_CONTEXT
 {
     BOOLEAN Initialized;
+    BOOLEAN Avx2;
     ULONG ActiveSeed;
     ULONG RtlRandomSeed;
     volatile LONG Index;
+    volatile LONG ThreadOrdinal;
     BYTE Vector[0x4000];
     RTL_CRITICAL_SECTION CriticalSection;
     volatile LONG BufferIndex; // FuzzedBuffers index (% by VFDYNF_FUZZED_BUFFERS_COUNT)
     ULONG MMapEntryCount;      // Number of MMapEntries
     VFDYNF_FUZZED_BUFFER_ENTRY FuzzedBuffers[VFDYNF_FUZZED_BUFFERS_COUNT];
     VFDYNF_FUZZ_MMAP_ENTRY MMapEntries[VFDYNF_FUZZ_MMAP_COUNT];
+    VFDYNF_FUZZ_OCCURRENCE Occurrences[VFDYNF_FUZZ_OCCURRENCE_COUNT];
 } VFDYNF_FUZZ_CONTEXT, *PVFDYNF_FUZZ_CONTEXT;
 
 static AVRF_RUN_ONCE AVrfpFuzzRunOnce = AVRF_RUN_ONCE_INIT;
@@ -54,37 +81,18 @@ static AVRF_RUN_ONCE AVrfpFuzzRunOnce = AVRF_RUN_ONCE_INIT;
 static VFDYNF_FUZZ_CONTEXT AVrfpFuzzContext =
 {
     .Initialized = FALSE,
+    .Avx2 = FALSE,
     .ActiveSeed = 0,
     .RtlRandomSeed = 0,
     .Index = 0,
+    .ThreadOrdinal = 0,
     .Vector = { 0 },
     .CriticalSection = { 0 },
     .MMapEntryCount = 0,
     .MMapEntries = { 0 },
     .BufferIndex = 0,
     .FuzzedBuffers = { 0 },
-};
-
-// https://github.com/winsiderss/systeminformer/blob/master/phlib/data.c
-static BOOLEAN AVrfpCharIsPrintable[256] =
-{
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0, /* 0 - 15 */ // TAB, LF and CR are printable
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 16 - 31 */
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* ' ' - '/' */
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* '0' - '9' */
-    1, 1, 1, 1, 1, 1, 1, /* ':' - '@' */
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 'A' - 'Z' */
-    1, 1, 1, 1, 1, 1, /* '[' - '`' */
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 'a' - 'z' */
-    1, 1, 1, 1, 0, /* '{' - 127 */ // DEL is not printable
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 128 - 143 */
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 144 - 159 */
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 160 - 175 */
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 176 - 191 */
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 192 - 207 */
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 208 - 223 */
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 224 - 239 */
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 /* 240 - 255 */
+    .Occurrences = { 0 },
 };
 
 static UNICODE_STRING AvrfpFuzzStringTableW[] =
@@ -152,19 +160,143 @@ BOOLEAN NTAPI AVrfpFuzzRunOnceRoutine(
     return TRUE;
 }
 
+ULONG64 AVrfpFuzzSplitMix64(
+    _Inout_ PULONG64 State
+    )
+{
+    ULONG64 value;
+
+    value = (*State += 0x9e3779b97f4a7c15ull);
+    value = ((value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull);
+    value = ((value ^ (value >> 27)) * 0x94d049bb133111ebull);
+
+    return (value ^ (value >> 31));
+}
+
+VOID AVrfpFuzzRandomSeed(
+    _Out_ PVFDYNF_FUZZ_RANDOM Random,
+    _In_ ULONG64 Seed
+    )
+{
+    //
+    // The state of xoshiro must not be all zero, SplitMix64 expands any seed
+    // into a well mixed state which never is.
+    //
+    for (ULONG i = 0; i < ARRAYSIZE(Random->State); i++)
+    {
+        Random->State[i] = AVrfpFuzzSplitMix64(&Seed);
+    }
+
+    Random->Index = VFDYNF_FUZZ_RANDOM_BATCH;
+    Random->Seeded = TRUE;
+}
+
+VOID AVrfpFuzzRandomRefill(
+    _Inout_ PVFDYNF_FUZZ_RANDOM Random
+    )
+{
+    PULONG64 state;
+
+    //
+    // xoshiro256**, each output fills two values of the batch.
+    //
+    state = Random->State;
+
+    for (ULONG i = 0; i < VFDYNF_FUZZ_RANDOM_BATCH; i += 2)
+    {
+        ULONG64 result;
+        ULONG64 t;
+
+        result = (RotateLeft64(state[1] * 5, 7) * 9);
+        t = (state[1] << 17);
+
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = RotateLeft64(state[3], 45);
+
+        Random->Values[i] = (ULONG)result;
+        Random->Values[i + 1] = (ULONG)(result >> 32);
+    }
+
+    Random->Index = 0;
+}
+
+BOOLEAN AVrfpFuzzRandomInitialize(
+    _Out_ PVFDYNF_FUZZ_RANDOM Random
+    )
+{
+    ULONG64 ordinal;
+    ULONG64 seed;
+
+    ordinal = (ULONG)InterlockedIncrement(&AVrfpFuzzContext.ThreadOrdinal);
+
+    if (AVrfProperties.FuzzSeed)
+    {
+        //
+        // Each thread derives its stream from the configured seed and the
+        // order in which the thread first fuzzed.
+        //
+        seed = (((ULONG64)AVrfProperties.FuzzSeed << 32) | ordinal);
+    }
+    else
+    {
+        if (!AVrfDelayLoadInitOnce() ||
+            !AVrfRunOnce(&AVrfpFuzzRunOnce, AVrfpFuzzRunOnceRoutine, FALSE))
+        {
+            return FALSE;
+        }
+
+        seed = *(PULONG64)&AVrfpFuzzContext.Vector[(ordinal * sizeof(ULONG64)) % VFDYNF_RAND_VECTOR_SIZE];
+        seed ^= AVrfpFuzzSplitMix64(&ordinal);
+    }
+
+    AVrfpFuzzRandomSeed(Random, seed);
+
+    return TRUE;
+}
+
 ULONG AVrfFuzzRandom(
     VOID
     )
 {
+    PVFDYNF_TLS tls;
+    PVFDYNF_FUZZ_RANDOM random;
     ULONG index;
 
-    if (AVrfProperties.FaultSeed)
+    //
+    // Every thread generates from its own state, fuzzing threads do not
+    // contend with each other for random values.
+    //
+    tls = AVrfGetTls();
+    if (tls)
+    {
+        random = &tls->FuzzRandom;
+
+        if (random->Seeded || AVrfpFuzzRandomInitialize(random))
+        {
+            if (random->Index >= VFDYNF_FUZZ_RANDOM_BATCH)
+            {
+                AVrfpFuzzRandomRefill(random);
+            }
+
+            return random->Values[random->Index++];
+        }
+    }
+
+    //
+    // Threads which predate the provider have no TLS and share the process
+    // wide generators.
+    //
+    if (AVrfProperties.FuzzSeed)
     {
         //
         // The user configured a specific seed to use with fuzzing, use
         // RtlRandomEx instead of the vector we would normally generate.
         //
-        // N.B. RtlRandomSeed is set to the FaultSeed to during initialization.
+        // N.B. RtlRandomSeed is set to the FuzzSeed to during initialization.
         //
         return RtlRandomEx(&AVrfpFuzzContext.RtlRandomSeed);
     }
@@ -180,6 +312,126 @@ ULONG AVrfFuzzRandom(
     return *(PULONG)&AVrfpFuzzContext.Vector[index % VFDYNF_RAND_VECTOR_SIZE];
 }
 
+ULONG64 AVrfpFuzzStackIdentity(
+    _In_ ULONG FaultType,
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount
+    )
+{
+    ULONG64 identity;
+
+    //
+    // The identity must be the same from run to run, frames are taken
+    // relative to the image containing them so it does not change with the
+    // load addresses of the modules.
+    //
+    identity = FaultType;
+
+    for (ULONG i = 0; i < FramesCount; i++)
+    {
+        PVOID imageBase;
+        ULONG64 frame;
+
+        frame = (ULONG64)(ULONG_PTR)Frames[i];
+
+        if (RtlPcToFileHeader(Frames[i], &imageBase))
+        {
+            frame -= (ULONG64)(ULONG_PTR)imageBase;
+        }
+
+        identity ^= frame;
+        identity = AVrfpFuzzSplitMix64(&identity);
+    }
+
+    return (identity ? identity : 1);
+}
+
+ULONG AVrfpFuzzStackOccurrence(
+    _In_ ULONG64 Identity
+    )
+{
+    ULONG index;
+
+    index = (ULONG)(Identity & (VFDYNF_FUZZ_OCCURRENCE_COUNT - 1));
+
+    for (ULONG i = 0; i < VFDYNF_FUZZ_OCCURRENCE_COUNT; i++)
+    {
+        PVFDYNF_FUZZ_OCCURRENCE occurrence;
+        LONG64 identity;
+
+        occurrence = &AVrfpFuzzContext.Occurrences[index];
+
+        identity = ReadAcquire64(&occurrence->Identity);
+        if (!identity)
+        {
+            identity = InterlockedCompareExchange64(&occurrence->Identity,
+                                                    (LONG64)Identity,
+                                                    0);
+            if (!identity)
+            {
+                identity = (LONG64)Identity;
+            }
+        }
+
+        if (identity == (LONG64)Identity)
+        {
+            return (ULONG)(InterlockedIncrement(&occurrence->Count) - 1);
+        }
+
+        index = ((index + 1) & (VFDYNF_FUZZ_OCCURRENCE_COUNT - 1));
+    }
+
+    //
+    // Every slot is taken, the stream is then only a function of the stack.
+    //
+    return 0;
+}
+
+VOID AVrfFuzzBeginEvent(
+    _In_ ULONG FaultType,
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount
+    )
+{
+    PVFDYNF_TLS tls;
+    ULONG64 identity;
+    ULONG occurrence;
+    ULONG64 mix;
+    ULONG64 seed;
+
+    //
+    // With a configured seed the random stream of a fuzzing event is derived
+    // from the seed, the identity of the stack and how many times the stack
+    // has been fuzzed before. The mutations an event receives do not depend on
+    // what other threads are doing, so an event can be replayed on its own.
+    //
+    if (!AVrfProperties.FuzzSeed)
+    {
+        return;
+    }
+
+    tls = AVrfGetTls();
+    if (!tls)
+    {
+        return;
+    }
+
+    identity = AVrfpFuzzStackIdentity(FaultType, Frames, FramesCount);
+    occurrence = AVrfpFuzzStackOccurrence(identity);
+
+    mix = identity;
+    seed = (((ULONG64)AVrfProperties.FuzzSeed << 32) | occurrence);
+    seed ^= AVrfpFuzzSplitMix64(&mix);
+
+    AVrfpFuzzRandomSeed(&tls->FuzzRandom, seed);
+
+    AVrfDbgPrint(DPFLTR_INFO_LEVEL,
+                 "fuzz event 0x%08x stack %016llx occurrence %lu",
+                 FaultType,
+                 identity,
+                 occurrence);
+}
+
 BOOLEAN AVrfFuzzProbability(
     _In_ ULONG Probability
     )
@@ -205,7 +457,6 @@ BOOLEAN AVrfpFuzzClassifyBuffer(
 {
     SIZE_T length;
     SIZE_T printable;
-    SIZE_T sentinels;
     SIZE_T percent;
 
     length = *Length;
@@ -216,36 +467,22 @@ BOOLEAN AVrfpFuzzClassifyBuffer(
         goto Exit;
     }
 
-    sentinels = 0;
-    printable = 0;
-
-    for (ULONG i = 0; i < length; i++)
+#if defined(VFDYNF_FUZZ_CLASSIFY_SSE2)
+    if (AVrfpFuzzContext.Avx2)
     {
-        if (AVrfpCharIsPrintable[Buffer[i]])
-        {
-            printable++;
-        }
-
-        if (Buffer[i] == VFDYNF_FUZZ_SENTINEL)
-        {
-            sentinels++;
-        }
-        else
-        {
-            sentinels = 0;
-        }
-
-        if (sentinels >= VFDYNF_FUZZ_CLASSIFY_SENTINELS)
-        {
-            //
-            // Likely at our memory fill, stop counting and clamp the length.
-            //
-            length = (((SIZE_T)i - VFDYNF_FUZZ_CLASSIFY_SENTINELS) + 1);
-            printable -= sentinels;
-            *Length = length;
-            break;
-        }
+        printable = AVrfpFuzzCountPrintableAvx2(Buffer, &length);
+    }
+    else
+    {
+        printable = AVrfpFuzzCountPrintableSse2(Buffer, &length);
     }
+#elif defined(VFDYNF_FUZZ_CLASSIFY_NEON)
+    printable = AVrfpFuzzCountPrintableNeon(Buffer, &length);
+#else
+    printable = AVrfpFuzzCountPrintable(Buffer, &length);
+#endif
+
+    *Length = length;
 
     //
     // Check if we've clamped the length too small.
@@ -294,195 +531,186 @@ VOID AVrfpFuzzGetBufferRange(
     *End = offsets[0] > offsets[1] ? offsets[0] : offsets[1];
 }
 
-VOID AVrfpFuzzBuffer(
-    _Inout_bytecount_(Length) PVOID Buffer,
-    _In_ SIZE_T Length
+VOID AVrfpFuzzMutateBuffer(
+    _Inout_bytecount_(Length) PBYTE Buffer,
+    _In_ SIZE_T Length,
+    _In_ VFDYNF_FUZZ_BUFFER_CLASS BufferClass
     )
 {
     PBYTE bufferBytes;
     SIZE_T bufferLength;
-    ULONG corruptionBlocks;
-    VFDYNF_FUZZ_BUFFER_CLASS bufferClass;
-
-    if (!AVrfProperties.FuzzCorruptionBlocks)
-    {
-        return;
-    }
 
     bufferBytes = Buffer;
     bufferLength = Length;
-    corruptionBlocks = (1 + (AVrfFuzzRandom() % AVrfProperties.FuzzCorruptionBlocks));
-
-    if (!AVrfpFuzzClassifyBuffer(bufferBytes, &bufferLength, &bufferClass))
-    {
-        return;
-    }
 
-    for (ULONG i = 0; i < corruptionBlocks; i++)
+    if (AVrfFuzzProbability(AVrfProperties.FuzzChaosProbability))
     {
-        if (AVrfFuzzProbability(AVrfProperties.FuzzChaosProbability))
-        {
-            ULONG start;
-            ULONG end;
+        ULONG start;
+        ULONG end;
 
-            AVrfpFuzzGetBufferRange(bufferLength, &start, &end);
+        AVrfpFuzzGetBufferRange(bufferLength, &start, &end);
 
-            if (AVrfFuzzProbability(100000))
+        if (AVrfFuzzProbability(100000))
+        {
+            if (AVrfFuzzProbability(500000))
             {
-                if (AVrfFuzzProbability(500000))
-                {
-                    RtlFillMemory(&bufferBytes[start], end - start, 0x00);
-                }
-                else
-                {
-                    RtlFillMemory(&bufferBytes[start], end - start, 0xff);
-                }
+                RtlFillMemory(&bufferBytes[start], end - start, 0x00);
             }
             else
             {
-                while (start < end)
-                {
-                    bufferBytes[start++] = (BYTE)AVrfFuzzRandom();
-                }
+                RtlFillMemory(&bufferBytes[start], end - start, 0xff);
             }
         }
-        else if (bufferClass == VFDynfBufferUnicode)
+        else
         {
-            ULONG start;
-            ULONG end;
-            PUNICODE_STRING string;
-
-            AVrfpFuzzGetBufferRange(bufferLength, &start, &end);
-
-            string = &AvrfpFuzzStringTableW[AVrfFuzzRandom() % ARRAYSIZE(AvrfpFuzzStringTableW)];
-
-            if (start % 2)
+            while (start < end)
             {
-                start++;
-                end++;
+                bufferBytes[start++] = (BYTE)AVrfFuzzRandom();
             }
+        }
+    }
+    else if (BufferClass == VFDynfBufferUnicode)
+    {
+        ULONG start;
+        ULONG end;
+        PUNICODE_STRING string;
 
-            if ((start < bufferLength) && (string->Length <= (end - start)))
-            {
-                memcpy(&bufferBytes[start], string->Buffer, string->Length);
-            }
+        AVrfpFuzzGetBufferRange(bufferLength, &start, &end);
+
+        string = &AvrfpFuzzStringTableW[AVrfFuzzRandom() % ARRAYSIZE(AvrfpFuzzStringTableW)];
+
+        if (start % 2)
+        {
+            start++;
+            end++;
         }
-        else if (bufferClass == VFDynfBufferAnsi)
+
+        if ((start < bufferLength) && (string->Length <= (end - start)))
         {
-            ULONG start;
-            ULONG end;
-            PANSI_STRING string;
+            memcpy(&bufferBytes[start], string->Buffer, string->Length);
+        }
+    }
+    else if (BufferClass == VFDynfBufferAnsi)
+    {
+        ULONG start;
+        ULONG end;
+        PANSI_STRING string;
 
-            AVrfpFuzzGetBufferRange(bufferLength, &start, &end);
+        AVrfpFuzzGetBufferRange(bufferLength, &start, &end);
 
-            string = &AvrfpFuzzStringTableA[AVrfFuzzRandom() % ARRAYSIZE(AvrfpFuzzStringTableW)];
+        string = &AvrfpFuzzStringTableA[AVrfFuzzRandom() % ARRAYSIZE(AvrfpFuzzStringTableW)];
 
-            if (string->Length <= (end - start))
-            {
-                memcpy(&bufferBytes[start], string->Buffer, string->Length);
-            }
+        if (string->Length <= (end - start))
+        {
+            memcpy(&bufferBytes[start], string->Buffer, string->Length);
         }
-        else
+    }
+    else
+    {
+        ULONG pos;
+
+        pos = AVrfFuzzRandom() % bufferLength;
+
+        if (AVrfFuzzProbability(250000))
         {
-            ULONG pos;
+            pos &= 0xfffffffc;
+        }
 
-            pos = AVrfFuzzRandom() % bufferLength;
+        if ((pos + 3) >= bufferLength)
+        {
+            bufferBytes[pos] ^= (BYTE)(1 + AVrfFuzzRandom());
+            return;
+        }
 
-            if (AVrfFuzzProbability(250000))
+        switch (AVrfFuzzRandom() % 13)
+        {
+            case 1: // off by a bit
             {
-                pos &= 0xfffffffc;
+                *(PULONG)&bufferBytes[pos] += 512 - (ULONG)(AVrfFuzzRandom() % 1024);
+                break;
             }
-
-            if ((pos + 3) >= bufferLength)
+            case 2: // off by multiple of four
             {
-                bufferBytes[pos] ^= (BYTE)(1 + AVrfFuzzRandom());
-                continue;
+                *(PULONG)&bufferBytes[pos] += 4 * (512 - (ULONG)(AVrfFuzzRandom() % 1024));
+                break;
             }
-
-            switch (AVrfFuzzRandom() % 13)
+            case 3: // negative one
+            {
+                *(PULONG)&bufferBytes[pos] = 0xffffffff;
+                break;
+            }
+            case 4: // small negative
+            {
+                *(PULONG)&bufferBytes[pos] = -(LONG)(AVrfFuzzRandom() % 25);
+                break;
+            }
+            case 5: // zero
             {
-                case 1: // off by a bit
-                {
-                    *(PULONG)&bufferBytes[pos] += 512 - (ULONG)(AVrfFuzzRandom() % 1024);
-                    break;
-                }
-                case 2: // off by multiple of four
-                {
-                    *(PULONG)&bufferBytes[pos] += 4 * (512 - (ULONG)(AVrfFuzzRandom() % 1024));
-                    break;
-                }
-                case 3: // negative one
-                {
-                    *(PULONG)&bufferBytes[pos] = 0xffffffff;
-                    break;
-                }
-                case 4: // small negative
-                {
-                    *(PULONG)&bufferBytes[pos] = -(LONG)(AVrfFuzzRandom() % 25);
-                    break;
-                }
-                case 5: // zero
-                {
-                    *(PULONG)&bufferBytes[pos] = 0;
-                    break;
-                }
-                case 6: // negate
-                {
-                    *(PULONG)&bufferBytes[pos] = -(*(PLONG)&bufferBytes[pos]);
-                    break;
-                }
-                case 7: // compliment
-                {
-                    *(PULONG)&bufferBytes[pos] = ~(*(PLONG)&bufferBytes[pos]);
-                    break;
-                }
-                case 8: // treat position as offset
-                {
-                    *(PULONG)&bufferBytes[pos] = (ULONG)pos + 4 * (128 - (ULONG)(AVrfFuzzRandom() % 256));
-                    break;
-                }
-                case 9: // copy alternate dword
-                {
-                    *(PULONG)&bufferBytes[pos] = *(PULONG)&bufferBytes[AVrfFuzzRandom() % (bufferLength - 3)];
-                    break;
-                }
-                default: // random dword
-                {
-                    *(PULONG)&bufferBytes[pos] = (ULONG)(1 + AVrfFuzzRandom());
-                    break;
-                }
+                *(PULONG)&bufferBytes[pos] = 0;
+                break;
+            }
+            case 6: // negate
+            {
+                *(PULONG)&bufferBytes[pos] = -(*(PLONG)&bufferBytes[pos]);
+                break;
+            }
+            case 7: // compliment
+            {
+                *(PULONG)&bufferBytes[pos] = ~(*(PLONG)&bufferBytes[pos]);
+                break;
+            }
+            case 8: // treat position as offset
+            {
+                *(PULONG)&bufferBytes[pos] = (ULONG)pos + 4 * (128 - (ULONG)(AVrfFuzzRandom() % 256));
+                break;
+            }
+            case 9: // copy alternate dword
+            {
+                *(PULONG)&bufferBytes[pos] = *(PULONG)&bufferBytes[AVrfFuzzRandom() % (bufferLength - 3)];
+                break;
+            }
+            default: // random dword
+            {
+                *(PULONG)&bufferBytes[pos] = (ULONG)(1 + AVrfFuzzRandom());
+                break;
             }
         }
     }
 }
 
-VOID AvrfpTrackFuzzedBuffer(
-    _In_ PVOID Buffer,
+VOID AVrfpFuzzBuffer(
+    _Inout_bytecount_(Length) PVOID Buffer,
     _In_ SIZE_T Length,
-    _In_ ULONG TypeIndex
+    _In_ ULONG Mutations
     )
 {
-    ULONG index;
-    PVFDYNF_FUZZED_BUFFER_ENTRY entry;
+    SIZE_T bufferLength;
+    VFDYNF_FUZZ_BUFFER_CLASS bufferClass;
 
-    index = (ULONG)(InterlockedIncrement(&AVrfpFuzzContext.BufferIndex) - 1);
+    bufferLength = Length;
 
-    entry = &AVrfpFuzzContext.FuzzedBuffers[index % VFDYNF_FUZZED_BUFFERS_COUNT];
+    if (!AVrfpFuzzClassifyBuffer(Buffer, &bufferLength, &bufferClass))
+    {
+        return;
+    }
 
-    entry->TypeIndex = TypeIndex;
-    entry->Address = Buffer;
-    entry->Size = Length;
+    for (ULONG i = 0; i < Mutations; i++)
+    {
+        AVrfpFuzzMutateBuffer(Buffer, bufferLength, bufferClass);
+    }
 }
 
-VOID AVrfFuzzBuffer(
+VOID AVrfpFuzzBufferByBlocks(
     _Inout_bytecount_(Length) PVOID Buffer,
-    _In_ SIZE_T Length,
-    _In_ ULONG TypeIndex
+    _In_ SIZE_T Length
     )
 {
     SIZE_T remaining;
 
-    AvrfpTrackFuzzedBuffer(Buffer, Length, TypeIndex);
+    if (!AVrfProperties.FuzzCorruptionBlocks)
+    {
+        return;
+    }
 
     remaining = Length;
 
@@ -490,39 +718,147 @@ VOID AVrfFuzzBuffer(
     {
         PVOID buffer;
         SIZE_T blockLength;
+        ULONG corruptionBlocks;
 
         buffer = Add2Ptr(Buffer, Length - remaining);
         blockLength = min(remaining, VFDYNF_FUZZ_BLOCK_SIZE);
+        corruptionBlocks = (1 + (AVrfFuzzRandom() % AVrfProperties.FuzzCorruptionBlocks));
 
-        AVrfpFuzzBuffer(buffer, blockLength);
+        AVrfpFuzzBuffer(buffer, blockLength, corruptionBlocks);
 
         remaining -= blockLength;
     }
-
-    if (AVrfProperties.EnableWriteFuzzedDataChecks)
-    {
-        //
-        // Logic elsewhere will try to detect if the buffer is possibly fuzzed.
-        // If the buffer is sufficiently large, ensure there are sentinel values
-        // at the end of the buffer for the check later.
-        //
-        // N.B. VFDYNF_POSSIBLY_FUZZED_MIN_LENGTH is always >= VFDYNF_POSSIBLY_FUZZED_SENTINELS
-        //
-        if (Length >= VFDYNF_POSSIBLY_FUZZED_MIN_LENGTH)
-        {
-            AVrfFuzzFillMemory(Add2Ptr(Buffer, Length - VFDYNF_POSSIBLY_FUZZED_SENTINELS),
-                               VFDYNF_POSSIBLY_FUZZED_SENTINELS);
-        }
-    }
 }
 
-VOID AVrfFuzzSize(
-    _Out_ PLARGE_INTEGER Size
+ULONG AVrfpFuzzDensityMutations(
+    _In_ SIZE_T Length
     )
 {
-    switch (AVrfFuzzRandom() % 5)
+    ULONG64 mutations;
+    ULONG64 remainder;
+
+    //
+    // Mutations per MiB, rounded up, at least one for any buffer.
+    //
+    mutations = ((ULONG64)(Length / VFDYNF_FUZZ_DENSITY_UNIT) * AVrfProperties.FuzzMutationDensity);
+    remainder = ((ULONG64)(Length % VFDYNF_FUZZ_DENSITY_UNIT) * AVrfProperties.FuzzMutationDensity);
+    mutations += ((remainder + VFDYNF_FUZZ_DENSITY_UNIT - 1) / VFDYNF_FUZZ_DENSITY_UNIT);
+
+    if (AVrfProperties.FuzzMutationLimit && (mutations > AVrfProperties.FuzzMutationLimit))
     {
-        case 1: // small value
+        mutations = AVrfProperties.FuzzMutationLimit;
+    }
+
+    return (ULONG)max(mutations, 1);
+}
+
+VOID AVrfpFuzzBufferMutations(
+    _Inout_bytecount_(Length) PVOID Buffer,
+    _In_ SIZE_T Length,
+    _In_ ULONG Mutations
+    )
+{
+    //
+    // Each mutation samples a position across the whole buffer and is applied
+    // to the block around it, only that block is classified. The cost follows
+    // the number of mutations rather than the length of the buffer.
+    //
+    for (ULONG i = 0; i < Mutations; i++)
+    {
+        ULONG64 offset;
+        SIZE_T blockOffset;
+        SIZE_T blockLength;
+
+        offset = (((ULONG64)AVrfFuzzRandom() << 32) | AVrfFuzzRandom());
+
+        blockOffset = (SIZE_T)(offset % Length);
+        blockOffset -= (blockOffset % VFDYNF_FUZZ_BLOCK_SIZE);
+        blockLength = min(Length - blockOffset, VFDYNF_FUZZ_BLOCK_SIZE);
+
+        AVrfpFuzzBuffer(Add2Ptr(Buffer, blockOffset), blockLength, 1);
+    }
+}
+
+VOID AVrfpFuzzBufferByDensity(
+    _Inout_bytecount_(Length) PVOID Buffer,
+    _In_ SIZE_T Length
+    )
+{
+    if (!Length)
+    {
+        return;
+    }
+
+    AVrfpFuzzBufferMutations(Buffer, Length, AVrfpFuzzDensityMutations(Length));
+}
+
+VOID AVrfpFuzzBufferRegion(
+    _Inout_bytecount_(Length) PVOID Buffer,
+    _In_ SIZE_T Length
+    )
+{
+    if (AVrfProperties.FuzzMutationDensity)
+    {
+        AVrfpFuzzBufferByDensity(Buffer, Length);
+    }
+    else
+    {
+        AVrfpFuzzBufferByBlocks(Buffer, Length);
+    }
+}
+
+VOID AvrfpTrackFuzzedBuffer(
+    _In_ PVOID Buffer,
+    _In_ SIZE_T Length,
+    _In_ ULONG TypeIndex
+    )
+{
+    ULONG index;
+    PVFDYNF_FUZZED_BUFFER_ENTRY entry;
+
+    index = (ULONG)(InterlockedIncrement(&AVrfpFuzzContext.BufferIndex) - 1);
+
+    entry = &AVrfpFuzzContext.FuzzedBuffers[index % VFDYNF_FUZZED_BUFFERS_COUNT];
+
+    entry->TypeIndex = TypeIndex;
+    entry->Address = Buffer;
+    entry->Size = Length;
+}
+
+VOID AVrfFuzzBuffer(
+    _Inout_bytecount_(Length) PVOID Buffer,
+    _In_ SIZE_T Length,
+    _In_ ULONG TypeIndex
+    )
+{
+    AvrfpTrackFuzzedBuffer(Buffer, Length, TypeIndex);
+
+    AVrfpFuzzBufferRegion(Buffer, Length);
+
+    if (AVrfProperties.EnableWriteFuzzedDataChecks)
+    {
+        //
+        // Logic elsewhere will try to detect if the buffer is possibly fuzzed.
+        // If the buffer is sufficiently large, ensure there are sentinel values
+        // at the end of the buffer for the check later.
+        //
+        // N.B. VFDYNF_POSSIBLY_FUZZED_MIN_LENGTH is always >= VFDYNF_POSSIBLY_FUZZED_SENTINELS
+        //
+        if (Length >= VFDYNF_POSSIBLY_FUZZED_MIN_LENGTH)
+        {
+            AVrfFuzzFillMemory(Add2Ptr(Buffer, Length - VFDYNF_POSSIBLY_FUZZED_SENTINELS),
+                               VFDYNF_POSSIBLY_FUZZED_SENTINELS);
+        }
+    }
+}
+
+VOID AVrfFuzzSize(
+    _Out_ PLARGE_INTEGER Size
+    )
+{
+    switch (AVrfFuzzRandom() % 5)
+    {
+        case 1: // small value
         {
             Size->HighPart = 0;
             Size->LowPart = AVrfFuzzRandom() % 32;
@@ -599,11 +935,296 @@ VOID AVrfFuzzSizeTruncateWideString(
     *Size = size.LowPart;
 }
 
+VOID AVrfpFreeFuzzedMemoryMapping(
+    _In_ PVFDYNF_FUZZ_MMAP_ENTRY Entry
+    )
+{
+    if (Entry->FuzzedBaseAddress)
+    {
+        NtUnmapViewOfSection(NtCurrentProcess(), Entry->FuzzedBaseAddress);
+    }
+
+    if (Entry->StagingBaseAddress)
+    {
+        NtUnmapViewOfSection(NtCurrentProcess(), Entry->StagingBaseAddress);
+    }
+
+    if (Entry->Pages.Buffer)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, Entry->Pages.Buffer);
+    }
+}
+
+VOID AVrfpFuzzMemoryMappingFill(
+    _Out_writes_bytes_all_(VFDYNF_FUZZ_MMAP_PAGE_SIZE) PVOID Page,
+    _In_ PVOID Original,
+    _In_ ULONG64 Seed,
+    _In_ ULONG64 PageIndex,
+    _In_ ULONG64 PageMutations,
+    _In_ BOOLEAN LastPage
+    )
+{
+    ULONG64 mix;
+    PVFDYNF_TLS tls;
+    VFDYNF_FUZZ_RANDOM random;
+
+    RtlZeroMemory(Page, VFDYNF_FUZZ_MMAP_PAGE_SIZE);
+
+    __try
+    {
+        RtlCopyMemory(Page, Original, VFDYNF_FUZZ_MMAP_PAGE_SIZE);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        NOTHING;
+    }
+
+    //
+    // Fuzz the page from its own stream and leave the stream of the thread
+    // which happened to touch it as it was.
+    //
+    tls = AVrfGetTls();
+    if (tls)
+    {
+        random = tls->FuzzRandom;
+
+        mix = PageIndex;
+
+        AVrfpFuzzRandomSeed(&tls->FuzzRandom, (Seed ^ AVrfpFuzzSplitMix64(&mix)));
+    }
+
+    if (AVrfProperties.FuzzMutationDensity)
+    {
+        ULONG64 mutations;
+        ULONG fraction;
+
+        //
+        // The count is rounded up or down at random in proportion to its
+        // fraction, so the expected count is exact however small it is. A
+        // page of a sparsely fuzzed mapping usually gets no mutation at all.
+        //
+        mutations = (PageMutations / VFDYNF_FUZZ_DENSITY_UNIT);
+        fraction = (ULONG)(PageMutations % VFDYNF_FUZZ_DENSITY_UNIT);
+
+        if ((AVrfFuzzRandom() % VFDYNF_FUZZ_DENSITY_UNIT) < fraction)
+        {
+            mutations++;
+        }
+
+        AVrfpFuzzBufferMutations(Page,
+                                 VFDYNF_FUZZ_MMAP_PAGE_SIZE,
+                                 (ULONG)min(mutations, ULONG_MAX));
+    }
+    else
+    {
+        AVrfpFuzzBufferByBlocks(Page, VFDYNF_FUZZ_MMAP_PAGE_SIZE);
+    }
+
+    if (tls)
+    {
+        tls->FuzzRandom = random;
+    }
+
+    //
+    // See AVrfFuzzBuffer, the sentinels go at the end of the whole mapping.
+    //
+    if (AVrfProperties.EnableWriteFuzzedDataChecks && LastPage)
+    {
+        AVrfFuzzFillMemory(Add2Ptr(Page, VFDYNF_FUZZ_MMAP_PAGE_SIZE - VFDYNF_POSSIBLY_FUZZED_SENTINELS),
+                           VFDYNF_POSSIBLY_FUZZED_SENTINELS);
+    }
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpFuzzMemoryMappingPopulate(
+    _Inout_ PVFDYNF_FUZZ_MMAP_ENTRY Entry
+    )
+{
+    NTSTATUS status;
+    PVOID baseAddress;
+    SIZE_T regionSize;
+
+    //
+    // The view is not yet handed to the application, so it is committed and
+    // filled in place. Each page is filled as it would be on a fault, the
+    // mapping is the same whether or not it is filled lazily.
+    //
+    baseAddress = Entry->FuzzedBaseAddress;
+    regionSize = Entry->RegionSize;
+
+    status = NtAllocateVirtualMemory(NtCurrentProcess(),
+                                     &baseAddress,
+                                     0,
+                                     &regionSize,
+                                     MEM_COMMIT,
+                                     PAGE_READWRITE);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    for (ULONG i = 0; i < Entry->Pages.SizeOfBitMap; i++)
+    {
+        SIZE_T offset;
+
+        offset = ((SIZE_T)i * VFDYNF_FUZZ_MMAP_PAGE_SIZE);
+
+        AVrfpFuzzMemoryMappingFill(Add2Ptr(Entry->FuzzedBaseAddress, offset),
+                                   Add2Ptr(Entry->OriginalBaseAddress, offset),
+                                   Entry->Seed,
+                                   i,
+                                   Entry->PageMutations,
+                                   ((offset + VFDYNF_FUZZ_MMAP_PAGE_SIZE) == Entry->RegionSize));
+    }
+
+    RtlSetAllBits(&Entry->Pages);
+
+    return STATUS_SUCCESS;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpCreateFuzzedMemoryMapping(
+    _Out_ PVFDYNF_FUZZ_MMAP_ENTRY Entry,
+    _In_ PVOID BaseAddress,
+    _In_ SIZE_T RegionSize
+    )
+{
+    NTSTATUS status;
+    HANDLE sectionHandle;
+    LARGE_INTEGER maximumSize;
+    SIZE_T viewSize;
+    SIZE_T pageCount;
+
+    RtlZeroMemory(Entry, sizeof(*Entry));
+
+    sectionHandle = NULL;
+
+    Entry->OriginalBaseAddress = BaseAddress;
+    Entry->RegionSize = ALIGN_UP_BY(RegionSize, VFDYNF_FUZZ_MMAP_PAGE_SIZE);
+
+    pageCount = (Entry->RegionSize / VFDYNF_FUZZ_MMAP_PAGE_SIZE);
+    if (pageCount > ULONG_MAX)
+    {
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    Entry->Pages.Buffer = RtlAllocateHeap(RtlProcessHeap(),
+                                          HEAP_ZERO_MEMORY,
+                                          ALIGN_UP_BY(pageCount, 32) / 8);
+    if (!Entry->Pages.Buffer)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    Entry->Pages.SizeOfBitMap = (ULONG)pageCount;
+
+    //
+    // N.B. The section is only reserved. With FuzzMMapLazyFill each page is
+    // committed when it is first touched, the commit charge follows the pages
+    // the application reads rather than the size of the mapping, and a
+    // reserved page faults in the fuzzed view until it is filled.
+    //
+    maximumSize.QuadPart = Entry->RegionSize;
+
+    status = NtCreateSection(&sectionHandle,
+                             SECTION_ALL_ACCESS,
+                             NULL,
+                             &maximumSize,
+                             PAGE_READWRITE,
+                             SEC_RESERVE,
+                             NULL);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    viewSize = 0;
+    status = NtMapViewOfSection(sectionHandle,
+                                NtCurrentProcess(),
+                                &Entry->FuzzedBaseAddress,
+                                0,
+                                0,
+                                NULL,
+                                &viewSize,
+                                ViewUnmap,
+                                0,
+                                PAGE_READWRITE);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    viewSize = 0;
+    status = NtMapViewOfSection(sectionHandle,
+                                NtCurrentProcess(),
+                                &Entry->StagingBaseAddress,
+                                0,
+                                0,
+                                NULL,
+                                &viewSize,
+                                ViewUnmap,
+                                0,
+                                PAGE_READWRITE);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // The pages are fuzzed whenever they are first touched, possibly by other
+    // threads. Each page draws from a stream derived from this seed so the
+    // mapping is fuzzed the same way regardless of the order pages are read.
+    //
+    Entry->Seed = (((ULONG64)AVrfFuzzRandom() << 32) | AVrfFuzzRandom());
+
+    //
+    // The mapping is mutated at the configured density as a whole, not each
+    // page as a buffer of its own. A page expects the share of a page of the
+    // density, and when the limit caps the mutations of the whole mapping the
+    // share of the limit instead.
+    //
+    Entry->PageMutations = ((ULONG64)AVrfProperties.FuzzMutationDensity * VFDYNF_FUZZ_MMAP_PAGE_SIZE);
+
+    if (AVrfProperties.FuzzMutationLimit)
+    {
+        ULONG64 limited;
+
+        C_ASSERT(((ULONG64)VFDYNF_FUZZ_MMAP_PAGE_SIZE * VFDYNF_FUZZ_DENSITY_UNIT) <= (1ull << 32));
+
+        limited = ((ULONG64)AVrfProperties.FuzzMutationLimit * VFDYNF_FUZZ_MMAP_PAGE_SIZE * VFDYNF_FUZZ_DENSITY_UNIT);
+        limited /= Entry->RegionSize;
+
+        Entry->PageMutations = min(Entry->PageMutations, limited);
+    }
+
+    if (!AVrfProperties.FuzzMMapLazyFill)
+    {
+        status = AVrfpFuzzMemoryMappingPopulate(Entry);
+    }
+
+Exit:
+
+    if (sectionHandle)
+    {
+        NtClose(sectionHandle);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        AVrfpFreeFuzzedMemoryMapping(Entry);
+    }
+
+    return status;
+}
+
 PVOID AVrfFuzzMemoryMapping(
     _In_ PVOID BaseAddress,
     _In_ SIZE_T RegionSize
     )
 {
+    NTSTATUS status;
     PVOID baseAddress;
     PVFDYNF_FUZZ_MMAP_ENTRY entry;
 
@@ -612,47 +1233,279 @@ PVOID AVrfFuzzMemoryMapping(
         return BaseAddress;
     }
 
-    baseAddress = RtlAllocateHeap(RtlProcessHeap(), 0, RegionSize);
-    if (!baseAddress)
-    {
-        return BaseAddress;
-    }
+    baseAddress = BaseAddress;
 
     AVrfEnterCriticalSection(&AVrfpFuzzContext.CriticalSection);
 
     if (AVrfpFuzzContext.MMapEntryCount < VFDYNF_FUZZ_MMAP_COUNT)
     {
-        entry = &AVrfpFuzzContext.MMapEntries[AVrfpFuzzContext.MMapEntryCount++];
+        entry = &AVrfpFuzzContext.MMapEntries[AVrfpFuzzContext.MMapEntryCount];
 
-        entry->OriginalBaseAddress = BaseAddress;
-        entry->FuzzedBaseAddress = baseAddress;
-
-        __try
+        status = AVrfpCreateFuzzedMemoryMapping(entry, BaseAddress, RegionSize);
+        if (NT_SUCCESS(status))
         {
-            RtlCopyMemory(baseAddress, BaseAddress, RegionSize);
+            AvrfpTrackFuzzedBuffer(entry->FuzzedBaseAddress,
+                                   RegionSize,
+                                   VFDYNF_FAULT_TYPE_INDEX_FUZZ_MMAP);
+
+            baseAddress = entry->FuzzedBaseAddress;
+
+            AVrfpFuzzContext.MMapEntryCount++;
         }
-        __except (EXCEPTION_EXECUTE_HANDLER)
+        else
         {
-            NOTHING;
+            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                         "failed to create fuzzed mapping (0x%08x)",
+                         status);
         }
-
-        AVrfFuzzBuffer(baseAddress,
-                       RegionSize,
-                       VFDYNF_FAULT_TYPE_INDEX_FUZZ_MMAP);
     }
     else
     {
         AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "out of fuzzing mmap slots");
         __debugbreak();
+    }
+
+    AVrfLeaveCriticalSection(&AVrfpFuzzContext.CriticalSection);
+
+    return baseAddress;
+}
 
-        RtlFreeHeap(RtlProcessHeap(), 0, baseAddress);
+BOOLEAN AVrfpFuzzMemoryMappingAllows(
+    _In_ PVOID Address,
+    _In_ ULONG_PTR AccessType
+    )
+{
+    NTSTATUS status;
+    MEMORY_BASIC_INFORMATION mbi;
+    ULONG allowed;
+
+    status = NtQueryVirtualMemory(NtCurrentProcess(),
+                                  Address,
+                                  MemoryBasicInformation,
+                                  &mbi,
+                                  sizeof(mbi),
+                                  NULL);
+    if (!NT_SUCCESS(status) ||
+        (mbi.State != MEM_COMMIT) ||
+        BooleanFlagOn(mbi.Protect, PAGE_GUARD))
+    {
+        return FALSE;
+    }
 
-        baseAddress = BaseAddress;
+    switch (AccessType)
+    {
+        case EXCEPTION_READ_FAULT:
+        {
+            allowed = (PAGE_READONLY | PAGE_READWRITE | PAGE_WRITECOPY |
+                       PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY);
+            break;
+        }
+        case EXCEPTION_WRITE_FAULT:
+        {
+            allowed = (PAGE_READWRITE | PAGE_WRITECOPY |
+                       PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY);
+            break;
+        }
+        default:
+        {
+            allowed = 0;
+            break;
+        }
     }
 
+    return BooleanFlagOn(mbi.Protect, allowed);
+}
+
+_Ret_maybenull_
+PVFDYNF_FUZZ_MMAP_ENTRY AVrfpFuzzLookupMemoryMapping(
+    _In_ PVOID Address
+    )
+{
+    //
+    // N.B. The caller must hold the fuzz lock. Entries move when a mapping
+    // is forgotten, the entry is only valid while the lock is held.
+    //
+    for (ULONG i = 0; i < AVrfpFuzzContext.MMapEntryCount; i++)
+    {
+        PVFDYNF_FUZZ_MMAP_ENTRY entry;
+
+        entry = &AVrfpFuzzContext.MMapEntries[i];
+
+        if ((Address >= entry->FuzzedBaseAddress) &&
+            (Address < Add2Ptr(entry->FuzzedBaseAddress, entry->RegionSize)))
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpFuzzMemoryMappingExpose(
+    _In_ PVFDYNF_FUZZ_MMAP_ENTRY Entry,
+    _In_ SIZE_T Offset,
+    _In_reads_bytes_(VFDYNF_FUZZ_MMAP_PAGE_SIZE) PVOID Page
+    )
+{
+    NTSTATUS status;
+    PVOID baseAddress;
+    SIZE_T regionSize;
+    ULONG oldProtect;
+
+    //
+    // Commit the page inaccessible in the fuzzed view, the commit is shared
+    // by both views. Write it through the staging view and only then make it
+    // accessible, other threads never see a partially filled page.
+    //
+    baseAddress = Add2Ptr(Entry->FuzzedBaseAddress, Offset);
+    regionSize = VFDYNF_FUZZ_MMAP_PAGE_SIZE;
+
+    status = NtAllocateVirtualMemory(NtCurrentProcess(),
+                                     &baseAddress,
+                                     0,
+                                     &regionSize,
+                                     MEM_COMMIT,
+                                     PAGE_NOACCESS);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    baseAddress = Add2Ptr(Entry->StagingBaseAddress, Offset);
+    regionSize = VFDYNF_FUZZ_MMAP_PAGE_SIZE;
+
+    status = NtProtectVirtualMemory(NtCurrentProcess(),
+                                    &baseAddress,
+                                    &regionSize,
+                                    PAGE_READWRITE,
+                                    &oldProtect);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    RtlCopyMemory(Add2Ptr(Entry->StagingBaseAddress, Offset),
+                  Page,
+                  VFDYNF_FUZZ_MMAP_PAGE_SIZE);
+
+    baseAddress = Add2Ptr(Entry->FuzzedBaseAddress, Offset);
+    regionSize = VFDYNF_FUZZ_MMAP_PAGE_SIZE;
+
+    return NtProtectVirtualMemory(NtCurrentProcess(),
+                                  &baseAddress,
+                                  &regionSize,
+                                  PAGE_READWRITE,
+                                  &oldProtect);
+}
+
+BOOLEAN AVrfFuzzMemoryMappingFault(
+    _In_ PVOID Address,
+    _In_ ULONG_PTR AccessType
+    )
+{
+    NTSTATUS status;
+    BOOLEAN result;
+    PVFDYNF_FUZZ_MMAP_ENTRY entry;
+    PVOID fuzzedBaseAddress;
+    PVOID original;
+    ULONG64 seed;
+    ULONG64 pageMutations;
+    SIZE_T offset;
+    ULONG pageIndex;
+    BOOLEAN lastPage;
+    BYTE page[VFDYNF_FUZZ_MMAP_PAGE_SIZE];
+
+    //
+    // N.B. This is called from the vectored exception handler for any access
+    // violation, most are unrelated to fuzzed mappings.
+    //
+    if (!AVrfpFuzzContext.MMapEntryCount)
+    {
+        return FALSE;
+    }
+
+    result = FALSE;
+
+    AVrfEnterCriticalSection(&AVrfpFuzzContext.CriticalSection);
+
+    entry = AVrfpFuzzLookupMemoryMapping(Address);
+    if (!entry)
+    {
+        goto Exit;
+    }
+
+    offset = ((ULONG_PTR)Address - (ULONG_PTR)entry->FuzzedBaseAddress);
+    offset &= ~((SIZE_T)VFDYNF_FUZZ_MMAP_PAGE_SIZE - 1);
+
+    pageIndex = (ULONG)(offset / VFDYNF_FUZZ_MMAP_PAGE_SIZE);
+
+    if (RtlTestBit(&entry->Pages, pageIndex))
+    {
+        //
+        // The page is already filled. Either another thread filled it while
+        // this one waited, and the access now succeeds, or the fault has
+        // nothing to do with the fuzzing and is left to the application.
+        //
+        result = AVrfpFuzzMemoryMappingAllows(Address, AccessType);
+        goto Exit;
+    }
+
+    fuzzedBaseAddress = entry->FuzzedBaseAddress;
+    original = Add2Ptr(entry->OriginalBaseAddress, offset);
+    seed = entry->Seed;
+    pageMutations = entry->PageMutations;
+    lastPage = ((offset + VFDYNF_FUZZ_MMAP_PAGE_SIZE) == entry->RegionSize);
+
     AVrfLeaveCriticalSection(&AVrfpFuzzContext.CriticalSection);
 
-    return baseAddress;
+    //
+    // The page is copied and fuzzed without the lock, faults on other pages
+    // are not held up by it. The page is the same whichever thread fills it.
+    //
+    AVrfpFuzzMemoryMappingFill(page,
+                               original,
+                               seed,
+                               pageIndex,
+                               pageMutations,
+                               lastPage);
+
+    AVrfEnterCriticalSection(&AVrfpFuzzContext.CriticalSection);
+
+    entry = AVrfpFuzzLookupMemoryMapping(Address);
+    if (!entry || (entry->FuzzedBaseAddress != fuzzedBaseAddress))
+    {
+        //
+        // The mapping was forgotten while the page was filled.
+        //
+        goto Exit;
+    }
+
+    if (RtlTestBit(&entry->Pages, pageIndex))
+    {
+        result = TRUE;
+        goto Exit;
+    }
+
+    status = AVrfpFuzzMemoryMappingExpose(entry, offset, page);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                     "failed to expose fuzzed mapping page %p (0x%08x)",
+                     Add2Ptr(entry->FuzzedBaseAddress, offset),
+                     status);
+        goto Exit;
+    }
+
+    RtlSetBit(&entry->Pages, pageIndex);
+
+    result = TRUE;
+
+Exit:
+
+    AVrfLeaveCriticalSection(&AVrfpFuzzContext.CriticalSection);
+
+    return result;
 }
 
 PVOID AVrfForgetFuzzedMemoryMapping(
@@ -677,10 +1530,10 @@ PVOID AVrfForgetFuzzedMemoryMapping(
             continue;
         }
 
-        RtlFreeHeap(RtlProcessHeap(), 0, BaseAddress);
-
         baseAddress = entry->OriginalBaseAddress;
 
+        AVrfpFreeFuzzedMemoryMapping(entry);
+
         AVrfpFuzzContext.MMapEntryCount--;
 
         length = ((AVrfpFuzzContext.MMapEntryCount - i) * sizeof(*entry));
@@ -751,6 +1604,10 @@ BOOLEAN AVrfFuzzProcessAttach(
 {
     AVrfInitializeCriticalSection(&AVrfpFuzzContext.CriticalSection);
 
+#if defined(VFDYNF_FUZZ_CLASSIFY_SSE2)
+    AVrfpFuzzContext.Avx2 = (USER_SHARED_DATA->ProcessorFeatures[PF_AVX2_INSTRUCTIONS_AVAILABLE] != FALSE);
+#endif
+
     if (AVrfProperties.FuzzSeed)
     {
         //
@@ -0,0 +1,362 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#pragma once
+
+//
+// Buffer classifier kernels, see AVrfpFuzzClassifyBuffer. The kernels only
+// use the base types and the compiler intrinsics, so the equivalence tests and
+// benchmarks in tests/fuzzcls build them on other hosts as well.
+//
+
+#if defined(_M_ARM64) || defined(_M_ARM64EC)
+#include <arm64_neon.h>
+#define VFDYNF_FUZZ_CLASSIFY_NEON
+#elif defined(_M_X64) || defined(_M_IX86)
+#define VFDYNF_FUZZ_CLASSIFY_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define VFDYNF_FUZZ_CLASSIFY_NEON
+#elif defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define VFDYNF_FUZZ_CLASSIFY_SSE2
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VFDYNF_FUZZ_CLASSIFY_AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define VFDYNF_FUZZ_CLASSIFY_AVX2_TARGET
+#endif
+
+#define VFDYNF_FUZZ_CLASSIFY_SENTINELS 5
+
+// https://github.com/winsiderss/systeminformer/blob/master/phlib/data.c
+static BOOLEAN AVrfpCharIsPrintable[256] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0, /* 0 - 15 */ // TAB, LF and CR are printable
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 16 - 31 */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* ' ' - '/' */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* '0' - '9' */
+    1, 1, 1, 1, 1, 1, 1, /* ':' - '@' */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 'A' - 'Z' */
+    1, 1, 1, 1, 1, 1, /* '[' - '`' */
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 'a' - 'z' */
+    1, 1, 1, 1, 0, /* '{' - 127 */ // DEL is not printable
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 128 - 143 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 144 - 159 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 160 - 175 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 176 - 191 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 192 - 207 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 208 - 223 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 224 - 239 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 /* 240 - 255 */
+};
+
+FORCEINLINE
+BOOLEAN AVrfpFuzzCountStep(
+    _In_ PBYTE Buffer,
+    _In_ SIZE_T Index,
+    _Inout_ PSIZE_T Printable,
+    _Inout_ PSIZE_T Sentinels,
+    _Inout_ PSIZE_T Length
+    )
+{
+    if (AVrfpCharIsPrintable[Buffer[Index]])
+    {
+        (*Printable)++;
+    }
+
+    if (Buffer[Index] == VFDYNF_FUZZ_SENTINEL)
+    {
+        (*Sentinels)++;
+    }
+    else
+    {
+        *Sentinels = 0;
+    }
+
+    if (*Sentinels >= VFDYNF_FUZZ_CLASSIFY_SENTINELS)
+    {
+        //
+        // Likely at our memory fill, stop counting and clamp the length.
+        //
+        *Length = ((Index - VFDYNF_FUZZ_CLASSIFY_SENTINELS) + 1);
+        *Printable -= *Sentinels;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+FORCEINLINE
+SIZE_T AVrfpFuzzCountPrintable(
+    _In_reads_bytes_(*Length) PBYTE Buffer,
+    _Inout_ PSIZE_T Length
+    )
+{
+    SIZE_T printable;
+    SIZE_T sentinels;
+
+    //
+    // Counts the printable bytes of the buffer. A run of sentinels is likely
+    // our memory fill, the length is clamped to where the run begins.
+    //
+    printable = 0;
+    sentinels = 0;
+
+    for (SIZE_T i = 0; i < *Length; i++)
+    {
+        if (AVrfpFuzzCountStep(Buffer, i, &printable, &sentinels, Length))
+        {
+            break;
+        }
+    }
+
+    return printable;
+}
+
+//
+// The vector kernels count whole chunks which contain no sentinel and step
+// through any chunk which does one byte at a time with AVrfpFuzzCountStep,
+// so they produce exactly the result of AVrfpFuzzCountPrintable. A chunk
+// without a sentinel ends any run of them. Sentinels are rare outside of our
+// memory fill, which ends the scan.
+//
+
+FORCEINLINE
+ULONG AVrfpFuzzPopCount32(
+    _In_ ULONG Value
+    )
+{
+    //
+    // N.B. The POPCNT instruction is not part of the baseline instruction set.
+    //
+    Value = (Value - ((Value >> 1) & 0x55555555ul));
+    Value = ((Value & 0x33333333ul) + ((Value >> 2) & 0x33333333ul));
+    Value = ((Value + (Value >> 4)) & 0x0f0f0f0ful);
+
+    return ((ULONG)(Value * 0x01010101ul) >> 24);
+}
+
+#if defined(VFDYNF_FUZZ_CLASSIFY_SSE2)
+
+FORCEINLINE
+SIZE_T AVrfpFuzzCountPrintableSse2(
+    _In_reads_bytes_(*Length) PBYTE Buffer,
+    _Inout_ PSIZE_T Length
+    )
+{
+    SIZE_T length;
+    SIZE_T printable;
+    SIZE_T sentinels;
+    SIZE_T i;
+    __m128i sentinel;
+    __m128i low;
+    __m128i high;
+    __m128i tab;
+    __m128i lf;
+    __m128i cr;
+
+    length = *Length;
+    printable = 0;
+    sentinels = 0;
+
+    sentinel = _mm_set1_epi8(VFDYNF_FUZZ_SENTINEL);
+    low = _mm_set1_epi8(0x1f);
+    high = _mm_set1_epi8(0x7f);
+    tab = _mm_set1_epi8('\t');
+    lf = _mm_set1_epi8('\n');
+    cr = _mm_set1_epi8('\r');
+
+    for (i = 0; (i + 16) <= length; i += 16)
+    {
+        __m128i chunk;
+        __m128i mask;
+
+        chunk = _mm_loadu_si128((const __m128i*)&Buffer[i]);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, sentinel)))
+        {
+            for (SIZE_T j = i; j < (i + 16); j++)
+            {
+                if (AVrfpFuzzCountStep(Buffer, j, &printable, &sentinels, Length))
+                {
+                    return printable;
+                }
+            }
+
+            continue;
+        }
+
+        //
+        // N.B. The comparisons are signed, bytes of 0x80 and above are
+        // negative and fall outside of 0x20 - 0x7e.
+        //
+        mask = _mm_and_si128(_mm_cmpgt_epi8(chunk, low), _mm_cmplt_epi8(chunk, high));
+        mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, tab));
+        mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, lf));
+        mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, cr));
+
+        printable += AVrfpFuzzPopCount32((ULONG)_mm_movemask_epi8(mask));
+        sentinels = 0;
+    }
+
+    for (; i < length; i++)
+    {
+        if (AVrfpFuzzCountStep(Buffer, i, &printable, &sentinels, Length))
+        {
+            break;
+        }
+    }
+
+    return printable;
+}
+
+FORCEINLINE VFDYNF_FUZZ_CLASSIFY_AVX2_TARGET
+SIZE_T AVrfpFuzzCountPrintableAvx2(
+    _In_reads_bytes_(*Length) PBYTE Buffer,
+    _Inout_ PSIZE_T Length
+    )
+{
+    SIZE_T length;
+    SIZE_T printable;
+    SIZE_T sentinels;
+    SIZE_T i;
+    __m256i sentinel;
+    __m256i low;
+    __m256i high;
+    __m256i tab;
+    __m256i lf;
+    __m256i cr;
+
+    length = *Length;
+    printable = 0;
+    sentinels = 0;
+
+    sentinel = _mm256_set1_epi8(VFDYNF_FUZZ_SENTINEL);
+    low = _mm256_set1_epi8(0x1f);
+    high = _mm256_set1_epi8(0x7f);
+    tab = _mm256_set1_epi8('\t');
+    lf = _mm256_set1_epi8('\n');
+    cr = _mm256_set1_epi8('\r');
+
+    for (i = 0; (i + 32) <= length; i += 32)
+    {
+        __m256i chunk;
+        __m256i mask;
+
+        chunk = _mm256_loadu_si256((const __m256i*)&Buffer[i]);
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, sentinel)))
+        {
+            for (SIZE_T j = i; j < (i + 32); j++)
+            {
+                if (AVrfpFuzzCountStep(Buffer, j, &printable, &sentinels, Length))
+                {
+                    _mm256_zeroupper();
+                    return printable;
+                }
+            }
+
+            continue;
+        }
+
+        mask = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, low), _mm256_cmpgt_epi8(high, chunk));
+        mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(chunk, tab));
+        mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(chunk, lf));
+        mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(chunk, cr));
+
+        printable += AVrfpFuzzPopCount32((ULONG)_mm256_movemask_epi8(mask));
+        sentinels = 0;
+    }
+
+    //
+    // N.B. Avoid the transition penalty in the SSE code which follows, the
+    // upper state is cleared on every path out of the kernel.
+    //
+    _mm256_zeroupper();
+
+    for (; i < length; i++)
+    {
+        if (AVrfpFuzzCountStep(Buffer, i, &printable, &sentinels, Length))
+        {
+            break;
+        }
+    }
+
+    return printable;
+}
+
+#elif defined(VFDYNF_FUZZ_CLASSIFY_NEON)
+
+FORCEINLINE
+SIZE_T AVrfpFuzzCountPrintableNeon(
+    _In_reads_bytes_(*Length) PBYTE Buffer,
+    _Inout_ PSIZE_T Length
+    )
+{
+    SIZE_T length;
+    SIZE_T printable;
+    SIZE_T sentinels;
+    SIZE_T i;
+    uint8x16_t sentinel;
+    uint8x16_t low;
+    uint8x16_t high;
+    uint8x16_t tab;
+    uint8x16_t lf;
+    uint8x16_t cr;
+    uint8x16_t one;
+
+    length = *Length;
+    printable = 0;
+    sentinels = 0;
+
+    sentinel = vdupq_n_u8(VFDYNF_FUZZ_SENTINEL);
+    low = vdupq_n_u8(0x20);
+    high = vdupq_n_u8(0x7e);
+    tab = vdupq_n_u8('\t');
+    lf = vdupq_n_u8('\n');
+    cr = vdupq_n_u8('\r');
+    one = vdupq_n_u8(1);
+
+    for (i = 0; (i + 16) <= length; i += 16)
+    {
+        uint8x16_t chunk;
+        uint8x16_t mask;
+
+        chunk = vld1q_u8(&Buffer[i]);
+
+        if (vmaxvq_u8(vceqq_u8(chunk, sentinel)))
+        {
+            for (SIZE_T j = i; j < (i + 16); j++)
+            {
+                if (AVrfpFuzzCountStep(Buffer, j, &printable, &sentinels, Length))
+                {
+                    return printable;
+                }
+            }
+
+            continue;
+        }
+
+        mask = vandq_u8(vcgeq_u8(chunk, low), vcleq_u8(chunk, high));
+        mask = vorrq_u8(mask, vceqq_u8(chunk, tab));
+        mask = vorrq_u8(mask, vceqq_u8(chunk, lf));
+        mask = vorrq_u8(mask, vceqq_u8(chunk, cr));
+
+        printable += vaddvq_u8(vandq_u8(mask, one));
+        sentinels = 0;
+    }
+
+    for (; i < length; i++)
+    {
+        if (AVrfpFuzzCountStep(Buffer, i, &printable, &sentinels, Length))
+        {
+            break;
+        }
+    }
+
+    return printable;
+}
+
+#endif
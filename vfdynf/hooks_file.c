@@ -87,11 +87,6 @@ Hook_NtReadFile(
 
     inputLength = Length;
 
-    if (AVrfHookIsCallerIncluded(VFDYNF_FAULT_TYPE_FUZZ_FILE))
-    {
-        AVrfFuzzFillMemory(Buffer, Length);
-    }
-
     if (AVrfHookShouldFaultInject(VFDYNF_FAULT_TYPE_FUZZ_FILE))
     {
         AVrfFuzzSizeTruncateULong(&Length);
@@ -112,12 +107,19 @@ Hook_NtReadFile(
         return status;
     }
 
+    //
+    // Only the bytes returned by the read are fuzzed. The rest of the buffer
+    // is left as the caller provided it.
+    //
     if (!Event &&
         !ApcRoutine &&
-        inputLength &&
+        IoStatusBlock->Information &&
+        (IoStatusBlock->Information <= inputLength) &&
         AVrfHookShouldFaultInject(VFDYNF_FAULT_TYPE_FUZZ_FILE))
     {
-        AVrfFuzzBuffer(Buffer, inputLength, VFDYNF_FAULT_TYPE_INDEX_FUZZ_FILE);
+        AVrfFuzzBuffer(Buffer,
+                       IoStatusBlock->Information,
+                       VFDYNF_FAULT_TYPE_INDEX_FUZZ_FILE);
     }
 
     return status;
@@ -348,11 +350,6 @@ Hook_Common_ReadFile(
 
     inputLength = nNumberOfBytesToRead;
 
-    if (lpBuffer && AVrfHookIsCallerIncluded(VFDYNF_FAULT_TYPE_FUZZ_FILE))
-    {
-        AVrfFuzzFillMemory(lpBuffer, inputLength);
-    }
-
     if (AVrfHookShouldFaultInject(VFDYNF_FAULT_TYPE_FUZZ_FILE))
     {
         AVrfFuzzSizeTruncateULong(&nNumberOfBytesToRead);
@@ -367,11 +364,13 @@ Hook_Common_ReadFile(
     if (result &&
         lpBuffer &&
         !lpOverlapped &&
-        inputLength &&
+        lpNumberOfBytesRead &&
+        *lpNumberOfBytesRead &&
+        (*lpNumberOfBytesRead <= inputLength) &&
         AVrfHookShouldFaultInject(VFDYNF_FAULT_TYPE_FUZZ_FILE))
     {
         AVrfFuzzBuffer(lpBuffer,
-                       inputLength,
+                       *lpNumberOfBytesRead,
                        VFDYNF_FAULT_TYPE_INDEX_FUZZ_FILE);
     }
 
@@ -4,6 +4,36 @@
 #include <vfdynf.h>
 #include <hooks.h>
 
+VOID AVrfpFuzzRecvBuffers(
+    _In_reads_(BufferCount) LPWSABUF Buffers,
+    _In_ ULONG BufferCount,
+    _In_ ULONG BytesReceived
+    )
+{
+    ULONG remaining;
+
+    //
+    // The received bytes fill the buffers in order, only those are fuzzed.
+    //
+    remaining = BytesReceived;
+
+    for (ULONG i = 0; (i < BufferCount) && remaining; i++)
+    {
+        ULONG length;
+
+        length = min(Buffers[i].len, remaining);
+
+        if (length)
+        {
+            AVrfFuzzBuffer(Buffers[i].buf,
+                           length,
+                           VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET);
+        }
+
+        remaining -= length;
+    }
+}
+
 int
 WSAAPI
 Hook_WSARecv(
@@ -20,14 +50,6 @@ Hook_WSARecv(
 
     AVRF_HOOK_CONTEXT();
 
-    if (AVrfHookIsCallerIncluded(VFDYNF_FAULT_TYPE_FUZZ_NET))
-    {
-        for (ULONG i = 0; i < dwBufferCount; i++)
-        {
-            AVrfFuzzFillMemory(lpBuffers[i].buf, lpBuffers[i].len);
-        }
-    }
-
     res = Orig_WSARecv(s,
                        lpBuffers,
                        dwBufferCount,
@@ -39,15 +61,11 @@ Hook_WSARecv(
     if ((res == 0) &&
         !lpOverlapped &&
         !lpCompletionRoutine &&
-        dwBufferCount &&
+        lpNumberOfBytesRecvd &&
+        *lpNumberOfBytesRecvd &&
         AVrfHookShouldFaultInject(VFDYNF_FAULT_TYPE_FUZZ_NET))
     {
-        for (ULONG i = 0; i < dwBufferCount; i++)
-        {
-            AVrfFuzzBuffer(lpBuffers[i].buf,
-                           lpBuffers[i].len,
-                           VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET);
-        }
+        AVrfpFuzzRecvBuffers(lpBuffers, dwBufferCount, *lpNumberOfBytesRecvd);
     }
 
     return res;
@@ -71,14 +89,6 @@ Hook_WSARecvFrom(
 
     AVRF_HOOK_CONTEXT();
 
-    if (AVrfHookIsCallerIncluded(VFDYNF_FAULT_TYPE_FUZZ_NET))
-    {
-        for (ULONG i = 0; i < dwBufferCount; i++)
-        {
-            AVrfFuzzFillMemory(lpBuffers[i].buf, lpBuffers[i].len);
-        }
-    }
-
     res = Orig_WSARecvFrom(s,
                            lpBuffers,
                            dwBufferCount,
@@ -92,15 +102,11 @@ Hook_WSARecvFrom(
     if ((res == 0) &&
         !lpOverlapped &&
         !lpCompletionRoutine &&
-        dwBufferCount &&
+        lpNumberOfBytesRecvd &&
+        *lpNumberOfBytesRecvd &&
         AVrfHookShouldFaultInject(VFDYNF_FAULT_TYPE_FUZZ_NET))
     {
-        for (ULONG i = 0; i < dwBufferCount; i++)
-        {
-            AVrfFuzzBuffer(lpBuffers[i].buf,
-                           lpBuffers[i].len,
-                           VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET);
-        }
+        AVrfpFuzzRecvBuffers(lpBuffers, dwBufferCount, *lpNumberOfBytesRecvd);
     }
 
     return res;
@@ -119,18 +125,14 @@ Hook_recv(
 
     AVRF_HOOK_CONTEXT();
 
-    if (AVrfHookIsCallerIncluded(VFDYNF_FAULT_TYPE_FUZZ_NET))
-    {
-        AVrfFuzzFillMemory(buf, len);
-    }
-
     res = Orig_recv(s, buf, len, flags);
 
     if ((res != SOCKET_ERROR) &&
-        (len > 0) &&
+        (res > 0) &&
+        (res <= len) &&
         AVrfHookShouldFaultInject(VFDYNF_FAULT_TYPE_FUZZ_NET))
     {
-        AVrfFuzzBuffer(buf, (ULONG)len, VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET);
+        AVrfFuzzBuffer(buf, (ULONG)res, VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET);
     }
 
     return res;
@@ -151,18 +153,14 @@ Hook_recvfrom(
 
     AVRF_HOOK_CONTEXT();
 
-    if (AVrfHookIsCallerIncluded(VFDYNF_FAULT_TYPE_FUZZ_NET))
-    {
-        AVrfFuzzFillMemory(buf, len);
-    }
-
     res = Orig_recvfrom(s, buf, len, flags, from, fromlen);
 
     if ((res != SOCKET_ERROR) &&
-        (len > 0) &&
+        (res > 0) &&
+        (res <= len) &&
         AVrfHookShouldFaultInject(VFDYNF_FAULT_TYPE_FUZZ_NET))
     {
-        AVrfFuzzBuffer(buf, (ULONG)len, VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET);
+        AVrfFuzzBuffer(buf, (ULONG)res, VFDYNF_FAULT_TYPE_INDEX_FUZZ_NET);
     }
 
     return res;
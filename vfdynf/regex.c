@@ -0,0 +1,727 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <vfdynf.h>
+#include <strsafe.h>
+
+#define VFDYNF_REGEX_CACHE_MAGIC      0x78657276ul // 'vrex'
+#define VFDYNF_REGEX_CACHE_VERSION    1ul
+#define VFDYNF_REGEX_CACHE_MAX_LENGTH (16 * 1024 * 1024)
+
+#define VFDYNF_REGEX_STATS_COUNT       4096
+#define VFDYNF_REGEX_STATS_MIN_SAMPLES 32
+#define VFDYNF_REGEX_STATS_CLOSED      ((PCRE2_HANDLE)(ULONG_PTR)-1)
+
+typedef struct _VFDYNF_REGEX_CACHE_HEADER
+{
+    ULONG Magic;
+    ULONG Version;
+    ULONG64 PatternHash;
+    ULONG64 DataHash;
+    ULONG PatternLength;
+    ULONG DataLength;
+} VFDYNF_REGEX_CACHE_HEADER, *PVFDYNF_REGEX_CACHE_HEADER;
+
+//
+// The cost of every compiled expression is tracked so expressions which are
+// expensive to evaluate can be found, and disabled when a cost threshold is
+// set. An expression whose statistics do not fit is matched untracked.
+//
+typedef struct _VFDYNF_REGEX_STATS
+{
+    PCRE2_HANDLE Regex;
+    volatile LONG Disabled;
+    volatile LONG LimitHits;
+    volatile LONG64 Matches;
+    volatile LONG64 Ticks;
+    volatile LONG64 MaxTicks;
+    UNICODE_STRING Pattern;
+} VFDYNF_REGEX_STATS, *PVFDYNF_REGEX_STATS;
+
+typedef struct _VFDYNF_REGEX_CONTEXT
+{
+    RTL_SRWLOCK Lock;
+    LARGE_INTEGER PerformanceFrequency;
+    volatile LONG Count;
+    PVFDYNF_REGEX_STATS Stats[VFDYNF_REGEX_STATS_COUNT];
+} VFDYNF_REGEX_CONTEXT, *PVFDYNF_REGEX_CONTEXT;
+
+static VFDYNF_REGEX_CONTEXT AVrfpRegexContext =
+{
+    .Lock = RTL_SRWLOCK_INIT,
+    .PerformanceFrequency = { 0 },
+    .Count = 0,
+    .Stats = { 0 },
+};
+
+ULONG64 AVrfpRegexHash(
+    _In_reads_bytes_(Length) CONST VOID* Buffer,
+    _In_ SIZE_T Length
+    )
+{
+    ULONG64 hash;
+    PBYTE bytes;
+
+    //
+    // FNV-1a, the cache is keyed on the pattern and validated with the data.
+    //
+    hash = 0xcbf29ce484222325ull;
+    bytes = (PBYTE)Buffer;
+
+    for (SIZE_T i = 0; i < Length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpRegexCacheOpen(
+    _In_ ULONG64 PatternHash,
+    _In_ BOOLEAN Write,
+    _Out_ PHANDLE FileHandle
+    )
+{
+    NTSTATUS status;
+    WCHAR path[MAX_PATH];
+    UNICODE_STRING ntPath;
+    OBJECT_ATTRIBUTES objectAttributes;
+    IO_STATUS_BLOCK ioStatusBlock;
+
+    *FileHandle = NULL;
+
+    status = StringCchPrintfW(path,
+                              ARRAYSIZE(path),
+                              L"%ls\\vfdynf_%016llx.pcre2",
+                              AVrfProperties.RegexCachePath,
+                              PatternHash);
+    if (FAILED(status))
+    {
+        return STATUS_NAME_TOO_LONG;
+    }
+
+    status = RtlDosPathNameToNtPathName_U_WithStatus(path, &ntPath, NULL, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    InitializeObjectAttributes(&objectAttributes,
+                               &ntPath,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    //
+    // N.B. Multiple processes may race to populate the same entry. Writers
+    // take the file exclusively and readers validate the contents, so a
+    // partially written entry is rejected and recompiled.
+    //
+    status = NtCreateFile(FileHandle,
+                          Write ? (FILE_GENERIC_WRITE | DELETE) : FILE_GENERIC_READ,
+                          &objectAttributes,
+                          &ioStatusBlock,
+                          NULL,
+                          FILE_ATTRIBUTE_NORMAL,
+                          Write ? 0 : FILE_SHARE_READ,
+                          Write ? FILE_OVERWRITE_IF : FILE_OPEN,
+                          FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+                          NULL,
+                          0);
+
+    RtlFreeUnicodeString(&ntPath);
+
+    return status;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpRegexCacheLoad(
+    _Out_ PPCRE2_HANDLE Regex,
+    _In_ PUNICODE_STRING Pattern,
+    _In_ ULONG64 PatternHash
+    )
+{
+    NTSTATUS status;
+    HANDLE fileHandle;
+    IO_STATUS_BLOCK ioStatusBlock;
+    FILE_STANDARD_INFORMATION info;
+    PVFDYNF_REGEX_CACHE_HEADER header;
+    PVOID pattern;
+    PVOID data;
+    ULONG length;
+
+    *Regex = NULL;
+    header = NULL;
+
+    status = AVrfpRegexCacheOpen(PatternHash, FALSE, &fileHandle);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    status = NtQueryInformationFile(fileHandle,
+                                    &ioStatusBlock,
+                                    &info,
+                                    sizeof(info),
+                                    FileStandardInformation);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    if ((info.EndOfFile.QuadPart <= sizeof(VFDYNF_REGEX_CACHE_HEADER)) ||
+        (info.EndOfFile.QuadPart > VFDYNF_REGEX_CACHE_MAX_LENGTH))
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto Exit;
+    }
+
+    length = info.EndOfFile.LowPart;
+
+    header = RtlAllocateHeap(RtlProcessHeap(), 0, length);
+    if (!header)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    status = NtReadFile(fileHandle,
+                        NULL,
+                        NULL,
+                        NULL,
+                        &ioStatusBlock,
+                        header,
+                        length,
+                        NULL,
+                        NULL);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    if ((ioStatusBlock.Information != length) ||
+        (header->Magic != VFDYNF_REGEX_CACHE_MAGIC) ||
+        (header->Version != VFDYNF_REGEX_CACHE_VERSION) ||
+        (header->PatternHash != PatternHash) ||
+        (header->PatternLength != Pattern->Length) ||
+        (((ULONG64)sizeof(VFDYNF_REGEX_CACHE_HEADER) +
+          header->PatternLength +
+          header->DataLength) != length))
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto Exit;
+    }
+
+    pattern = Add2Ptr(header, sizeof(VFDYNF_REGEX_CACHE_HEADER));
+    data = Add2Ptr(pattern, header->PatternLength);
+
+    //
+    // The hash only keys the entry, compare the pattern to rule out a
+    // collision and check the data since PCRE2 trusts what it decodes.
+    //
+    if ((RtlCompareMemory(pattern, Pattern->Buffer, Pattern->Length) != Pattern->Length) ||
+        (AVrfpRegexHash(data, header->DataLength) != header->DataHash))
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto Exit;
+    }
+
+    status = Pcre2Deserialize(Regex, data, header->DataLength);
+
+Exit:
+
+    if (header)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, header);
+    }
+
+    NtClose(fileHandle);
+
+    return status;
+}
+
+VOID AVrfpRegexCacheStore(
+    _In_ PCRE2_HANDLE Regex,
+    _In_ PUNICODE_STRING Pattern,
+    _In_ ULONG64 PatternHash
+    )
+{
+    NTSTATUS status;
+    HANDLE fileHandle;
+    IO_STATUS_BLOCK ioStatusBlock;
+    VFDYNF_REGEX_CACHE_HEADER header;
+    PVOID data;
+    SIZE_T length;
+
+    status = Pcre2Serialize(Regex, &data, &length);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                     "failed to serialize regex (0x%08x)",
+                     status);
+        return;
+    }
+
+    if (length > (VFDYNF_REGEX_CACHE_MAX_LENGTH / 2))
+    {
+        goto Exit;
+    }
+
+    status = AVrfpRegexCacheOpen(PatternHash, TRUE, &fileHandle);
+    if (!NT_SUCCESS(status))
+    {
+        //
+        // Expected when another process is populating the same entry.
+        //
+        goto Exit;
+    }
+
+    header.Magic = VFDYNF_REGEX_CACHE_MAGIC;
+    header.Version = VFDYNF_REGEX_CACHE_VERSION;
+    header.PatternHash = PatternHash;
+    header.DataHash = AVrfpRegexHash(data, length);
+    header.PatternLength = Pattern->Length;
+    header.DataLength = (ULONG)length;
+
+    status = NtWriteFile(fileHandle,
+                         NULL,
+                         NULL,
+                         NULL,
+                         &ioStatusBlock,
+                         &header,
+                         sizeof(header),
+                         NULL,
+                         NULL);
+    if (NT_SUCCESS(status))
+    {
+        status = NtWriteFile(fileHandle,
+                             NULL,
+                             NULL,
+                             NULL,
+                             &ioStatusBlock,
+                             Pattern->Buffer,
+                             Pattern->Length,
+                             NULL,
+                             NULL);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = NtWriteFile(fileHandle,
+                             NULL,
+                             NULL,
+                             NULL,
+                             &ioStatusBlock,
+                             data,
+                             (ULONG)length,
+                             NULL,
+                             NULL);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        FILE_DISPOSITION_INFORMATION disposition;
+
+        AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                     "failed to write regex cache (0x%08x)",
+                     status);
+
+        disposition.DeleteFile = TRUE;
+
+        NtSetInformationFile(fileHandle,
+                             &ioStatusBlock,
+                             &disposition,
+                             sizeof(disposition),
+                             FileDispositionInformation);
+    }
+
+    NtClose(fileHandle);
+
+Exit:
+
+    Pcre2SerializeFree(data);
+}
+
+ULONG AVrfpRegexStatsIndex(
+    _In_ PCRE2_HANDLE Regex
+    )
+{
+    ULONG_PTR value;
+
+    value = (ULONG_PTR)Regex;
+    value ^= (value >> 17);
+    value *= 0x9e3779b9;
+
+    return (ULONG)(value & (VFDYNF_REGEX_STATS_COUNT - 1));
+}
+
+_Ret_maybenull_
+PVFDYNF_REGEX_STATS AVrfpRegexLookupStats(
+    _In_ PCRE2_HANDLE Regex
+    )
+{
+    ULONG index;
+
+    //
+    // N.B. Slots are only ever filled, closed expressions keep their slot so
+    // lookups do not need the lock.
+    //
+    index = AVrfpRegexStatsIndex(Regex);
+
+    for (ULONG i = 0; i < VFDYNF_REGEX_STATS_COUNT; i++)
+    {
+        PVFDYNF_REGEX_STATS stats;
+
+        stats = ReadPointerAcquire(&AVrfpRegexContext.Stats[index]);
+        if (!stats)
+        {
+            break;
+        }
+
+        if (stats->Regex == Regex)
+        {
+            return stats;
+        }
+
+        index = ((index + 1) & (VFDYNF_REGEX_STATS_COUNT - 1));
+    }
+
+    return NULL;
+}
+
+VOID AVrfpRegexTrackStats(
+    _In_ PCRE2_HANDLE Regex,
+    _In_ PUNICODE_STRING Pattern
+    )
+{
+    PVFDYNF_REGEX_STATS stats;
+    ULONG index;
+
+    stats = RtlAllocateHeap(RtlProcessHeap(),
+                            HEAP_ZERO_MEMORY,
+                            sizeof(VFDYNF_REGEX_STATS) + Pattern->Length);
+    if (!stats)
+    {
+        return;
+    }
+
+    stats->Regex = Regex;
+    stats->Pattern.Buffer = Add2Ptr(stats, sizeof(VFDYNF_REGEX_STATS));
+    stats->Pattern.Length = Pattern->Length;
+    stats->Pattern.MaximumLength = Pattern->Length;
+    RtlCopyMemory(stats->Pattern.Buffer, Pattern->Buffer, Pattern->Length);
+
+    RtlAcquireSRWLockExclusive(&AVrfpRegexContext.Lock);
+
+    //
+    // Keep the table at most half full, probe sequences stay short.
+    //
+    if (AVrfpRegexContext.Count >= (VFDYNF_REGEX_STATS_COUNT / 2))
+    {
+        RtlReleaseSRWLockExclusive(&AVrfpRegexContext.Lock);
+        RtlFreeHeap(RtlProcessHeap(), 0, stats);
+        return;
+    }
+
+    index = AVrfpRegexStatsIndex(Regex);
+
+    while (AVrfpRegexContext.Stats[index])
+    {
+        index = ((index + 1) & (VFDYNF_REGEX_STATS_COUNT - 1));
+    }
+
+    WritePointerRelease(&AVrfpRegexContext.Stats[index], stats);
+    AVrfpRegexContext.Count++;
+
+    RtlReleaseSRWLockExclusive(&AVrfpRegexContext.Lock);
+}
+
+VOID AVrfpRegexUpdatePeak64(
+    _Inout_ volatile LONG64* Peak,
+    _In_ LONG64 Value
+    )
+{
+    LONG64 peak;
+
+    peak = ReadNoFence64(Peak);
+    while (Value > peak)
+    {
+        LONG64 prev;
+
+        prev = InterlockedCompareExchange64(Peak, Value, peak);
+        if (prev == peak)
+        {
+            break;
+        }
+
+        peak = prev;
+    }
+}
+
+ULONG64 AVrfpRegexTicksToMicroseconds(
+    _In_ LONG64 Ticks
+    )
+{
+    LONG64 frequency;
+
+    frequency = AVrfpRegexContext.PerformanceFrequency.QuadPart;
+    if (!frequency || (Ticks <= 0))
+    {
+        return 0;
+    }
+
+    return (ULONG64)(((Ticks / frequency) * 1000000) +
+                     (((Ticks % frequency) * 1000000) / frequency));
+}
+
+VOID AVrfpRegexAccount(
+    _Inout_ PVFDYNF_REGEX_STATS Stats,
+    _In_ LONG64 Ticks,
+    _In_ NTSTATUS Status
+    )
+{
+    LONG64 matches;
+    LONG64 ticks;
+
+    matches = InterlockedIncrement64(&Stats->Matches);
+    ticks = InterlockedAdd64(&Stats->Ticks, Ticks);
+    AVrfpRegexUpdatePeak64(&Stats->MaxTicks, Ticks);
+
+    if (Status == STATUS_QUOTA_EXCEEDED)
+    {
+        if (InterlockedIncrement(&Stats->LimitHits) == 1)
+        {
+            AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                         "regex exceeded the match limits, no verdict %wZ",
+                         &Stats->Pattern);
+        }
+    }
+
+    if (!AVrfProperties.RegexCostThreshold ||
+        (matches < VFDYNF_REGEX_STATS_MIN_SAMPLES))
+    {
+        return;
+    }
+
+    if (AVrfpRegexTicksToMicroseconds(ticks / matches) <= AVrfProperties.RegexCostThreshold)
+    {
+        return;
+    }
+
+    if (InterlockedCompareExchange(&Stats->Disabled, TRUE, FALSE) == FALSE)
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                     "regex disabled, average cost %llu us over %lld matches %wZ",
+                     AVrfpRegexTicksToMicroseconds(ticks / matches),
+                     matches,
+                     &Stats->Pattern);
+    }
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfCompileRegex(
+    _Out_ PPCRE2_HANDLE Regex,
+    _In_ PUNICODE_STRING Pattern
+    )
+{
+    NTSTATUS status;
+    ULONG64 patternHash;
+
+    if (AVrfProperties.RegexCachePath[0] == L'\0')
+    {
+        status = Pcre2Compile(Regex, Pattern);
+        goto Exit;
+    }
+
+    patternHash = AVrfpRegexHash(Pattern->Buffer, Pattern->Length);
+
+    status = AVrfpRegexCacheLoad(Regex, Pattern, patternHash);
+    if (NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    status = Pcre2Compile(Regex, Pattern);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    AVrfpRegexCacheStore(*Regex, Pattern, patternHash);
+
+Exit:
+
+    if (NT_SUCCESS(status))
+    {
+        AVrfpRegexTrackStats(*Regex, Pattern);
+    }
+
+    return status;
+}
+
+VOID AVrfCloseRegex(
+    _In_ PCRE2_HANDLE Regex
+    )
+{
+    PVFDYNF_REGEX_STATS stats;
+
+    //
+    // The statistics of a closed expression are kept, the handle may be
+    // reused by a later expression.
+    //
+    stats = AVrfpRegexLookupStats(Regex);
+    if (stats)
+    {
+        stats->Regex = VFDYNF_REGEX_STATS_CLOSED;
+    }
+
+    Pcre2Close(Regex);
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfMatchRegex(
+    _In_ PCRE2_HANDLE Regex,
+    _In_ PCUNICODE_STRING String,
+    _Out_ PBOOLEAN Match
+    )
+{
+    NTSTATUS status;
+    PVFDYNF_TLS tls;
+    PVFDYNF_REGEX_STATS stats;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+
+    *Match = FALSE;
+
+    //
+    // N.B. A disabled expression, or a match which exceeded the limits, has
+    // no verdict. It is not the same as no match, the caller decides what to
+    // do with the subject and must not keep the result.
+    //
+    stats = AVrfpRegexLookupStats(Regex);
+    if (stats && ReadNoFence(&stats->Disabled))
+    {
+        return STATUS_REQUEST_ABORTED;
+    }
+
+    //
+    // Matching state, the JIT stack in particular, is kept per thread. It is
+    // created on the first match and freed when the thread exits. Threads
+    // which predate the provider have no TLS and match without it.
+    //
+    tls = AVrfGetTls();
+    if (tls && !tls->RegexThread)
+    {
+        if (!NT_SUCCESS(Pcre2CreateThreadContext(&tls->RegexThread)))
+        {
+            tls->RegexThread = NULL;
+        }
+    }
+
+    RtlQueryPerformanceCounter(&start);
+
+    status = Pcre2MatchEx(Regex,
+                          (PUNICODE_STRING)String,
+                          tls ? tls->RegexThread : NULL,
+                          Match);
+
+    RtlQueryPerformanceCounter(&end);
+
+    if (stats)
+    {
+        AVrfpRegexAccount(stats, end.QuadPart - start.QuadPart, status);
+    }
+
+    return status;
+}
+
+BOOLEAN AVrfRegexProcessAttach(
+    VOID
+    )
+{
+    RtlQueryPerformanceFrequency(&AVrfpRegexContext.PerformanceFrequency);
+
+    //
+    // N.B. The limits must be set before the first thread context is created,
+    // which is on the first match.
+    //
+    Pcre2SetMatchLimits(AVrfProperties.RegexMatchLimit,
+                        AVrfProperties.RegexDepthLimit);
+
+    return TRUE;
+}
+
+VOID AVrfRegexProcessDetach(
+    VOID
+    )
+{
+    RtlAcquireSRWLockExclusive(&AVrfpRegexContext.Lock);
+
+    for (ULONG i = 0; i < VFDYNF_REGEX_STATS_COUNT; i++)
+    {
+        if (AVrfpRegexContext.Stats[i])
+        {
+            RtlFreeHeap(RtlProcessHeap(), 0, AVrfpRegexContext.Stats[i]);
+            AVrfpRegexContext.Stats[i] = NULL;
+        }
+    }
+
+    AVrfpRegexContext.Count = 0;
+
+    RtlReleaseSRWLockExclusive(&AVrfpRegexContext.Lock);
+}
+
+BOOLEAN NTAPI AVrfQueryRegexStatistics(
+    _Out_writes_to_opt_(Count, *ReturnCount) PVFDYNF_REGEX_STATISTICS Statistics,
+    _In_ ULONG Count,
+    _Out_ PULONG ReturnCount
+    )
+{
+    ULONG total;
+
+    total = 0;
+
+    RtlAcquireSRWLockShared(&AVrfpRegexContext.Lock);
+
+    for (ULONG i = 0; i < VFDYNF_REGEX_STATS_COUNT; i++)
+    {
+        PVFDYNF_REGEX_STATS stats;
+        PVFDYNF_REGEX_STATISTICS entry;
+        ULONG length;
+
+        stats = AVrfpRegexContext.Stats[i];
+        if (!stats)
+        {
+            continue;
+        }
+
+        if (!Statistics || (total >= Count))
+        {
+            total++;
+            continue;
+        }
+
+        entry = &Statistics[total++];
+
+        entry->Matches = (ULONG64)ReadNoFence64(&stats->Matches);
+        entry->TotalTime = AVrfpRegexTicksToMicroseconds(ReadNoFence64(&stats->Ticks));
+        entry->MaxTime = AVrfpRegexTicksToMicroseconds(ReadNoFence64(&stats->MaxTicks));
+        entry->LimitHits = (ULONG)ReadNoFence(&stats->LimitHits);
+        entry->Disabled = (ReadNoFence(&stats->Disabled) != FALSE);
+        entry->Closed = (stats->Regex == VFDYNF_REGEX_STATS_CLOSED);
+
+        length = min(stats->Pattern.Length / sizeof(WCHAR),
+                     ARRAYSIZE(entry->Pattern) - 1);
+
+        RtlCopyMemory(entry->Pattern, stats->Pattern.Buffer, length * sizeof(WCHAR));
+        entry->Pattern[length] = L'\0';
+    }
+
+    RtlReleaseSRWLockShared(&AVrfpRegexContext.Lock);
+
+    *ReturnCount = total;
+
+    return (Statistics && (total <= Count));
+}
@@ -0,0 +1,644 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <vfdynf.h>
+
+//
+// Literal prefilter for lists of regular expressions. A literal substring
+// which every match of a pattern must contain is pulled from each pattern and
+// the literals of a list are compiled into an Aho-Corasick automaton. One scan
+// of a subject with the automaton finds every pattern whose literal occurs in
+// it, only those patterns (and the patterns no literal was found for) need to
+// be run by PCRE2.
+//
+// Literal extraction is deliberately conservative. Only atoms outside of any
+// group are considered, and a pattern with a top level alternation or any
+// "(?" construct (inline options can make it case insensitive) is never
+// filtered. A pattern which is not filtered is always a candidate.
+//
+
+#define VFDYNF_REGEX_PREFILTER_MIN_LITERAL 3
+#define VFDYNF_REGEX_PREFILTER_MAX_LITERAL 128
+#define VFDYNF_REGEX_PREFILTER_ASCII       128
+#define VFDYNF_REGEX_PREFILTER_NO_PATTERN  ULONG_MAX
+
+typedef struct _VFDYNF_REGEX_PREFILTER_NODE
+{
+    WCHAR Char;
+    ULONG Child;
+    ULONG Sibling;
+    ULONG Fail;
+    ULONG OutputLink;
+    ULONG Pattern;
+} VFDYNF_REGEX_PREFILTER_NODE, *PVFDYNF_REGEX_PREFILTER_NODE;
+
+//
+// N.B. Node zero is the root. Since the root is never a child, a child,
+// sibling, or link of zero means there is none. Patterns which share a
+// literal are chained through NextPattern.
+//
+typedef struct _VFDYNF_REGEX_PREFILTER
+{
+    ULONG PatternCount;
+    ULONG NodeCount;
+    PULONG NextPattern;
+    PVFDYNF_REGEX_PREFILTER_NODE Nodes;
+    ULONG Unfiltered[VFDYNF_REGEX_PREFILTER_BITMAP_SIZE];
+    ULONG RootAscii[VFDYNF_REGEX_PREFILTER_ASCII];
+} VFDYNF_REGEX_PREFILTER;
+
+ULONG AVrfpRegexSkipClass(
+    _In_ PCUNICODE_STRING Pattern,
+    _In_ ULONG Index
+    )
+{
+    ULONG length;
+    ULONG i;
+
+    //
+    // Returns the index of the closing bracket of the class opened at Index,
+    // or the length of the pattern when it is not closed. A bracket directly
+    // after the opening bracket (or its negation) is a literal.
+    //
+    length = (Pattern->Length / sizeof(WCHAR));
+    i = (Index + 1);
+
+    if ((i < length) && (Pattern->Buffer[i] == L'^'))
+    {
+        i++;
+    }
+
+    if ((i < length) && (Pattern->Buffer[i] == L']'))
+    {
+        i++;
+    }
+
+    for (; i < length; i++)
+    {
+        if (Pattern->Buffer[i] == L'\\')
+        {
+            i++;
+        }
+        else if (Pattern->Buffer[i] == L']')
+        {
+            break;
+        }
+    }
+
+    return min(i, length);
+}
+
+VOID AVrfpRegexEndRun(
+    _In_reads_(RunLength) PWCHAR Run,
+    _Inout_ PULONG RunLength,
+    _Out_writes_(VFDYNF_REGEX_PREFILTER_MAX_LITERAL) PWCHAR Literal,
+    _Inout_ PULONG LiteralLength
+    )
+{
+    //
+    // Keep the run of literal characters when it is the longest so far.
+    //
+    if (*RunLength > *LiteralLength)
+    {
+        RtlCopyMemory(Literal, Run, *RunLength * sizeof(WCHAR));
+        *LiteralLength = *RunLength;
+    }
+
+    *RunLength = 0;
+}
+
+BOOLEAN AVrfpRegexRequiredLiteral(
+    _In_ PCUNICODE_STRING Pattern,
+    _Out_writes_(VFDYNF_REGEX_PREFILTER_MAX_LITERAL) PWCHAR Literal,
+    _Out_ PULONG LiteralLength
+    )
+{
+    WCHAR run[VFDYNF_REGEX_PREFILTER_MAX_LITERAL];
+    ULONG runLength;
+    ULONG length;
+    ULONG depth;
+    BOOLEAN quoted;
+
+    *LiteralLength = 0;
+
+    length = (Pattern->Length / sizeof(WCHAR));
+    runLength = 0;
+    depth = 0;
+    quoted = FALSE;
+
+    for (ULONG i = 0; i < length; i++)
+    {
+        WCHAR c;
+
+        c = Pattern->Buffer[i];
+
+        if (quoted)
+        {
+            //
+            // Everything between \Q and \E is literal.
+            //
+            if ((c == L'\\') &&
+                ((i + 1) < length) &&
+                (Pattern->Buffer[i + 1] == L'E'))
+            {
+                quoted = FALSE;
+                i++;
+                continue;
+            }
+        }
+        else
+        {
+            switch (c)
+            {
+                case L'\\':
+                {
+                    if (++i >= length)
+                    {
+                        *LiteralLength = 0;
+                        return FALSE;
+                    }
+
+                    c = Pattern->Buffer[i];
+
+                    if (c == L'Q')
+                    {
+                        quoted = TRUE;
+                        continue;
+                    }
+
+                    if (((c >= L'a') && (c <= L'z')) ||
+                        ((c >= L'A') && (c <= L'Z')) ||
+                        ((c >= L'0') && (c <= L'9')))
+                    {
+                        //
+                        // Character classes, assertions, and control
+                        // characters end the run. Escapes which take an
+                        // argument (\x, \p, back references, etc.) are not
+                        // parsed, the pattern is left unfiltered.
+                        //
+                        if (!wcschr(L"dDwWsSbBAzZGhHvVRXKtnrfeaE", c))
+                        {
+                            *LiteralLength = 0;
+                            return FALSE;
+                        }
+
+                        if (!depth)
+                        {
+                            AVrfpRegexEndRun(run, &runLength, Literal, LiteralLength);
+                        }
+
+                        continue;
+                    }
+
+                    break;
+                }
+                case L'|':
+                {
+                    if (!depth)
+                    {
+                        //
+                        // Alternatives at the top level, nothing is required.
+                        //
+                        *LiteralLength = 0;
+                        return FALSE;
+                    }
+
+                    continue;
+                }
+                case L'(':
+                {
+                    if (((i + 1) < length) && (Pattern->Buffer[i + 1] == L'?'))
+                    {
+                        *LiteralLength = 0;
+                        return FALSE;
+                    }
+
+                    if (!depth)
+                    {
+                        AVrfpRegexEndRun(run, &runLength, Literal, LiteralLength);
+                    }
+
+                    depth++;
+                    continue;
+                }
+                case L')':
+                {
+                    if (!depth)
+                    {
+                        *LiteralLength = 0;
+                        return FALSE;
+                    }
+
+                    depth--;
+                    continue;
+                }
+                case L'[':
+                {
+                    if (!depth)
+                    {
+                        AVrfpRegexEndRun(run, &runLength, Literal, LiteralLength);
+                    }
+
+                    i = AVrfpRegexSkipClass(Pattern, i);
+                    continue;
+                }
+                case L'.':
+                case L'^':
+                case L'$':
+                case L'+':
+                {
+                    if (!depth)
+                    {
+                        AVrfpRegexEndRun(run, &runLength, Literal, LiteralLength);
+                    }
+
+                    continue;
+                }
+                case L'*':
+                case L'?':
+                case L'{':
+                {
+                    if (!depth)
+                    {
+                        //
+                        // The preceding atom may not occur at all.
+                        //
+                        if (runLength)
+                        {
+                            runLength--;
+                        }
+
+                        AVrfpRegexEndRun(run, &runLength, Literal, LiteralLength);
+                    }
+
+                    if (c == L'{')
+                    {
+                        while (((i + 1) < length) && (Pattern->Buffer[i] != L'}'))
+                        {
+                            i++;
+                        }
+                    }
+
+                    continue;
+                }
+                default:
+                {
+                    break;
+                }
+            }
+        }
+
+        if (depth)
+        {
+            continue;
+        }
+
+        //
+        // A literal character. When it is quantified the quantifier ends the
+        // run and takes it back off again if it is optional.
+        //
+        if (runLength >= ARRAYSIZE(run))
+        {
+            AVrfpRegexEndRun(run, &runLength, Literal, LiteralLength);
+        }
+
+        run[runLength++] = c;
+    }
+
+    if (depth || quoted)
+    {
+        *LiteralLength = 0;
+        return FALSE;
+    }
+
+    AVrfpRegexEndRun(run, &runLength, Literal, LiteralLength);
+
+    return (*LiteralLength >= VFDYNF_REGEX_PREFILTER_MIN_LITERAL);
+}
+
+ULONG AVrfpRegexPrefilterFindChild(
+    _In_ PVFDYNF_REGEX_PREFILTER Prefilter,
+    _In_ ULONG Node,
+    _In_ WCHAR Char
+    )
+{
+    ULONG child;
+
+    if (!Node && (Char < VFDYNF_REGEX_PREFILTER_ASCII))
+    {
+        return Prefilter->RootAscii[Char];
+    }
+
+    for (child = Prefilter->Nodes[Node].Child;
+         child;
+         child = Prefilter->Nodes[child].Sibling)
+    {
+        if (Prefilter->Nodes[child].Char == Char)
+        {
+            return child;
+        }
+    }
+
+    return 0;
+}
+
+VOID AVrfpRegexPrefilterInsert(
+    _Inout_ PVFDYNF_REGEX_PREFILTER Prefilter,
+    _In_reads_(LiteralLength) PWCHAR Literal,
+    _In_ ULONG LiteralLength,
+    _In_ ULONG PatternIndex
+    )
+{
+    ULONG node;
+
+    node = 0;
+
+    for (ULONG i = 0; i < LiteralLength; i++)
+    {
+        ULONG child;
+
+        child = AVrfpRegexPrefilterFindChild(Prefilter, node, Literal[i]);
+        if (!child)
+        {
+            PVFDYNF_REGEX_PREFILTER_NODE entry;
+
+            child = Prefilter->NodeCount++;
+
+            entry = &Prefilter->Nodes[child];
+            entry->Char = Literal[i];
+            entry->Child = 0;
+            entry->Sibling = Prefilter->Nodes[node].Child;
+            entry->Fail = 0;
+            entry->OutputLink = 0;
+            entry->Pattern = VFDYNF_REGEX_PREFILTER_NO_PATTERN;
+
+            Prefilter->Nodes[node].Child = child;
+
+            if (!node && (Literal[i] < VFDYNF_REGEX_PREFILTER_ASCII))
+            {
+                Prefilter->RootAscii[Literal[i]] = child;
+            }
+        }
+
+        node = child;
+    }
+
+    Prefilter->NextPattern[PatternIndex] = Prefilter->Nodes[node].Pattern;
+    Prefilter->Nodes[node].Pattern = PatternIndex;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpRegexPrefilterLink(
+    _Inout_ PVFDYNF_REGEX_PREFILTER Prefilter
+    )
+{
+    PULONG queue;
+    ULONG head;
+    ULONG tail;
+
+    //
+    // Breadth first so the failure link of every shallower node is known
+    // before it is needed.
+    //
+    queue = RtlAllocateHeap(RtlProcessHeap(),
+                            0,
+                            Prefilter->NodeCount * sizeof(ULONG));
+    if (!queue)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    head = 0;
+    tail = 0;
+
+    for (ULONG child = Prefilter->Nodes[0].Child;
+         child;
+         child = Prefilter->Nodes[child].Sibling)
+    {
+        queue[tail++] = child;
+    }
+
+    while (head < tail)
+    {
+        ULONG node;
+
+        node = queue[head++];
+
+        for (ULONG child = Prefilter->Nodes[node].Child;
+             child;
+             child = Prefilter->Nodes[child].Sibling)
+        {
+            PVFDYNF_REGEX_PREFILTER_NODE entry;
+            ULONG fail;
+
+            entry = &Prefilter->Nodes[child];
+            fail = Prefilter->Nodes[node].Fail;
+
+            for (;;)
+            {
+                ULONG next;
+
+                next = AVrfpRegexPrefilterFindChild(Prefilter, fail, entry->Char);
+                if (next)
+                {
+                    entry->Fail = next;
+                    break;
+                }
+
+                if (!fail)
+                {
+                    entry->Fail = 0;
+                    break;
+                }
+
+                fail = Prefilter->Nodes[fail].Fail;
+            }
+
+            if (Prefilter->Nodes[entry->Fail].Pattern != VFDYNF_REGEX_PREFILTER_NO_PATTERN)
+            {
+                entry->OutputLink = entry->Fail;
+            }
+            else
+            {
+                entry->OutputLink = Prefilter->Nodes[entry->Fail].OutputLink;
+            }
+
+            queue[tail++] = child;
+        }
+    }
+
+    RtlFreeHeap(RtlProcessHeap(), 0, queue);
+
+    return STATUS_SUCCESS;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfCreateRegexPrefilter(
+    _In_reads_(Count) PCUNICODE_STRING Patterns,
+    _In_ ULONG Count,
+    _Outptr_result_maybenull_ PVFDYNF_REGEX_PREFILTER* Prefilter
+    )
+{
+    NTSTATUS status;
+    PVFDYNF_REGEX_PREFILTER prefilter;
+    WCHAR literal[VFDYNF_REGEX_PREFILTER_MAX_LITERAL];
+    ULONG literalLength;
+    ULONG nodeCount;
+    ULONG filtered;
+
+    *Prefilter = NULL;
+
+    Count = min(Count, VFDYNF_REGEX_PREFILTER_MAX_PATTERNS);
+
+    nodeCount = 1;
+    filtered = 0;
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        if (AVrfpRegexRequiredLiteral(&Patterns[i], literal, &literalLength))
+        {
+            nodeCount += literalLength;
+            filtered++;
+        }
+    }
+
+    if (!filtered)
+    {
+        //
+        // Nothing to filter, every pattern is always run.
+        //
+        return STATUS_SUCCESS;
+    }
+
+    prefilter = RtlAllocateHeap(RtlProcessHeap(),
+                                HEAP_ZERO_MEMORY,
+                                (sizeof(VFDYNF_REGEX_PREFILTER) +
+                                 (Count * sizeof(ULONG)) +
+                                 (nodeCount * sizeof(VFDYNF_REGEX_PREFILTER_NODE))));
+    if (!prefilter)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    prefilter->PatternCount = Count;
+    prefilter->NextPattern = Add2Ptr(prefilter, sizeof(VFDYNF_REGEX_PREFILTER));
+    prefilter->Nodes = Add2Ptr(prefilter->NextPattern, Count * sizeof(ULONG));
+
+    prefilter->Nodes[0].Pattern = VFDYNF_REGEX_PREFILTER_NO_PATTERN;
+    prefilter->NodeCount = 1;
+
+    for (ULONG i = 0; i < Count; i++)
+    {
+        if (AVrfpRegexRequiredLiteral(&Patterns[i], literal, &literalLength))
+        {
+            AVrfpRegexPrefilterInsert(prefilter, literal, literalLength, i);
+        }
+        else
+        {
+            _bittestandset((PLONG)&prefilter->Unfiltered[i / 32], i % 32);
+        }
+    }
+
+    AVRF_ASSERT(prefilter->NodeCount <= nodeCount);
+
+    status = AVrfpRegexPrefilterLink(prefilter);
+    if (!NT_SUCCESS(status))
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, prefilter);
+        return status;
+    }
+
+    AVrfDbgPrint(DPFLTR_INFO_LEVEL,
+                 "regex prefilter %lu of %lu patterns, %lu nodes",
+                 filtered,
+                 Count,
+                 prefilter->NodeCount);
+
+    *Prefilter = prefilter;
+
+    return STATUS_SUCCESS;
+}
+
+VOID AVrfFreeRegexPrefilter(
+    _In_ PVFDYNF_REGEX_PREFILTER Prefilter
+    )
+{
+    RtlFreeHeap(RtlProcessHeap(), 0, Prefilter);
+}
+
+VOID AVrfRegexPrefilterScan(
+    _In_ PVFDYNF_REGEX_PREFILTER Prefilter,
+    _In_ PCUNICODE_STRING String,
+    _Out_writes_(VFDYNF_REGEX_PREFILTER_BITMAP_SIZE) PULONG Candidates
+    )
+{
+    ULONG length;
+    ULONG node;
+
+    RtlCopyMemory(Candidates,
+                  Prefilter->Unfiltered,
+                  sizeof(Prefilter->Unfiltered));
+
+    length = (String->Length / sizeof(WCHAR));
+    node = 0;
+
+    for (ULONG i = 0; i < length; i++)
+    {
+        WCHAR c;
+        ULONG output;
+
+        c = String->Buffer[i];
+
+        for (;;)
+        {
+            ULONG next;
+
+            next = AVrfpRegexPrefilterFindChild(Prefilter, node, c);
+            if (next)
+            {
+                node = next;
+                break;
+            }
+
+            if (!node)
+            {
+                break;
+            }
+
+            node = Prefilter->Nodes[node].Fail;
+        }
+
+        if (Prefilter->Nodes[node].Pattern != VFDYNF_REGEX_PREFILTER_NO_PATTERN)
+        {
+            output = node;
+        }
+        else
+        {
+            output = Prefilter->Nodes[node].OutputLink;
+        }
+
+        for (; output; output = Prefilter->Nodes[output].OutputLink)
+        {
+            for (ULONG pattern = Prefilter->Nodes[output].Pattern;
+                 pattern != VFDYNF_REGEX_PREFILTER_NO_PATTERN;
+                 pattern = Prefilter->NextPattern[pattern])
+            {
+                _bittestandset((PLONG)&Candidates[pattern / 32], pattern % 32);
+            }
+        }
+    }
+}
+
+BOOLEAN AVrfRegexPrefilterIsCandidate(
+    _In_ PVFDYNF_REGEX_PREFILTER Prefilter,
+    _In_reads_(VFDYNF_REGEX_PREFILTER_BITMAP_SIZE) PULONG Candidates,
+    _In_ ULONG Index
+    )
+{
+    if (Index >= Prefilter->PatternCount)
+    {
+        return TRUE;
+    }
+
+    return BooleanFlagOn(Candidates[Index / 32], (1ul << (Index % 32)));
+}
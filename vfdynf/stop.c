@@ -26,7 +26,15 @@ BOOLEAN NTAPI AVrfpVerifierStopModuleEnumCallback(
     {
         if (AVrfpStopRegex)
         {
-            context->Result = Pcre2Match(AVrfpStopRegex, &Module->BaseName);
+            BOOLEAN match;
+
+            //
+            // A module the expression has no verdict for does not stop.
+            //
+            context->Result = (NT_SUCCESS(AVrfMatchRegex(AVrfpStopRegex,
+                                                         &Module->BaseName,
+                                                         &match)) &&
+                               match);
         }
         else
         {
@@ -75,7 +83,7 @@ BOOLEAN AVrfStopProcessAttach(
         return TRUE;
     }
 
-    status = Pcre2Compile(&AVrfpStopRegex, &pattern);
+    status = AVrfCompileRegex(&AVrfpStopRegex, &pattern);
     if (!NT_SUCCESS(status))
     {
         AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
@@ -95,7 +103,7 @@ VOID AVrfStopProcessDetach(
 {
     if (AVrfpStopRegex)
     {
-        Pcre2Close(AVrfpStopRegex);
+        AVrfCloseRegex(AVrfpStopRegex);
         AVrfpStopRegex = NULL;
     }
 }
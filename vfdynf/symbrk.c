@@ -0,0 +1,555 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <vfdynf.h>
+#include <vfsymsrv.h>
+
+#define VFDYNF_SYM_BROKER_RETRY_PERIOD 10000
+
+typedef struct _VFDYNF_SYM_BROKER_MODULE
+{
+    PVOID BaseAddress;
+    PVOID EndAddress;
+    UNICODE_STRING BaseName;
+    WCHAR BaseNameBuffer[MAX_PATH];
+} VFDYNF_SYM_BROKER_MODULE, *PVFDYNF_SYM_BROKER_MODULE;
+
+typedef struct _VFDYNF_SYM_BROKER_ENUM_CONTEXT
+{
+    PVOID Frame;
+    PVFDYNF_SYM_BROKER_MODULE Module;
+    PVFSYMSRV_MODULE Identity;
+} VFDYNF_SYM_BROKER_ENUM_CONTEXT, *PVFDYNF_SYM_BROKER_ENUM_CONTEXT;
+
+//
+// N.B. There is one connection to the broker, symbol workers take turns using
+// it under the lock.
+//
+typedef struct _VFDYNF_SYM_BROKER_CONTEXT
+{
+    RTL_SRWLOCK Lock;
+    HANDLE PipeHandle;
+    HANDLE Event;
+    ULONG64 NextConnect;
+    PVOID Request;
+    PVOID Response;
+    VFDYNF_SYM_BROKER_MODULE Modules[VFSYMSRV_MAX_FRAMES];
+    WCHAR SymbolBuffer[MAX_PATH + VFSYMSRV_MAX_NAME + 2];
+} VFDYNF_SYM_BROKER_CONTEXT, *PVFDYNF_SYM_BROKER_CONTEXT;
+
+static VFDYNF_SYM_BROKER_CONTEXT AVrfpSymBrokerContext =
+{
+    .Lock = RTL_SRWLOCK_INIT,
+    .PipeHandle = NULL,
+    .Event = NULL,
+    .NextConnect = 0,
+    .Request = NULL,
+    .Response = NULL,
+    .Modules = { 0 },
+    .SymbolBuffer = { 0 },
+};
+
+VOID AVrfpSymBrokerDisconnect(
+    _In_ BOOLEAN Retry
+    )
+{
+    if (AVrfpSymBrokerContext.PipeHandle)
+    {
+        NtClose(AVrfpSymBrokerContext.PipeHandle);
+        AVrfpSymBrokerContext.PipeHandle = NULL;
+    }
+
+    if (Retry)
+    {
+        AVrfpSymBrokerContext.NextConnect = (NtGetTickCount64() +
+                                             VFDYNF_SYM_BROKER_RETRY_PERIOD);
+    }
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpSymBrokerConnect(
+    VOID
+    )
+{
+    NTSTATUS status;
+    WCHAR buffer[MAX_PATH + 16];
+    UNICODE_STRING pipeName;
+    OBJECT_ATTRIBUTES objectAttributes;
+    IO_STATUS_BLOCK ioStatusBlock;
+    FILE_PIPE_INFORMATION pipeInfo;
+
+    if (AVrfpSymBrokerContext.PipeHandle)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (NtGetTickCount64() < AVrfpSymBrokerContext.NextConnect)
+    {
+        //
+        // Do not hammer a broker that is not running, retry periodically.
+        //
+        return STATUS_PIPE_NOT_AVAILABLE;
+    }
+
+    if (!AVrfpSymBrokerContext.Event)
+    {
+        status = NtCreateEvent(&AVrfpSymBrokerContext.Event,
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               NotificationEvent,
+                               FALSE);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    if (!AVrfpSymBrokerContext.Request)
+    {
+        AVrfpSymBrokerContext.Request = RtlAllocateHeap(RtlProcessHeap(),
+                                                        0,
+                                                        VFSYMSRV_MAX_REQUEST_SIZE);
+        if (!AVrfpSymBrokerContext.Request)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    if (!AVrfpSymBrokerContext.Response)
+    {
+        AVrfpSymBrokerContext.Response = RtlAllocateHeap(RtlProcessHeap(),
+                                                         0,
+                                                         VFSYMSRV_MAX_RESPONSE_SIZE);
+        if (!AVrfpSymBrokerContext.Response)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    pipeName.Buffer = buffer;
+    pipeName.Length = 0;
+    pipeName.MaximumLength = sizeof(buffer);
+
+    status = RtlAppendUnicodeToString(&pipeName, L"\\??\\pipe\\");
+    if (NT_SUCCESS(status))
+    {
+        status = RtlAppendUnicodeToString(&pipeName,
+                                          AVrfProperties.SymBrokerPipeName);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        AVrfpSymBrokerDisconnect(TRUE);
+        return status;
+    }
+
+    InitializeObjectAttributes(&objectAttributes,
+                               &pipeName,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    status = NtCreateFile(&AVrfpSymBrokerContext.PipeHandle,
+                          FILE_GENERIC_READ | FILE_GENERIC_WRITE,
+                          &objectAttributes,
+                          &ioStatusBlock,
+                          NULL,
+                          0,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE,
+                          FILE_OPEN,
+                          FILE_NON_DIRECTORY_FILE,
+                          NULL,
+                          0);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfpSymBrokerContext.PipeHandle = NULL;
+        AVrfpSymBrokerDisconnect(TRUE);
+        return status;
+    }
+
+    pipeInfo.ReadMode = FILE_PIPE_MESSAGE_MODE;
+    pipeInfo.CompletionMode = FILE_PIPE_QUEUE_OPERATION;
+
+    status = NtSetInformationFile(AVrfpSymBrokerContext.PipeHandle,
+                                  &ioStatusBlock,
+                                  &pipeInfo,
+                                  sizeof(pipeInfo),
+                                  FilePipeInformation);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfpSymBrokerDisconnect(TRUE);
+        return status;
+    }
+
+    AVrfDbgPrint(DPFLTR_INFO_LEVEL,
+                 "connected to symbol broker %ls",
+                 AVrfProperties.SymBrokerPipeName);
+
+    return STATUS_SUCCESS;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpSymBrokerIo(
+    _In_ BOOLEAN Write,
+    _In_ PVOID Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG Transferred
+    )
+{
+    NTSTATUS status;
+    IO_STATUS_BLOCK ioStatusBlock;
+    LARGE_INTEGER timeout;
+
+    *Transferred = 0;
+
+    NtResetEvent(AVrfpSymBrokerContext.Event, NULL);
+
+    if (Write)
+    {
+        status = NtWriteFile(AVrfpSymBrokerContext.PipeHandle,
+                             AVrfpSymBrokerContext.Event,
+                             NULL,
+                             NULL,
+                             &ioStatusBlock,
+                             Buffer,
+                             Length,
+                             NULL,
+                             NULL);
+    }
+    else
+    {
+        status = NtReadFile(AVrfpSymBrokerContext.PipeHandle,
+                            AVrfpSymBrokerContext.Event,
+                            NULL,
+                            NULL,
+                            &ioStatusBlock,
+                            Buffer,
+                            Length,
+                            NULL,
+                            NULL);
+    }
+
+    if (status == STATUS_PENDING)
+    {
+        timeout.QuadPart = (-10000LL * AVrfProperties.SymResolveTimeout);
+
+        status = NtWaitForSingleObject(AVrfpSymBrokerContext.Event,
+                                       FALSE,
+                                       &timeout);
+        if (status != STATUS_SUCCESS)
+        {
+            IO_STATUS_BLOCK cancelStatusBlock;
+
+            //
+            // The broker is not responding. Cancel and wait for the operation
+            // to finish before the buffer is reused.
+            //
+            NtCancelIoFile(AVrfpSymBrokerContext.PipeHandle,
+                           &cancelStatusBlock);
+            NtWaitForSingleObject(AVrfpSymBrokerContext.Event, FALSE, NULL);
+
+            return STATUS_IO_TIMEOUT;
+        }
+
+        status = ioStatusBlock.Status;
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        *Transferred = (ULONG)ioStatusBlock.Information;
+    }
+
+    return status;
+}
+
+_Function_class_(AVRF_MODULE_ENUM_CALLBACK)
+BOOLEAN NTAPI AVrfpSymBrokerModuleEnumCallback(
+    _In_ PAVRF_MODULE_ENTRY Module,
+    _In_ PVOID Context
+    )
+{
+    PVFDYNF_SYM_BROKER_ENUM_CONTEXT context;
+    PIMAGE_NT_HEADERS ntHeaders;
+
+    context = Context;
+
+    if ((context->Frame < Module->BaseAddress) ||
+        (context->Frame >= Module->EndAddress))
+    {
+        return FALSE;
+    }
+
+    if (!NT_SUCCESS(RtlImageNtHeaderEx(0,
+                                       Module->BaseAddress,
+                                       PtrOffset(Module->BaseAddress,
+                                                 Module->EndAddress),
+                                       &ntHeaders)))
+    {
+        return FALSE;
+    }
+
+    context->Module->BaseAddress = Module->BaseAddress;
+    context->Module->EndAddress = Module->EndAddress;
+    context->Module->BaseName.Length = 0;
+    context->Module->BaseName.MaximumLength = sizeof(context->Module->BaseNameBuffer);
+    context->Module->BaseName.Buffer = context->Module->BaseNameBuffer;
+
+    RtlCopyUnicodeString(&context->Module->BaseName, &Module->BaseName);
+
+    RtlZeroMemory(context->Identity, sizeof(VFSYMSRV_MODULE));
+
+    context->Identity->TimeDateStamp = ntHeaders->FileHeader.TimeDateStamp;
+    context->Identity->SizeOfImage = ntHeaders->OptionalHeader.SizeOfImage;
+
+    RtlCopyMemory(context->Identity->FullName,
+                  Module->FullName.Buffer,
+                  min(Module->FullName.Length,
+                      sizeof(context->Identity->FullName) - sizeof(WCHAR)));
+
+    return TRUE;
+}
+
+BOOLEAN AVrfSymBrokerEnabled(
+    VOID
+    )
+{
+    return (AVrfProperties.SymBrokerPipeName[0] != L'\0');
+}
+
+_Requires_exclusive_lock_held_(AVrfpSymBrokerContext.Lock)
+NTSTATUS AVrfpSymBrokerResolve(
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount,
+    _In_ PAVRF_SYM_BROKER_CALLBACK Callback,
+    _In_opt_ PVOID Context
+    )
+{
+    NTSTATUS status;
+    PVFSYMSRV_REQUEST_HEADER request;
+    PVFSYMSRV_MODULE modules;
+    PVFSYMSRV_FRAME frames;
+    PVFSYMSRV_RESPONSE_HEADER response;
+    ULONG moduleCount;
+    ULONG length;
+    ULONG offset;
+
+    status = AVrfpSymBrokerConnect();
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    FramesCount = min(FramesCount, VFSYMSRV_MAX_FRAMES);
+
+    //
+    // Frames are sent as a module and RVA. The module table is written in
+    // place after the header and then the frames are moved down behind it.
+    // Frames are staged at the end of the buffer in the meantime.
+    //
+    request = AVrfpSymBrokerContext.Request;
+    modules = Add2Ptr(request, sizeof(VFSYMSRV_REQUEST_HEADER));
+    frames = Add2Ptr(request,
+                     (VFSYMSRV_MAX_REQUEST_SIZE -
+                      (VFSYMSRV_MAX_FRAMES * sizeof(VFSYMSRV_FRAME))));
+
+    moduleCount = 0;
+
+    for (ULONG i = 0; i < FramesCount; i++)
+    {
+        VFDYNF_SYM_BROKER_ENUM_CONTEXT context;
+
+        frames[i].ModuleIndex = VFSYMSRV_NO_MODULE;
+        frames[i].Rva = 0;
+
+        for (ULONG j = 0; j < moduleCount; j++)
+        {
+            PVFDYNF_SYM_BROKER_MODULE module;
+
+            module = &AVrfpSymBrokerContext.Modules[j];
+
+            if ((Frames[i] >= module->BaseAddress) &&
+                (Frames[i] < module->EndAddress))
+            {
+                frames[i].ModuleIndex = j;
+                frames[i].Rva = PtrOffset(module->BaseAddress, Frames[i]);
+                break;
+            }
+        }
+
+        if (frames[i].ModuleIndex != VFSYMSRV_NO_MODULE)
+        {
+            continue;
+        }
+
+        context.Frame = Frames[i];
+        context.Module = &AVrfpSymBrokerContext.Modules[moduleCount];
+        context.Identity = &modules[moduleCount];
+
+        if (AVrfEnumLoadedModules(AVrfpSymBrokerModuleEnumCallback, &context))
+        {
+            frames[i].ModuleIndex = moduleCount;
+            frames[i].Rva = PtrOffset(context.Module->BaseAddress, Frames[i]);
+            moduleCount++;
+        }
+    }
+
+    request->Magic = VFSYMSRV_MAGIC;
+    request->Version = VFSYMSRV_VERSION;
+    request->ModuleCount = moduleCount;
+    request->FrameCount = FramesCount;
+
+    RtlMoveMemory(&modules[moduleCount],
+                  frames,
+                  FramesCount * sizeof(VFSYMSRV_FRAME));
+
+    length = (sizeof(VFSYMSRV_REQUEST_HEADER) +
+              (moduleCount * sizeof(VFSYMSRV_MODULE)) +
+              (FramesCount * sizeof(VFSYMSRV_FRAME)));
+
+    status = AVrfpSymBrokerIo(TRUE, request, length, &length);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                     "failed to send symbol broker request (0x%08x)",
+                     status);
+
+        AVrfpSymBrokerDisconnect(TRUE);
+        return status;
+    }
+
+    response = AVrfpSymBrokerContext.Response;
+
+    status = AVrfpSymBrokerIo(FALSE,
+                              response,
+                              VFSYMSRV_MAX_RESPONSE_SIZE,
+                              &length);
+    if (!NT_SUCCESS(status))
+    {
+        AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                     "failed to receive symbol broker response (0x%08x)",
+                     status);
+
+        AVrfpSymBrokerDisconnect(TRUE);
+        return status;
+    }
+
+    if ((length < sizeof(VFSYMSRV_RESPONSE_HEADER)) ||
+        (response->Magic != VFSYMSRV_MAGIC) ||
+        (response->Version != VFSYMSRV_VERSION) ||
+        (response->FrameCount != FramesCount))
+    {
+        AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "invalid symbol broker response");
+
+        AVrfpSymBrokerDisconnect(TRUE);
+        return STATUS_INVALID_NETWORK_RESPONSE;
+    }
+
+    //
+    // N.B. The frame table is still intact in the request buffer.
+    //
+    frames = (PVFSYMSRV_FRAME)&modules[moduleCount];
+    offset = sizeof(VFSYMSRV_RESPONSE_HEADER);
+
+    for (ULONG i = 0; i < FramesCount; i++)
+    {
+        USHORT nameLength;
+        UNICODE_STRING name;
+        UNICODE_STRING symbol;
+
+        if ((length - offset) < sizeof(USHORT))
+        {
+            status = STATUS_INVALID_NETWORK_RESPONSE;
+            break;
+        }
+
+        nameLength = *(PUSHORT)Add2Ptr(response, offset);
+        offset += sizeof(USHORT);
+
+        if (((length - offset) < nameLength) ||
+            (nameLength > (VFSYMSRV_MAX_NAME * sizeof(WCHAR))) ||
+            (nameLength % sizeof(WCHAR)))
+        {
+            status = STATUS_INVALID_NETWORK_RESPONSE;
+            break;
+        }
+
+        name.Length = nameLength;
+        name.MaximumLength = nameLength;
+        name.Buffer = Add2Ptr(response, offset);
+
+        offset += nameLength;
+
+        if (!nameLength || (frames[i].ModuleIndex == VFSYMSRV_NO_MODULE))
+        {
+            continue;
+        }
+
+        symbol.Length = 0;
+        symbol.MaximumLength = sizeof(AVrfpSymBrokerContext.SymbolBuffer);
+        symbol.Buffer = AVrfpSymBrokerContext.SymbolBuffer;
+
+        RtlAppendUnicodeStringToString(&symbol,
+                                       &AVrfpSymBrokerContext.Modules[frames[i].ModuleIndex].BaseName);
+        RtlAppendUnicodeToString(&symbol, L"!");
+        RtlAppendUnicodeStringToString(&symbol, &name);
+
+        Callback(Frames[i], &symbol, Context);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        AVrfDbgPuts(DPFLTR_ERROR_LEVEL, "malformed symbol broker response");
+
+        AVrfpSymBrokerDisconnect(TRUE);
+    }
+
+    return status;
+}
+
+NTSTATUS AVrfSymBrokerResolve(
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount,
+    _In_ PAVRF_SYM_BROKER_CALLBACK Callback,
+    _In_opt_ PVOID Context
+    )
+{
+    NTSTATUS status;
+
+    if (!AVrfSymBrokerEnabled())
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    RtlAcquireSRWLockExclusive(&AVrfpSymBrokerContext.Lock);
+
+    status = AVrfpSymBrokerResolve(Frames, FramesCount, Callback, Context);
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymBrokerContext.Lock);
+
+    return status;
+}
+
+VOID AVrfSymBrokerCleanup(
+    VOID
+    )
+{
+    AVrfpSymBrokerDisconnect(FALSE);
+
+    if (AVrfpSymBrokerContext.Event)
+    {
+        NtClose(AVrfpSymBrokerContext.Event);
+        AVrfpSymBrokerContext.Event = NULL;
+    }
+
+    if (AVrfpSymBrokerContext.Request)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, AVrfpSymBrokerContext.Request);
+        AVrfpSymBrokerContext.Request = NULL;
+    }
+
+    if (AVrfpSymBrokerContext.Response)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, AVrfpSymBrokerContext.Response);
+        AVrfpSymBrokerContext.Response = NULL;
+    }
+}
@@ -0,0 +1,593 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <vfdynf.h>
+#include <delayld.h>
+
+//
+// Exclusion ranges. Exclusion expressions which can only match within a
+// single frame (see AVrfpIsFrameLocalPattern) are compiled ahead of time into
+// sorted RVA ranges per module. When a module is loaded its symbols are
+// enumerated once and each "module!symbol" is matched against the frame local
+// expressions of every fault type. Classifying a stack for those expressions
+// is then a range lookup per frame, with no symbol resolution, stack string,
+// or regex.
+//
+// Frames the ranges do not cover (unknown modules or addresses outside of any
+// enumerated symbol) make the verdict unknown and the caller falls back to
+// matching the full stack.
+//
+
+#define VFDYNF_SYM_EXCL_TAG_FUNCTION    5  // SymTagFunction
+#define VFDYNF_SYM_EXCL_TAG_PUBLIC      10 // SymTagPublicSymbol
+#define VFDYNF_SYM_EXCL_INITIAL_SYMBOLS 1024
+
+typedef struct _VFDYNF_SYM_EXCL_SYMBOL
+{
+    ULONG Rva;
+    ULONG Size;
+    ULONG Mask;
+    BOOLEAN Public;
+} VFDYNF_SYM_EXCL_SYMBOL, *PVFDYNF_SYM_EXCL_SYMBOL;
+
+typedef struct _VFDYNF_SYM_EXCL_RANGE
+{
+    ULONG StartRva;
+    ULONG EndRva;
+    ULONG Mask;
+} VFDYNF_SYM_EXCL_RANGE, *PVFDYNF_SYM_EXCL_RANGE;
+
+typedef struct _VFDYNF_SYM_EXCL_MODULE
+{
+    LIST_ENTRY Links;
+    PVOID BaseAddress;
+    PVOID EndAddress;
+    ULONG ModuleMask;
+    ULONG Count;
+    VFDYNF_SYM_EXCL_RANGE Ranges[ANYSIZE_ARRAY];
+} VFDYNF_SYM_EXCL_MODULE, *PVFDYNF_SYM_EXCL_MODULE;
+
+typedef struct _VFDYNF_SYM_EXCL_ENUM_CONTEXT
+{
+    PVOID BaseAddress;
+    SIZE_T Size;
+    PCUNICODE_STRING BaseName;
+    BOOLEAN HasFrameExclusions;
+    BOOLEAN HasFunctions;
+    BOOLEAN Failed;
+    BOOLEAN NoVerdict;
+    ULONG Count;
+    ULONG Capacity;
+    PVFDYNF_SYM_EXCL_SYMBOL Symbols;
+    WCHAR Buffer[MAX_PATH + MAX_SYM_NAME + 2];
+    BYTE SymbolInfoBuffer[sizeof(SYMBOL_INFOW) + ((MAX_SYM_NAME + 1) * sizeof(WCHAR))];
+} VFDYNF_SYM_EXCL_ENUM_CONTEXT, *PVFDYNF_SYM_EXCL_ENUM_CONTEXT;
+
+typedef struct _VFDYNF_SYM_EXCL_CONTEXT
+{
+    RTL_SRWLOCK Lock;
+    LIST_ENTRY Modules;
+} VFDYNF_SYM_EXCL_CONTEXT, *PVFDYNF_SYM_EXCL_CONTEXT;
+
+static VFDYNF_SYM_EXCL_CONTEXT AVrfpSymExclContext =
+{
+    .Lock = RTL_SRWLOCK_INIT,
+    .Modules = { &AVrfpSymExclContext.Modules, &AVrfpSymExclContext.Modules },
+};
+
+int __cdecl AVrfpSymExclCompare(
+    _In_ const void* Left,
+    _In_ const void* Right
+    )
+{
+    const VFDYNF_SYM_EXCL_SYMBOL* left = Left;
+    const VFDYNF_SYM_EXCL_SYMBOL* right = Right;
+
+    if (left->Rva < right->Rva)
+    {
+        return -1;
+    }
+
+    if (left->Rva > right->Rva)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+_Requires_lock_held_(AVrfpSymExclContext.Lock)
+PVFDYNF_SYM_EXCL_MODULE AVrfpSymExclLookupModule(
+    _In_ PVOID Address
+    )
+{
+    for (PLIST_ENTRY entry = AVrfpSymExclContext.Modules.Flink;
+         entry != &AVrfpSymExclContext.Modules;
+         entry = entry->Flink)
+    {
+        PVFDYNF_SYM_EXCL_MODULE module;
+
+        module = CONTAINING_RECORD(entry, VFDYNF_SYM_EXCL_MODULE, Links);
+
+        if ((Address >= module->BaseAddress) && (Address < module->EndAddress))
+        {
+            return module;
+        }
+    }
+
+    return NULL;
+}
+
+_Requires_exclusive_lock_held_(AVrfpSymExclContext.Lock)
+VOID AVrfpSymExclRemoveModule(
+    _In_ PVOID BaseAddress
+    )
+{
+    PVFDYNF_SYM_EXCL_MODULE module;
+
+    module = AVrfpSymExclLookupModule(BaseAddress);
+    if (module)
+    {
+        RemoveEntryList(&module->Links);
+        RtlFreeHeap(RtlProcessHeap(), 0, module);
+    }
+}
+
+ULONG AVrfpSymExclClassify(
+    _Inout_ PVFDYNF_SYM_EXCL_ENUM_CONTEXT Context,
+    _In_opt_z_ PCWSTR Name
+    )
+{
+    UNICODE_STRING symbol;
+    BOOLEAN cacheable;
+    ULONG mask;
+
+    if (!Context->HasFrameExclusions)
+    {
+        return 0;
+    }
+
+    //
+    // Build the frame exactly as the symbol provider would, "module!symbol".
+    //
+    symbol.Length = 0;
+    symbol.MaximumLength = sizeof(Context->Buffer);
+    symbol.Buffer = Context->Buffer;
+
+    RtlAppendUnicodeStringToString(&symbol, Context->BaseName);
+    RtlAppendUnicodeToString(&symbol, L"!");
+
+    if (Name)
+    {
+        RtlAppendUnicodeToString(&symbol, Name);
+    }
+
+    mask = AVrfFaultFrameExclusionMask(&symbol, &cacheable);
+    if (!cacheable)
+    {
+        //
+        // An expression had no verdict for the symbol. The ranges are kept
+        // for the life of the module, do not build them, frames fall back to
+        // matching the stack.
+        //
+        Context->NoVerdict = TRUE;
+    }
+
+    return mask;
+}
+
+_Success_(return != FALSE)
+BOOLEAN AVrfpSymExclClassifyAlias(
+    _Inout_ PVFDYNF_SYM_EXCL_ENUM_CONTEXT Context,
+    _In_ ULONG Rva,
+    _Out_ PULONG Mask
+    )
+{
+    PSYMBOL_INFOW info;
+    ULONG64 disp;
+
+    //
+    // Identical functions may be folded to one address. A frame there
+    // resolves to whichever of the names dbghelp returns for the address,
+    // classify that name only.
+    //
+    info = (PSYMBOL_INFOW)Context->SymbolInfoBuffer;
+
+    RtlZeroMemory(info, sizeof(SYMBOL_INFOW));
+    info->SizeOfStruct = sizeof(SYMBOL_INFOW);
+    info->MaxNameLen = MAX_SYM_NAME;
+
+    if (!Delay_SymFromAddrW(NtCurrentProcess(),
+                            ((ULONG64)Context->BaseAddress + Rva),
+                            &disp,
+                            info))
+    {
+        return FALSE;
+    }
+
+    *Mask = AVrfpSymExclClassify(Context, info->Name);
+
+    return TRUE;
+}
+
+BOOL CALLBACK AVrfpSymExclEnumSymbolsCallback(
+    _In_ PSYMBOL_INFOW SymInfo,
+    _In_ ULONG SymbolSize,
+    _In_opt_ PVOID UserContext
+    )
+{
+    PVFDYNF_SYM_EXCL_ENUM_CONTEXT context;
+    PVFDYNF_SYM_EXCL_SYMBOL symbol;
+    ULONG64 rva;
+
+    context = UserContext;
+
+    if ((SymInfo->Tag != VFDYNF_SYM_EXCL_TAG_FUNCTION) &&
+        (SymInfo->Tag != VFDYNF_SYM_EXCL_TAG_PUBLIC))
+    {
+        return TRUE;
+    }
+
+    rva = (SymInfo->Address - (ULONG64)context->BaseAddress);
+    if ((SymInfo->Address < (ULONG64)context->BaseAddress) ||
+        (rva >= context->Size))
+    {
+        return TRUE;
+    }
+
+    if (context->Count >= context->Capacity)
+    {
+        PVOID symbols;
+        ULONG capacity;
+
+        capacity = (context->Capacity ?
+                    (context->Capacity * 2) :
+                    VFDYNF_SYM_EXCL_INITIAL_SYMBOLS);
+
+        if (context->Symbols)
+        {
+            symbols = RtlReAllocateHeap(RtlProcessHeap(),
+                                        0,
+                                        context->Symbols,
+                                        capacity * sizeof(VFDYNF_SYM_EXCL_SYMBOL));
+        }
+        else
+        {
+            symbols = RtlAllocateHeap(RtlProcessHeap(),
+                                      0,
+                                      capacity * sizeof(VFDYNF_SYM_EXCL_SYMBOL));
+        }
+
+        if (!symbols)
+        {
+            context->Failed = TRUE;
+            return FALSE;
+        }
+
+        context->Symbols = symbols;
+        context->Capacity = capacity;
+    }
+
+    symbol = &context->Symbols[context->Count++];
+
+    symbol->Rva = (ULONG)rva;
+    symbol->Size = SymbolSize;
+    symbol->Public = (SymInfo->Tag == VFDYNF_SYM_EXCL_TAG_PUBLIC);
+    symbol->Mask = AVrfpSymExclClassify(context, SymInfo->Name);
+
+    if (!symbol->Public)
+    {
+        context->HasFunctions = TRUE;
+    }
+
+    return TRUE;
+}
+
+_Must_inspect_result_
+PVFDYNF_SYM_EXCL_MODULE AVrfpSymExclBuildModule(
+    _Inout_ PVFDYNF_SYM_EXCL_ENUM_CONTEXT Context
+    )
+{
+    PVFDYNF_SYM_EXCL_MODULE module;
+    PVFDYNF_SYM_EXCL_RANGE range;
+    ULONG count;
+
+    //
+    // When private symbols are available the public symbols are duplicates
+    // of the functions, ignore them so the functions define the ranges.
+    //
+    count = 0;
+    for (ULONG i = 0; i < Context->Count; i++)
+    {
+        if (Context->HasFunctions && Context->Symbols[i].Public)
+        {
+            continue;
+        }
+
+        Context->Symbols[count++] = Context->Symbols[i];
+    }
+
+    qsort(Context->Symbols,
+          count,
+          sizeof(VFDYNF_SYM_EXCL_SYMBOL),
+          AVrfpSymExclCompare);
+
+    module = RtlAllocateHeap(RtlProcessHeap(),
+                             0,
+                             (FIELD_OFFSET(VFDYNF_SYM_EXCL_MODULE, Ranges) +
+                              (max(count, 1) * sizeof(VFDYNF_SYM_EXCL_RANGE))));
+    if (!module)
+    {
+        return NULL;
+    }
+
+    module->BaseAddress = Context->BaseAddress;
+    module->EndAddress = Add2Ptr(Context->BaseAddress, Context->Size);
+    module->ModuleMask = AVrfpSymExclClassify(Context, NULL);
+    module->Count = 0;
+
+    range = NULL;
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        PVFDYNF_SYM_EXCL_SYMBOL symbol;
+        ULONG startRva;
+        ULONG endRva;
+        ULONG nextRva;
+        ULONG mask;
+        BOOLEAN alias;
+
+        symbol = &Context->Symbols[i];
+        startRva = symbol->Rva;
+        mask = symbol->Mask;
+        endRva = (symbol->Size ? (startRva + symbol->Size) : 0);
+        alias = FALSE;
+
+        while (((i + 1) < count) && (Context->Symbols[i + 1].Rva == startRva))
+        {
+            i++;
+            alias = TRUE;
+            if (Context->Symbols[i].Size)
+            {
+                endRva = max(endRva, startRva + Context->Symbols[i].Size);
+            }
+        }
+
+        if (alias && !AVrfpSymExclClassifyAlias(Context, startRva, &mask))
+        {
+            //
+            // Leave the address uncovered, frames in it fall back to matching
+            // the stack.
+            //
+            range = NULL;
+            continue;
+        }
+
+        //
+        // Symbols without a size extend to the next symbol, as they would
+        // when resolving an address.
+        //
+        nextRva = (((i + 1) < count) ?
+                   Context->Symbols[i + 1].Rva :
+                   (ULONG)Context->Size);
+
+        if (!endRva || (endRva > nextRva))
+        {
+            endRva = nextRva;
+        }
+
+        if (range && (range->EndRva == startRva) && (range->Mask == mask))
+        {
+            range->EndRva = endRva;
+            continue;
+        }
+
+        range = &module->Ranges[module->Count++];
+
+        range->StartRva = startRva;
+        range->EndRva = endRva;
+        range->Mask = mask;
+    }
+
+    return module;
+}
+
+VOID AVrfSymExclTrackModule(
+    _In_ PVOID BaseAddress,
+    _In_ SIZE_T Size,
+    _In_ PCUNICODE_STRING BaseName
+    )
+{
+    PVFDYNF_SYM_EXCL_ENUM_CONTEXT context;
+    PVFDYNF_SYM_EXCL_MODULE module;
+
+    //
+    // N.B. This is called by the symbol provider with the dbghelp lock held
+    // after the module symbols are loaded.
+    //
+
+    module = NULL;
+
+    context = RtlAllocateHeap(RtlProcessHeap(),
+                              HEAP_ZERO_MEMORY,
+                              sizeof(VFDYNF_SYM_EXCL_ENUM_CONTEXT));
+    if (!context)
+    {
+        goto Exit;
+    }
+
+    if (!AVrfFaultPrepareFrameExclusions(&context->HasFrameExclusions))
+    {
+        goto Exit;
+    }
+
+    context->BaseAddress = BaseAddress;
+    context->Size = Size;
+    context->BaseName = BaseName;
+
+    if (!Delay_SymEnumSymbolsW(NtCurrentProcess(),
+                               (ULONG64)BaseAddress,
+                               L"*",
+                               AVrfpSymExclEnumSymbolsCallback,
+                               context) ||
+        context->Failed)
+    {
+        AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                     "failed to enumerate symbols for exclusion ranges %wZ",
+                     BaseName);
+        goto Exit;
+    }
+
+    module = AVrfpSymExclBuildModule(context);
+    if (!module)
+    {
+        goto Exit;
+    }
+
+    if (context->NoVerdict)
+    {
+        AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                     "no verdict for the module symbols, exclusion ranges not kept %wZ",
+                     BaseName);
+
+        RtlFreeHeap(RtlProcessHeap(), 0, module);
+        module = NULL;
+        goto Exit;
+    }
+
+    AVrfDbgPrint(DPFLTR_INFO_LEVEL,
+                 "compiled %lu exclusion ranges for %wZ",
+                 module->Count,
+                 BaseName);
+
+Exit:
+
+    RtlAcquireSRWLockExclusive(&AVrfpSymExclContext.Lock);
+
+    AVrfpSymExclRemoveModule(BaseAddress);
+
+    if (module)
+    {
+        InsertHeadList(&AVrfpSymExclContext.Modules, &module->Links);
+    }
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymExclContext.Lock);
+
+    if (context)
+    {
+        if (context->Symbols)
+        {
+            RtlFreeHeap(RtlProcessHeap(), 0, context->Symbols);
+        }
+
+        RtlFreeHeap(RtlProcessHeap(), 0, context);
+    }
+}
+
+VOID AVrfSymExclUntrackModule(
+    _In_ PVOID BaseAddress
+    )
+{
+    RtlAcquireSRWLockExclusive(&AVrfpSymExclContext.Lock);
+
+    AVrfpSymExclRemoveModule(BaseAddress);
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymExclContext.Lock);
+}
+
+ULONG AVrfSymExclCheckStack(
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount,
+    _In_ ULONG FaultType
+    )
+{
+    ULONG verdict;
+
+    verdict = VFDYNF_SYM_EXCL_INCLUDED;
+
+    RtlAcquireSRWLockShared(&AVrfpSymExclContext.Lock);
+
+    for (ULONG i = 0; i < FramesCount; i++)
+    {
+        PVFDYNF_SYM_EXCL_MODULE module;
+        PVFDYNF_SYM_EXCL_RANGE range;
+        ULONG rva;
+        ULONG low;
+        ULONG high;
+
+        module = AVrfpSymExclLookupModule(Frames[i]);
+        if (!module)
+        {
+            verdict = VFDYNF_SYM_EXCL_UNKNOWN;
+            continue;
+        }
+
+        if (BooleanFlagOn(module->ModuleMask, FaultType))
+        {
+            verdict = VFDYNF_SYM_EXCL_EXCLUDED;
+            break;
+        }
+
+        rva = PtrOffset(module->BaseAddress, Frames[i]);
+        range = NULL;
+        low = 0;
+        high = module->Count;
+
+        while (low < high)
+        {
+            ULONG mid;
+
+            mid = low + ((high - low) / 2);
+
+            if (rva < module->Ranges[mid].StartRva)
+            {
+                high = mid;
+            }
+            else if (rva >= module->Ranges[mid].EndRva)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                range = &module->Ranges[mid];
+                break;
+            }
+        }
+
+        if (!range)
+        {
+            verdict = VFDYNF_SYM_EXCL_UNKNOWN;
+            continue;
+        }
+
+        if (BooleanFlagOn(range->Mask, FaultType))
+        {
+            verdict = VFDYNF_SYM_EXCL_EXCLUDED;
+            break;
+        }
+    }
+
+    RtlReleaseSRWLockShared(&AVrfpSymExclContext.Lock);
+
+    return verdict;
+}
+
+VOID AVrfSymExclCleanup(
+    VOID
+    )
+{
+    RtlAcquireSRWLockExclusive(&AVrfpSymExclContext.Lock);
+
+    while (!IsListEmpty(&AVrfpSymExclContext.Modules))
+    {
+        PLIST_ENTRY entry;
+
+        entry = RemoveHeadList(&AVrfpSymExclContext.Modules);
+
+        RtlFreeHeap(RtlProcessHeap(),
+                    0,
+                    CONTAINING_RECORD(entry, VFDYNF_SYM_EXCL_MODULE, Links));
+    }
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymExclContext.Lock);
+}
@@ -0,0 +1,582 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <vfdynf.h>
+
+//
+// Export table symbolizer. Each module's export directory is parsed once, when
+// the module is tracked, into a table sorted by RVA. Frames resolve to the
+// nearest export at or below them. This does not touch dbghelp, PDBs, or the
+// symbol search path so it is cheap enough to use as a first tier, or alone,
+// when full symbols are unavailable.
+//
+// N.B. The export directory is read from the mapped image, so it is only ever
+// parsed while the image is known to be mapped. That is from the loader
+// callback, or with the loaded module list locked for modules which predate
+// the provider. Modules are untracked from the unload callback, before the
+// image is unmapped.
+//
+
+#define VFDYNF_SYM_EXPORT_MAX_FUNCTIONS 0x10000
+#define VFDYNF_SYM_EXPORT_MAX_NAME      256
+
+typedef struct _VFDYNF_SYM_EXPORT
+{
+    ULONG Rva;
+    ULONG NameOffset;
+    USHORT NameLength;
+    USHORT Ordinal;
+} VFDYNF_SYM_EXPORT, *PVFDYNF_SYM_EXPORT;
+
+typedef struct _VFDYNF_SYM_EXPORT_MODULE
+{
+    LIST_ENTRY Links;
+    PVOID BaseAddress;
+    PVOID EndAddress;
+    UNICODE_STRING BaseName;
+    ULONG Count;
+    PVFDYNF_SYM_EXPORT Exports;
+    PWCHAR Names;
+} VFDYNF_SYM_EXPORT_MODULE, *PVFDYNF_SYM_EXPORT_MODULE;
+
+typedef struct _VFDYNF_SYM_EXPORT_CONTEXT
+{
+    RTL_SRWLOCK Lock;
+    LIST_ENTRY Modules;
+} VFDYNF_SYM_EXPORT_CONTEXT, *PVFDYNF_SYM_EXPORT_CONTEXT;
+
+typedef struct _VFDYNF_SYM_EXPORT_ENUM_CONTEXT
+{
+    PVOID Frame;
+    UNICODE_STRING BaseName;
+    WCHAR BaseNameBuffer[MAX_PATH];
+} VFDYNF_SYM_EXPORT_ENUM_CONTEXT, *PVFDYNF_SYM_EXPORT_ENUM_CONTEXT;
+
+static VFDYNF_SYM_EXPORT_CONTEXT AVrfpSymExportContext =
+{
+    .Lock = RTL_SRWLOCK_INIT,
+    .Modules = { &AVrfpSymExportContext.Modules, &AVrfpSymExportContext.Modules },
+};
+
+int __cdecl AVrfpSymExportCompare(
+    _In_ const void* Left,
+    _In_ const void* Right
+    )
+{
+    const VFDYNF_SYM_EXPORT* left = Left;
+    const VFDYNF_SYM_EXPORT* right = Right;
+
+    if (left->Rva < right->Rva)
+    {
+        return -1;
+    }
+
+    if (left->Rva > right->Rva)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+_Requires_lock_held_(AVrfpSymExportContext.Lock)
+PVFDYNF_SYM_EXPORT_MODULE AVrfpSymExportLookupModule(
+    _In_ PVOID Address
+    )
+{
+    for (PLIST_ENTRY entry = AVrfpSymExportContext.Modules.Flink;
+         entry != &AVrfpSymExportContext.Modules;
+         entry = entry->Flink)
+    {
+        PVFDYNF_SYM_EXPORT_MODULE module;
+
+        module = CONTAINING_RECORD(entry, VFDYNF_SYM_EXPORT_MODULE, Links);
+
+        if ((Address >= module->BaseAddress) && (Address < module->EndAddress))
+        {
+            return module;
+        }
+    }
+
+    return NULL;
+}
+
+_Requires_exclusive_lock_held_(AVrfpSymExportContext.Lock)
+VOID AVrfpSymExportRemoveModule(
+    _In_ PVOID BaseAddress
+    )
+{
+    PVFDYNF_SYM_EXPORT_MODULE module;
+
+    module = AVrfpSymExportLookupModule(BaseAddress);
+    if (module)
+    {
+        RemoveEntryList(&module->Links);
+        RtlFreeHeap(RtlProcessHeap(), 0, module);
+    }
+}
+
+_Must_inspect_result_
+PVFDYNF_SYM_EXPORT_MODULE AVrfpSymExportParseModule(
+    _In_ PVOID BaseAddress,
+    _In_ SIZE_T Size,
+    _In_ PCUNICODE_STRING BaseName
+    )
+{
+    PVFDYNF_SYM_EXPORT_MODULE module;
+    PIMAGE_EXPORT_DIRECTORY exportDir;
+    ULONG exportDirRva;
+    ULONG exportDirSize;
+    PULONG functions;
+    PULONG names;
+    PUSHORT nameOrdinals;
+    PULONG nameIndex;
+    ULONG functionCount;
+    ULONG nameCount;
+    ULONG count;
+    ULONG namesLength;
+    SIZE_T allocSize;
+    ULONG nameOffset;
+
+    module = NULL;
+    functions = NULL;
+    names = NULL;
+    nameOrdinals = NULL;
+    nameIndex = NULL;
+    exportDirRva = 0;
+    functionCount = 0;
+    nameCount = 0;
+    count = 0;
+    namesLength = 0;
+
+    //
+    // N.B. Modules without exports, or with a malformed export directory,
+    // are still tracked with an empty table so they are not parsed again.
+    //
+    exportDir = RtlImageDirectoryEntryToData(BaseAddress,
+                                             TRUE,
+                                             IMAGE_DIRECTORY_ENTRY_EXPORT,
+                                             &exportDirSize);
+    if (!exportDir ||
+        (exportDir->NumberOfFunctions > VFDYNF_SYM_EXPORT_MAX_FUNCTIONS) ||
+        (exportDir->NumberOfNames > exportDir->NumberOfFunctions) ||
+        (exportDir->AddressOfFunctions >= Size) ||
+        (exportDir->AddressOfNames >= Size) ||
+        (exportDir->AddressOfNameOrdinals >= Size) ||
+        ((Size - exportDir->AddressOfFunctions) < (exportDir->NumberOfFunctions * sizeof(ULONG))) ||
+        ((Size - exportDir->AddressOfNames) < (exportDir->NumberOfNames * sizeof(ULONG))) ||
+        ((Size - exportDir->AddressOfNameOrdinals) < (exportDir->NumberOfNames * sizeof(USHORT))))
+    {
+        goto Allocate;
+    }
+
+    exportDirRva = PtrOffset(BaseAddress, exportDir);
+    functionCount = exportDir->NumberOfFunctions;
+    nameCount = exportDir->NumberOfNames;
+
+    functions = Add2Ptr(BaseAddress, exportDir->AddressOfFunctions);
+    names = Add2Ptr(BaseAddress, exportDir->AddressOfNames);
+    nameOrdinals = Add2Ptr(BaseAddress, exportDir->AddressOfNameOrdinals);
+
+    nameIndex = RtlAllocateHeap(RtlProcessHeap(),
+                                0,
+                                functionCount * sizeof(ULONG));
+    if (!nameIndex)
+    {
+        goto Allocate;
+    }
+
+    RtlFillMemory(nameIndex, functionCount * sizeof(ULONG), 0xff);
+
+    //
+    // Functions may have more than one name, the first one wins.
+    //
+    for (ULONG i = 0; i < nameCount; i++)
+    {
+        if ((nameOrdinals[i] < functionCount) &&
+            (nameIndex[nameOrdinals[i]] == MAXULONG) &&
+            (names[i] < Size))
+        {
+            nameIndex[nameOrdinals[i]] = i;
+        }
+    }
+
+    for (ULONG i = 0; i < functionCount; i++)
+    {
+        //
+        // Skip empty slots, forwarders, and anything outside of the image.
+        //
+        if (!functions[i] ||
+            (functions[i] >= Size) ||
+            ((functions[i] >= exportDirRva) &&
+             (functions[i] < (exportDirRva + exportDirSize))))
+        {
+            continue;
+        }
+
+        count++;
+
+        if (nameIndex[i] != MAXULONG)
+        {
+            PCSTR name;
+
+            name = Add2Ptr(BaseAddress, names[nameIndex[i]]);
+
+            namesLength += (ULONG)strnlen(name,
+                                          min(VFDYNF_SYM_EXPORT_MAX_NAME,
+                                              Size - names[nameIndex[i]]));
+        }
+    }
+
+Allocate:
+
+    allocSize = (sizeof(VFDYNF_SYM_EXPORT_MODULE) +
+                 (count * sizeof(VFDYNF_SYM_EXPORT)) +
+                 BaseName->Length +
+                 (namesLength * sizeof(WCHAR)));
+
+    module = RtlAllocateHeap(RtlProcessHeap(), 0, allocSize);
+    if (!module)
+    {
+        goto Exit;
+    }
+
+    module->BaseAddress = BaseAddress;
+    module->EndAddress = Add2Ptr(BaseAddress, Size);
+    module->Count = 0;
+    module->Exports = Add2Ptr(module, sizeof(VFDYNF_SYM_EXPORT_MODULE));
+    module->BaseName.Buffer = Add2Ptr(module->Exports,
+                                      count * sizeof(VFDYNF_SYM_EXPORT));
+    module->BaseName.Length = BaseName->Length;
+    module->BaseName.MaximumLength = BaseName->Length;
+    module->Names = Add2Ptr(module->BaseName.Buffer, BaseName->Length);
+
+    RtlCopyMemory(module->BaseName.Buffer, BaseName->Buffer, BaseName->Length);
+
+    if (!count)
+    {
+        goto Exit;
+    }
+
+    nameOffset = 0;
+
+    for (ULONG i = 0; i < functionCount; i++)
+    {
+        PVFDYNF_SYM_EXPORT symExport;
+
+        if (!functions[i] ||
+            (functions[i] >= Size) ||
+            ((functions[i] >= exportDirRva) &&
+             (functions[i] < (exportDirRva + exportDirSize))))
+        {
+            continue;
+        }
+
+        symExport = &module->Exports[module->Count++];
+
+        symExport->Rva = functions[i];
+        symExport->NameOffset = nameOffset;
+        symExport->NameLength = 0;
+        symExport->Ordinal = (USHORT)(exportDir->Base + i);
+
+        if (nameIndex[i] != MAXULONG)
+        {
+            PCSTR name;
+            ULONG length;
+
+            name = Add2Ptr(BaseAddress, names[nameIndex[i]]);
+            length = (ULONG)strnlen(name,
+                                    min(VFDYNF_SYM_EXPORT_MAX_NAME,
+                                        Size - names[nameIndex[i]]));
+
+            //
+            // Export names are ASCII, widen them in place.
+            //
+            for (ULONG j = 0; j < length; j++)
+            {
+                module->Names[nameOffset + j] = (WCHAR)(UCHAR)name[j];
+            }
+
+            symExport->NameLength = (USHORT)length;
+            nameOffset += length;
+        }
+    }
+
+    qsort(module->Exports,
+          module->Count,
+          sizeof(VFDYNF_SYM_EXPORT),
+          AVrfpSymExportCompare);
+
+Exit:
+
+    if (nameIndex)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, nameIndex);
+    }
+
+    return module;
+}
+
+BOOLEAN AVrfSymExportEnabled(
+    VOID
+    )
+{
+    return (AVrfProperties.SymExportResolve != VFDYNF_SYM_EXPORT_RESOLVE_DISABLED);
+}
+
+BOOLEAN AVrfSymExportExclusive(
+    VOID
+    )
+{
+    return (AVrfProperties.SymExportResolve == VFDYNF_SYM_EXPORT_RESOLVE_ONLY);
+}
+
+VOID AVrfSymExportTrackModule(
+    _In_ PVOID BaseAddress,
+    _In_ SIZE_T Size,
+    _In_ PCUNICODE_STRING BaseName
+    )
+{
+    PVFDYNF_SYM_EXPORT_MODULE module;
+
+    module = AVrfpSymExportParseModule(BaseAddress, Size, BaseName);
+    if (!module)
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                     "failed to parse exports of %wZ",
+                     BaseName);
+        return;
+    }
+
+    RtlAcquireSRWLockExclusive(&AVrfpSymExportContext.Lock);
+
+    //
+    // The module may have been tracked lazily before the load was processed,
+    // or a previous module at this address was not untracked.
+    //
+    AVrfpSymExportRemoveModule(BaseAddress);
+
+    InsertHeadList(&AVrfpSymExportContext.Modules, &module->Links);
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymExportContext.Lock);
+}
+
+VOID AVrfSymExportUntrackModule(
+    _In_ PVOID BaseAddress
+    )
+{
+    RtlAcquireSRWLockExclusive(&AVrfpSymExportContext.Lock);
+
+    AVrfpSymExportRemoveModule(BaseAddress);
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymExportContext.Lock);
+}
+
+_Function_class_(AVRF_MODULE_ENUM_CALLBACK)
+BOOLEAN NTAPI AVrfpSymExportModuleEnumCallback(
+    _In_ PAVRF_MODULE_ENTRY Module,
+    _In_ PVOID Context
+    )
+{
+    PVFDYNF_SYM_EXPORT_ENUM_CONTEXT context;
+
+    context = Context;
+
+    if ((context->Frame >= Module->BaseAddress) &&
+        (context->Frame < Module->EndAddress))
+    {
+        RtlCopyUnicodeString(&context->BaseName, &Module->BaseName);
+
+        //
+        // The module list is locked, the module can not be unloaded until
+        // its exports are parsed.
+        //
+        AVrfSymExportTrackModule(Module->BaseAddress,
+                                 PtrOffset(Module->BaseAddress, Module->EndAddress),
+                                 &Module->BaseName);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN AVrfpSymExportFrameInFunction(
+    _In_ PVFDYNF_SYM_EXPORT_MODULE Module,
+    _In_ PVFDYNF_SYM_EXPORT Export,
+    _In_ PVOID Frame
+    )
+{
+#if defined(_M_IX86)
+    UNREFERENCED_PARAMETER(Module);
+    UNREFERENCED_PARAMETER(Export);
+    UNREFERENCED_PARAMETER(Frame);
+
+    //
+    // There is no function table to bound the export with.
+    //
+    return FALSE;
+#else
+    PRUNTIME_FUNCTION function;
+    ULONG64 imageBase;
+
+    //
+    // N.B. The module is tracked and the export lock is held, the image can
+    // not be unmapped while the function table is searched.
+    //
+    function = RtlLookupFunctionEntry((ULONG64)(ULONG_PTR)Frame, &imageBase, NULL);
+    if (!function)
+    {
+        return FALSE;
+    }
+
+    return (((PVOID)(ULONG_PTR)imageBase == Module->BaseAddress) &&
+            (function->BeginAddress == Export->Rva));
+#endif
+}
+
+BOOLEAN AVrfSymExportResolveFrame(
+    _In_ PVOID Frame,
+    _In_ BOOLEAN Nearest,
+    _Inout_ PUNICODE_STRING Symbol
+    )
+{
+    BOOLEAN result;
+    PVFDYNF_SYM_EXPORT_MODULE module;
+    PVFDYNF_SYM_EXPORT symExport;
+    ULONG rva;
+    ULONG low;
+    ULONG high;
+
+    result = FALSE;
+
+    RtlAcquireSRWLockShared(&AVrfpSymExportContext.Lock);
+
+    module = AVrfpSymExportLookupModule(Frame);
+    if (!module)
+    {
+        VFDYNF_SYM_EXPORT_ENUM_CONTEXT context;
+
+        RtlReleaseSRWLockShared(&AVrfpSymExportContext.Lock);
+
+        //
+        // Modules loaded before the provider started are tracked on first
+        // use rather than all up front.
+        //
+        context.Frame = Frame;
+        context.BaseName.Length = 0;
+        context.BaseName.MaximumLength = sizeof(context.BaseNameBuffer);
+        context.BaseName.Buffer = context.BaseNameBuffer;
+
+        if (!AVrfEnumLoadedModules(AVrfpSymExportModuleEnumCallback, &context))
+        {
+            RtlAppendUnicodeToString(Symbol, L"(null)!");
+            return FALSE;
+        }
+
+        RtlAcquireSRWLockShared(&AVrfpSymExportContext.Lock);
+
+        module = AVrfpSymExportLookupModule(Frame);
+        if (!module)
+        {
+            RtlAppendUnicodeStringToString(Symbol, &context.BaseName);
+            RtlAppendUnicodeToString(Symbol, L"!");
+            goto Exit;
+        }
+    }
+
+    RtlAppendUnicodeStringToString(Symbol, &module->BaseName);
+    RtlAppendUnicodeToString(Symbol, L"!");
+
+    //
+    // Find the last export at or below the frame.
+    //
+    rva = PtrOffset(module->BaseAddress, Frame);
+    symExport = NULL;
+    low = 0;
+    high = module->Count;
+
+    while (low < high)
+    {
+        ULONG mid;
+
+        mid = low + ((high - low) / 2);
+
+        if (module->Exports[mid].Rva <= rva)
+        {
+            symExport = &module->Exports[mid];
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    if (!symExport)
+    {
+        goto Exit;
+    }
+
+    //
+    // Most functions are not exported, the nearest export before a frame is
+    // often some other function. Unless the nearest export is good enough,
+    // only take the export when the frame is within its function.
+    //
+    if (!Nearest && !AVrfpSymExportFrameInFunction(module, symExport, Frame))
+    {
+        goto Exit;
+    }
+
+    if (symExport->NameLength)
+    {
+        UNICODE_STRING name;
+
+        name.Length = (symExport->NameLength * sizeof(WCHAR));
+        name.MaximumLength = name.Length;
+        name.Buffer = &module->Names[symExport->NameOffset];
+
+        RtlAppendUnicodeStringToString(Symbol, &name);
+    }
+    else
+    {
+        WCHAR buffer[16];
+        UNICODE_STRING ordinal;
+
+        ordinal.Length = 0;
+        ordinal.MaximumLength = sizeof(buffer);
+        ordinal.Buffer = buffer;
+
+        RtlIntegerToUnicodeString(symExport->Ordinal, 10, &ordinal);
+
+        RtlAppendUnicodeToString(Symbol, L"Ordinal");
+        RtlAppendUnicodeStringToString(Symbol, &ordinal);
+    }
+
+    result = TRUE;
+
+Exit:
+
+    RtlReleaseSRWLockShared(&AVrfpSymExportContext.Lock);
+
+    return result;
+}
+
+VOID AVrfSymExportCleanup(
+    VOID
+    )
+{
+    RtlAcquireSRWLockExclusive(&AVrfpSymExportContext.Lock);
+
+    while (!IsListEmpty(&AVrfpSymExportContext.Modules))
+    {
+        PLIST_ENTRY entry;
+
+        entry = RemoveHeadList(&AVrfpSymExportContext.Modules);
+
+        RtlFreeHeap(RtlProcessHeap(),
+                    0,
+                    CONTAINING_RECORD(entry, VFDYNF_SYM_EXPORT_MODULE, Links));
+    }
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymExportContext.Lock);
+}
@@ -0,0 +1,530 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <vfdynf.h>
+
+//
+// Frame symbols ("module!symbol") are interned and stacks are kept as arrays
+// of symbol IDs. Each distinct string is stored once and the text of a stack
+// is only built when an expression spanning frames needs it.
+//
+// N.B. Interned strings are not released until the provider is cleaned up, a
+// view of one remains valid until then.
+//
+
+#define VFDYNF_SYM_INTERN_BUCKETS_MIN  (4 * 1024)
+#define VFDYNF_SYM_INTERN_CHUNK_SIZE   4096
+#define VFDYNF_SYM_INTERN_MAX_CHUNKS   1024
+#define VFDYNF_SYM_INTERN_ARENA_SIZE   (64 * 1024)
+#define VFDYNF_SYM_INTERN_MASK_VALID   0x80000000ul
+
+//
+// N.B. FrameValid and FrameMatch hold the verdicts of frame pattern elements
+// for the symbol, bit N for the element assigned cache index N. See
+// framepat.c.
+//
+typedef struct _VFDYNF_SYM_INTERN_ENTRY
+{
+    ULONG Hash;
+    volatile LONG Mask;
+    volatile LONG64 FrameValid;
+    volatile LONG64 FrameMatch;
+    UNICODE_STRING Symbol;
+} VFDYNF_SYM_INTERN_ENTRY, *PVFDYNF_SYM_INTERN_ENTRY;
+
+typedef struct _VFDYNF_SYM_INTERN_ARENA
+{
+    struct _VFDYNF_SYM_INTERN_ARENA* Next;
+    SIZE_T Used;
+    DECLSPEC_ALIGN(16) BYTE Buffer[VFDYNF_SYM_INTERN_ARENA_SIZE];
+} VFDYNF_SYM_INTERN_ARENA, *PVFDYNF_SYM_INTERN_ARENA;
+
+//
+// The table maps string hashes to IDs by open addressing, the chunks map IDs
+// to entries. Chunks are never moved so an entry can be found by ID without
+// touching the table.
+//
+typedef struct _VFDYNF_SYM_INTERN_CONTEXT
+{
+    RTL_SRWLOCK Lock;
+    PVFDYNF_SYM_ID Table;
+    ULONG TableSize;
+    ULONG Count;
+    PVFDYNF_SYM_INTERN_ARENA Arena;
+    PVFDYNF_SYM_INTERN_ENTRY* Chunks[VFDYNF_SYM_INTERN_MAX_CHUNKS];
+} VFDYNF_SYM_INTERN_CONTEXT, *PVFDYNF_SYM_INTERN_CONTEXT;
+
+static VFDYNF_SYM_INTERN_CONTEXT AVrfpSymInternContext =
+{
+    .Lock = RTL_SRWLOCK_INIT,
+    .Table = NULL,
+    .TableSize = 0,
+    .Count = 0,
+    .Arena = NULL,
+    .Chunks = { 0 },
+};
+
+ULONG AVrfpSymInternHash(
+    _In_ PCUNICODE_STRING Symbol
+    )
+{
+    ULONG hash;
+
+    if (!NT_SUCCESS(RtlHashUnicodeString(Symbol,
+                                         FALSE,
+                                         HASH_STRING_ALGORITHM_X65599,
+                                         &hash)))
+    {
+        hash = 0;
+    }
+
+    return hash;
+}
+
+_Requires_lock_held_(AVrfpSymInternContext.Lock)
+PVFDYNF_SYM_INTERN_ENTRY AVrfpSymInternEntry(
+    _In_ VFDYNF_SYM_ID Id
+    )
+{
+    ULONG index;
+    PVFDYNF_SYM_INTERN_ENTRY* chunk;
+
+    if ((Id == VFDYNF_SYM_ID_INVALID) || (Id > AVrfpSymInternContext.Count))
+    {
+        return NULL;
+    }
+
+    index = (Id - 1);
+
+    chunk = AVrfpSymInternContext.Chunks[index / VFDYNF_SYM_INTERN_CHUNK_SIZE];
+
+    return chunk[index % VFDYNF_SYM_INTERN_CHUNK_SIZE];
+}
+
+_Requires_lock_held_(AVrfpSymInternContext.Lock)
+VFDYNF_SYM_ID AVrfpSymInternLookup(
+    _In_ PCUNICODE_STRING Symbol,
+    _In_ ULONG Hash
+    )
+{
+    ULONG mask;
+    ULONG index;
+
+    if (!AVrfpSymInternContext.Table)
+    {
+        return VFDYNF_SYM_ID_INVALID;
+    }
+
+    mask = (AVrfpSymInternContext.TableSize - 1);
+    index = (Hash & mask);
+
+    for (;;)
+    {
+        VFDYNF_SYM_ID id;
+        PVFDYNF_SYM_INTERN_ENTRY entry;
+
+        id = AVrfpSymInternContext.Table[index];
+        if (id == VFDYNF_SYM_ID_INVALID)
+        {
+            return VFDYNF_SYM_ID_INVALID;
+        }
+
+        entry = AVrfpSymInternEntry(id);
+
+        if ((entry->Hash == Hash) &&
+            RtlEqualUnicodeString(&entry->Symbol, Symbol, FALSE))
+        {
+            return id;
+        }
+
+        index = ((index + 1) & mask);
+    }
+}
+
+_Requires_exclusive_lock_held_(AVrfpSymInternContext.Lock)
+BOOLEAN AVrfpSymInternGrowTable(
+    VOID
+    )
+{
+    PVFDYNF_SYM_ID table;
+    ULONG tableSize;
+    ULONG mask;
+
+    if (AVrfpSymInternContext.Table &&
+        (AVrfpSymInternContext.Count < ((AVrfpSymInternContext.TableSize / 4) * 3)))
+    {
+        return TRUE;
+    }
+
+    tableSize = max(AVrfpSymInternContext.TableSize * 2,
+                    VFDYNF_SYM_INTERN_BUCKETS_MIN);
+
+    table = RtlAllocateHeap(RtlProcessHeap(),
+                            HEAP_ZERO_MEMORY,
+                            tableSize * sizeof(VFDYNF_SYM_ID));
+    if (!table)
+    {
+        return FALSE;
+    }
+
+    mask = (tableSize - 1);
+
+    for (VFDYNF_SYM_ID id = 1; id <= AVrfpSymInternContext.Count; id++)
+    {
+        ULONG index;
+
+        index = (AVrfpSymInternEntry(id)->Hash & mask);
+
+        while (table[index] != VFDYNF_SYM_ID_INVALID)
+        {
+            index = ((index + 1) & mask);
+        }
+
+        table[index] = id;
+    }
+
+    if (AVrfpSymInternContext.Table)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, AVrfpSymInternContext.Table);
+    }
+
+    AVrfpSymInternContext.Table = table;
+    AVrfpSymInternContext.TableSize = tableSize;
+
+    return TRUE;
+}
+
+_Requires_exclusive_lock_held_(AVrfpSymInternContext.Lock)
+PVFDYNF_SYM_INTERN_ENTRY AVrfpSymInternAllocateEntry(
+    _In_ USHORT Length
+    )
+{
+    PVFDYNF_SYM_INTERN_ARENA arena;
+    PVFDYNF_SYM_INTERN_ENTRY entry;
+    SIZE_T size;
+
+    size = ALIGN_UP_BY(sizeof(VFDYNF_SYM_INTERN_ENTRY) + Length, sizeof(ULONG64));
+
+    if (size > VFDYNF_SYM_INTERN_ARENA_SIZE)
+    {
+        return NULL;
+    }
+
+    arena = AVrfpSymInternContext.Arena;
+    if (!arena || ((VFDYNF_SYM_INTERN_ARENA_SIZE - arena->Used) < size))
+    {
+        arena = RtlAllocateHeap(RtlProcessHeap(),
+                                0,
+                                sizeof(VFDYNF_SYM_INTERN_ARENA));
+        if (!arena)
+        {
+            return NULL;
+        }
+
+        arena->Next = AVrfpSymInternContext.Arena;
+        arena->Used = 0;
+        AVrfpSymInternContext.Arena = arena;
+    }
+
+    entry = (PVFDYNF_SYM_INTERN_ENTRY)&arena->Buffer[arena->Used];
+
+    arena->Used += size;
+
+    return entry;
+}
+
+VFDYNF_SYM_ID AVrfSymInternSymbol(
+    _In_ PCUNICODE_STRING Symbol
+    )
+{
+    VFDYNF_SYM_ID id;
+    ULONG hash;
+    ULONG index;
+    PVFDYNF_SYM_INTERN_ENTRY entry;
+    PVFDYNF_SYM_INTERN_ENTRY* chunk;
+
+    hash = AVrfpSymInternHash(Symbol);
+
+    RtlAcquireSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    id = AVrfpSymInternLookup(Symbol, hash);
+
+    RtlReleaseSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    if (id != VFDYNF_SYM_ID_INVALID)
+    {
+        return id;
+    }
+
+    RtlAcquireSRWLockExclusive(&AVrfpSymInternContext.Lock);
+
+    //
+    // Another worker may have interned the same string in the meantime.
+    //
+    id = AVrfpSymInternLookup(Symbol, hash);
+    if (id != VFDYNF_SYM_ID_INVALID)
+    {
+        goto Exit;
+    }
+
+    index = AVrfpSymInternContext.Count;
+
+    if ((index / VFDYNF_SYM_INTERN_CHUNK_SIZE) >= VFDYNF_SYM_INTERN_MAX_CHUNKS)
+    {
+        goto Exit;
+    }
+
+    if (!AVrfpSymInternGrowTable())
+    {
+        goto Exit;
+    }
+
+    chunk = AVrfpSymInternContext.Chunks[index / VFDYNF_SYM_INTERN_CHUNK_SIZE];
+    if (!chunk)
+    {
+        chunk = RtlAllocateHeap(RtlProcessHeap(),
+                                0,
+                                (VFDYNF_SYM_INTERN_CHUNK_SIZE *
+                                 sizeof(PVFDYNF_SYM_INTERN_ENTRY)));
+        if (!chunk)
+        {
+            goto Exit;
+        }
+
+        AVrfpSymInternContext.Chunks[index / VFDYNF_SYM_INTERN_CHUNK_SIZE] = chunk;
+    }
+
+    entry = AVrfpSymInternAllocateEntry(Symbol->Length);
+    if (!entry)
+    {
+        goto Exit;
+    }
+
+    entry->Hash = hash;
+    entry->Mask = 0;
+    entry->FrameValid = 0;
+    entry->FrameMatch = 0;
+    entry->Symbol.Length = Symbol->Length;
+    entry->Symbol.MaximumLength = Symbol->Length;
+    entry->Symbol.Buffer = (PWCH)(entry + 1);
+
+    RtlCopyMemory(entry->Symbol.Buffer, Symbol->Buffer, Symbol->Length);
+
+    chunk[index % VFDYNF_SYM_INTERN_CHUNK_SIZE] = entry;
+
+    AVrfpSymInternContext.Count++;
+
+    id = AVrfpSymInternContext.Count;
+
+    index = (hash & (AVrfpSymInternContext.TableSize - 1));
+
+    while (AVrfpSymInternContext.Table[index] != VFDYNF_SYM_ID_INVALID)
+    {
+        index = ((index + 1) & (AVrfpSymInternContext.TableSize - 1));
+    }
+
+    AVrfpSymInternContext.Table[index] = id;
+
+Exit:
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymInternContext.Lock);
+
+    if (id == VFDYNF_SYM_ID_INVALID)
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL, "failed to intern symbol %wZ", Symbol);
+    }
+
+    return id;
+}
+
+BOOLEAN AVrfSymInternGetSymbol(
+    _In_ VFDYNF_SYM_ID Id,
+    _Out_ PUNICODE_STRING Symbol
+    )
+{
+    PVFDYNF_SYM_INTERN_ENTRY entry;
+
+    RtlAcquireSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    entry = AVrfpSymInternEntry(Id);
+    if (entry)
+    {
+        *Symbol = entry->Symbol;
+    }
+    else
+    {
+        RtlInitEmptyUnicodeString(Symbol, NULL, 0);
+    }
+
+    RtlReleaseSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    return (entry != NULL);
+}
+
+BOOLEAN AVrfSymInternQueryMask(
+    _In_ VFDYNF_SYM_ID Id,
+    _Out_ PULONG Mask
+    )
+{
+    PVFDYNF_SYM_INTERN_ENTRY entry;
+    ULONG mask;
+
+    *Mask = 0;
+
+    RtlAcquireSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    entry = AVrfpSymInternEntry(Id);
+    mask = (entry ? (ULONG)ReadAcquire(&entry->Mask) : 0);
+
+    RtlReleaseSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    if (!BooleanFlagOn(mask, VFDYNF_SYM_INTERN_MASK_VALID))
+    {
+        return FALSE;
+    }
+
+    *Mask = (mask & ~VFDYNF_SYM_INTERN_MASK_VALID);
+
+    return TRUE;
+}
+
+VOID AVrfSymInternSetMask(
+    _In_ VFDYNF_SYM_ID Id,
+    _In_ ULONG Mask
+    )
+{
+    PVFDYNF_SYM_INTERN_ENTRY entry;
+
+    //
+    // N.B. The mask is a pure function of the symbol, racing writers store the
+    // same value.
+    //
+    RtlAcquireSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    entry = AVrfpSymInternEntry(Id);
+    if (entry)
+    {
+        WriteRelease(&entry->Mask, (LONG)(Mask | VFDYNF_SYM_INTERN_MASK_VALID));
+    }
+
+    RtlReleaseSRWLockShared(&AVrfpSymInternContext.Lock);
+}
+
+BOOLEAN AVrfSymInternQueryFrameMatch(
+    _In_ VFDYNF_SYM_ID Id,
+    _In_ ULONG Index,
+    _Out_ PBOOLEAN Match
+    )
+{
+    PVFDYNF_SYM_INTERN_ENTRY entry;
+    ULONG64 bit;
+    ULONG64 valid;
+    ULONG64 match;
+
+    *Match = FALSE;
+
+    if (Index >= VFDYNF_SYM_INTERN_FRAME_BITS)
+    {
+        return FALSE;
+    }
+
+    bit = (1ull << Index);
+
+    RtlAcquireSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    entry = AVrfpSymInternEntry(Id);
+    if (entry)
+    {
+        valid = (ULONG64)ReadAcquire64(&entry->FrameValid);
+        match = (ULONG64)ReadNoFence64(&entry->FrameMatch);
+    }
+    else
+    {
+        valid = 0;
+        match = 0;
+    }
+
+    RtlReleaseSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    if (!(valid & bit))
+    {
+        return FALSE;
+    }
+
+    *Match = ((match & bit) != 0);
+
+    return TRUE;
+}
+
+VOID AVrfSymInternSetFrameMatch(
+    _In_ VFDYNF_SYM_ID Id,
+    _In_ ULONG Index,
+    _In_ BOOLEAN Match
+    )
+{
+    PVFDYNF_SYM_INTERN_ENTRY entry;
+    ULONG64 bit;
+
+    if (Index >= VFDYNF_SYM_INTERN_FRAME_BITS)
+    {
+        return;
+    }
+
+    bit = (1ull << Index);
+
+    //
+    // N.B. The match bit is published before the valid bit. Like the mask the
+    // verdict is a pure function of the symbol, racing writers agree.
+    //
+    RtlAcquireSRWLockShared(&AVrfpSymInternContext.Lock);
+
+    entry = AVrfpSymInternEntry(Id);
+    if (entry)
+    {
+        if (Match)
+        {
+            InterlockedOr64(&entry->FrameMatch, (LONG64)bit);
+        }
+
+        InterlockedOr64(&entry->FrameValid, (LONG64)bit);
+    }
+
+    RtlReleaseSRWLockShared(&AVrfpSymInternContext.Lock);
+}
+
+VOID AVrfSymInternCleanup(
+    VOID
+    )
+{
+    RtlAcquireSRWLockExclusive(&AVrfpSymInternContext.Lock);
+
+    while (AVrfpSymInternContext.Arena)
+    {
+        PVFDYNF_SYM_INTERN_ARENA arena;
+
+        arena = AVrfpSymInternContext.Arena;
+        AVrfpSymInternContext.Arena = arena->Next;
+
+        RtlFreeHeap(RtlProcessHeap(), 0, arena);
+    }
+
+    for (ULONG i = 0; i < ARRAYSIZE(AVrfpSymInternContext.Chunks); i++)
+    {
+        if (AVrfpSymInternContext.Chunks[i])
+        {
+            RtlFreeHeap(RtlProcessHeap(), 0, AVrfpSymInternContext.Chunks[i]);
+            AVrfpSymInternContext.Chunks[i] = NULL;
+        }
+    }
+
+    if (AVrfpSymInternContext.Table)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, AVrfpSymInternContext.Table);
+        AVrfpSymInternContext.Table = NULL;
+    }
+
+    AVrfpSymInternContext.TableSize = 0;
+    AVrfpSymInternContext.Count = 0;
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymInternContext.Lock);
+}
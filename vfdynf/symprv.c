@@ -30,11 +30,16 @@ typedef enum _VFDYNF_SYM_REQUEST_TYPE
 typedef struct _VFDYNF_SYM_SYMBOLS
 {
     volatile BOOLEAN Abandoned;
-    DECLSPEC_ALIGN(16) UNICODE_STRING StackSymbols;
+    BOOLEAN InFlight;
+    ULONG Waiters;
+    ULONG StackHash;
+    LIST_ENTRY InFlightEntry;
+    RTL_SRWLOCK TextLock;
+    ULONG TextClass;
+    UNICODE_STRING Text;
     ULONG FramesCount;
-    PVOID Frames[250];
-    WCHAR SymbolBuffer[MAX_SYM_NAME + MAX_PATH + 1];
-    DECLSPEC_ALIGN(16) WCHAR StackSymbolBuffer[UNICODE_STRING_MAX_CHARS];
+    PVOID Frames[VFDYNF_SYM_MAX_FRAMES];
+    VFDYNF_SYM_STACK Stack;
 } VFDYNF_SYM_SYMBOLS, *PVFDYNF_SYM_SYMBOLS;
 
 typedef struct _VFDYNF_SYM_DLL_LOAD_UNLOAD
@@ -47,9 +52,12 @@ typedef struct _VFDYNF_SYM_DLL_LOAD_UNLOAD
 typedef struct _VFDYNF_SYM_REQUEST
 {
     volatile LONG RefCount;
-    SLIST_ENTRY Entry;
+    BOOLEAN Queued;
+    LIST_ENTRY QueueEntry;
     NTSTATUS Status;
     HANDLE Event;
+    LARGE_INTEGER QueueTime;
+    LONG64 Deadline;
 
     VFDYNF_SYM_REQUEST_TYPE Type;
 
@@ -61,19 +69,136 @@ typedef struct _VFDYNF_SYM_REQUEST
     };
 } VFDYNF_SYM_REQUEST, *PVFDYNF_SYM_REQUEST;
 
+#define VFDYNF_SYM_INFLIGHT_BUCKETS  64
+#define VFDYNF_SYM_IDLE_TRIM_PERIOD  5000
+#define VFDYNF_SYM_MAX_WORKERS       8
+#define VFDYNF_SYM_NO_DEADLINE       MAXLONG64
+
+//
+// Workers each take whole requests from the shared queue. Module lookups, the
+// cache, the export tables, the broker, and building the stack string run in
+// parallel, dbghelp is serialized on the provider lock.
+//
+// N.B. The symbol buffer is only used by the owning worker.
+//
+typedef struct _VFDYNF_SYM_WORKER
+{
+    ULONG Index;
+    HANDLE ThreadHandle;
+    HANDLE ThreadId;
+    WCHAR SymbolBuffer[MAX_SYM_NAME + MAX_PATH + 1];
+} VFDYNF_SYM_WORKER, *PVFDYNF_SYM_WORKER;
+
+#define VFDYNF_SYM_WARM_QUEUED  0
+#define VFDYNF_SYM_WARM_LOADING 1
+#define VFDYNF_SYM_WARM_READY   2
+
+typedef struct _VFDYNF_SYM_WARM_MODULE
+{
+    LIST_ENTRY Links;
+    LIST_ENTRY PendingLinks;
+    PVOID BaseAddress;
+    PVOID EndAddress;
+    LONG State;
+    UNICODE_STRING BaseName;
+    WCHAR BaseNameBuffer[MAX_PATH];
+} VFDYNF_SYM_WARM_MODULE, *PVFDYNF_SYM_WARM_MODULE;
+
+#define VFDYNF_SYM_BUFFER_SIZE_SMALL  (4 * 1024)
+#define VFDYNF_SYM_BUFFER_SIZE_MEDIUM (16 * 1024)
+#define VFDYNF_SYM_BUFFER_SIZE_LARGE  UNICODE_STRING_MAX_BYTES
+
+//
+// Requests and stack symbol buffers are pooled. Each pool holds at most
+// MaxFree idle entries, anything beyond that is returned to the heap. When the
+// worker goes idle the pools are trimmed down to IdleFree entries.
+//
+// N.B. Idle entries are linked through their first bytes.
+//
+typedef struct _VFDYNF_SYM_POOL
+{
+    SLIST_HEADER FreeList;
+    ULONG Size;
+    LONG MaxFree;
+    LONG IdleFree;
+    volatile LONG Allocated;
+    volatile LONG InUse;
+    volatile LONG Free;
+    volatile LONG PeakInUse;
+} VFDYNF_SYM_POOL, *PVFDYNF_SYM_POOL;
+
+#define VFDYNF_SYM_POOL_INIT(size, maxFree, idleFree)                         \
+{                                                                             \
+    .FreeList = { 0 },                                                        \
+    .Size = (size),                                                           \
+    .MaxFree = (maxFree),                                                     \
+    .IdleFree = (idleFree),                                                   \
+    .Allocated = 0,                                                           \
+    .InUse = 0,                                                               \
+    .Free = 0,                                                                \
+    .PeakInUse = 0,                                                           \
+}
+
+#define VFDYNF_SYM_CACHE_BUCKETS     (16 * 1024)
+#define VFDYNF_SYM_CACHE_MAX_USED    ((VFDYNF_SYM_CACHE_BUCKETS / 4) * 3)
+#define VFDYNF_SYM_CACHE_TOMBSTONE   ((PVOID)(ULONG_PTR)-1)
+
+typedef struct _VFDYNF_SYM_CACHE_ENTRY
+{
+    PVOID Frame;
+    VFDYNF_SYM_ID Symbol;
+} VFDYNF_SYM_CACHE_ENTRY, *PVFDYNF_SYM_CACHE_ENTRY;
+
+//
+// Maps frames to interned symbols.
+//
+// N.B. The symbol cache is shared by the workers.
+//
+typedef struct _VFDYNF_SYM_CACHE
+{
+    RTL_SRWLOCK Lock;
+    PVFDYNF_SYM_CACHE_ENTRY Table;
+    ULONG Count;
+    ULONG Used;
+    volatile LONG64 Hits;
+    volatile LONG64 Misses;
+} VFDYNF_SYM_CACHE, *PVFDYNF_SYM_CACHE;
+
 typedef struct _VFDYNF_SYMBOL_PROVDER_CONTEXT
 {
     BOOLEAN Initialized;
     volatile BOOLEAN SymInitialized;
     volatile BOOLEAN StopWorker;
     CRITICAL_SECTION CriticalSection;
-    HANDLE WorkerThreadHandle;
-    HANDLE WorkerThreadId;
+    ULONG WorkerCount;
+    VFDYNF_SYM_WORKER Workers[VFDYNF_SYM_MAX_WORKERS];
     volatile HANDLE InitThreadId;
     volatile LONG CurrentAbandoned;
-    SLIST_HEADER WorkQueue;
+    RTL_SRWLOCK QueueLock;
+    LIST_ENTRY SymbolQueue;
+    LIST_ENTRY ModuleQueue;
+    BOOLEAN ModuleLaneBusy;
+    ULONG IdleWorkers;
     HANDLE WorkQueueEvent;
-    SLIST_HEADER FreeList;
+    volatile LONG QueueDepth;
+    volatile LONG PeakQueueDepth;
+    volatile LONG64 Completed;
+    volatile LONG64 Expired;
+    volatile LONG64 QueueLatency;
+    volatile LONG64 MaxQueueLatency;
+    volatile LONG64 ServiceLatency;
+    volatile LONG64 MaxServiceLatency;
+    LARGE_INTEGER PerformanceFrequency;
+    VFDYNF_SYM_POOL RequestPool;
+    VFDYNF_SYM_POOL BufferPools[VFDYNF_SYMBOL_BUFFER_CLASS_COUNT];
+    RTL_SRWLOCK InFlightLock;
+    LIST_ENTRY InFlight[VFDYNF_SYM_INFLIGHT_BUCKETS];
+    VFDYNF_SYM_CACHE Cache;
+    RTL_SRWLOCK WarmLock;
+    LIST_ENTRY WarmModules;
+    LIST_ENTRY WarmPending;
+    volatile LONG WarmPendingCount;
+    volatile LONG WarmReadyCount;
     BYTE SymbolInfoBuffer[sizeof(SYMBOL_INFOW) + ((MAX_SYM_NAME + 1) * sizeof(WCHAR))];
 } VFDYNF_SYMBOL_PROVDER_CONTEX, *PVFDYNF_SYMBOL_PROVDER_CONTEXT;
 
@@ -85,53 +210,191 @@ static VFDYNF_SYMBOL_PROVDER_CONTEX AVrfpSymContext =
     .SymInitialized = FALSE,
     .StopWorker = FALSE,
     .CriticalSection = { 0 },
-    .WorkerThreadHandle = NULL,
-    .WorkerThreadId = NULL,
+    .WorkerCount = 0,
+    .Workers = { 0 },
     .CurrentAbandoned = 0,
     .InitThreadId = NULL,
-    .WorkQueue = { 0 },
+    .QueueLock = RTL_SRWLOCK_INIT,
+    .SymbolQueue = { 0 },
+    .ModuleQueue = { 0 },
+    .ModuleLaneBusy = FALSE,
+    .IdleWorkers = 0,
     .WorkQueueEvent = { 0 },
-    .FreeList = { 0 },
+    .QueueDepth = 0,
+    .PeakQueueDepth = 0,
+    .Completed = 0,
+    .Expired = 0,
+    .QueueLatency = 0,
+    .MaxQueueLatency = 0,
+    .ServiceLatency = 0,
+    .MaxServiceLatency = 0,
+    .PerformanceFrequency = { 0 },
+    .RequestPool = VFDYNF_SYM_POOL_INIT(sizeof(VFDYNF_SYM_REQUEST), 64, 4),
+    .BufferPools =
+    {
+        VFDYNF_SYM_POOL_INIT(VFDYNF_SYM_BUFFER_SIZE_SMALL, 64, 4),
+        VFDYNF_SYM_POOL_INIT(VFDYNF_SYM_BUFFER_SIZE_MEDIUM, 16, 1),
+        VFDYNF_SYM_POOL_INIT(VFDYNF_SYM_BUFFER_SIZE_LARGE, 4, 0),
+    },
+    .InFlightLock = RTL_SRWLOCK_INIT,
+    .InFlight = { 0 },
+    .Cache = { .Lock = RTL_SRWLOCK_INIT },
+    .WarmLock = RTL_SRWLOCK_INIT,
+    .WarmModules = { 0 },
+    .WarmPending = { 0 },
+    .WarmPendingCount = 0,
+    .WarmReadyCount = 0,
     .SymbolInfoBuffer = { 0 },
 };
 
+VOID AVrfpSymUpdatePeak(
+    _Inout_ volatile LONG* Peak,
+    _In_ LONG Value
+    )
+{
+    LONG peak;
+
+    peak = ReadNoFence(Peak);
+    while (Value > peak)
+    {
+        LONG prev;
+
+        prev = InterlockedCompareExchange(Peak, Value, peak);
+        if (prev == peak)
+        {
+            break;
+        }
+
+        peak = prev;
+    }
+}
+
+VOID AVrfpSymUpdatePeak64(
+    _Inout_ volatile LONG64* Peak,
+    _In_ LONG64 Value
+    )
+{
+    LONG64 peak;
+
+    peak = ReadNoFence64(Peak);
+    while (Value > peak)
+    {
+        LONG64 prev;
+
+        prev = InterlockedCompareExchange64(Peak, Value, peak);
+        if (prev == peak)
+        {
+            break;
+        }
+
+        peak = prev;
+    }
+}
+
 _Must_inspect_result_
-PVFDYNF_SYM_REQUEST AVrfpSymCreateRequest(
-    VOID
+PVOID AVrfpSymPoolAllocate(
+    _Inout_ PVFDYNF_SYM_POOL Pool
     )
 {
-    PVFDYNF_SYM_REQUEST sym;
-    PSLIST_ENTRY entry;
+    PVOID entry;
 
-    entry = RtlInterlockedPopEntrySList(&AVrfpSymContext.FreeList);
+    entry = RtlInterlockedPopEntrySList(&Pool->FreeList);
     if (entry)
     {
-        sym = CONTAINING_RECORD(entry, VFDYNF_SYM_REQUEST, Entry);
+        InterlockedDecrement(&Pool->Free);
     }
     else
     {
-        sym = RtlAllocateHeap(RtlProcessHeap(), 0, sizeof(VFDYNF_SYM_REQUEST));
-        if (!sym)
+        entry = RtlAllocateHeap(RtlProcessHeap(), HEAP_ZERO_MEMORY, Pool->Size);
+        if (!entry)
         {
             return NULL;
         }
 
-        RtlZeroMemory(sym, sizeof(VFDYNF_SYM_REQUEST));
+        InterlockedIncrement(&Pool->Allocated);
+    }
 
-        if (!NT_SUCCESS(NtCreateEvent(&sym->Event,
-                                      EVENT_ALL_ACCESS,
-                                      NULL,
-                                      NotificationEvent,
-                                      FALSE)))
-        {
-            RtlFreeHeap(RtlProcessHeap(), 0, sym);
-            return NULL;
-        }
+    AVrfpSymUpdatePeak(&Pool->PeakInUse, InterlockedIncrement(&Pool->InUse));
+
+    return entry;
+}
+
+VOID AVrfpSymPoolRelease(
+    _Inout_ PVFDYNF_SYM_POOL Pool,
+    _In_ _Post_invalid_ PVOID Entry
+    )
+{
+    InterlockedDecrement(&Pool->Allocated);
+
+    RtlFreeHeap(RtlProcessHeap(), 0, Entry);
+}
+
+_Must_inspect_result_
+BOOLEAN AVrfpSymPoolFree(
+    _Inout_ PVFDYNF_SYM_POOL Pool,
+    _In_ PVOID Entry
+    )
+{
+    InterlockedDecrement(&Pool->InUse);
+
+    //
+    // Keep the entry for reuse unless the pool already holds its limit, in
+    // which case the caller returns it to the heap.
+    //
+    if (InterlockedIncrement(&Pool->Free) > Pool->MaxFree)
+    {
+        InterlockedDecrement(&Pool->Free);
+        return FALSE;
     }
 
-    InterlockedIncrement(&sym->RefCount);
+    RtlInterlockedPushEntrySList(&Pool->FreeList, Entry);
 
-    return sym;
+    return TRUE;
+}
+
+_Must_inspect_result_
+PVOID AVrfpSymPoolTrim(
+    _Inout_ PVFDYNF_SYM_POOL Pool,
+    _In_ LONG Keep
+    )
+{
+    PVOID entry;
+
+    if (ReadNoFence(&Pool->Free) <= Keep)
+    {
+        return NULL;
+    }
+
+    entry = RtlInterlockedPopEntrySList(&Pool->FreeList);
+    if (entry)
+    {
+        InterlockedDecrement(&Pool->Free);
+    }
+
+    return entry;
+}
+
+_Must_inspect_result_
+PWCHAR AVrfpSymAllocateBuffer(
+    _In_ ULONG BufferClass
+    )
+{
+    return AVrfpSymPoolAllocate(&AVrfpSymContext.BufferPools[BufferClass]);
+}
+
+VOID AVrfpSymFreeBuffer(
+    _In_ ULONG BufferClass,
+    _In_ PWCHAR Buffer
+    )
+{
+    PVFDYNF_SYM_POOL pool;
+
+    pool = &AVrfpSymContext.BufferPools[BufferClass];
+
+    if (!AVrfpSymPoolFree(pool, Buffer))
+    {
+        AVrfpSymPoolRelease(pool, Buffer);
+    }
 }
 
 VOID AVrfpSymFreeRequest(
@@ -143,7 +406,53 @@ VOID AVrfpSymFreeRequest(
         NtClose(Sym->Event);
     }
 
-    RtlFreeHeap(RtlProcessHeap(), 0, Sym);
+    AVrfpSymPoolRelease(&AVrfpSymContext.RequestPool, Sym);
+}
+
+_Must_inspect_result_
+PVFDYNF_SYM_REQUEST AVrfpSymCreateRequest(
+    _In_ VFDYNF_SYM_REQUEST_TYPE Type
+    )
+{
+    PVFDYNF_SYM_REQUEST sym;
+    HANDLE event;
+
+    sym = AVrfpSymPoolAllocate(&AVrfpSymContext.RequestPool);
+    if (!sym)
+    {
+        return NULL;
+    }
+
+    //
+    // N.B. Pooled requests keep their event, new allocations are zeroed.
+    //
+    event = sym->Event;
+    if (!event)
+    {
+        if (!NT_SUCCESS(NtCreateEvent(&event,
+                                      EVENT_ALL_ACCESS,
+                                      NULL,
+                                      NotificationEvent,
+                                      FALSE)))
+        {
+            if (!AVrfpSymPoolFree(&AVrfpSymContext.RequestPool, sym))
+            {
+                AVrfpSymFreeRequest(sym);
+            }
+
+            return NULL;
+        }
+    }
+
+    RtlZeroMemory(sym, FIELD_OFFSET(VFDYNF_SYM_REQUEST, Symbols));
+    RtlZeroMemory(&sym->Symbols, FIELD_OFFSET(VFDYNF_SYM_SYMBOLS, Frames));
+
+    sym->Event = event;
+    sym->Type = Type;
+
+    InterlockedIncrement(&sym->RefCount);
+
+    return sym;
 }
 
 VOID AVrfpSymReference(
@@ -159,10 +468,45 @@ VOID AVrfpSymDereference(
 {
     if (!InterlockedDecrement(&Sym->RefCount))
     {
+        if ((Sym->Type == SymSymbols) && Sym->Symbols.Text.Buffer)
+        {
+            AVrfpSymFreeBuffer(Sym->Symbols.TextClass, Sym->Symbols.Text.Buffer);
+
+            Sym->Symbols.Text.Buffer = NULL;
+        }
+
         if (InterlockedExchangeAcquireBoolean(&Sym->Symbols.Abandoned, FALSE))
             InterlockedDecrement((LONG volatile*)&AVrfpSymContext.CurrentAbandoned);
 
-        RtlInterlockedPushEntrySList(&AVrfpSymContext.FreeList, &Sym->Entry);
+        if (!AVrfpSymPoolFree(&AVrfpSymContext.RequestPool, Sym))
+        {
+            AVrfpSymFreeRequest(Sym);
+        }
+    }
+}
+
+VOID AVrfpSymTrimPools(
+    _In_ BOOLEAN Drain
+    )
+{
+    PVFDYNF_SYM_POOL pool;
+    PVOID entry;
+
+    pool = &AVrfpSymContext.RequestPool;
+
+    while ((entry = AVrfpSymPoolTrim(pool, Drain ? 0 : pool->IdleFree)) != NULL)
+    {
+        AVrfpSymFreeRequest(entry);
+    }
+
+    for (ULONG i = 0; i < ARRAYSIZE(AVrfpSymContext.BufferPools); i++)
+    {
+        pool = &AVrfpSymContext.BufferPools[i];
+
+        while ((entry = AVrfpSymPoolTrim(pool, Drain ? 0 : pool->IdleFree)) != NULL)
+        {
+            AVrfpSymPoolRelease(pool, entry);
+        }
     }
 }
 
@@ -171,6 +515,7 @@ VOID AVrfpSymAbandonSymbolsRequest(
     )
 {
     ULONG abandoned;
+    BOOLEAN queued;
 
     abandoned = (ULONG)InterlockedIncrement(&AVrfpSymContext.CurrentAbandoned);
 
@@ -182,6 +527,93 @@ VOID AVrfpSymAbandonSymbolsRequest(
                      "abandoned threshold reached %d",
                      abandoned);
     }
+
+    //
+    // No one wants the result, if no worker has started on the request yet
+    // take it out of the queue now rather than when a worker reaches it.
+    //
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.QueueLock);
+
+    queued = Sym->Queued;
+    if (queued)
+    {
+        RemoveEntryList(&Sym->QueueEntry);
+        Sym->Queued = FALSE;
+
+        InterlockedDecrement(&AVrfpSymContext.QueueDepth);
+    }
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.QueueLock);
+
+    if (queued)
+    {
+        InterlockedIncrement64(&AVrfpSymContext.Expired);
+
+        AVrfpSymDereference(Sym);
+    }
+}
+
+_Must_inspect_result_
+_Requires_lock_held_(AVrfpSymContext.InFlightLock)
+PVFDYNF_SYM_REQUEST AVrfpSymLookupInFlight(
+    _In_ ULONG StackHash,
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount
+    )
+{
+    PLIST_ENTRY bucket;
+
+    bucket = &AVrfpSymContext.InFlight[StackHash % VFDYNF_SYM_INFLIGHT_BUCKETS];
+
+    for (PLIST_ENTRY entry = bucket->Flink;
+         entry != bucket;
+         entry = entry->Flink)
+    {
+        PVFDYNF_SYM_REQUEST sym;
+
+        sym = CONTAINING_RECORD(entry,
+                                VFDYNF_SYM_REQUEST,
+                                Symbols.InFlightEntry);
+
+        //
+        // The stack hash is not unique, compare the frames as well.
+        //
+        if ((sym->Symbols.StackHash == StackHash) &&
+            (sym->Symbols.FramesCount == FramesCount) &&
+            RtlEqualMemory(sym->Symbols.Frames,
+                           Frames,
+                           FramesCount * sizeof(PVOID)))
+        {
+            return sym;
+        }
+    }
+
+    return NULL;
+}
+
+_Requires_lock_held_(AVrfpSymContext.InFlightLock)
+VOID AVrfpSymRemoveInFlight(
+    _Inout_ PVFDYNF_SYM_REQUEST Sym
+    )
+{
+    if (Sym->Symbols.InFlight)
+    {
+        RemoveEntryList(&Sym->Symbols.InFlightEntry);
+        Sym->Symbols.InFlight = FALSE;
+    }
+}
+
+VOID AVrfpSymCompleteInFlight(
+    _Inout_ PVFDYNF_SYM_REQUEST Sym
+    )
+{
+    //
+    // Once complete the request no longer accepts waiters. Callers arriving
+    // after this point will queue a new request.
+    //
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.InFlightLock);
+    AVrfpSymRemoveInFlight(Sym);
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.InFlightLock);
 }
 
 BOOL CALLBACK AVrfpSymRegsteredSymbolCallback(
@@ -237,76 +669,313 @@ BOOL CALLBACK AVrfpSymRegsteredSymbolCallback(
     return TRUE;
 }
 
-_Function_class_(AVRF_RUN_ONCE_ROUTINE)
-BOOLEAN NTAPI AVrfpSymRunOnceRoutine(
-    VOID
+_Requires_lock_held_(AVrfpSymContext.WarmLock)
+PVFDYNF_SYM_WARM_MODULE AVrfpSymWarmLookup(
+    _In_ PVOID Address
     )
 {
-    BOOLEAN result;
-
-    WritePointerRelease(&AVrfpSymContext.InitThreadId, NtCurrentThreadId());
-
-    AVrfEnterCriticalSection(&AVrfpSymContext.CriticalSection);
-
-    if (AVrfProperties.SymbolSearchPath[0] == L'\0')
+    for (PLIST_ENTRY entry = AVrfpSymContext.WarmModules.Flink;
+         entry != &AVrfpSymContext.WarmModules;
+         entry = entry->Flink)
     {
-        if (!Delay_SymInitializeW(NtCurrentProcess(), NULL, FALSE))
-        {
-            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
-                         "failed to initialize symbols (%lu)",
-                         NtCurrentTeb()->LastErrorValue);
+        PVFDYNF_SYM_WARM_MODULE module;
 
-            result = FALSE;
-            goto Exit;
-        }
-    }
-    else
-    {
-        if (!Delay_SymInitializeW(NtCurrentProcess(),
-                                  AVrfProperties.SymbolSearchPath,
-                                  FALSE))
-        {
-            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
-                         "failed to initialize symbols (%lu)",
-                         NtCurrentTeb()->LastErrorValue);
+        module = CONTAINING_RECORD(entry, VFDYNF_SYM_WARM_MODULE, Links);
 
-            result = FALSE;
-            goto Exit;
+        if ((Address >= module->BaseAddress) && (Address < module->EndAddress))
+        {
+            return module;
         }
     }
 
-    Delay_SymSetOptions(Delay_SymGetOptions() | SYMOPT_UNDNAME);
-    Delay_SymRegisterCallbackW64(NtCurrentProcess(),
-                                 AVrfpSymRegsteredSymbolCallback,
-                                 0);
-
-    WriteReleaseBoolean(&AVrfpSymContext.SymInitialized, TRUE);
+    return NULL;
+}
 
-    Delay_SymRefreshModuleList(NtCurrentProcess());
+_Requires_exclusive_lock_held_(AVrfpSymContext.WarmLock)
+VOID AVrfpSymWarmRemoveLocked(
+    _In_ PVOID BaseAddress
+    )
+{
+    PVFDYNF_SYM_WARM_MODULE module;
 
-    result = TRUE;
+    module = AVrfpSymWarmLookup(BaseAddress);
+    if (!module)
+    {
+        return;
+    }
 
-Exit:
+    RemoveEntryList(&module->Links);
 
-    AVrfLeaveCriticalSection(&AVrfpSymContext.CriticalSection);
+    if (module->State == VFDYNF_SYM_WARM_QUEUED)
+    {
+        RemoveEntryList(&module->PendingLinks);
+    }
 
-#pragma prefast(suppress : 6387) // SAL is incorrect on WritePointerRelease
-    WritePointerRelease(&AVrfpSymContext.InitThreadId, NULL);
+    if (module->State == VFDYNF_SYM_WARM_READY)
+    {
+        InterlockedDecrement(&AVrfpSymContext.WarmReadyCount);
+    }
+    else
+    {
+        InterlockedDecrement(&AVrfpSymContext.WarmPendingCount);
+    }
 
-    return result;
+    RtlFreeHeap(RtlProcessHeap(), 0, module);
 }
 
-BOOLEAN AVrfpSymDelayInitOnce(
-    VOID
+VOID AVrfpSymWarmQueue(
+    _In_ PVOID BaseAddress,
+    _In_ SIZE_T Size,
+    _In_ PCUNICODE_STRING BaseName
     )
 {
-    if (!AVrfDelayLoadInitOnce())
-    {
-        return FALSE;
-    }
+    PVFDYNF_SYM_WARM_MODULE module;
 
     //
-    // N.B. Asynchronous initialization here (Aync = TRUE) is important to
+    // Only modules which faults may be injected for are warmed. Symbols for
+    // other modules are loaded on demand.
+    //
+    if (!AVrfFaultIsModuleIncluded(BaseName))
+    {
+        return;
+    }
+
+    module = RtlAllocateHeap(RtlProcessHeap(), 0, sizeof(VFDYNF_SYM_WARM_MODULE));
+    if (!module)
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                     "failed to queue symbol warm-up for %wZ",
+                     BaseName);
+        return;
+    }
+
+    module->BaseAddress = BaseAddress;
+    module->EndAddress = Add2Ptr(BaseAddress, Size);
+    module->State = VFDYNF_SYM_WARM_QUEUED;
+    module->BaseName.Length = 0;
+    module->BaseName.MaximumLength = sizeof(module->BaseNameBuffer);
+    module->BaseName.Buffer = module->BaseNameBuffer;
+
+    RtlCopyUnicodeString(&module->BaseName, BaseName);
+
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.WarmLock);
+
+    AVrfpSymWarmRemoveLocked(BaseAddress);
+
+    InsertTailList(&AVrfpSymContext.WarmModules, &module->Links);
+    InsertTailList(&AVrfpSymContext.WarmPending, &module->PendingLinks);
+
+    InterlockedIncrement(&AVrfpSymContext.WarmPendingCount);
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.WarmLock);
+}
+
+VOID AVrfpSymWarmRemove(
+    _In_ PVOID BaseAddress
+    )
+{
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.WarmLock);
+
+    AVrfpSymWarmRemoveLocked(BaseAddress);
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.WarmLock);
+}
+
+BOOLEAN AVrfpSymWarmNext(
+    VOID
+    )
+{
+    PVFDYNF_SYM_WARM_MODULE module;
+    PVOID baseAddress;
+    SIZE_T size;
+    WCHAR buffer[MAX_PATH];
+    UNICODE_STRING baseName;
+    PSYMBOL_INFOW info;
+    ULONG64 disp;
+
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.WarmLock);
+
+    if (IsListEmpty(&AVrfpSymContext.WarmPending))
+    {
+        RtlReleaseSRWLockExclusive(&AVrfpSymContext.WarmLock);
+        return FALSE;
+    }
+
+    module = CONTAINING_RECORD(RemoveHeadList(&AVrfpSymContext.WarmPending),
+                               VFDYNF_SYM_WARM_MODULE,
+                               PendingLinks);
+
+    module->State = VFDYNF_SYM_WARM_LOADING;
+
+    //
+    // N.B. The entry may be replaced while the symbols are loading, take a
+    // copy of what is needed.
+    //
+    baseAddress = module->BaseAddress;
+    size = PtrOffset(module->BaseAddress, module->EndAddress);
+
+    baseName.Length = 0;
+    baseName.MaximumLength = sizeof(buffer);
+    baseName.Buffer = buffer;
+
+    RtlCopyUnicodeString(&baseName, &module->BaseName);
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.WarmLock);
+
+    AVrfEnterCriticalSection(&AVrfpSymContext.CriticalSection);
+
+    //
+    // Symbols are loaded deferred when warming. Looking up any address in the
+    // module forces dbghelp to load them now rather than on first demand.
+    //
+    info = (PSYMBOL_INFOW)AVrfpSymContext.SymbolInfoBuffer;
+
+    RtlZeroMemory(info, sizeof(SYMBOL_INFOW));
+    info->SizeOfStruct = sizeof(SYMBOL_INFOW);
+    info->MaxNameLen = MAX_SYM_NAME;
+
+    Delay_SymFromAddrW(NtCurrentProcess(), (ULONG64)baseAddress, &disp, info);
+
+    if (AVrfProperties.SymExclusionRanges)
+    {
+        AVrfSymExclTrackModule(baseAddress, size, &baseName);
+    }
+
+    AVrfLeaveCriticalSection(&AVrfpSymContext.CriticalSection);
+
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.WarmLock);
+
+    module = AVrfpSymWarmLookup(baseAddress);
+    if (module && (module->State == VFDYNF_SYM_WARM_LOADING))
+    {
+        module->State = VFDYNF_SYM_WARM_READY;
+
+        InterlockedDecrement(&AVrfpSymContext.WarmPendingCount);
+        InterlockedIncrement(&AVrfpSymContext.WarmReadyCount);
+    }
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.WarmLock);
+
+    AVrfDbgPrint(DPFLTR_INFO_LEVEL, "warmed symbols for %wZ", &baseName);
+
+    return TRUE;
+}
+
+_Function_class_(AVRF_MODULE_ENUM_CALLBACK)
+BOOLEAN NTAPI AVrfpSymInitModuleEnumCallback(
+    _In_ PAVRF_MODULE_ENTRY Module,
+    _In_ PVOID Context
+    )
+{
+    SIZE_T size;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    size = PtrOffset(Module->BaseAddress, Module->EndAddress);
+
+    if (AVrfProperties.SymWarmUp)
+    {
+        AVrfpSymWarmQueue(Module->BaseAddress, size, &Module->BaseName);
+    }
+    else
+    {
+        AVrfSymExclTrackModule(Module->BaseAddress, size, &Module->BaseName);
+    }
+
+    return FALSE;
+}
+
+_Function_class_(AVRF_RUN_ONCE_ROUTINE)
+BOOLEAN NTAPI AVrfpSymRunOnceRoutine(
+    VOID
+    )
+{
+    BOOLEAN result;
+
+    WritePointerRelease(&AVrfpSymContext.InitThreadId, NtCurrentThreadId());
+
+    AVrfEnterCriticalSection(&AVrfpSymContext.CriticalSection);
+
+    if (AVrfProperties.SymbolSearchPath[0] == L'\0')
+    {
+        if (!Delay_SymInitializeW(NtCurrentProcess(), NULL, FALSE))
+        {
+            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                         "failed to initialize symbols (%lu)",
+                         NtCurrentTeb()->LastErrorValue);
+
+            result = FALSE;
+            goto Exit;
+        }
+    }
+    else
+    {
+        if (!Delay_SymInitializeW(NtCurrentProcess(),
+                                  AVrfProperties.SymbolSearchPath,
+                                  FALSE))
+        {
+            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                         "failed to initialize symbols (%lu)",
+                         NtCurrentTeb()->LastErrorValue);
+
+            result = FALSE;
+            goto Exit;
+        }
+    }
+
+    if (AVrfProperties.SymWarmUp)
+    {
+        //
+        // Module symbols are loaded in the background, see AVrfpSymWarmNext.
+        //
+        Delay_SymSetOptions(Delay_SymGetOptions() |
+                            SYMOPT_UNDNAME |
+                            SYMOPT_DEFERRED_LOADS);
+    }
+    else
+    {
+        Delay_SymSetOptions(Delay_SymGetOptions() | SYMOPT_UNDNAME);
+    }
+
+    Delay_SymRegisterCallbackW64(NtCurrentProcess(),
+                                 AVrfpSymRegsteredSymbolCallback,
+                                 0);
+
+    WriteReleaseBoolean(&AVrfpSymContext.SymInitialized, TRUE);
+
+    Delay_SymRefreshModuleList(NtCurrentProcess());
+
+    if (AVrfProperties.SymWarmUp || AVrfProperties.SymExclusionRanges)
+    {
+        //
+        // Modules loaded after this are handled as the loads are processed.
+        //
+        AVrfEnumLoadedModules(AVrfpSymInitModuleEnumCallback, NULL);
+    }
+
+    result = TRUE;
+
+Exit:
+
+    AVrfLeaveCriticalSection(&AVrfpSymContext.CriticalSection);
+
+#pragma prefast(suppress : 6387) // SAL is incorrect on WritePointerRelease
+    WritePointerRelease(&AVrfpSymContext.InitThreadId, NULL);
+
+    return result;
+}
+
+BOOLEAN AVrfpSymDelayInitOnce(
+    VOID
+    )
+{
+    if (!AVrfDelayLoadInitOnce())
+    {
+        return FALSE;
+    }
+
+    //
+    // N.B. Asynchronous initialization here (Aync = TRUE) is important to
     // avoid contention with the loader.
     //
     // Even though the symbol provider works asynchronously and is capable
@@ -341,221 +1010,926 @@ BOOLEAN NTAPI AVrfpSymModuleEnumCallback(
     return FALSE;
 }
 
-NTSTATUS AVrfpSymResolveSymbols(
-    _In_ PVFDYNF_SYM_SYMBOLS Sym
+ULONG AVrfpSymCacheHash(
+    _In_ PVOID Frame
     )
 {
-    NTSTATUS status;
+    ULONG64 hash;
+
+    hash = ((ULONG64)(ULONG_PTR)Frame * 0x9e3779b97f4a7c15ull);
+
+    return ((ULONG)(hash >> 32) & (VFDYNF_SYM_CACHE_BUCKETS - 1));
+}
 
-    if (!AVrfpSymDelayInitOnce())
+_Requires_exclusive_lock_held_(AVrfpSymContext.Cache.Lock)
+VOID AVrfpSymCacheFlush(
+    VOID
+    )
+{
+    PVFDYNF_SYM_CACHE cache;
+
+    cache = &AVrfpSymContext.Cache;
+
+    if (cache->Table)
     {
-        status = STATUS_DEVICE_NOT_READY;
-        goto Exit;
+        RtlZeroMemory(cache->Table,
+                      VFDYNF_SYM_CACHE_BUCKETS * sizeof(VFDYNF_SYM_CACHE_ENTRY));
     }
 
-    Sym->StackSymbols.Length = 0;
-    Sym->StackSymbols.MaximumLength = sizeof(Sym->StackSymbolBuffer);
-    Sym->StackSymbols.Buffer = Sym->StackSymbolBuffer;
+    cache->Count = 0;
+    cache->Used = 0;
+}
+
+_Requires_lock_held_(AVrfpSymContext.Cache.Lock)
+VFDYNF_SYM_ID AVrfpSymCacheLookup(
+    _In_ PVOID Frame
+    )
+{
+    PVFDYNF_SYM_CACHE cache;
+    ULONG index;
 
-    for (ULONG i = 0; i < Sym->FramesCount; i++)
+    cache = &AVrfpSymContext.Cache;
+
+    if (!cache->Table)
     {
-        PVOID frame;
-        PSYMBOL_INFOW info;
-        ULONG64 disp;
-        UNICODE_STRING symbol;
-        VFDYNF_SYM_MODULE_ENUM_CONTEXT context;
+        return VFDYNF_SYM_ID_INVALID;
+    }
 
-        frame = Sym->Frames[i];
+    index = AVrfpSymCacheHash(Frame);
 
-        symbol.Length = 0;
-        symbol.MaximumLength = sizeof(Sym->SymbolBuffer);
-        symbol.Buffer = Sym->SymbolBuffer;
+    for (ULONG i = 0; i < VFDYNF_SYM_CACHE_BUCKETS; i++)
+    {
+        PVFDYNF_SYM_CACHE_ENTRY entry;
 
-        context.Sym.Frame = frame;
-        context.Sym.Symbol = &symbol;
+        entry = &cache->Table[index];
 
-        if (ReadAcquireBoolean(&Sym->Abandoned))
+        if (entry->Frame == Frame)
         {
-            //
-            // The thread waiting on this to complete has timed out and no
-            // longer wants a result, stop processing. In situations where
-            // the work queue is backing up this helps with recovery.
-            //
-            status = STATUS_ABANDONED;
-            goto Exit;
+            return entry->Symbol;
         }
 
-        if (!AVrfEnumLoadedModules(AVrfpSymModuleEnumCallback, &context))
+        if (!entry->Frame)
         {
-            RtlAppendUnicodeToString(&symbol, L"(null)");
+            break;
         }
 
-        RtlAppendUnicodeToString(&symbol, L"!");
+        index = ((index + 1) & (VFDYNF_SYM_CACHE_BUCKETS - 1));
+    }
+
+    return VFDYNF_SYM_ID_INVALID;
+}
+
+VFDYNF_SYM_ID AVrfpSymCacheFind(
+    _In_ PVOID Frame
+    )
+{
+    VFDYNF_SYM_ID symbol;
 
-        AVrfEnterCriticalSection(&AVrfpSymContext.CriticalSection);
+    RtlAcquireSRWLockShared(&AVrfpSymContext.Cache.Lock);
 
-        info = (PSYMBOL_INFOW)AVrfpSymContext.SymbolInfoBuffer;
+    symbol = AVrfpSymCacheLookup(Frame);
 
-        RtlZeroMemory(info, sizeof(SYMBOL_INFOW));
-        info->SizeOfStruct = sizeof(SYMBOL_INFOW);
-        info->MaxNameLen = MAX_SYM_NAME;
+    RtlReleaseSRWLockShared(&AVrfpSymContext.Cache.Lock);
 
-        //
-        // If this fails the symbol will not be appended to the module. The
-        // caller will be given a frame with only a module name: "ntdll.dll!"
-        //
-        if (Delay_SymFromAddrW(NtCurrentProcess(),
-                               (ULONG64)frame,
-                               &disp,
-                               info))
+    return symbol;
+}
+
+_Requires_exclusive_lock_held_(AVrfpSymContext.Cache.Lock)
+VOID AVrfpSymCacheInsertLocked(
+    _In_ PVOID Frame,
+    _In_ VFDYNF_SYM_ID Symbol
+    )
+{
+    PVFDYNF_SYM_CACHE cache;
+    ULONG index;
+    PVFDYNF_SYM_CACHE_ENTRY entry;
+
+    cache = &AVrfpSymContext.Cache;
+
+    //
+    // Another worker may have resolved the same frame in the meantime.
+    //
+    if (AVrfpSymCacheLookup(Frame) != VFDYNF_SYM_ID_INVALID)
+    {
+        return;
+    }
+
+    if (!cache->Table)
+    {
+        cache->Table = RtlAllocateHeap(RtlProcessHeap(),
+                                       HEAP_ZERO_MEMORY,
+                                       (VFDYNF_SYM_CACHE_BUCKETS *
+                                        sizeof(VFDYNF_SYM_CACHE_ENTRY)));
+        if (!cache->Table)
         {
-            RtlAppendUnicodeToString(&symbol, info->Name);
+            return;
         }
+    }
 
-        AVrfLeaveCriticalSection(&AVrfpSymContext.CriticalSection);
+    //
+    // Removed entries leave tombstones behind to keep probe chains intact.
+    // Rather than rehashing, start over once the table fills up. This bounds
+    // the table load, the symbols themselves stay interned.
+    //
+    if (cache->Used >= VFDYNF_SYM_CACHE_MAX_USED)
+    {
+        AVrfDbgPrint(DPFLTR_INFO_LEVEL,
+                     "flushing symbol cache (%lu entries)",
+                     cache->Count);
 
-        //
-        // If we fail here it means we've run out of the maximum Unicode string
-        // length which is innately impossible to extend further. Rather than
-        // consider this a failure, we'll just stop appending symbols, debug
-        // print that an error occurred, and break out to classify the stack
-        // that we do have.
-        //
+        AVrfpSymCacheFlush();
+    }
 
-        status = RtlAppendUnicodeStringToString(&Sym->StackSymbols, &symbol);
-        if (!NT_SUCCESS(status))
-        {
-            AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
-                         "failed to append symbol to stack string (0x%08x)",
-                         status);
+    index = AVrfpSymCacheHash(Frame);
 
-            status = STATUS_SUCCESS;
-            goto Exit;
-        }
+    for (;;)
+    {
+        entry = &cache->Table[index];
 
-        status = RtlAppendUnicodeToString(&Sym->StackSymbols, L"\n");
-        if (!NT_SUCCESS(status))
+        if (!entry->Frame)
         {
-            AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
-                         "failed to append new line to stack string (0x%08x)",
-                         status);
+            cache->Used++;
+            break;
+        }
 
-            status = STATUS_SUCCESS;
-            goto Exit;
+        if (entry->Frame == VFDYNF_SYM_CACHE_TOMBSTONE)
+        {
+            break;
         }
+
+        index = ((index + 1) & (VFDYNF_SYM_CACHE_BUCKETS - 1));
     }
 
-    if (Sym->StackSymbols.Length >= sizeof(WCHAR))
+    entry->Frame = Frame;
+    entry->Symbol = Symbol;
+
+    cache->Count++;
+}
+
+VOID AVrfpSymCacheInsert(
+    _In_ PVOID Frame,
+    _In_ VFDYNF_SYM_ID Symbol
+    )
+{
+    if (Symbol == VFDYNF_SYM_ID_INVALID)
     {
-        //
-        // Pop the last new line.
-        //
-        Sym->StackSymbols.Length -= sizeof(WCHAR);
+        return;
     }
 
-    status = STATUS_SUCCESS;
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.Cache.Lock);
 
-Exit:
+    AVrfpSymCacheInsertLocked(Frame, Symbol);
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.Cache.Lock);
+}
+
+VOID AVrfpSymCachePurge(
+    _In_ PVOID BaseAddress,
+    _In_ SIZE_T Size
+    )
+{
+    PVFDYNF_SYM_CACHE cache;
+    PVOID endAddress;
+
+    cache = &AVrfpSymContext.Cache;
+
+    RtlAcquireSRWLockExclusive(&cache->Lock);
+
+    if (!cache->Table || !cache->Count)
+    {
+        goto Exit;
+    }
+
+    endAddress = Add2Ptr(BaseAddress, Size);
+
+    //
+    // N.B. The symbols stay interned, another module may share the names.
+    //
+    for (ULONG i = 0; i < VFDYNF_SYM_CACHE_BUCKETS; i++)
+    {
+        PVFDYNF_SYM_CACHE_ENTRY entry;
+
+        entry = &cache->Table[i];
+
+        if ((entry->Frame >= BaseAddress) && (entry->Frame < endAddress))
+        {
+            entry->Frame = VFDYNF_SYM_CACHE_TOMBSTONE;
+            cache->Count--;
+        }
+    }
+
+Exit:
+
+    RtlReleaseSRWLockExclusive(&cache->Lock);
+}
+
+BOOLEAN AVrfpSymResolveFrame(
+    _In_ PVOID Frame,
+    _Inout_ PUNICODE_STRING Symbol
+    )
+{
+    BOOLEAN result;
+    PSYMBOL_INFOW info;
+    ULONG64 disp;
+    VFDYNF_SYM_MODULE_ENUM_CONTEXT context;
+
+    context.Sym.Frame = Frame;
+    context.Sym.Symbol = Symbol;
+
+    result = TRUE;
+
+    if (!AVrfEnumLoadedModules(AVrfpSymModuleEnumCallback, &context))
+    {
+        RtlAppendUnicodeToString(Symbol, L"(null)");
+        result = FALSE;
+    }
+
+    RtlAppendUnicodeToString(Symbol, L"!");
+
+    AVrfEnterCriticalSection(&AVrfpSymContext.CriticalSection);
+
+    info = (PSYMBOL_INFOW)AVrfpSymContext.SymbolInfoBuffer;
+
+    RtlZeroMemory(info, sizeof(SYMBOL_INFOW));
+    info->SizeOfStruct = sizeof(SYMBOL_INFOW);
+    info->MaxNameLen = MAX_SYM_NAME;
+
+    //
+    // If this fails the symbol will not be appended to the module. The
+    // caller will be given a frame with only a module name: "ntdll.dll!"
+    //
+    if (Delay_SymFromAddrW(NtCurrentProcess(),
+                           (ULONG64)Frame,
+                           &disp,
+                           info))
+    {
+        RtlAppendUnicodeToString(Symbol, info->Name);
+    }
+    else
+    {
+        result = FALSE;
+    }
+
+    AVrfLeaveCriticalSection(&AVrfpSymContext.CriticalSection);
+
+    return result;
+}
+
+_Function_class_(AVRF_SYM_BROKER_CALLBACK)
+VOID NTAPI AVrfpSymBrokerCallback(
+    _In_ PVOID Frame,
+    _In_ PUNICODE_STRING Symbol,
+    _In_opt_ PVOID Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    AVrfpSymCacheInsert(Frame, AVrfSymInternSymbol(Symbol));
+}
+
+VOID AVrfpSymResolveFromBroker(
+    _In_ PVFDYNF_SYM_SYMBOLS Sym
+    )
+{
+    PVOID frames[ARRAYSIZE(Sym->Frames)];
+    ULONG count;
+
+    //
+    // Send any frames that are not already cached to the broker. What it
+    // resolves is placed in the cache, anything else falls back to dbghelp.
+    //
+    count = 0;
+    for (ULONG i = 0; i < Sym->FramesCount; i++)
+    {
+        if (AVrfpSymCacheFind(Sym->Frames[i]) == VFDYNF_SYM_ID_INVALID)
+        {
+            frames[count++] = Sym->Frames[i];
+        }
+    }
+
+    if (count)
+    {
+        AVrfSymBrokerResolve(frames, count, AVrfpSymBrokerCallback, NULL);
+    }
+}
+
+VOID AVrfpSymResolveFromExports(
+    _Inout_ PVFDYNF_SYM_WORKER Worker,
+    _In_ PVFDYNF_SYM_SYMBOLS Sym
+    )
+{
+    for (ULONG i = 0; i < Sym->FramesCount; i++)
+    {
+        UNICODE_STRING symbol;
+
+        if (AVrfpSymCacheFind(Sym->Frames[i]) != VFDYNF_SYM_ID_INVALID)
+        {
+            continue;
+        }
+
+        symbol.Length = 0;
+        symbol.MaximumLength = sizeof(Worker->SymbolBuffer);
+        symbol.Buffer = Worker->SymbolBuffer;
+
+        if (AVrfSymExportResolveFrame(Sym->Frames[i], FALSE, &symbol))
+        {
+            AVrfpSymCacheInsert(Sym->Frames[i], AVrfSymInternSymbol(&symbol));
+        }
+    }
+}
+
+ULONG64 AVrfpSymStackFingerprint(
+    _In_ PVFDYNF_SYM_STACK Stack
+    )
+{
+    ULONG64 hash;
+
+    //
+    // Interned symbols are unique by text, so the sequence of identifiers
+    // fingerprints the text of the stack without building it.
+    //
+    hash = (0xcbf29ce484222325ull ^ Stack->Count);
+
+    for (ULONG i = 0; i < Stack->Count; i++)
+    {
+        hash ^= Stack->Symbols[i];
+        hash *= 0x9e3779b97f4a7c15ull;
+        hash ^= (hash >> 32);
+    }
+
+    return (hash ? hash : 1);
+}
+
+NTSTATUS AVrfpSymResolveSymbols(
+    _Inout_ PVFDYNF_SYM_WORKER Worker,
+    _In_ PVFDYNF_SYM_SYMBOLS Sym
+    )
+{
+    NTSTATUS status;
+
+    //
+    // N.B. When only export tables are used dbghelp is never initialized.
+    //
+    if (!AVrfSymExportExclusive() && !AVrfpSymDelayInitOnce())
+    {
+        status = STATUS_DEVICE_NOT_READY;
+        goto Exit;
+    }
+
+    //
+    // The export tables are the cheapest tier, frames they place within an
+    // exported function are not sent to the broker or dbghelp.
+    //
+    if (AVrfSymExportEnabled())
+    {
+        AVrfpSymResolveFromExports(Worker, Sym);
+    }
+
+    if (AVrfSymBrokerEnabled() && !AVrfSymExportExclusive())
+    {
+        AVrfpSymResolveFromBroker(Sym);
+    }
+
+    //
+    // The stack is kept as one interned symbol per frame, its text is only
+    // built if an expression needs it, see AVrfSymGetStackText.
+    //
+    Sym->Stack.Count = 0;
+    Sym->Stack.Fingerprint = 0;
+
+    for (ULONG i = 0; i < Sym->FramesCount; i++)
+    {
+        PVOID frame;
+        VFDYNF_SYM_ID id;
+        BOOLEAN resolved;
+        UNICODE_STRING symbol;
+
+        frame = Sym->Frames[i];
+
+        if (ReadAcquireBoolean(&Sym->Abandoned))
+        {
+            //
+            // The thread waiting on this to complete has timed out and no
+            // longer wants a result, stop processing. In situations where
+            // the work queue is backing up this helps with recovery.
+            //
+            status = STATUS_ABANDONED;
+            goto Exit;
+        }
+
+        //
+        // Most frames are shared between many stacks, resolve them from the
+        // cache when possible to avoid going to dbghelp.
+        //
+        id = AVrfpSymCacheFind(frame);
+        if (id != VFDYNF_SYM_ID_INVALID)
+        {
+            InterlockedIncrement64(&AVrfpSymContext.Cache.Hits);
+        }
+        else
+        {
+            InterlockedIncrement64(&AVrfpSymContext.Cache.Misses);
+
+            symbol.Length = 0;
+            symbol.MaximumLength = sizeof(Worker->SymbolBuffer);
+            symbol.Buffer = Worker->SymbolBuffer;
+
+            //
+            // Failures are not cached, the module may not be known to dbghelp
+            // yet if the request to load it is still in the queue.
+            //
+            if (AVrfSymExportExclusive())
+            {
+                AVrfSymExportResolveFrame(frame, TRUE, &symbol);
+                resolved = FALSE;
+            }
+            else
+            {
+                resolved = AVrfpSymResolveFrame(frame, &symbol);
+            }
+
+            //
+            // N.B. The symbol table is full or could not grow. The stack is
+            // not completed with a blank frame, callers would match their
+            // expressions against text which is missing part of the stack.
+            //
+            id = AVrfSymInternSymbol(&symbol);
+            if (id == VFDYNF_SYM_ID_INVALID)
+            {
+                Sym->Stack.Count = 0;
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                goto Exit;
+            }
+
+            if (resolved)
+            {
+                AVrfpSymCacheInsert(frame, id);
+            }
+        }
+
+        Sym->Stack.Symbols[Sym->Stack.Count++] = id;
+    }
+
+    Sym->Stack.Fingerprint = AVrfpSymStackFingerprint(&Sym->Stack);
+
+    status = STATUS_SUCCESS;
+
+Exit:
+
+    return status;
+}
+
+_Must_inspect_result_
+NTSTATUS AVrfpSymBuildStackText(
+    _Inout_ PVFDYNF_SYM_SYMBOLS Sym
+    )
+{
+    ULONG length;
+    ULONG count;
+    ULONG bufferClass;
+    PWCHAR buffer;
+
+    //
+    // Size the text first so it is written once into the smallest buffer
+    // that holds it. Like the string limit itself, a stack which does not fit
+    // is cut at the last whole frame.
+    //
+    length = 0;
+    count = 0;
+
+    for (ULONG i = 0; i < Sym->Stack.Count; i++)
+    {
+        UNICODE_STRING symbol;
+        ULONG required;
+
+        AVrfSymInternGetSymbol(Sym->Stack.Symbols[i], &symbol);
+
+        required = (length + symbol.Length + (i ? sizeof(WCHAR) : 0));
+        if (required > AVrfpSymContext.BufferPools[VFDYNF_SYMBOL_BUFFER_CLASS_COUNT - 1].Size)
+        {
+            AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                         "stack text truncated at %lu of %lu frames",
+                         i,
+                         Sym->Stack.Count);
+            break;
+        }
+
+        length = required;
+        count++;
+    }
+
+    for (bufferClass = 0;
+         bufferClass < (VFDYNF_SYMBOL_BUFFER_CLASS_COUNT - 1);
+         bufferClass++)
+    {
+        if (length <= AVrfpSymContext.BufferPools[bufferClass].Size)
+        {
+            break;
+        }
+    }
+
+    buffer = AVrfpSymAllocateBuffer(bufferClass);
+    if (!buffer)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Sym->Text.Length = 0;
+    Sym->Text.MaximumLength = (USHORT)AVrfpSymContext.BufferPools[bufferClass].Size;
+    Sym->Text.Buffer = buffer;
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        UNICODE_STRING symbol;
+
+        if (i)
+        {
+            Sym->Text.Buffer[Sym->Text.Length / sizeof(WCHAR)] = L'\n';
+            Sym->Text.Length += sizeof(WCHAR);
+        }
+
+        AVrfSymInternGetSymbol(Sym->Stack.Symbols[i], &symbol);
+
+        RtlCopyMemory(Add2Ptr(Sym->Text.Buffer, Sym->Text.Length),
+                      symbol.Buffer,
+                      symbol.Length);
+
+        Sym->Text.Length += symbol.Length;
+    }
+
+    Sym->TextClass = bufferClass;
+
+    return STATUS_SUCCESS;
+}
+
+_Function_class_(AVRF_MODULE_ENUM_CALLBACK)
+BOOLEAN NTAPI AVrfpSymDllLoadModuleCallback(
+    _In_ PAVRF_MODULE_ENTRY Module,
+    _In_ PVOID Context
+    )
+{
+    PVFDYNF_SYM_MODULE_ENUM_CONTEXT context;
+
+    context = Context;
+
+    if (context->DllLoad.BaseAddress == Module->BaseAddress)
+    {
+        RtlCopyUnicodeString(context->DllLoad.FullName, &Module->FullName);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+NTSTATUS AVrfpSymDllLoad(
+    _In_ PVFDYNF_SYM_DLL_LOAD_UNLOAD Sym
+    )
+{
+    VFDYNF_SYM_MODULE_ENUM_CONTEXT context;
+    WCHAR fullName[MAX_PATH + 1];
+    UNICODE_STRING fullNameString;
+
+    if (!ReadAcquireBoolean(&AVrfpSymContext.SymInitialized))
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    fullNameString.Length = 0;
+    fullNameString.MaximumLength = MAX_PATH * sizeof(WCHAR);
+    fullNameString.Buffer = fullName;
+
+    context.DllLoad.BaseAddress = Sym->DllBase;
+    context.DllLoad.FullName = &fullNameString;
+
+    if (!AVrfEnumLoadedModules(AVrfpSymDllLoadModuleCallback, &context))
+    {
+        AVrfDbgPrint(DPFLTR_ERROR_LEVEL, "failed to locate %ls", Sym->DllName);
+
+        return STATUS_NOT_FOUND;
+    }
+
+    fullName[fullNameString.Length / sizeof(WCHAR)] = UNICODE_NULL;
+
+    AVrfEnterCriticalSection(&AVrfpSymContext.CriticalSection);
+
+    if (!Delay_SymLoadModuleExW(NtCurrentProcess(),
+                                NULL,
+                                fullName,
+                                Sym->DllName,
+                                (ULONG64)Sym->DllBase,
+                                (ULONG)Sym->DllSize,
+                                NULL,
+                                0) &&
+        NtCurrentTeb()->LastErrorValue)
+    {
+        AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
+                     "SymLoadModuleExW failed %ls (%lu)",
+                     Sym->DllName,
+                     NtCurrentTeb()->LastErrorValue);
+    }
+    else if (AVrfProperties.SymWarmUp)
+    {
+        UNICODE_STRING dllName;
+
+        //
+        // Exclusion ranges are compiled once the symbols are warm.
+        //
+        RtlInitUnicodeString(&dllName, Sym->DllName);
+
+        AVrfpSymWarmQueue(Sym->DllBase, Sym->DllSize, &dllName);
+    }
+    else if (AVrfProperties.SymExclusionRanges)
+    {
+        UNICODE_STRING dllName;
+
+        RtlInitUnicodeString(&dllName, Sym->DllName);
+
+        AVrfSymExclTrackModule(Sym->DllBase, Sym->DllSize, &dllName);
+    }
+
+    AVrfLeaveCriticalSection(&AVrfpSymContext.CriticalSection);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS AVrfpSymDllUnload(
+    _In_ PVFDYNF_SYM_DLL_LOAD_UNLOAD Sym
+    )
+{
+    if (AVrfProperties.SymExclusionRanges)
+    {
+        AVrfSymExclUntrackModule(Sym->DllBase);
+    }
+
+    if (AVrfProperties.SymWarmUp)
+    {
+        AVrfpSymWarmRemove(Sym->DllBase);
+    }
+
+    if (!ReadAcquireBoolean(&AVrfpSymContext.SymInitialized))
+    {
+        AVrfpSymCachePurge(Sym->DllBase, Sym->DllSize);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    AVrfEnterCriticalSection(&AVrfpSymContext.CriticalSection);
+
+    Delay_SymUnloadModule64(NtCurrentProcess(), (ULONG64)Sym->DllBase);
+
+    AVrfLeaveCriticalSection(&AVrfpSymContext.CriticalSection);
+
+    AVrfpSymCachePurge(Sym->DllBase, Sym->DllSize);
+
+    return STATUS_SUCCESS;
+}
+
+LONG64 AVrfpSymTicksToMicroseconds(
+    _In_ LONG64 Ticks
+    )
+{
+    LONG64 frequency;
+
+    frequency = AVrfpSymContext.PerformanceFrequency.QuadPart;
+    if (!frequency)
+    {
+        return 0;
+    }
+
+    return (((Ticks / frequency) * 1000000) +
+            (((Ticks % frequency) * 1000000) / frequency));
+}
+
+VOID AVrfpSymProcessRequest(
+    _Inout_ PVFDYNF_SYM_WORKER Worker,
+    _Inout_ PVFDYNF_SYM_REQUEST Sym
+    )
+{
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    LONG64 latency;
+
+    NtQueryPerformanceCounter(&start, NULL);
+
+    latency = (start.QuadPart - Sym->QueueTime.QuadPart);
+
+    InterlockedAdd64(&AVrfpSymContext.QueueLatency, latency);
+    AVrfpSymUpdatePeak64(&AVrfpSymContext.MaxQueueLatency, latency);
+
+    switch (Sym->Type)
+    {
+        case SymSymbols:
+        {
+            Sym->Status = AVrfpSymResolveSymbols(Worker, &Sym->Symbols);
+            AVrfpSymCompleteInFlight(Sym);
+            break;
+        }
+        case SymDllLoad:
+        {
+            Sym->Status = AVrfpSymDllLoad(&Sym->DllLoad);
+            break;
+        }
+        case SymDllUnload:
+        {
+            Sym->Status = AVrfpSymDllUnload(&Sym->DllUnload);
+            break;
+        }
+        DEFAULT_UNREACHABLE;
+    }
+
+    NtQueryPerformanceCounter(&end, NULL);
+
+    latency = (end.QuadPart - start.QuadPart);
+
+    InterlockedAdd64(&AVrfpSymContext.ServiceLatency, latency);
+    AVrfpSymUpdatePeak64(&AVrfpSymContext.MaxServiceLatency, latency);
+
+    InterlockedIncrement64(&AVrfpSymContext.Completed);
+}
+
+LONG64 AVrfpSymDeadline(
+    _In_opt_ PLARGE_INTEGER Timeout
+    )
+{
+    LARGE_INTEGER now;
+    LONG64 frequency;
+    LONG64 relative;
+
+    if (!Timeout)
+    {
+        return VFDYNF_SYM_NO_DEADLINE;
+    }
+
+    //
+    // Timeouts are in 100ns units, relative when negative and absolute system
+    // time otherwise. Deadlines are kept in performance counter ticks.
+    //
+    if (Timeout->QuadPart <= 0)
+    {
+        relative = -Timeout->QuadPart;
+    }
+    else
+    {
+        LARGE_INTEGER systemTime;
+
+        NtQuerySystemTime(&systemTime);
+
+        relative = max(Timeout->QuadPart - systemTime.QuadPart, 0);
+    }
+
+    NtQueryPerformanceCounter(&now, NULL);
+
+    frequency = AVrfpSymContext.PerformanceFrequency.QuadPart;
+
+    return (now.QuadPart +
+            ((relative / 10000000) * frequency) +
+            (((relative % 10000000) * frequency) / 10000000));
+}
+
+_Requires_exclusive_lock_held_(AVrfpSymContext.QueueLock)
+VOID AVrfpSymInsertSymbolQueue(
+    _Inout_ PVFDYNF_SYM_REQUEST Sym
+    )
+{
+    PLIST_ENTRY entry;
+
+    //
+    // The symbol queue is ordered by deadline. Most requests use the same
+    // timeout so the position is found from the tail almost immediately.
+    //
+    for (entry = AVrfpSymContext.SymbolQueue.Blink;
+         entry != &AVrfpSymContext.SymbolQueue;
+         entry = entry->Blink)
+    {
+        PVFDYNF_SYM_REQUEST other;
+
+        other = CONTAINING_RECORD(entry, VFDYNF_SYM_REQUEST, QueueEntry);
+
+        if (other->Deadline <= Sym->Deadline)
+        {
+            break;
+        }
+    }
 
-    return status;
+    InsertHeadList(entry, &Sym->QueueEntry);
 }
 
-_Function_class_(AVRF_MODULE_ENUM_CALLBACK)
-BOOLEAN NTAPI AVrfpSymDllLoadModuleCallback(
-    _In_ PAVRF_MODULE_ENTRY Module,
-    _In_ PVOID Context
+VOID AVrfpSymExtendDeadline(
+    _Inout_ PVFDYNF_SYM_REQUEST Sym,
+    _In_ LONG64 Deadline
     )
 {
-    PVFDYNF_SYM_MODULE_ENUM_CONTEXT context;
-
-    context = Context;
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.QueueLock);
 
-    if (context->DllLoad.BaseAddress == Module->BaseAddress)
+    if (Deadline > Sym->Deadline)
     {
-        RtlCopyUnicodeString(context->DllLoad.FullName, &Module->FullName);
-        return TRUE;
+        Sym->Deadline = Deadline;
+
+        if (Sym->Queued)
+        {
+            RemoveEntryList(&Sym->QueueEntry);
+            AVrfpSymInsertSymbolQueue(Sym);
+        }
     }
 
-    return FALSE;
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.QueueLock);
 }
 
-NTSTATUS AVrfpSymDllLoad(
-    _In_ PVFDYNF_SYM_DLL_LOAD_UNLOAD Sym
+_Must_inspect_result_
+_Requires_exclusive_lock_held_(AVrfpSymContext.QueueLock)
+PVFDYNF_SYM_REQUEST AVrfpSymDequeue(
+    _Inout_ PLIST_ENTRY Expired
     )
 {
-    VFDYNF_SYM_MODULE_ENUM_CONTEXT context;
-    WCHAR fullName[MAX_PATH + 1];
-    UNICODE_STRING fullNameString;
+    PVFDYNF_SYM_REQUEST sym;
+    LARGE_INTEGER now;
 
-    if (!ReadAcquireBoolean(&AVrfpSymContext.SymInitialized))
+    //
+    // DLL bookkeeping is its own lane and takes priority, symbols of a new
+    // module can not be resolved until its load is processed. The lane is
+    // serviced by one worker at a time to keep loads and unloads in order.
+    //
+    if (!AVrfpSymContext.ModuleLaneBusy &&
+        !IsListEmpty(&AVrfpSymContext.ModuleQueue))
     {
-        return STATUS_DEVICE_NOT_READY;
-    }
+        sym = CONTAINING_RECORD(RemoveHeadList(&AVrfpSymContext.ModuleQueue),
+                                VFDYNF_SYM_REQUEST,
+                                QueueEntry);
 
-    fullNameString.Length = 0;
-    fullNameString.MaximumLength = MAX_PATH * sizeof(WCHAR);
-    fullNameString.Buffer = fullName;
+        sym->Queued = FALSE;
 
-    context.DllLoad.BaseAddress = Sym->DllBase;
-    context.DllLoad.FullName = &fullNameString;
+        AVrfpSymContext.ModuleLaneBusy = TRUE;
 
-    if (!AVrfEnumLoadedModules(AVrfpSymDllLoadModuleCallback, &context))
-    {
-        AVrfDbgPrint(DPFLTR_ERROR_LEVEL, "failed to locate %ls", Sym->DllName);
+        InterlockedDecrement(&AVrfpSymContext.QueueDepth);
 
-        return STATUS_NOT_FOUND;
+        return sym;
     }
 
-    fullName[fullNameString.Length / sizeof(WCHAR)] = UNICODE_NULL;
-
-    AVrfEnterCriticalSection(&AVrfpSymContext.CriticalSection);
+    NtQueryPerformanceCounter(&now, NULL);
 
-    if (!Delay_SymLoadModuleExW(NtCurrentProcess(),
-                                NULL,
-                                fullName,
-                                Sym->DllName,
-                                (ULONG64)Sym->DllBase,
-                                (ULONG)Sym->DllSize,
-                                NULL,
-                                0) &&
-        NtCurrentTeb()->LastErrorValue)
+    //
+    // Requests whose deadline has passed have no one waiting on them anymore,
+    // they are dropped before any work is done for them.
+    //
+    while (!IsListEmpty(&AVrfpSymContext.SymbolQueue))
     {
-        AVrfDbgPrint(DPFLTR_WARNING_LEVEL,
-                     "SymLoadModuleExW failed %ls (%lu)",
-                     Sym->DllName,
-                     NtCurrentTeb()->LastErrorValue);
-    }
+        sym = CONTAINING_RECORD(RemoveHeadList(&AVrfpSymContext.SymbolQueue),
+                                VFDYNF_SYM_REQUEST,
+                                QueueEntry);
 
-    AVrfLeaveCriticalSection(&AVrfpSymContext.CriticalSection);
+        sym->Queued = FALSE;
 
-    return STATUS_SUCCESS;
+        InterlockedDecrement(&AVrfpSymContext.QueueDepth);
+
+        if ((sym->Deadline > now.QuadPart) &&
+            !ReadAcquireBoolean(&sym->Symbols.Abandoned))
+        {
+            return sym;
+        }
+
+        InsertTailList(Expired, &sym->QueueEntry);
+    }
+
+    return NULL;
 }
 
-NTSTATUS AVrfpSymDllUnload(
-    _In_ PVFDYNF_SYM_DLL_LOAD_UNLOAD Sym
+VOID AVrfpSymDropExpired(
+    _Inout_ PLIST_ENTRY Expired
     )
 {
-    if (!ReadAcquireBoolean(&AVrfpSymContext.SymInitialized))
+    while (!IsListEmpty(Expired))
     {
-        return STATUS_DEVICE_NOT_READY;
-    }
+        PVFDYNF_SYM_REQUEST sym;
 
-    AVrfEnterCriticalSection(&AVrfpSymContext.CriticalSection);
+        sym = CONTAINING_RECORD(RemoveHeadList(Expired),
+                                VFDYNF_SYM_REQUEST,
+                                QueueEntry);
 
-    Delay_SymUnloadModule64(NtCurrentProcess(), (ULONG64)Sym->DllBase);
+        //
+        // N.B. STATUS_TIMEOUT is a success code, an error makes sure a waiter
+        // never takes the stack of a request which was not resolved.
+        //
+        sym->Status = STATUS_IO_TIMEOUT;
+        AVrfpSymCompleteInFlight(sym);
 
-    AVrfLeaveCriticalSection(&AVrfpSymContext.CriticalSection);
+        InterlockedIncrement64(&AVrfpSymContext.Expired);
 
-    return STATUS_SUCCESS;
+        NtSetEvent(sym->Event, NULL);
+
+        AVrfpSymDereference(sym);
+    }
 }
 
 NTSTATUS NTAPI AVrfpSymWorker(
     _In_ PVOID ThreadParameter
     )
 {
+    PVFDYNF_SYM_WORKER worker;
     KPRIORITY threadPriority;
+    LARGE_INTEGER idleTimeout;
 
-    UNREFERENCED_PARAMETER(ThreadParameter);
+    worker = ThreadParameter;
+
+    idleTimeout.QuadPart = (-10000LL * VFDYNF_SYM_IDLE_TRIM_PERIOD);
 
     //
     // This thread has the potential to block all other threads in the process
@@ -574,49 +1948,75 @@ NTSTATUS NTAPI AVrfpSymWorker(
 
     while (!ReadAcquireBoolean(&AVrfpSymContext.StopWorker))
     {
-        PSLIST_ENTRY work;
+        PVFDYNF_SYM_REQUEST sym;
+        LIST_ENTRY expired;
 
-        work = RtlInterlockedFlushSList(&AVrfpSymContext.WorkQueue);
-        if (!work)
+        InitializeListHead(&expired);
+
+        RtlAcquireSRWLockExclusive(&AVrfpSymContext.QueueLock);
+
+        sym = AVrfpSymDequeue(&expired);
+        if (!sym)
         {
-            NtWaitForSingleObject(AVrfpSymContext.WorkQueueEvent, FALSE, NULL);
-            continue;
+            //
+            // N.B. The event is reset under the queue lock, a request queued
+            // after this point signals it again.
+            //
+            AVrfpSymContext.IdleWorkers++;
+            NtResetEvent(AVrfpSymContext.WorkQueueEvent, NULL);
         }
 
-        while (work)
-        {
-            PVFDYNF_SYM_REQUEST sym;
+        RtlReleaseSRWLockExclusive(&AVrfpSymContext.QueueLock);
+
+        AVrfpSymDropExpired(&expired);
 
-            sym = CONTAINING_RECORD(work, VFDYNF_SYM_REQUEST, Entry);
+        if (!sym)
+        {
+            NTSTATUS status;
 
-            work = work->Next;
+            //
+            // Warm module symbols only while there are no requests and one
+            // module at a time, demand is never queued behind more than one
+            // module load. The first worker does this and the idle trimming.
+            //
+            if ((worker->Index == 0) && AVrfpSymWarmNext())
+            {
+                status = STATUS_SUCCESS;
+            }
+            else
+            {
+                status = NtWaitForSingleObject(AVrfpSymContext.WorkQueueEvent,
+                                               FALSE,
+                                               &idleTimeout);
+            }
 
-            switch (sym->Type)
+            if ((status == STATUS_TIMEOUT) && (worker->Index == 0))
             {
-                case SymSymbols:
-                {
-                    sym->Status = AVrfpSymResolveSymbols(&sym->Symbols);
-                    break;
-                }
-                case SymDllLoad:
-                {
-                    sym->Status = AVrfpSymDllLoad(&sym->DllLoad);
-                    break;
-                }
-                case SymDllUnload:
-                {
-                    sym->Status = AVrfpSymDllUnload(&sym->DllUnload);
-                    break;
-                }
-                DEFAULT_UNREACHABLE;
+                //
+                // Release pooled memory a burst of requests left behind.
+                //
+                AVrfpSymTrimPools(FALSE);
             }
 
-            NtSetEvent(sym->Event, NULL);
+            RtlAcquireSRWLockExclusive(&AVrfpSymContext.QueueLock);
+            AVrfpSymContext.IdleWorkers--;
+            RtlReleaseSRWLockExclusive(&AVrfpSymContext.QueueLock);
 
-            AVrfpSymDereference(sym);
+            continue;
+        }
+
+        AVrfpSymProcessRequest(worker, sym);
+
+        if (sym->Type != SymSymbols)
+        {
+            RtlAcquireSRWLockExclusive(&AVrfpSymContext.QueueLock);
+            AVrfpSymContext.ModuleLaneBusy = FALSE;
+            RtlReleaseSRWLockExclusive(&AVrfpSymContext.QueueLock);
         }
 
-        NtResetEvent(AVrfpSymContext.WorkQueueEvent, NULL);
+        NtSetEvent(sym->Event, NULL);
+
+        AVrfpSymDereference(sym);
     }
 
     return STATUS_SUCCESS;
@@ -634,10 +2034,30 @@ VOID AVrfpSymEnqueue(
 
     AVrfpSymReference(Sym);
 
-    if (!RtlInterlockedPushEntrySList(&AVrfpSymContext.WorkQueue, &Sym->Entry))
+    NtQueryPerformanceCounter(&Sym->QueueTime, NULL);
+
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.QueueLock);
+
+    if (Type == SymSymbols)
+    {
+        AVrfpSymInsertSymbolQueue(Sym);
+    }
+    else
+    {
+        InsertTailList(&AVrfpSymContext.ModuleQueue, &Sym->QueueEntry);
+    }
+
+    Sym->Queued = TRUE;
+
+    AVrfpSymUpdatePeak(&AVrfpSymContext.PeakQueueDepth,
+                       InterlockedIncrement(&AVrfpSymContext.QueueDepth));
+
+    if (AVrfpSymContext.IdleWorkers)
     {
         NtSetEvent(AVrfpSymContext.WorkQueueEvent, NULL);
     }
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.QueueLock);
 }
 
 BOOLEAN AvrfIsSymProviderThread(
@@ -648,66 +2068,160 @@ BOOLEAN AvrfIsSymProviderThread(
 
     threadId = NtCurrentThreadId();
 
-    if ((threadId == AVrfpSymContext.WorkerThreadId) ||
-        (threadId == ReadPointerAcquire(&AVrfpSymContext.InitThreadId)))
+    if (threadId == ReadPointerAcquire(&AVrfpSymContext.InitThreadId))
     {
         return TRUE;
     }
 
+    for (ULONG i = 0; i < AVrfpSymContext.WorkerCount; i++)
+    {
+        if (threadId == AVrfpSymContext.Workers[i].ThreadId)
+        {
+            return TRUE;
+        }
+    }
+
     return FALSE;
 }
 
+BOOLEAN AVrfSymIsModuleWarm(
+    _In_ PVOID Address
+    )
+{
+    PVFDYNF_SYM_WARM_MODULE module;
+    BOOLEAN warm;
+
+    if (!AVrfProperties.SymWarmUp)
+    {
+        return TRUE;
+    }
+
+    //
+    // Modules which are not being warmed have their symbols loaded on demand,
+    // there is nothing to wait for.
+    //
+    RtlAcquireSRWLockShared(&AVrfpSymContext.WarmLock);
+
+    module = AVrfpSymWarmLookup(Address);
+    warm = (!module || (module->State == VFDYNF_SYM_WARM_READY));
+
+    RtlReleaseSRWLockShared(&AVrfpSymContext.WarmLock);
+
+    return warm;
+}
+
 NTSTATUS AVrfSymGetSymbols(
     _In_count_(FramesCount) CONST PVOID* Frames,
     _In_ ULONG FramesCount,
-    _Out_ PUNICODE_STRING* StackSymbols,
+    _In_ ULONG StackHash,
+    _Out_ PVFDYNF_SYM_STACK* Stack,
     _In_opt_ PLARGE_INTEGER Timeout
     )
 {
     NTSTATUS status;
     ULONG abandoned;
     PVFDYNF_SYM_REQUEST sym;
+    PVFDYNF_SYM_REQUEST newSym;
+    BOOLEAN lastWaiter;
+    LONG64 deadline;
 
-    *StackSymbols = NULL;
+    *Stack = NULL;
 
     abandoned = (ULONG)ReadAcquire(&AVrfpSymContext.CurrentAbandoned);
     if (abandoned >= AVrfProperties.SymAbandonedThreshold)
     {
         //
-        // The number of queued an abandoned requests has reached a limit which
-        // justifies trying to allow the process to recover. Do not allow any
-        // more symbol resolution requests until the system drops back below
-        // the threshold. The worker thread is currently abandoning work in the
-        // queue in order to recover.
+        // The number of outstanding abandoned requests has reached a limit
+        // which justifies trying to allow the process to recover. Do not allow
+        // any more symbol resolution requests until the system drops back
+        // below the threshold. Abandoned requests are removed from the queue
+        // and the workers stop on those already started in order to recover.
         //
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    sym = AVrfpSymCreateRequest();
-    if (!sym)
+    newSym = AVrfpSymCreateRequest(SymSymbols);
+    if (!newSym)
     {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    FramesCount = min(FramesCount, ARRAYSIZE(sym->Symbols.Frames));
+    FramesCount = min(FramesCount, ARRAYSIZE(newSym->Symbols.Frames));
+
+    deadline = AVrfpSymDeadline(Timeout);
+
+    //
+    // Many threads commonly reach a new stack at the same time, for example
+    // in a thread pool. Attach to a pending request for the same stack when
+    // there is one rather than resolving the same symbols again.
+    //
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.InFlightLock);
+
+    sym = AVrfpSymLookupInFlight(StackHash, Frames, FramesCount);
+    if (sym)
+    {
+        AVrfpSymReference(sym);
+        sym->Symbols.Waiters++;
+
+        //
+        // The request is wanted for as long as any waiter is.
+        //
+        AVrfpSymExtendDeadline(sym, deadline);
+    }
+    else
+    {
+        sym = newSym;
+        newSym = NULL;
+
+        RtlCopyMemory(sym->Symbols.Frames, Frames, FramesCount * sizeof(PVOID));
+        sym->Symbols.FramesCount = FramesCount;
+        sym->Symbols.StackHash = StackHash;
+        sym->Symbols.Waiters = 1;
+        sym->Symbols.InFlight = TRUE;
+        sym->Deadline = deadline;
+
+        InsertTailList(&AVrfpSymContext.InFlight[StackHash % VFDYNF_SYM_INFLIGHT_BUCKETS],
+                       &sym->Symbols.InFlightEntry);
 
-    RtlCopyMemory(sym->Symbols.Frames, Frames, FramesCount * sizeof(PVOID));
-    sym->Symbols.FramesCount = FramesCount;
+        AVrfpSymEnqueue(SymSymbols, sym);
+    }
+
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.InFlightLock);
 
-    AVrfpSymEnqueue(SymSymbols, sym);
+    if (newSym)
+    {
+        AVrfpSymDereference(newSym);
+    }
 
     status = NtWaitForSingleObject(sym->Event, FALSE, Timeout);
     if (status != STATUS_SUCCESS)
     {
-        AVrfpSymAbandonSymbolsRequest(sym);
+        //
+        // Only abandon the request when no one else is waiting on it.
+        //
+        RtlAcquireSRWLockExclusive(&AVrfpSymContext.InFlightLock);
+
+        lastWaiter = (--sym->Symbols.Waiters == 0);
+        if (lastWaiter)
+        {
+            AVrfpSymRemoveInFlight(sym);
+        }
+
+        RtlReleaseSRWLockExclusive(&AVrfpSymContext.InFlightLock);
+
+        if (lastWaiter)
+        {
+            AVrfpSymAbandonSymbolsRequest(sym);
+        }
+
         AVrfpSymDereference(sym);
         return status;
     }
 
     status = sym->Status;
-    if (NT_SUCCESS(status))
+    if (status == STATUS_SUCCESS)
     {
-        *StackSymbols = &sym->Symbols.StackSymbols;
+        *Stack = &sym->Symbols.Stack;
     }
     else
     {
@@ -717,15 +2231,45 @@ NTSTATUS AVrfSymGetSymbols(
     return status;
 }
 
+NTSTATUS AVrfSymGetStackText(
+    _In_ PVFDYNF_SYM_STACK Stack,
+    _Out_ PCUNICODE_STRING* Text
+    )
+{
+    NTSTATUS status;
+    PVFDYNF_SYM_REQUEST sym;
+
+    sym = CONTAINING_RECORD(Stack, VFDYNF_SYM_REQUEST, Symbols.Stack);
+
+    //
+    // The request may be shared by many waiters, the first one to need the
+    // text builds it.
+    //
+    RtlAcquireSRWLockExclusive(&sym->Symbols.TextLock);
+
+    if (sym->Symbols.Text.Buffer)
+    {
+        status = STATUS_SUCCESS;
+    }
+    else
+    {
+        status = AVrfpSymBuildStackText(&sym->Symbols);
+    }
+
+    RtlReleaseSRWLockExclusive(&sym->Symbols.TextLock);
+
+    *Text = (NT_SUCCESS(status) ? &sym->Symbols.Text : NULL);
+
+    return status;
+}
+
 VOID AVrfSymFreeSymbols(
-    _In_ PUNICODE_STRING StackSymbols
+    _In_ PVFDYNF_SYM_STACK Stack
     )
 {
     PVFDYNF_SYM_REQUEST sym;
 
-    sym = CONTAINING_RECORD(StackSymbols,
-                            VFDYNF_SYM_REQUEST,
-                            Symbols.StackSymbols);
+    sym = CONTAINING_RECORD(Stack, VFDYNF_SYM_REQUEST, Symbols.Stack);
 
     AVrfpSymDereference(sym);
 }
@@ -738,7 +2282,20 @@ VOID AVrfSymDllLoad(
 {
     PVFDYNF_SYM_REQUEST sym;
 
-    sym = AVrfpSymCreateRequest();
+    if (AVrfSymExportEnabled())
+    {
+        UNICODE_STRING dllName;
+
+        //
+        // N.B. The exports are parsed here, where the image is known to be
+        // mapped, rather than by the workers.
+        //
+        RtlInitUnicodeString(&dllName, DllName);
+
+        AVrfSymExportTrackModule(DllBase, DllSize, &dllName);
+    }
+
+    sym = AVrfpSymCreateRequest(SymDllLoad);
     if (!sym)
     {
         return;
@@ -764,7 +2321,12 @@ VOID AVrfSymDllUnload(
 {
     PVFDYNF_SYM_REQUEST sym;
 
-    sym = AVrfpSymCreateRequest();
+    if (AVrfSymExportEnabled())
+    {
+        AVrfSymExportUntrackModule(DllBase);
+    }
+
+    sym = AVrfpSymCreateRequest(SymDllUnload);
     if (!sym)
     {
         return;
@@ -788,6 +2350,8 @@ BOOLEAN AVrfSymProcessAttach(
 {
     NTSTATUS status;
     CLIENT_ID clientId;
+    LARGE_INTEGER counter;
+    ULONG workerCount;
 
     if (AVrfpSymContext.Initialized)
     {
@@ -796,8 +2360,22 @@ BOOLEAN AVrfSymProcessAttach(
 
     AVrfInitializeCriticalSection(&AVrfpSymContext.CriticalSection);
 
-    RtlInitializeSListHead(&AVrfpSymContext.WorkQueue);
-    RtlInitializeSListHead(&AVrfpSymContext.FreeList);
+    InitializeListHead(&AVrfpSymContext.SymbolQueue);
+    InitializeListHead(&AVrfpSymContext.ModuleQueue);
+    RtlInitializeSListHead(&AVrfpSymContext.RequestPool.FreeList);
+
+    for (ULONG i = 0; i < ARRAYSIZE(AVrfpSymContext.BufferPools); i++)
+    {
+        RtlInitializeSListHead(&AVrfpSymContext.BufferPools[i].FreeList);
+    }
+
+    for (ULONG i = 0; i < ARRAYSIZE(AVrfpSymContext.InFlight); i++)
+    {
+        InitializeListHead(&AVrfpSymContext.InFlight[i]);
+    }
+
+    InitializeListHead(&AVrfpSymContext.WarmModules);
+    InitializeListHead(&AVrfpSymContext.WarmPending);
 
     status = NtCreateEvent(&AVrfpSymContext.WorkQueueEvent,
                            EVENT_ALL_ACCESS,
@@ -813,30 +2391,52 @@ BOOLEAN AVrfSymProcessAttach(
         return FALSE;
     }
 
-    status = RtlCreateUserThread(NtCurrentProcess(),
-                                 NULL,
-                                 FALSE,
-                                 0,
-                                 0,
-                                 0,
-                                 AVrfpSymWorker,
-                                 NULL,
-                                 &AVrfpSymContext.WorkerThreadHandle,
-                                 &clientId);
-    if (!NT_SUCCESS(status))
+    NtQueryPerformanceCounter(&counter, &AVrfpSymContext.PerformanceFrequency);
+
+    workerCount = AVrfProperties.SymWorkerCount;
+    workerCount = max(workerCount, 1);
+    workerCount = min(workerCount, VFDYNF_SYM_MAX_WORKERS);
+
+    for (ULONG i = 0; i < workerCount; i++)
+    {
+        PVFDYNF_SYM_WORKER worker;
+
+        worker = &AVrfpSymContext.Workers[i];
+
+        worker->Index = i;
+
+        status = RtlCreateUserThread(NtCurrentProcess(),
+                                     NULL,
+                                     FALSE,
+                                     0,
+                                     0,
+                                     0,
+                                     AVrfpSymWorker,
+                                     worker,
+                                     &worker->ThreadHandle,
+                                     &clientId);
+        if (!NT_SUCCESS(status))
+        {
+            AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
+                         "failed to create symbol provider thread (0x%08x)",
+                         status);
+
+            break;
+        }
+
+        worker->ThreadId = clientId.UniqueThread;
+
+        AVrfpSymContext.WorkerCount++;
+    }
+
+    if (!AVrfpSymContext.WorkerCount)
     {
         NtClose(AVrfpSymContext.WorkQueueEvent);
         AVrfpSymContext.WorkQueueEvent = NULL;
 
-        AVrfDbgPrint(DPFLTR_ERROR_LEVEL,
-                     "failed to create symbol provider thread (0x%08x)",
-                     status);
-
         return FALSE;
     }
 
-    AVrfpSymContext.WorkerThreadId = clientId.UniqueThread;
-
     AVrfpSymContext.Initialized = TRUE;
 
     return TRUE;
@@ -846,7 +2446,7 @@ VOID AVrfSymProcessDetach(
     VOID
     )
 {
-    PSLIST_ENTRY entry;
+    LARGE_INTEGER timeout;
 
     if (!AVrfpSymContext.Initialized)
     {
@@ -854,21 +2454,56 @@ VOID AVrfSymProcessDetach(
     }
 
     WriteReleaseBoolean(&AVrfpSymContext.StopWorker, TRUE);
-    NtSetEvent(AVrfpSymContext.WorkQueueEvent, NULL);
-    NtWaitForSingleObject(AVrfpSymContext.WorkerThreadHandle, FALSE, FALSE);
-    NtClose(AVrfpSymContext.WorkerThreadHandle);
+
+    timeout.QuadPart = (-10000LL * 100);
+
+    for (ULONG i = 0; i < AVrfpSymContext.WorkerCount; i++)
+    {
+        //
+        // N.B. Workers reset the shared event when they find the queue empty,
+        // keep signaling it until each one has observed the stop.
+        //
+        do
+        {
+            NtSetEvent(AVrfpSymContext.WorkQueueEvent, NULL);
+        } while (NtWaitForSingleObject(AVrfpSymContext.Workers[i].ThreadHandle,
+                                       FALSE,
+                                       &timeout) == STATUS_TIMEOUT);
+
+        NtClose(AVrfpSymContext.Workers[i].ThreadHandle);
+    }
+
+    AVrfpSymContext.WorkerCount = 0;
+
     NtClose(AVrfpSymContext.WorkQueueEvent);
 
-    entry = RtlInterlockedFlushSList(&AVrfpSymContext.FreeList);
-    while (entry)
+    AVrfpSymTrimPools(TRUE);
+
+    AVrfSymBrokerCleanup();
+
+    AVrfSymExportCleanup();
+
+    AVrfSymExclCleanup();
+
+    AVrfSymInternCleanup();
+
+    while (!IsListEmpty(&AVrfpSymContext.WarmModules))
     {
-        PVFDYNF_SYM_REQUEST sym;
+        AVrfpSymWarmRemoveLocked(CONTAINING_RECORD(AVrfpSymContext.WarmModules.Flink,
+                                                   VFDYNF_SYM_WARM_MODULE,
+                                                   Links)->BaseAddress);
+    }
+
+    RtlAcquireSRWLockExclusive(&AVrfpSymContext.Cache.Lock);
 
-        sym = CONTAINING_RECORD(entry, VFDYNF_SYM_REQUEST, Entry);
+    AVrfpSymCacheFlush();
 
-        entry = entry->Next;
+    RtlReleaseSRWLockExclusive(&AVrfpSymContext.Cache.Lock);
 
-        AVrfpSymFreeRequest(sym);
+    if (AVrfpSymContext.Cache.Table)
+    {
+        RtlFreeHeap(RtlProcessHeap(), 0, AVrfpSymContext.Cache.Table);
+        AVrfpSymContext.Cache.Table = NULL;
     }
 
     if (ReadAcquireBoolean(&AVrfpSymContext.SymInitialized))
@@ -880,3 +2515,52 @@ VOID AVrfSymProcessDetach(
 
     AVrfpSymContext.Initialized = FALSE;
 }
+
+VOID AVrfpSymQueryPool(
+    _In_ PVFDYNF_SYM_POOL Pool,
+    _Out_ PVFDYNF_POOL_STATISTICS Statistics
+    )
+{
+    Statistics->EntrySize = Pool->Size;
+    Statistics->Allocated = (ULONG)ReadNoFence(&Pool->Allocated);
+    Statistics->InUse = (ULONG)ReadNoFence(&Pool->InUse);
+    Statistics->PeakInUse = (ULONG)ReadNoFence(&Pool->PeakInUse);
+    Statistics->Free = (ULONG)ReadNoFence(&Pool->Free);
+    Statistics->MaxFree = (ULONG)Pool->MaxFree;
+}
+
+BOOLEAN NTAPI AVrfQuerySymbolStatistics(
+    _Inout_ PVFDYNF_SYMBOL_STATISTICS Statistics
+    )
+{
+    if (Statistics->Size != sizeof(VFDYNF_SYMBOL_STATISTICS))
+    {
+        return FALSE;
+    }
+
+    Statistics->Abandoned = (ULONG)ReadNoFence(&AVrfpSymContext.CurrentAbandoned);
+
+    AVrfpSymQueryPool(&AVrfpSymContext.RequestPool, &Statistics->Requests);
+
+    for (ULONG i = 0; i < VFDYNF_SYMBOL_BUFFER_CLASS_COUNT; i++)
+    {
+        AVrfpSymQueryPool(&AVrfpSymContext.BufferPools[i],
+                          &Statistics->Buffers[i]);
+    }
+
+    Statistics->CacheHits = (ULONG64)ReadNoFence64(&AVrfpSymContext.Cache.Hits);
+    Statistics->CacheMisses = (ULONG64)ReadNoFence64(&AVrfpSymContext.Cache.Misses);
+    Statistics->WarmPending = (ULONG)ReadNoFence(&AVrfpSymContext.WarmPendingCount);
+    Statistics->WarmReady = (ULONG)ReadNoFence(&AVrfpSymContext.WarmReadyCount);
+    Statistics->Workers = AVrfpSymContext.WorkerCount;
+    Statistics->QueueDepth = (ULONG)max(ReadNoFence(&AVrfpSymContext.QueueDepth), 0);
+    Statistics->PeakQueueDepth = (ULONG)ReadNoFence(&AVrfpSymContext.PeakQueueDepth);
+    Statistics->Completed = (ULONG64)ReadNoFence64(&AVrfpSymContext.Completed);
+    Statistics->Expired = (ULONG64)ReadNoFence64(&AVrfpSymContext.Expired);
+    Statistics->QueueLatency = AVrfpSymTicksToMicroseconds(ReadNoFence64(&AVrfpSymContext.QueueLatency));
+    Statistics->MaxQueueLatency = AVrfpSymTicksToMicroseconds(ReadNoFence64(&AVrfpSymContext.MaxQueueLatency));
+    Statistics->ServiceLatency = AVrfpSymTicksToMicroseconds(ReadNoFence64(&AVrfpSymContext.ServiceLatency));
+    Statistics->MaxServiceLatency = AVrfpSymTicksToMicroseconds(ReadNoFence64(&AVrfpSymContext.MaxServiceLatency));
+
+    return TRUE;
+}
@@ -195,15 +195,32 @@ InterlockedExchangeAcquireBoolean(
                                    VFDYNF_FAULT_TYPE_FUZZ_MMAP               |\
                                    VFDYNF_FAULT_TYPE_FUZZ_NET))
 
+#define VFDYNF_FAULT_FUZZ_MASK (VFDYNF_FAULT_TYPE_FUZZ_REG                   |\
+                                VFDYNF_FAULT_TYPE_FUZZ_FILE                  |\
+                                VFDYNF_FAULT_TYPE_FUZZ_MMAP                  |\
+                                VFDYNF_FAULT_TYPE_FUZZ_NET)
+
 #define VFDYN_SYMSEARCH_MAX_LENGTH (1024)
-#define VFDYN_REGEX_MAX_LENGTH     (16 * 1024)
 
+#define VFDYNF_SYM_EXPORT_RESOLVE_DISABLED 0ul
+#define VFDYNF_SYM_EXPORT_RESOLVE_FIRST    1ul
+#define VFDYNF_SYM_EXPORT_RESOLVE_ONLY     2ul
+
+#define VFDYNF_SYM_EXCL_UNKNOWN  0ul
+#define VFDYNF_SYM_EXCL_EXCLUDED 1ul
+#define VFDYNF_SYM_EXCL_INCLUDED 2ul
+
+//
+// N.B. The regular expression properties are variable length. They are not
+// stored in place, the property callback reads them into heap buffers sized
+// to the registry value. A null buffer means the property was not provided.
+//
 typedef struct _VFDYNF_PROPERTIES
 {
     ULONG GracePeriod;
     WCHAR SymbolSearchPath[VFDYN_SYMSEARCH_MAX_LENGTH];
-    WCHAR IncludeRegex[VFDYN_REGEX_MAX_LENGTH];
-    WCHAR ExclusionsRegex[VFDYN_REGEX_MAX_LENGTH];
+    PWCHAR IncludeRegex;
+    PWCHAR ExclusionsRegex;
     ULONG DynamicFaultPeroid;
     ULONG64 EnableFaultMask;
     ULONG FaultProbability;
@@ -211,6 +228,9 @@ typedef struct _VFDYNF_PROPERTIES
     ULONG FuzzSeed;
     ULONG FuzzCorruptionBlocks;
     ULONG FuzzChaosProbability;
+    ULONG FuzzMutationDensity;
+    ULONG FuzzMutationLimit;
+    BOOLEAN FuzzMMapLazyFill;
     ULONG FuzzSizeTruncateProbability;
     ULONG64 HeapReasonableAllocLimit;
     BOOLEAN EnableFaultsInLdrPath;
@@ -218,9 +238,19 @@ typedef struct _VFDYNF_PROPERTIES
     ULONG SymResolvePriority;
     ULONG SymResolveTimeout;
     ULONG SymAbandonedThreshold;
-    WCHAR StopRegex[VFDYN_REGEX_MAX_LENGTH];
-    WCHAR TypeIncludeRegex[VFDYNF_FAULT_TYPE_COUNT][VFDYN_REGEX_MAX_LENGTH];
-    WCHAR TypeExclusionsRegex[VFDYNF_FAULT_TYPE_COUNT][VFDYN_REGEX_MAX_LENGTH];
+    ULONG SymWorkerCount;
+    PWCHAR StopRegex;
+    WCHAR RegexCachePath[MAX_PATH];
+    WCHAR SymBrokerPipeName[MAX_PATH];
+    WCHAR FaultLogPath[MAX_PATH];
+    ULONG SymExportResolve;
+    BOOLEAN SymExclusionRanges;
+    BOOLEAN SymWarmUp;
+    ULONG RegexMatchLimit;
+    ULONG RegexDepthLimit;
+    ULONG RegexCostThreshold;
+    PWCHAR TypeIncludeRegex[VFDYNF_FAULT_TYPE_COUNT];
+    PWCHAR TypeExclusionsRegex[VFDYNF_FAULT_TYPE_COUNT];
 } VFDYNF_PROPERTIES, *PVFDYNF_PROPERTIES;
 
 #define VFDYNF_CODE_DEPRECATED_FUNCTION    0xdf01
@@ -278,9 +308,25 @@ BOOLEAN AVrfEnumLoadedModules(
     _In_opt_ PVOID Context
     );
 
+#define VFDYNF_FUZZ_RANDOM_BATCH 32
+
+//
+// Per thread fuzzing random state, see AVrfFuzzRandom. Values are generated
+// in batches and handed out from Values until Index reaches the batch size.
+//
+typedef struct _VFDYNF_FUZZ_RANDOM
+{
+    BOOLEAN Seeded;
+    ULONG Index;
+    ULONG64 State[4];
+    ULONG Values[VFDYNF_FUZZ_RANDOM_BATCH];
+} VFDYNF_FUZZ_RANDOM, *PVFDYNF_FUZZ_RANDOM;
+
 typedef struct _VFDYNF_TLS
 {
     ULONG SuppressFaultMask;
+    PCRE2_THREAD_HANDLE RegexThread;
+    VFDYNF_FUZZ_RANDOM FuzzRandom;
 } VFDYNF_TLS, *PVFDYNF_TLS;
 
 _Maybenull_
@@ -302,6 +348,63 @@ VOID AVrfStopProcessDetach(
     VOID
     );
 
+// regex.c
+
+_Must_inspect_result_
+NTSTATUS AVrfCompileRegex(
+    _Out_ PPCRE2_HANDLE Regex,
+    _In_ PUNICODE_STRING Pattern
+    );
+
+VOID AVrfCloseRegex(
+    _In_ PCRE2_HANDLE Regex
+    );
+
+_Must_inspect_result_
+NTSTATUS AVrfMatchRegex(
+    _In_ PCRE2_HANDLE Regex,
+    _In_ PCUNICODE_STRING String,
+    _Out_ PBOOLEAN Match
+    );
+
+BOOLEAN AVrfRegexProcessAttach(
+    VOID
+    );
+
+VOID AVrfRegexProcessDetach(
+    VOID
+    );
+
+// regexpf.c
+
+#define VFDYNF_REGEX_PREFILTER_MAX_PATTERNS 2048
+#define VFDYNF_REGEX_PREFILTER_BITMAP_SIZE  (VFDYNF_REGEX_PREFILTER_MAX_PATTERNS / 32)
+
+typedef struct _VFDYNF_REGEX_PREFILTER* PVFDYNF_REGEX_PREFILTER;
+
+_Must_inspect_result_
+NTSTATUS AVrfCreateRegexPrefilter(
+    _In_reads_(Count) PCUNICODE_STRING Patterns,
+    _In_ ULONG Count,
+    _Outptr_result_maybenull_ PVFDYNF_REGEX_PREFILTER* Prefilter
+    );
+
+VOID AVrfFreeRegexPrefilter(
+    _In_ PVFDYNF_REGEX_PREFILTER Prefilter
+    );
+
+VOID AVrfRegexPrefilterScan(
+    _In_ PVFDYNF_REGEX_PREFILTER Prefilter,
+    _In_ PCUNICODE_STRING String,
+    _Out_writes_(VFDYNF_REGEX_PREFILTER_BITMAP_SIZE) PULONG Candidates
+    );
+
+BOOLEAN AVrfRegexPrefilterIsCandidate(
+    _In_ PVFDYNF_REGEX_PREFILTER Prefilter,
+    _In_reads_(VFDYNF_REGEX_PREFILTER_BITMAP_SIZE) PULONG Candidates,
+    _In_ ULONG Index
+    );
+
 // hooks.c
 
 extern RTL_VERIFIER_DLL_DESCRIPTOR AVrfDllDescriptors[];
@@ -312,6 +415,23 @@ BOOLEAN AVrfLinkHooks(
 
 // symprv.c
 
+#define VFDYNF_SYM_MAX_FRAMES 250
+#define VFDYNF_SYM_ID_INVALID 0
+
+typedef ULONG VFDYNF_SYM_ID, *PVFDYNF_SYM_ID;
+
+//
+// A resolved stack, one interned symbol per frame. See AVrfSymGetStackText
+// for the text of the whole stack. Stacks which resolve to the same symbols
+// have the same fingerprint regardless of their addresses, it is never zero.
+//
+typedef struct _VFDYNF_SYM_STACK
+{
+    ULONG Count;
+    ULONG64 Fingerprint;
+    VFDYNF_SYM_ID Symbols[VFDYNF_SYM_MAX_FRAMES];
+} VFDYNF_SYM_STACK, *PVFDYNF_SYM_STACK;
+
 BOOLEAN AVrfSymProcessAttach(
     VOID
     );
@@ -336,15 +456,172 @@ BOOLEAN AvrfIsSymProviderThread(
     VOID
     );
 
+BOOLEAN AVrfSymIsModuleWarm(
+    _In_ PVOID Address
+    );
+
 NTSTATUS AVrfSymGetSymbols(
     _In_count_(FramesCount) CONST PVOID* Frames,
     _In_ ULONG FramesCount,
-    _Out_ PUNICODE_STRING* StackSymbols,
+    _In_ ULONG StackHash,
+    _Out_ PVFDYNF_SYM_STACK* Stack,
     _In_opt_ PLARGE_INTEGER Timeout
     );
 
+NTSTATUS AVrfSymGetStackText(
+    _In_ PVFDYNF_SYM_STACK Stack,
+    _Out_ PCUNICODE_STRING* Text
+    );
+
 VOID AVrfSymFreeSymbols(
-    _In_ PUNICODE_STRING StackSymbols
+    _In_ PVFDYNF_SYM_STACK Stack
+    );
+
+// symintern.c
+
+#define VFDYNF_SYM_INTERN_FRAME_BITS 64
+
+VFDYNF_SYM_ID AVrfSymInternSymbol(
+    _In_ PCUNICODE_STRING Symbol
+    );
+
+BOOLEAN AVrfSymInternGetSymbol(
+    _In_ VFDYNF_SYM_ID Id,
+    _Out_ PUNICODE_STRING Symbol
+    );
+
+BOOLEAN AVrfSymInternQueryMask(
+    _In_ VFDYNF_SYM_ID Id,
+    _Out_ PULONG Mask
+    );
+
+VOID AVrfSymInternSetMask(
+    _In_ VFDYNF_SYM_ID Id,
+    _In_ ULONG Mask
+    );
+
+BOOLEAN AVrfSymInternQueryFrameMatch(
+    _In_ VFDYNF_SYM_ID Id,
+    _In_ ULONG Index,
+    _Out_ PBOOLEAN Match
+    );
+
+VOID AVrfSymInternSetFrameMatch(
+    _In_ VFDYNF_SYM_ID Id,
+    _In_ ULONG Index,
+    _In_ BOOLEAN Match
+    );
+
+VOID AVrfSymInternCleanup(
+    VOID
+    );
+
+// framepat.c
+
+#define VFDYNF_FRAME_PATTERN_PREFIX       L"frames:"
+#define VFDYNF_FRAME_PATTERN_MAX_ELEMENTS 31
+
+typedef struct _VFDYNF_FRAME_PATTERN* PVFDYNF_FRAME_PATTERN;
+
+BOOLEAN AVrfIsFramePattern(
+    _In_ PCUNICODE_STRING Pattern
+    );
+
+_Must_inspect_result_
+NTSTATUS AVrfCompileFramePattern(
+    _In_ PCUNICODE_STRING Pattern,
+    _Outptr_ PVFDYNF_FRAME_PATTERN* FramePattern
+    );
+
+VOID AVrfFreeFramePattern(
+    _In_ PVFDYNF_FRAME_PATTERN FramePattern
+    );
+
+_Must_inspect_result_
+NTSTATUS AVrfMatchFramePattern(
+    _In_ PVFDYNF_FRAME_PATTERN FramePattern,
+    _In_ PVFDYNF_SYM_STACK Stack,
+    _Out_ PBOOLEAN Match
+    );
+
+// symbrk.c
+
+typedef
+_Function_class_(AVRF_SYM_BROKER_CALLBACK)
+VOID
+NTAPI
+AVRF_SYM_BROKER_CALLBACK(
+    _In_ PVOID Frame,
+    _In_ PUNICODE_STRING Symbol,
+    _In_opt_ PVOID Context
+    );
+typedef AVRF_SYM_BROKER_CALLBACK* PAVRF_SYM_BROKER_CALLBACK;
+
+BOOLEAN AVrfSymBrokerEnabled(
+    VOID
+    );
+
+NTSTATUS AVrfSymBrokerResolve(
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount,
+    _In_ PAVRF_SYM_BROKER_CALLBACK Callback,
+    _In_opt_ PVOID Context
+    );
+
+VOID AVrfSymBrokerCleanup(
+    VOID
+    );
+
+// symexp.c
+
+BOOLEAN AVrfSymExportEnabled(
+    VOID
+    );
+
+BOOLEAN AVrfSymExportExclusive(
+    VOID
+    );
+
+VOID AVrfSymExportTrackModule(
+    _In_ PVOID BaseAddress,
+    _In_ SIZE_T Size,
+    _In_ PCUNICODE_STRING BaseName
+    );
+
+VOID AVrfSymExportUntrackModule(
+    _In_ PVOID BaseAddress
+    );
+
+BOOLEAN AVrfSymExportResolveFrame(
+    _In_ PVOID Frame,
+    _In_ BOOLEAN Nearest,
+    _Inout_ PUNICODE_STRING Symbol
+    );
+
+VOID AVrfSymExportCleanup(
+    VOID
+    );
+
+// symexcl.c
+
+VOID AVrfSymExclTrackModule(
+    _In_ PVOID BaseAddress,
+    _In_ SIZE_T Size,
+    _In_ PCUNICODE_STRING BaseName
+    );
+
+VOID AVrfSymExclUntrackModule(
+    _In_ PVOID BaseAddress
+    );
+
+ULONG AVrfSymExclCheckStack(
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount,
+    _In_ ULONG FaultType
+    );
+
+VOID AVrfSymExclCleanup(
+    VOID
     );
 
 // except.c
@@ -394,6 +671,12 @@ BOOLEAN AVrfFuzzProbability(
     _In_ ULONG Probability
     );
 
+VOID AVrfFuzzBeginEvent(
+    _In_ ULONG FaultType,
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount
+    );
+
 VOID AVrfFuzzBuffer(
     _Inout_bytecount_(Length) PVOID Buffer,
     _In_ SIZE_T Length,
@@ -425,6 +708,11 @@ PVOID AVrfForgetFuzzedMemoryMapping(
     _In_ PVOID BaseAddress
     );
 
+BOOLEAN AVrfFuzzMemoryMappingFault(
+    _In_ PVOID Address,
+    _In_ ULONG_PTR AccessType
+    );
+
 BOOLEAN AVrfBufferIsPossiblyFuzzed(
     _In_reads_bytes_opt_(Length) CONST VOID* Buffer,
     _In_ SIZE_T Length
@@ -450,6 +738,42 @@ BOOLEAN AVrfShouldFaultInject(
     _In_opt_ _Maybenull_ PVOID CallerAddress
     );
 
+BOOLEAN AVrfFaultPrepareFrameExclusions(
+    _Out_ PBOOLEAN HasFrameExclusions
+    );
+
+ULONG AVrfFaultFrameExclusionMask(
+    _In_ PCUNICODE_STRING Symbol,
+    _Out_ PBOOLEAN Cacheable
+    );
+
+BOOLEAN AVrfFaultIsModuleIncluded(
+    _In_ PCUNICODE_STRING BaseName
+    );
+
+// fltlog.c
+
+BOOLEAN AVrfFaultLogEnabled(
+    VOID
+    );
+
+VOID AVrfFaultLogRecord(
+    _In_ ULONG FaultType,
+    _In_ ULONG StackHash,
+    _In_count_(FramesCount) CONST PVOID* Frames,
+    _In_ ULONG FramesCount
+    );
+
+VOID AVrfFaultLogDllUnload(
+    _In_z_ PCWSTR DllName,
+    _In_ PVOID DllBase,
+    _In_ SIZE_T DllSize
+    );
+
+VOID AVrfFaultLogProcessDetach(
+    VOID
+    );
+
 // stacktrk.c
 
 typedef struct _AVRF_STACK_ENTRY
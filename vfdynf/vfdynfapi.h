@@ -27,6 +27,52 @@ EXTERN_C_START
 #define VFDYNF_FAULT_TYPE_FUZZ_NET        0x00001000ul
 #define VFDYNF_FAULT_TYPE_ALL             0x00001FFFul
 
+#define VFDYNF_SYMBOL_BUFFER_CLASS_COUNT  3
+
+typedef struct _VFDYNF_POOL_STATISTICS
+{
+    ULONG EntrySize;
+    ULONG Allocated;
+    ULONG InUse;
+    ULONG PeakInUse;
+    ULONG Free;
+    ULONG MaxFree;
+} VFDYNF_POOL_STATISTICS, *PVFDYNF_POOL_STATISTICS;
+
+typedef struct _VFDYNF_SYMBOL_STATISTICS
+{
+    ULONG Size;
+    ULONG Abandoned;
+    VFDYNF_POOL_STATISTICS Requests;
+    VFDYNF_POOL_STATISTICS Buffers[VFDYNF_SYMBOL_BUFFER_CLASS_COUNT];
+    ULONG64 CacheHits;
+    ULONG64 CacheMisses;
+    ULONG WarmPending;
+    ULONG WarmReady;
+    ULONG Workers;
+    ULONG QueueDepth;
+    ULONG PeakQueueDepth;
+    ULONG64 Completed;
+    ULONG64 Expired;
+    ULONG64 QueueLatency;
+    ULONG64 MaxQueueLatency;
+    ULONG64 ServiceLatency;
+    ULONG64 MaxServiceLatency;
+} VFDYNF_SYMBOL_STATISTICS, *PVFDYNF_SYMBOL_STATISTICS;
+
+#define VFDYNF_REGEX_PATTERN_LENGTH       128
+
+typedef struct _VFDYNF_REGEX_STATISTICS
+{
+    ULONG64 Matches;
+    ULONG64 TotalTime;
+    ULONG64 MaxTime;
+    ULONG LimitHits;
+    BOOLEAN Disabled;
+    BOOLEAN Closed;
+    WCHAR Pattern[VFDYNF_REGEX_PATTERN_LENGTH];
+} VFDYNF_REGEX_STATISTICS, *PVFDYNF_REGEX_STATISTICS;
+
 /**
  * \brief Runtime suppresses fault injection for the process.
  *
@@ -103,6 +149,55 @@ AVrfRestoreCurrentThreadFaultInjection(
     _In_ ULONG FaultMask
     );
 
+/**
+ * \brief Queries statistics of the symbol provider.
+ *
+ * \details Reports occupancy of the symbol request and stack string buffer
+ * pools, the effectiveness of the symbol cache, and the depth of the work
+ * queue. Expired counts requests dropped from the queue because every waiter
+ * had timed out before a worker reached them. Latencies are totals and maximums in microseconds, queue latency is
+ * the time a request waited for a worker and service latency the time a
+ * worker spent on it. The counters are sampled without synchronization and
+ * should be treated as approximate. The caller must initialize the Size
+ * member to sizeof(VFDYNF_SYMBOL_STATISTICS).
+ *
+ * \param[in,out] Statistics Receives the symbol provider statistics.
+ *
+ * \return TRUE if the statistics were queried, FALSE otherwise.
+ */
+VFDYNFAPI
+BOOLEAN
+NTAPI
+AVrfQuerySymbolStatistics(
+    _Inout_ PVFDYNF_SYMBOL_STATISTICS Statistics
+    );
+
+/**
+ * \brief Queries the cost of each compiled regular expression.
+ *
+ * \details Reports one entry per compiled expression, in no particular
+ * order. Times are totals and maximums in microseconds. LimitHits counts the
+ * matches which exceeded RegexMatchLimit or RegexDepthLimit, Disabled is set
+ * once the average time of the expression exceeded RegexCostThreshold. The
+ * pattern is truncated to fit. The counters are sampled without
+ * synchronization and should be treated as approximate.
+ *
+ * \param[out] Statistics Optionally receives the statistics.
+ * \param[in] Count Number of entries in the Statistics buffer.
+ * \param[out] ReturnCount Receives the number of compiled expressions.
+ *
+ * \return TRUE if the statistics of every expression were returned, FALSE if
+ * the buffer was not provided or is too small.
+ */
+VFDYNFAPI
+BOOLEAN
+NTAPI
+AVrfQueryRegexStatistics(
+    _Out_writes_to_opt_(Count, *ReturnCount) PVFDYNF_REGEX_STATISTICS Statistics,
+    _In_ ULONG Count,
+    _Out_ PULONG ReturnCount
+    );
+
 EXTERN_C_END
 
 #endif
@@ -0,0 +1,526 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include "vflog.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VFSYMDIR_MAX_PATH 4096
+
+typedef struct _VFSYMDIR_SYMBOL
+{
+    ULONG StartRva;
+    ULONG EndRva;
+    ULONG MaxEndRva; // of this and every symbol before it
+    PCHAR Name;
+} VFSYMDIR_SYMBOL, *PVFSYMDIR_SYMBOL;
+
+struct _VFSYMDIR_MAP
+{
+    PVFSYMDIR_MAP Next;
+    PCHAR BaseName;
+    ULONG TimeDateStamp;
+    ULONG SizeOfImage;
+    BOOLEAN Found;
+    ULONG SymbolCount;
+    PVFSYMDIR_SYMBOL Symbols;
+};
+
+struct _VFSYMDIR
+{
+    PCHAR Path;
+    PVFSYMDIR_MAP Maps;
+};
+
+static int VfSymDirpCompareSymbols(
+    const void* Lhs,
+    const void* Rhs
+    )
+{
+    const VFSYMDIR_SYMBOL* lhs = Lhs;
+    const VFSYMDIR_SYMBOL* rhs = Rhs;
+
+    if (lhs->StartRva != rhs->StartRva)
+    {
+        return ((lhs->StartRva < rhs->StartRva) ? -1 : 1);
+    }
+
+    return strcmp(lhs->Name, rhs->Name);
+}
+
+static PCHAR VfSymDirpReadFile(
+    PCSTR Path
+    )
+{
+    FILE* file;
+    PCHAR buffer;
+    SIZE_T length;
+    SIZE_T capacity;
+
+    file = fopen(Path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+
+    buffer = NULL;
+    length = 0;
+    capacity = 0;
+
+    for (;;)
+    {
+        SIZE_T bytesRead;
+
+        if ((capacity - length) < 4096)
+        {
+            PCHAR grown;
+
+            capacity = (capacity ? (capacity * 2) : 65536);
+
+            grown = realloc(buffer, capacity + 1);
+            if (!grown)
+            {
+                free(buffer);
+                buffer = NULL;
+                goto Exit;
+            }
+
+            buffer = grown;
+        }
+
+        bytesRead = fread(&buffer[length], 1, (capacity - length), file);
+        length += bytesRead;
+
+        if (bytesRead == 0)
+        {
+            break;
+        }
+    }
+
+    if (ferror(file))
+    {
+        free(buffer);
+        buffer = NULL;
+        goto Exit;
+    }
+
+    buffer[length] = '\0';
+
+Exit:
+
+    fclose(file);
+
+    return buffer;
+}
+
+static BOOLEAN VfSymDirpParse(
+    PVFSYMDIR_MAP Map,
+    PCHAR Text
+    )
+{
+    ULONG capacity;
+    PCHAR line;
+
+    capacity = 0;
+
+    for (line = Text; line && *line; )
+    {
+        PCHAR next;
+        PCHAR cursor;
+        PCHAR end;
+        unsigned long rva;
+        unsigned long size;
+        SIZE_T nameLength;
+        PVFSYMDIR_SYMBOL symbol;
+
+        next = strchr(line, '\n');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+
+        cursor = line;
+        line = next;
+
+        while (isspace((unsigned char)*cursor))
+        {
+            cursor++;
+        }
+
+        if ((*cursor == '\0') || (*cursor == '#'))
+        {
+            continue;
+        }
+
+        rva = strtoul(cursor, &end, 16);
+        if ((end == cursor) || !isspace((unsigned char)*end) || (rva > 0xfffffffful))
+        {
+            continue;
+        }
+
+        cursor = end;
+        size = strtoul(cursor, &end, 16);
+        if ((end == cursor) || !isspace((unsigned char)*end) || (size > 0xfffffffful))
+        {
+            continue;
+        }
+
+        cursor = end;
+        while (isspace((unsigned char)*cursor))
+        {
+            cursor++;
+        }
+
+        nameLength = strlen(cursor);
+        while (nameLength && isspace((unsigned char)cursor[nameLength - 1]))
+        {
+            nameLength--;
+        }
+
+        if (!nameLength)
+        {
+            continue;
+        }
+
+        if (Map->SymbolCount == capacity)
+        {
+            PVFSYMDIR_SYMBOL grown;
+
+            capacity = (capacity ? (capacity * 2) : 256);
+
+            grown = realloc(Map->Symbols, capacity * sizeof(VFSYMDIR_SYMBOL));
+            if (!grown)
+            {
+                return FALSE;
+            }
+
+            Map->Symbols = grown;
+        }
+
+        symbol = &Map->Symbols[Map->SymbolCount];
+
+        symbol->Name = malloc(nameLength + 1);
+        if (!symbol->Name)
+        {
+            return FALSE;
+        }
+
+        memcpy(symbol->Name, cursor, nameLength);
+        symbol->Name[nameLength] = '\0';
+
+        symbol->StartRva = (ULONG)rva;
+
+        //
+        // Zero for now, a symbol without a size is sized once sorted.
+        //
+        if (size && (size <= (0xfffffffful - rva)))
+        {
+            symbol->EndRva = (ULONG)(rva + size);
+        }
+        else
+        {
+            symbol->EndRva = 0;
+        }
+
+        Map->SymbolCount++;
+    }
+
+    if (Map->SymbolCount)
+    {
+        qsort(Map->Symbols,
+              Map->SymbolCount,
+              sizeof(VFSYMDIR_SYMBOL),
+              VfSymDirpCompareSymbols);
+    }
+
+    for (ULONG i = 0; i < Map->SymbolCount; i++)
+    {
+        PVFSYMDIR_SYMBOL symbol;
+
+        symbol = &Map->Symbols[i];
+
+        if (symbol->EndRva)
+        {
+            continue;
+        }
+
+        //
+        // Extends to the next symbol which starts after it, or to the end of
+        // the image.
+        //
+        symbol->EndRva = Map->SizeOfImage;
+
+        for (ULONG j = (i + 1); j < Map->SymbolCount; j++)
+        {
+            if (Map->Symbols[j].StartRva > symbol->StartRva)
+            {
+                symbol->EndRva = Map->Symbols[j].StartRva;
+                break;
+            }
+        }
+    }
+
+    for (ULONG i = 0; i < Map->SymbolCount; i++)
+    {
+        ULONG previous;
+
+        previous = (i ? Map->Symbols[i - 1].MaxEndRva : 0);
+
+        Map->Symbols[i].MaxEndRva = ((Map->Symbols[i].EndRva > previous) ?
+                                     Map->Symbols[i].EndRva :
+                                     previous);
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN VfSymDirpLoad(
+    PVFSYMDIR SymDir,
+    PVFSYMDIR_MAP Map,
+    PCSTR BaseName
+    )
+{
+    CHAR path[VFSYMDIR_MAX_PATH];
+    PCHAR text;
+    BOOLEAN result;
+    int length;
+
+    length = snprintf(path,
+                      sizeof(path),
+                      "%s/%s/%08X%x/%s.sym",
+                      SymDir->Path,
+                      BaseName,
+                      Map->TimeDateStamp,
+                      Map->SizeOfImage,
+                      BaseName);
+    if ((length < 0) || ((SIZE_T)length >= sizeof(path)))
+    {
+        return FALSE;
+    }
+
+    text = VfSymDirpReadFile(path);
+    if (!text)
+    {
+        return FALSE;
+    }
+
+    result = VfSymDirpParse(Map, text);
+
+    free(text);
+
+    return result;
+}
+
+static VOID VfSymDirpFreeMap(
+    PVFSYMDIR_MAP Map
+    )
+{
+    for (ULONG i = 0; i < Map->SymbolCount; i++)
+    {
+        free(Map->Symbols[i].Name);
+    }
+
+    free(Map->Symbols);
+    free(Map->BaseName);
+    free(Map);
+}
+
+PVFSYMDIR VfSymDirOpen(
+    PCSTR Path
+    )
+{
+    PVFSYMDIR symDir;
+    SIZE_T length;
+
+    symDir = calloc(1, sizeof(*symDir));
+    if (!symDir)
+    {
+        return NULL;
+    }
+
+    length = strlen(Path);
+
+    symDir->Path = malloc(length + 1);
+    if (!symDir->Path)
+    {
+        free(symDir);
+        return NULL;
+    }
+
+    memcpy(symDir->Path, Path, length + 1);
+
+    while ((length > 1) && (symDir->Path[length - 1] == '/'))
+    {
+        symDir->Path[--length] = '\0';
+    }
+
+    return symDir;
+}
+
+VOID VfSymDirClose(
+    PVFSYMDIR SymDir
+    )
+{
+    PVFSYMDIR_MAP map;
+
+    map = SymDir->Maps;
+
+    while (map)
+    {
+        PVFSYMDIR_MAP next;
+
+        next = map->Next;
+        VfSymDirpFreeMap(map);
+        map = next;
+    }
+
+    free(SymDir->Path);
+    free(SymDir);
+}
+
+//
+// Maps are kept for the life of the directory, including the modules which
+// have no symbols, so each module identity is looked up on disk once no
+// matter how many logs or faults refer to it.
+//
+PCVFSYMDIR_MAP VfSymDirLoadModule(
+    PVFSYMDIR SymDir,
+    PCSTR BaseName,
+    ULONG TimeDateStamp,
+    ULONG SizeOfImage
+    )
+{
+    PVFSYMDIR_MAP map;
+    CHAR lowerName[VFSYMSRV_MAX_MODULE_PATH * 4];
+    SIZE_T length;
+
+    for (map = SymDir->Maps; map; map = map->Next)
+    {
+        if ((map->TimeDateStamp == TimeDateStamp) &&
+            (map->SizeOfImage == SizeOfImage) &&
+            (strcmp(map->BaseName, BaseName) == 0))
+        {
+            return (map->Found ? map : NULL);
+        }
+    }
+
+    length = strlen(BaseName);
+
+    map = calloc(1, sizeof(*map));
+    if (!map)
+    {
+        return NULL;
+    }
+
+    map->BaseName = malloc(length + 1);
+    if (!map->BaseName)
+    {
+        free(map);
+        return NULL;
+    }
+
+    memcpy(map->BaseName, BaseName, length + 1);
+    map->TimeDateStamp = TimeDateStamp;
+    map->SizeOfImage = SizeOfImage;
+
+    //
+    // Windows file names are case insensitive and the same module is logged
+    // with whatever case it was loaded by, try the name as logged and then in
+    // lower case, which is how symbol stores usually name the directories.
+    //
+    map->Found = VfSymDirpLoad(SymDir, map, BaseName);
+
+    if (!map->Found && (length < sizeof(lowerName)))
+    {
+        BOOLEAN differs;
+
+        differs = FALSE;
+
+        for (SIZE_T i = 0; i <= length; i++)
+        {
+            lowerName[i] = (CHAR)tolower((unsigned char)BaseName[i]);
+            differs |= (lowerName[i] != BaseName[i]);
+        }
+
+        if (differs)
+        {
+            map->Found = VfSymDirpLoad(SymDir, map, lowerName);
+        }
+    }
+
+    map->Next = SymDir->Maps;
+    SymDir->Maps = map;
+
+    return (map->Found ? map : NULL);
+}
+
+BOOLEAN VfSymDirLookup(
+    PCVFSYMDIR_MAP Map,
+    ULONG Rva,
+    PCSTR* Name,
+    PULONG Displacement
+    )
+{
+    ULONG low;
+    ULONG high;
+
+    if (!Map || !Map->SymbolCount)
+    {
+        return FALSE;
+    }
+
+    //
+    // Find the last symbol starting at or before the RVA.
+    //
+    low = 0;
+    high = Map->SymbolCount;
+
+    while (low < high)
+    {
+        ULONG middle;
+
+        middle = (low + ((high - low) / 2));
+
+        if (Map->Symbols[middle].StartRva <= Rva)
+        {
+            low = (middle + 1);
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if (!low)
+    {
+        return FALSE;
+    }
+
+    //
+    // Symbols may nest, walk back to the closest one which covers the RVA
+    // until no symbol further back reaches it.
+    //
+    for (ULONG i = low; i > 0; i--)
+    {
+        const VFSYMDIR_SYMBOL* symbol;
+
+        symbol = &Map->Symbols[i - 1];
+
+        if (Rva >= symbol->MaxEndRva)
+        {
+            break;
+        }
+
+        if (Rva < symbol->EndRva)
+        {
+            *Name = symbol->Name;
+            *Displacement = (Rva - symbol->StartRva);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
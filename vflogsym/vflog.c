@@ -0,0 +1,351 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include "vflog.h"
+
+#include <string.h>
+
+static USHORT VfLogpRead16(
+    PCBYTE Buffer
+    )
+{
+    return (USHORT)(Buffer[0] | (Buffer[1] << 8));
+}
+
+static ULONG VfLogpRead32(
+    PCBYTE Buffer
+    )
+{
+    return ((ULONG)Buffer[0] |
+            ((ULONG)Buffer[1] << 8) |
+            ((ULONG)Buffer[2] << 16) |
+            ((ULONG)Buffer[3] << 24));
+}
+
+static LONGLONG VfLogpRead64(
+    PCBYTE Buffer
+    )
+{
+    return (LONGLONG)((uint64_t)VfLogpRead32(Buffer) |
+                      ((uint64_t)VfLogpRead32(Buffer + 4) << 32));
+}
+
+#define VFLOG_READ16(Buffer, Type, Field)                                     \
+    VfLogpRead16((Buffer) + FIELD_OFFSET(Type, Field))
+#define VFLOG_READ32(Buffer, Type, Field)                                     \
+    VfLogpRead32((Buffer) + FIELD_OFFSET(Type, Field))
+#define VFLOG_READ64(Buffer, Type, Field)                                     \
+    VfLogpRead64((Buffer) + FIELD_OFFSET(Type, Field))
+
+static BOOLEAN VfLogpReadModule(
+    PCBYTE Record,
+    ULONG Length,
+    PVFLOG_MODULE Module
+    )
+{
+    ULONG nameLength;
+    PCBYTE name;
+
+    if (Length < FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName))
+    {
+        return FALSE;
+    }
+
+    nameLength = VFLOG_READ16(Record, VFSYMSRV_LOG_MODULE, NameLength);
+
+    if ((nameLength >= (VFSYMSRV_MAX_MODULE_PATH * sizeof(WCHAR))) ||
+        (nameLength > (Length - FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName))))
+    {
+        return FALSE;
+    }
+
+    Module->Index = VFLOG_READ32(Record, VFSYMSRV_LOG_MODULE, Index);
+    Module->TimeDateStamp = VFLOG_READ32(Record, VFSYMSRV_LOG_MODULE, TimeDateStamp);
+    Module->SizeOfImage = VFLOG_READ32(Record, VFSYMSRV_LOG_MODULE, SizeOfImage);
+    Module->NameLength = (nameLength / sizeof(WCHAR));
+
+    name = (Record + FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName));
+
+    for (ULONG i = 0; i < Module->NameLength; i++)
+    {
+        Module->FullName[i] = VfLogpRead16(name + (i * sizeof(WCHAR)));
+    }
+
+    Module->FullName[Module->NameLength] = 0;
+
+    return TRUE;
+}
+
+static BOOLEAN VfLogpReadFault(
+    PCBYTE Record,
+    ULONG Length,
+    PVFLOG_FAULT Fault
+    )
+{
+    ULONG frameCount;
+    PCBYTE frames;
+
+    if (Length < FIELD_OFFSET(VFSYMSRV_LOG_FAULT, Frames))
+    {
+        return FALSE;
+    }
+
+    frameCount = VFLOG_READ32(Record, VFSYMSRV_LOG_FAULT, FrameCount);
+
+    if ((frameCount > VFSYMSRV_MAX_FRAMES) ||
+        (Length != (FIELD_OFFSET(VFSYMSRV_LOG_FAULT, Frames) +
+                    (frameCount * sizeof(VFSYMSRV_FRAME)))))
+    {
+        return FALSE;
+    }
+
+    Fault->FaultType = VFLOG_READ32(Record, VFSYMSRV_LOG_FAULT, FaultType);
+    Fault->StackHash = VFLOG_READ32(Record, VFSYMSRV_LOG_FAULT, StackHash);
+    Fault->ThreadId = VFLOG_READ32(Record, VFSYMSRV_LOG_FAULT, ThreadId);
+    Fault->FrameCount = frameCount;
+    Fault->Time = VFLOG_READ64(Record, VFSYMSRV_LOG_FAULT, Time);
+
+    frames = (Record + FIELD_OFFSET(VFSYMSRV_LOG_FAULT, Frames));
+
+    for (ULONG i = 0; i < frameCount; i++)
+    {
+        PCBYTE frame;
+
+        frame = (frames + (i * sizeof(VFSYMSRV_FRAME)));
+
+        Fault->Frames[i].ModuleIndex = VFLOG_READ32(frame, VFSYMSRV_FRAME, ModuleIndex);
+        Fault->Frames[i].Rva = VFLOG_READ32(frame, VFSYMSRV_FRAME, Rva);
+    }
+
+    return TRUE;
+}
+
+//
+// Returns FALSE only if the header is not a log this reader understands. A log
+// truncated part way through a record, as when the process was killed while
+// writing, is parsed up to the truncation which is noted in the summary.
+//
+BOOLEAN VfLogParse(
+    PCBYTE Buffer,
+    SIZE_T Length,
+    PCVFLOG_CALLBACKS Callbacks,
+    PVOID Context,
+    PVFLOG_SUMMARY Summary
+    )
+{
+    VFLOG_MODULE module;
+    VFLOG_FAULT fault;
+    SIZE_T offset;
+
+    memset(Summary, 0, sizeof(*Summary));
+
+    if ((Length < sizeof(VFSYMSRV_LOG_HEADER)) ||
+        (VFLOG_READ32(Buffer, VFSYMSRV_LOG_HEADER, Magic) != VFSYMSRV_LOG_MAGIC) ||
+        (VFLOG_READ32(Buffer, VFSYMSRV_LOG_HEADER, Version) != VFSYMSRV_LOG_VERSION))
+    {
+        return FALSE;
+    }
+
+    Summary->ProcessId = VFLOG_READ32(Buffer, VFSYMSRV_LOG_HEADER, ProcessId);
+    Summary->StartTime = VFLOG_READ64(Buffer, VFSYMSRV_LOG_HEADER, StartTime);
+
+    offset = sizeof(VFSYMSRV_LOG_HEADER);
+
+    while (offset < Length)
+    {
+        PCBYTE record;
+        USHORT type;
+        ULONG recordLength;
+
+        record = (Buffer + offset);
+
+        if ((Length - offset) < sizeof(VFSYMSRV_LOG_RECORD))
+        {
+            Summary->Truncated = TRUE;
+            Summary->TruncatedOffset = (ULONG)offset;
+            break;
+        }
+
+        type = VFLOG_READ16(record, VFSYMSRV_LOG_RECORD, Type);
+        recordLength = VFLOG_READ32(record, VFSYMSRV_LOG_RECORD, Length);
+
+        if ((recordLength < sizeof(VFSYMSRV_LOG_RECORD)) ||
+            (recordLength > (Length - offset)))
+        {
+            Summary->Truncated = TRUE;
+            Summary->TruncatedOffset = (ULONG)offset;
+            break;
+        }
+
+        if (type == VFSYMSRV_LOG_RECORD_MODULE)
+        {
+            if (VfLogpReadModule(record, recordLength, &module))
+            {
+                Summary->Modules++;
+
+                if (Callbacks && Callbacks->Module)
+                {
+                    Callbacks->Module(Context, &module);
+                }
+            }
+            else
+            {
+                Summary->Invalid++;
+
+                if (Callbacks && Callbacks->Invalid)
+                {
+                    Callbacks->Invalid(Context, type, (ULONG)offset);
+                }
+            }
+        }
+        else if (type == VFSYMSRV_LOG_RECORD_FAULT)
+        {
+            if (VfLogpReadFault(record, recordLength, &fault))
+            {
+                Summary->Faults++;
+
+                if (Callbacks && Callbacks->Fault)
+                {
+                    Callbacks->Fault(Context, &fault);
+                }
+            }
+            else
+            {
+                Summary->Invalid++;
+
+                if (Callbacks && Callbacks->Invalid)
+                {
+                    Callbacks->Invalid(Context, type, (ULONG)offset);
+                }
+            }
+        }
+        else
+        {
+            Summary->Unknown++;
+        }
+
+        offset += recordLength;
+    }
+
+    return TRUE;
+}
+
+//
+// Module indices are assigned in order, so no valid index reaches the count
+// of the smallest module records that fit in the log.
+//
+ULONG VfLogMaxModules(
+    SIZE_T Length
+    )
+{
+    SIZE_T count;
+
+    count = (Length / FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName));
+
+    return ((count > 0xfffffffful) ? 0xfffffffful : (ULONG)count);
+}
+
+//
+// Unpaired surrogates become U+FFFD. The output is always terminated and is
+// truncated on a character boundary if the buffer is too small.
+//
+SIZE_T VfLogToUtf8(
+    PCWCH String,
+    ULONG Length,
+    PCHAR Buffer,
+    SIZE_T BufferSize
+    )
+{
+    SIZE_T used;
+
+    if (!BufferSize)
+    {
+        return 0;
+    }
+
+    used = 0;
+
+    for (ULONG i = 0; i < Length; i++)
+    {
+        uint32_t c;
+        BYTE encoded[4];
+        SIZE_T count;
+
+        c = String[i];
+
+        if ((c >= 0xd800) && (c <= 0xdbff) &&
+            ((i + 1) < Length) &&
+            (String[i + 1] >= 0xdc00) && (String[i + 1] <= 0xdfff))
+        {
+            c = (0x10000 + ((c - 0xd800) << 10) + (String[i + 1] - 0xdc00));
+            i++;
+        }
+        else if ((c >= 0xd800) && (c <= 0xdfff))
+        {
+            c = 0xfffd;
+        }
+
+        if (c < 0x80)
+        {
+            encoded[0] = (BYTE)c;
+            count = 1;
+        }
+        else if (c < 0x800)
+        {
+            encoded[0] = (BYTE)(0xc0 | (c >> 6));
+            encoded[1] = (BYTE)(0x80 | (c & 0x3f));
+            count = 2;
+        }
+        else if (c < 0x10000)
+        {
+            encoded[0] = (BYTE)(0xe0 | (c >> 12));
+            encoded[1] = (BYTE)(0x80 | ((c >> 6) & 0x3f));
+            encoded[2] = (BYTE)(0x80 | (c & 0x3f));
+            count = 3;
+        }
+        else
+        {
+            encoded[0] = (BYTE)(0xf0 | (c >> 18));
+            encoded[1] = (BYTE)(0x80 | ((c >> 12) & 0x3f));
+            encoded[2] = (BYTE)(0x80 | ((c >> 6) & 0x3f));
+            encoded[3] = (BYTE)(0x80 | (c & 0x3f));
+            count = 4;
+        }
+
+        if ((used + count) >= BufferSize)
+        {
+            break;
+        }
+
+        memcpy(&Buffer[used], encoded, count);
+        used += count;
+    }
+
+    Buffer[used] = '\0';
+
+    return used;
+}
+
+SIZE_T VfLogModuleBaseName(
+    PCVFLOG_MODULE Module,
+    PCHAR Buffer,
+    SIZE_T BufferSize
+    )
+{
+    ULONG start;
+
+    start = 0;
+
+    for (ULONG i = 0; i < Module->NameLength; i++)
+    {
+        if ((Module->FullName[i] == L'\\') || (Module->FullName[i] == L'/'))
+        {
+            start = (i + 1);
+        }
+    }
+
+    return VfLogToUtf8(&Module->FullName[start],
+                       (Module->NameLength - start),
+                       Buffer,
+                       BufferSize);
+}
@@ -0,0 +1,174 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#pragma once
+
+//
+// Portable reader of the fault logs vfdynf writes (see include/vfsymsrv.h)
+// and the stand-in symbol directory used to symbolize them on any host.
+//
+// The log layout comes from include/vfsymsrv.h, which only needs the base
+// types defined here. Fields are read as little endian at their offsets, the
+// records are never cast, so the reader does not depend on the alignment or
+// byte order of the host.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t BYTE, *PBYTE;
+typedef const BYTE* PCBYTE;
+typedef uint8_t BOOLEAN, *PBOOLEAN;
+typedef uint16_t USHORT, *PUSHORT;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG;
+typedef uint16_t WCHAR, *PWCHAR;
+typedef const WCHAR* PCWCH;
+typedef char CHAR, *PCHAR;
+typedef const char* PCSTR;
+typedef size_t SIZE_T, *PSIZE_T;
+typedef void VOID, *PVOID;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        int32_t HighPart;
+    };
+    _Alignas(8) LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+#define TRUE  1
+#define FALSE 0
+
+#define ANYSIZE_ARRAY 1
+#define FIELD_OFFSET(Type, Field) ((ULONG)offsetof(Type, Field))
+
+#include <vfsymsrv.h>
+
+_Static_assert(sizeof(VFSYMSRV_LOG_HEADER) == 24, "log header layout");
+_Static_assert(sizeof(VFSYMSRV_LOG_RECORD) == 8, "log record layout");
+_Static_assert(FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName) == 24, "log module layout");
+_Static_assert(FIELD_OFFSET(VFSYMSRV_LOG_FAULT, Time) == 24, "log fault layout");
+_Static_assert(FIELD_OFFSET(VFSYMSRV_LOG_FAULT, Frames) == 32, "log fault layout");
+_Static_assert(sizeof(VFSYMSRV_FRAME) == 8, "frame layout");
+
+typedef struct _VFLOG_MODULE
+{
+    ULONG Index;
+    ULONG TimeDateStamp;
+    ULONG SizeOfImage;
+    ULONG NameLength; // characters
+    WCHAR FullName[VFSYMSRV_MAX_MODULE_PATH];
+} VFLOG_MODULE, *PVFLOG_MODULE;
+
+typedef const VFLOG_MODULE* PCVFLOG_MODULE;
+
+typedef struct _VFLOG_FAULT
+{
+    ULONG FaultType;
+    ULONG StackHash;
+    ULONG ThreadId;
+    ULONG FrameCount;
+    LONGLONG Time;
+    VFSYMSRV_FRAME Frames[VFSYMSRV_MAX_FRAMES];
+} VFLOG_FAULT, *PVFLOG_FAULT;
+
+typedef const VFLOG_FAULT* PCVFLOG_FAULT;
+
+//
+// Called for each record in the order of the log. Records of a known type
+// which are malformed are reported to Invalid, records of a type the reader
+// does not know are skipped.
+//
+typedef struct _VFLOG_CALLBACKS
+{
+    VOID (*Module)(PVOID Context, PCVFLOG_MODULE Module);
+    VOID (*Fault)(PVOID Context, PCVFLOG_FAULT Fault);
+    VOID (*Invalid)(PVOID Context, USHORT Type, ULONG Offset);
+} VFLOG_CALLBACKS, *PVFLOG_CALLBACKS;
+
+typedef const VFLOG_CALLBACKS* PCVFLOG_CALLBACKS;
+
+typedef struct _VFLOG_SUMMARY
+{
+    ULONG ProcessId;
+    LONGLONG StartTime;
+    ULONG Modules;
+    ULONG Faults;
+    ULONG Unknown;
+    ULONG Invalid;
+    BOOLEAN Truncated;
+    ULONG TruncatedOffset;
+} VFLOG_SUMMARY, *PVFLOG_SUMMARY;
+
+BOOLEAN VfLogParse(
+    PCBYTE Buffer,
+    SIZE_T Length,
+    PCVFLOG_CALLBACKS Callbacks,
+    PVOID Context,
+    PVFLOG_SUMMARY Summary
+    );
+
+ULONG VfLogMaxModules(
+    SIZE_T Length
+    );
+
+SIZE_T VfLogModuleBaseName(
+    PCVFLOG_MODULE Module,
+    PCHAR Buffer,
+    SIZE_T BufferSize
+    );
+
+SIZE_T VfLogToUtf8(
+    PCWCH String,
+    ULONG Length,
+    PCHAR Buffer,
+    SIZE_T BufferSize
+    );
+
+//
+// Stand-in symbol directory. It is laid out like a symbol store, keyed by the
+// module identity the log records:
+//
+//   <directory>/<module>/<TIMESTAMP><size of image>/<module>.sym
+//
+// where the time date stamp is eight upper case hex digits and the size of
+// image is lower case hex without leading zeros, as a symbol server keys the
+// image. Each line of a .sym file is a symbol:
+//
+//   <rva> <size> <name>
+//
+// with the RVA and size in hex. A symbol of size zero extends to the next
+// symbol. Empty lines and lines starting with '#' are ignored. The files can
+// be produced from a PDB store by any tool which dumps the public and
+// function symbols.
+//
+
+typedef struct _VFSYMDIR VFSYMDIR, *PVFSYMDIR;
+typedef struct _VFSYMDIR_MAP VFSYMDIR_MAP, *PVFSYMDIR_MAP;
+
+typedef const VFSYMDIR_MAP* PCVFSYMDIR_MAP;
+
+PVFSYMDIR VfSymDirOpen(
+    PCSTR Path
+    );
+
+VOID VfSymDirClose(
+    PVFSYMDIR SymDir
+    );
+
+PCVFSYMDIR_MAP VfSymDirLoadModule(
+    PVFSYMDIR SymDir,
+    PCSTR BaseName,
+    ULONG TimeDateStamp,
+    ULONG SizeOfImage
+    );
+
+BOOLEAN VfSymDirLookup(
+    PCVFSYMDIR_MAP Map,
+    ULONG Rva,
+    PCSTR* Name,
+    PULONG Displacement
+    );
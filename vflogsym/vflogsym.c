@@ -0,0 +1,292 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include "vflog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Offline symbolizer of vfdynf fault logs for any host, the counterpart of
+// vfsymsrv.exe -log which needs dbghelp. Symbols come from a stand-in symbol
+// directory (see vflog.h) and the output is that of vfsymsrv.exe -log, so
+// the two can be used interchangeably by whatever consumes the reports.
+//
+// usage: vflogsym <symbol directory> <log file> [log file ...]
+//
+
+typedef struct _VFLOGSYM_MODULE
+{
+    PCHAR BaseName;
+    ULONG SizeOfImage;
+    PCVFSYMDIR_MAP Map;
+} VFLOGSYM_MODULE, *PVFLOGSYM_MODULE;
+
+typedef struct _VFLOGSYM_CONTEXT
+{
+    PVFSYMDIR SymDir;
+    PVFLOGSYM_MODULE Modules;
+    ULONG MaxModules;
+} VFLOGSYM_CONTEXT, *PVFLOGSYM_CONTEXT;
+
+static VOID VfLogSymOnModule(
+    PVOID Context,
+    PCVFLOG_MODULE Module
+    )
+{
+    PVFLOGSYM_CONTEXT context;
+    PVFLOGSYM_MODULE loaded;
+    CHAR baseName[VFSYMSRV_MAX_MODULE_PATH * 4];
+    SIZE_T length;
+
+    context = Context;
+
+    if (Module->Index >= context->MaxModules)
+    {
+        printf("invalid module record\n");
+        return;
+    }
+
+    length = VfLogModuleBaseName(Module, baseName, sizeof(baseName));
+
+    loaded = &context->Modules[Module->Index];
+
+    free(loaded->BaseName);
+
+    loaded->BaseName = malloc(length + 1);
+    if (!loaded->BaseName)
+    {
+        loaded->Map = NULL;
+        return;
+    }
+
+    memcpy(loaded->BaseName, baseName, length + 1);
+    loaded->SizeOfImage = Module->SizeOfImage;
+    loaded->Map = VfSymDirLoadModule(context->SymDir,
+                                     baseName,
+                                     Module->TimeDateStamp,
+                                     Module->SizeOfImage);
+}
+
+static VOID VfLogSymOnFault(
+    PVOID Context,
+    PCVFLOG_FAULT Fault
+    )
+{
+    PVFLOGSYM_CONTEXT context;
+
+    context = Context;
+
+    printf("fault type 0x%08x thread %u stack 0x%08x time 0x%016llx\n",
+           Fault->FaultType,
+           Fault->ThreadId,
+           Fault->StackHash,
+           (unsigned long long)Fault->Time);
+
+    for (ULONG i = 0; i < Fault->FrameCount; i++)
+    {
+        PVFLOGSYM_MODULE module;
+        ULONG rva;
+        PCSTR name;
+        ULONG disp;
+
+        if ((Fault->Frames[i].ModuleIndex >= context->MaxModules) ||
+            !context->Modules[Fault->Frames[i].ModuleIndex].BaseName)
+        {
+            printf("    <unknown>\n");
+            continue;
+        }
+
+        module = &context->Modules[Fault->Frames[i].ModuleIndex];
+        rva = Fault->Frames[i].Rva;
+
+        if ((rva < module->SizeOfImage) &&
+            VfSymDirLookup(module->Map, rva, &name, &disp))
+        {
+            printf("    %s!%s+0x%x\n", module->BaseName, name, disp);
+            continue;
+        }
+
+        printf("    %s+0x%x\n", module->BaseName, rva);
+    }
+}
+
+static VOID VfLogSymOnInvalid(
+    PVOID Context,
+    USHORT Type,
+    ULONG Offset
+    )
+{
+    (VOID)Context;
+    (VOID)Offset;
+
+    if (Type == VFSYMSRV_LOG_RECORD_MODULE)
+    {
+        printf("invalid module record\n");
+    }
+    else
+    {
+        printf("invalid fault record\n");
+    }
+}
+
+static const VFLOG_CALLBACKS VfLogSymCallbacks =
+{
+    .Module = VfLogSymOnModule,
+    .Fault = VfLogSymOnFault,
+    .Invalid = VfLogSymOnInvalid,
+};
+
+static PCBYTE VfLogSymReadFile(
+    PCSTR FileName,
+    PSIZE_T Length
+    )
+{
+    FILE* file;
+    PBYTE buffer;
+    long length;
+
+    buffer = NULL;
+
+    file = fopen(FileName, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+
+    if ((fseek(file, 0, SEEK_END) != 0) ||
+        ((length = ftell(file)) < 0) ||
+        (fseek(file, 0, SEEK_SET) != 0))
+    {
+        goto Exit;
+    }
+
+    buffer = malloc(length ? (SIZE_T)length : 1);
+    if (!buffer)
+    {
+        goto Exit;
+    }
+
+    if (fread(buffer, 1, (SIZE_T)length, file) != (SIZE_T)length)
+    {
+        free(buffer);
+        buffer = NULL;
+        goto Exit;
+    }
+
+    *Length = (SIZE_T)length;
+
+Exit:
+
+    fclose(file);
+
+    return buffer;
+}
+
+static BOOLEAN VfLogSymProcessLog(
+    PVFSYMDIR SymDir,
+    PCSTR FileName
+    )
+{
+    BOOLEAN result;
+    PCBYTE buffer;
+    SIZE_T length;
+    VFLOGSYM_CONTEXT context;
+    VFLOG_SUMMARY summary;
+
+    result = FALSE;
+    context.Modules = NULL;
+
+    buffer = VfLogSymReadFile(FileName, &length);
+    if (!buffer)
+    {
+        printf("failed to read %s\n", FileName);
+        return FALSE;
+    }
+
+    context.SymDir = SymDir;
+    context.MaxModules = VfLogMaxModules(length);
+    context.Modules = calloc((context.MaxModules ? context.MaxModules : 1),
+                             sizeof(VFLOGSYM_MODULE));
+    if (!context.Modules)
+    {
+        printf("failed to allocate log buffers\n");
+        goto Exit;
+    }
+
+    //
+    // The header is checked before anything is printed so an invalid log
+    // gives only the one line, as it does from vfsymsrv.exe -log.
+    //
+    if (!VfLogParse(buffer, length, NULL, NULL, &summary))
+    {
+        printf("invalid log %s\n", FileName);
+        goto Exit;
+    }
+
+    printf("%s: process %u\n", FileName, summary.ProcessId);
+
+    VfLogParse(buffer, length, &VfLogSymCallbacks, &context, &summary);
+
+    if (summary.Truncated)
+    {
+        printf("truncated log at offset %u\n", summary.TruncatedOffset);
+    }
+
+    printf("%s: %u faults\n", FileName, summary.Faults);
+
+    result = TRUE;
+
+Exit:
+
+    if (context.Modules)
+    {
+        for (ULONG i = 0; i < context.MaxModules; i++)
+        {
+            free(context.Modules[i].BaseName);
+        }
+
+        free(context.Modules);
+    }
+
+    free((PVOID)buffer);
+
+    return result;
+}
+
+int main(
+    int argc,
+    char* argv[]
+    )
+{
+    PVFSYMDIR symDir;
+    int exitCode;
+
+    if (argc < 3)
+    {
+        printf("usage: vflogsym <symbol directory> <log file> [log file ...]\n");
+        return 1;
+    }
+
+    symDir = VfSymDirOpen(argv[1]);
+    if (!symDir)
+    {
+        printf("failed to open symbol directory %s\n", argv[1]);
+        return 1;
+    }
+
+    exitCode = 0;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (!VfLogSymProcessLog(symDir, argv[i]))
+        {
+            exitCode = 1;
+        }
+    }
+
+    VfSymDirClose(symDir);
+
+    return exitCode;
+}
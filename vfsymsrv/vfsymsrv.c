@@ -0,0 +1,705 @@
+/*
+    Copyright (c) Johnny Shaw. All rights reserved.
+*/
+#include <Windows.h>
+#include <DbgHelp.h>
+#include <stdio.h>
+#include <vfsymsrv.h>
+
+//
+// Out-of-process symbol broker for vfdynf. Symbols are resolved here rather
+// than in the verified process so PDBs are not loaded into the target address
+// space and the loaded symbols stay warm across targets and runs.
+//
+// Modules are loaded into a virtual dbghelp session at synthetic base
+// addresses, keyed by their identity. Any number of verified processes may
+// connect, each is serviced on its own thread and dbghelp is serialized.
+//
+// Fault logs written by vfdynf (FaultLogPath) are symbolized offline in batch
+// with the same module loading. The symbol search path may be a local PDB
+// store or a directory of stand-in symbols, nothing is resolved in the
+// processes that wrote the logs.
+//
+// Usage: vfsymsrv.exe [pipe name] [symbol search path]
+//        vfsymsrv.exe -log <symbol search path> <log file> [log file ...]
+//
+
+#define VFSYMSRV_BASE_ADDRESS 0x10000000ull
+#define VFSYMSRV_MAX_LOADED   1024
+
+typedef struct _VFSYMSRV_LOADED_MODULE
+{
+    ULONG TimeDateStamp;
+    ULONG SizeOfImage;
+    ULONG64 BaseAddress;
+    WCHAR FullName[VFSYMSRV_MAX_MODULE_PATH];
+} VFSYMSRV_LOADED_MODULE, *PVFSYMSRV_LOADED_MODULE;
+
+//
+// N.B. The base name refers into the log buffer, names in the log are not
+// terminated.
+//
+typedef struct _VFSYMSRV_LOG_LOADED_MODULE
+{
+    ULONG64 BaseAddress;
+    ULONG Generation;
+    ULONG SizeOfImage;
+    ULONG BaseNameLength;
+    PCWSTR BaseName;
+    PVFSYMSRV_LOG_MODULE Record;
+} VFSYMSRV_LOG_LOADED_MODULE, *PVFSYMSRV_LOG_LOADED_MODULE;
+
+typedef struct _VFSYMSRV_CONTEXT
+{
+    CRITICAL_SECTION CriticalSection;
+    HANDLE Process;
+    ULONG64 NextBase;
+    ULONG Generation;
+    ULONG ModuleCount;
+    VFSYMSRV_LOADED_MODULE Modules[VFSYMSRV_MAX_LOADED];
+    BYTE SymbolInfoBuffer[sizeof(SYMBOL_INFOW) + (VFSYMSRV_MAX_NAME * sizeof(WCHAR))];
+} VFSYMSRV_CONTEXT, *PVFSYMSRV_CONTEXT;
+
+static VFSYMSRV_CONTEXT SymSrvContext =
+{
+    .CriticalSection = { 0 },
+    .Process = NULL,
+    .NextBase = VFSYMSRV_BASE_ADDRESS,
+    .Generation = 0,
+    .ModuleCount = 0,
+    .Modules = { 0 },
+    .SymbolInfoBuffer = { 0 },
+};
+
+VOID SymSrvUnloadModules(
+    VOID
+    )
+{
+    for (ULONG i = 0; i < SymSrvContext.ModuleCount; i++)
+    {
+        if (SymSrvContext.Modules[i].BaseAddress)
+        {
+            SymUnloadModule64(SymSrvContext.Process,
+                              SymSrvContext.Modules[i].BaseAddress);
+        }
+    }
+
+    //
+    // N.B. Synthetic bases are never reused. A base handed out before the
+    // modules were unloaded no longer resolves to anything, rather than
+    // resolving to the symbols of some other module. Callers holding bases
+    // check the generation and load their modules again.
+    //
+    SymSrvContext.ModuleCount = 0;
+    SymSrvContext.Generation++;
+}
+
+_Requires_lock_held_(SymSrvContext.CriticalSection)
+ULONG64 SymSrvLoadModule(
+    _In_ PVFSYMSRV_MODULE Module
+    )
+{
+    PVFSYMSRV_LOADED_MODULE loaded;
+    ULONG64 baseAddress;
+
+    for (ULONG i = 0; i < SymSrvContext.ModuleCount; i++)
+    {
+        loaded = &SymSrvContext.Modules[i];
+
+        if ((loaded->TimeDateStamp == Module->TimeDateStamp) &&
+            (loaded->SizeOfImage == Module->SizeOfImage) &&
+            (_wcsicmp(loaded->FullName, Module->FullName) == 0))
+        {
+            return loaded->BaseAddress;
+        }
+    }
+
+    if (SymSrvContext.ModuleCount >= VFSYMSRV_MAX_LOADED)
+    {
+        printf("module table full, unloading all modules\n");
+        SymSrvUnloadModules();
+    }
+
+    loaded = &SymSrvContext.Modules[SymSrvContext.ModuleCount++];
+
+    loaded->TimeDateStamp = Module->TimeDateStamp;
+    loaded->SizeOfImage = Module->SizeOfImage;
+    loaded->BaseAddress = 0;
+    wcscpy_s(loaded->FullName, ARRAYSIZE(loaded->FullName), Module->FullName);
+
+    //
+    // Modules are given a synthetic base so that identical modules from any
+    // process share the same loaded symbols. A failed load is remembered with
+    // a zero base so it is not retried for every frame.
+    //
+    baseAddress = SymSrvContext.NextBase;
+
+    if (!SymLoadModuleExW(SymSrvContext.Process,
+                          NULL,
+                          Module->FullName,
+                          NULL,
+                          baseAddress,
+                          Module->SizeOfImage,
+                          NULL,
+                          0))
+    {
+        printf("failed to load %ls (%lu)\n", Module->FullName, GetLastError());
+        return 0;
+    }
+
+    SymSrvContext.NextBase += ((Module->SizeOfImage + 0xffffull) & ~0xffffull);
+
+    loaded->BaseAddress = baseAddress;
+
+    return baseAddress;
+}
+
+_Success_(return != FALSE)
+BOOLEAN SymSrvProcessRequest(
+    _In_reads_bytes_(RequestLength) PVFSYMSRV_REQUEST_HEADER Request,
+    _In_ ULONG RequestLength,
+    _Out_writes_bytes_(VFSYMSRV_MAX_RESPONSE_SIZE) PVFSYMSRV_RESPONSE_HEADER Response,
+    _Out_ PULONG ResponseLength
+    )
+{
+    PVFSYMSRV_MODULE modules;
+    PVFSYMSRV_FRAME frames;
+    ULONG64 bases[VFSYMSRV_MAX_FRAMES];
+    ULONG offset;
+
+    *ResponseLength = 0;
+
+    if ((RequestLength < sizeof(VFSYMSRV_REQUEST_HEADER)) ||
+        (Request->Magic != VFSYMSRV_MAGIC) ||
+        (Request->Version != VFSYMSRV_VERSION) ||
+        (Request->ModuleCount > VFSYMSRV_MAX_FRAMES) ||
+        (Request->FrameCount > VFSYMSRV_MAX_FRAMES) ||
+        (RequestLength != (sizeof(VFSYMSRV_REQUEST_HEADER) +
+                           (Request->ModuleCount * sizeof(VFSYMSRV_MODULE)) +
+                           (Request->FrameCount * sizeof(VFSYMSRV_FRAME)))))
+    {
+        printf("invalid request\n");
+        return FALSE;
+    }
+
+    modules = (PVFSYMSRV_MODULE)(Request + 1);
+    frames = (PVFSYMSRV_FRAME)&modules[Request->ModuleCount];
+
+    Response->Magic = VFSYMSRV_MAGIC;
+    Response->Version = VFSYMSRV_VERSION;
+    Response->FrameCount = Request->FrameCount;
+    Response->Reserved = 0;
+
+    offset = sizeof(VFSYMSRV_RESPONSE_HEADER);
+
+    EnterCriticalSection(&SymSrvContext.CriticalSection);
+
+    for (;;)
+    {
+        ULONG generation;
+
+        generation = SymSrvContext.Generation;
+
+        for (ULONG i = 0; i < Request->ModuleCount; i++)
+        {
+            modules[i].FullName[ARRAYSIZE(modules[i].FullName) - 1] = L'\0';
+
+            bases[i] = SymSrvLoadModule(&modules[i]);
+        }
+
+        //
+        // When the table filled while loading, the modules loaded before that
+        // are gone. A request has fewer modules than the table holds, so the
+        // second pass always completes.
+        //
+        if (generation == SymSrvContext.Generation)
+        {
+            break;
+        }
+    }
+
+    for (ULONG i = 0; i < Request->FrameCount; i++)
+    {
+        PSYMBOL_INFOW info;
+        ULONG64 disp;
+        USHORT length;
+
+        length = 0;
+        info = (PSYMBOL_INFOW)SymSrvContext.SymbolInfoBuffer;
+
+        if ((frames[i].ModuleIndex < Request->ModuleCount) &&
+            bases[frames[i].ModuleIndex] &&
+            (frames[i].Rva < modules[frames[i].ModuleIndex].SizeOfImage))
+        {
+            ZeroMemory(info, sizeof(SYMBOL_INFOW));
+            info->SizeOfStruct = sizeof(SYMBOL_INFOW);
+            info->MaxNameLen = VFSYMSRV_MAX_NAME;
+
+            if (SymFromAddrW(SymSrvContext.Process,
+                             bases[frames[i].ModuleIndex] + frames[i].Rva,
+                             &disp,
+                             info))
+            {
+                length = (USHORT)(min(info->NameLen, VFSYMSRV_MAX_NAME) * sizeof(WCHAR));
+            }
+        }
+
+        *(PUSHORT)((PBYTE)Response + offset) = length;
+        offset += sizeof(USHORT);
+
+        if (length)
+        {
+            CopyMemory((PBYTE)Response + offset, info->Name, length);
+            offset += length;
+        }
+    }
+
+    LeaveCriticalSection(&SymSrvContext.CriticalSection);
+
+    *ResponseLength = offset;
+
+    return TRUE;
+}
+
+DWORD WINAPI SymSrvClientThread(
+    _In_ LPVOID Parameter
+    )
+{
+    HANDLE pipeHandle;
+    PVFSYMSRV_REQUEST_HEADER request;
+    PVFSYMSRV_RESPONSE_HEADER response;
+
+    pipeHandle = Parameter;
+
+    request = HeapAlloc(GetProcessHeap(), 0, VFSYMSRV_MAX_REQUEST_SIZE);
+    response = HeapAlloc(GetProcessHeap(), 0, VFSYMSRV_MAX_RESPONSE_SIZE);
+    if (!request || !response)
+    {
+        printf("failed to allocate client buffers\n");
+        goto Exit;
+    }
+
+    for (;;)
+    {
+        DWORD length;
+        ULONG responseLength;
+
+        if (!ReadFile(pipeHandle,
+                      request,
+                      VFSYMSRV_MAX_REQUEST_SIZE,
+                      &length,
+                      NULL))
+        {
+            break;
+        }
+
+        if (!SymSrvProcessRequest(request, length, response, &responseLength))
+        {
+            break;
+        }
+
+        if (!WriteFile(pipeHandle, response, responseLength, &length, NULL))
+        {
+            break;
+        }
+    }
+
+Exit:
+
+    if (request)
+    {
+        HeapFree(GetProcessHeap(), 0, request);
+    }
+
+    if (response)
+    {
+        HeapFree(GetProcessHeap(), 0, response);
+    }
+
+    DisconnectNamedPipe(pipeHandle);
+    CloseHandle(pipeHandle);
+
+    return 0;
+}
+
+_Requires_lock_held_(SymSrvContext.CriticalSection)
+VOID SymSrvLoadLogModule(
+    _Inout_ PVFSYMSRV_LOG_LOADED_MODULE Module
+    )
+{
+    VFSYMSRV_MODULE identity;
+
+    ZeroMemory(&identity, sizeof(identity));
+    identity.TimeDateStamp = Module->Record->TimeDateStamp;
+    identity.SizeOfImage = Module->Record->SizeOfImage;
+    CopyMemory(identity.FullName, Module->Record->FullName, Module->Record->NameLength);
+
+    Module->BaseAddress = SymSrvLoadModule(&identity);
+    Module->Generation = SymSrvContext.Generation;
+}
+
+VOID SymSrvPrintLogFrame(
+    _In_ PVFSYMSRV_LOG_LOADED_MODULE Module,
+    _In_ ULONG Rva
+    )
+{
+    PSYMBOL_INFOW info;
+    ULONG64 disp;
+
+    if (Module->Generation != SymSrvContext.Generation)
+    {
+        SymSrvLoadLogModule(Module);
+    }
+
+    if (Module->BaseAddress && (Rva < Module->SizeOfImage))
+    {
+        info = (PSYMBOL_INFOW)SymSrvContext.SymbolInfoBuffer;
+
+        ZeroMemory(info, sizeof(SYMBOL_INFOW));
+        info->SizeOfStruct = sizeof(SYMBOL_INFOW);
+        info->MaxNameLen = VFSYMSRV_MAX_NAME;
+
+        if (SymFromAddrW(SymSrvContext.Process,
+                         Module->BaseAddress + Rva,
+                         &disp,
+                         info))
+        {
+            printf("    %.*ls!%.*ls+0x%llx\n",
+                   (int)Module->BaseNameLength,
+                   Module->BaseName,
+                   (int)min(info->NameLen, VFSYMSRV_MAX_NAME),
+                   info->Name,
+                   disp);
+            return;
+        }
+    }
+
+    printf("    %.*ls+0x%lx\n",
+           (int)Module->BaseNameLength,
+           Module->BaseName,
+           Rva);
+}
+
+_Success_(return != FALSE)
+BOOLEAN SymSrvProcessLog(
+    _In_z_ PCWSTR FileName
+    )
+{
+    BOOLEAN result;
+    HANDLE fileHandle;
+    LARGE_INTEGER fileSize;
+    PBYTE buffer;
+    PVFSYMSRV_LOG_HEADER header;
+    PVFSYMSRV_LOG_LOADED_MODULE modules;
+    ULONG maxModules;
+    ULONG offset;
+    ULONG length;
+    ULONG faults;
+
+    result = FALSE;
+    buffer = NULL;
+    modules = NULL;
+    faults = 0;
+
+    fileHandle = CreateFileW(FileName,
+                             GENERIC_READ,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE,
+                             NULL,
+                             OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL,
+                             NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+    {
+        printf("failed to open %ls (%lu)\n", FileName, GetLastError());
+        return FALSE;
+    }
+
+    if (!GetFileSizeEx(fileHandle, &fileSize) ||
+        (fileSize.QuadPart < sizeof(VFSYMSRV_LOG_HEADER)) ||
+        (fileSize.QuadPart > MAXLONG))
+    {
+        printf("invalid log %ls\n", FileName);
+        goto Exit;
+    }
+
+    length = fileSize.LowPart;
+
+    //
+    // Every module record is at least the fixed part of the record, which
+    // bounds the number of module indices a valid log can define.
+    //
+    maxModules = (length / FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName));
+
+    buffer = HeapAlloc(GetProcessHeap(), 0, length);
+    modules = HeapAlloc(GetProcessHeap(),
+                        HEAP_ZERO_MEMORY,
+                        maxModules * sizeof(VFSYMSRV_LOG_LOADED_MODULE));
+    if (!buffer || !modules)
+    {
+        printf("failed to allocate log buffers\n");
+        goto Exit;
+    }
+
+    if (!ReadFile(fileHandle, buffer, length, &length, NULL) ||
+        (length != fileSize.LowPart))
+    {
+        printf("failed to read %ls (%lu)\n", FileName, GetLastError());
+        goto Exit;
+    }
+
+    header = (PVFSYMSRV_LOG_HEADER)buffer;
+
+    if ((header->Magic != VFSYMSRV_LOG_MAGIC) ||
+        (header->Version != VFSYMSRV_LOG_VERSION))
+    {
+        printf("invalid log %ls\n", FileName);
+        goto Exit;
+    }
+
+    printf("%ls: process %lu\n", FileName, header->ProcessId);
+
+    EnterCriticalSection(&SymSrvContext.CriticalSection);
+
+    //
+    // N.B. A log from a process which crashed may end in a partial record,
+    // everything before it is still reported.
+    //
+    for (offset = sizeof(VFSYMSRV_LOG_HEADER);
+         (length - offset) >= sizeof(VFSYMSRV_LOG_RECORD);
+         )
+    {
+        PVFSYMSRV_LOG_RECORD record;
+
+        record = (PVFSYMSRV_LOG_RECORD)(buffer + offset);
+
+        if ((record->Length < sizeof(VFSYMSRV_LOG_RECORD)) ||
+            (record->Length > (length - offset)))
+        {
+            printf("truncated log at offset %lu\n", offset);
+            break;
+        }
+
+        offset += record->Length;
+
+        if (record->Type == VFSYMSRV_LOG_RECORD_MODULE)
+        {
+            PVFSYMSRV_LOG_MODULE module;
+            PVFSYMSRV_LOG_LOADED_MODULE loaded;
+
+            module = (PVFSYMSRV_LOG_MODULE)record;
+
+            if ((record->Length < FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName)) ||
+                (module->Index >= maxModules) ||
+                (module->NameLength >= (VFSYMSRV_MAX_MODULE_PATH * sizeof(WCHAR))) ||
+                (module->NameLength > (record->Length - FIELD_OFFSET(VFSYMSRV_LOG_MODULE, FullName))))
+            {
+                printf("invalid module record\n");
+                continue;
+            }
+
+            loaded = &modules[module->Index];
+
+            loaded->Record = module;
+            loaded->SizeOfImage = module->SizeOfImage;
+
+            SymSrvLoadLogModule(loaded);
+
+            //
+            // N.B. The name in the record is not terminated.
+            //
+            loaded->BaseName = module->FullName;
+            loaded->BaseNameLength = (module->NameLength / sizeof(WCHAR));
+
+            for (ULONG i = 0; i < (module->NameLength / sizeof(WCHAR)); i++)
+            {
+                if (module->FullName[i] == L'\\')
+                {
+                    loaded->BaseName = &module->FullName[i + 1];
+                    loaded->BaseNameLength = ((module->NameLength / sizeof(WCHAR)) - (i + 1));
+                }
+            }
+        }
+        else if (record->Type == VFSYMSRV_LOG_RECORD_FAULT)
+        {
+            PVFSYMSRV_LOG_FAULT fault;
+
+            fault = (PVFSYMSRV_LOG_FAULT)record;
+
+            if ((record->Length < FIELD_OFFSET(VFSYMSRV_LOG_FAULT, Frames)) ||
+                (fault->FrameCount > VFSYMSRV_MAX_FRAMES) ||
+                (record->Length != (FIELD_OFFSET(VFSYMSRV_LOG_FAULT, Frames) +
+                                    (fault->FrameCount * sizeof(VFSYMSRV_FRAME)))))
+            {
+                printf("invalid fault record\n");
+                continue;
+            }
+
+            faults++;
+
+            printf("fault type 0x%08lx thread %lu stack 0x%08lx time 0x%016llx\n",
+                   fault->FaultType,
+                   fault->ThreadId,
+                   fault->StackHash,
+                   fault->Time.QuadPart);
+
+            for (ULONG i = 0; i < fault->FrameCount; i++)
+            {
+                ULONG index;
+
+                index = fault->Frames[i].ModuleIndex;
+
+                if ((index >= maxModules) || !modules[index].BaseName)
+                {
+                    printf("    <unknown>\n");
+                    continue;
+                }
+
+                SymSrvPrintLogFrame(&modules[index], fault->Frames[i].Rva);
+            }
+        }
+    }
+
+    LeaveCriticalSection(&SymSrvContext.CriticalSection);
+
+    printf("%ls: %lu faults\n", FileName, faults);
+
+    result = TRUE;
+
+Exit:
+
+    if (modules)
+    {
+        HeapFree(GetProcessHeap(), 0, modules);
+    }
+
+    if (buffer)
+    {
+        HeapFree(GetProcessHeap(), 0, buffer);
+    }
+
+    CloseHandle(fileHandle);
+
+    return result;
+}
+
+int wmain(
+    _In_ int argc,
+    _In_reads_(argc) wchar_t* argv[]
+    )
+{
+    WCHAR pipeName[MAX_PATH];
+    PCWSTR searchPath;
+    BOOLEAN offline;
+
+    offline = ((argc > 1) && (_wcsicmp(argv[1], L"-log") == 0));
+
+    if (offline)
+    {
+        if (argc < 4)
+        {
+            printf("usage: vfsymsrv.exe -log <symbol search path> <log file> [log file ...]\n");
+            return 1;
+        }
+
+        searchPath = argv[2];
+    }
+    else
+    {
+        swprintf_s(pipeName,
+                   ARRAYSIZE(pipeName),
+                   L"\\\\.\\pipe\\%ls",
+                   (argc > 1) ? argv[1] : VFSYMSRV_DEFAULT_PIPE_NAME);
+
+        searchPath = (argc > 2) ? argv[2] : NULL;
+    }
+
+    InitializeCriticalSection(&SymSrvContext.CriticalSection);
+
+    SymSrvContext.Process = GetCurrentProcess();
+
+    SymSetOptions(SymGetOptions() |
+                  SYMOPT_UNDNAME |
+                  SYMOPT_DEFERRED_LOADS |
+                  SYMOPT_FAIL_CRITICAL_ERRORS);
+
+    if (!SymInitializeW(SymSrvContext.Process, searchPath, FALSE))
+    {
+        printf("failed to initialize symbols (%lu)\n", GetLastError());
+        return 1;
+    }
+
+    if (offline)
+    {
+        int exitCode;
+
+        exitCode = 0;
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (!SymSrvProcessLog(argv[i]))
+            {
+                exitCode = 1;
+            }
+        }
+
+        SymCleanup(SymSrvContext.Process);
+
+        DeleteCriticalSection(&SymSrvContext.CriticalSection);
+
+        return exitCode;
+    }
+
+    printf("listening on %ls\n", pipeName);
+
+    for (;;)
+    {
+        HANDLE pipeHandle;
+        HANDLE threadHandle;
+
+        pipeHandle = CreateNamedPipeW(pipeName,
+                                      PIPE_ACCESS_DUPLEX,
+                                      (PIPE_TYPE_MESSAGE |
+                                       PIPE_READMODE_MESSAGE |
+                                       PIPE_WAIT |
+                                       PIPE_REJECT_REMOTE_CLIENTS),
+                                      PIPE_UNLIMITED_INSTANCES,
+                                      VFSYMSRV_MAX_RESPONSE_SIZE,
+                                      VFSYMSRV_MAX_REQUEST_SIZE,
+                                      0,
+                                      NULL);
+        if (pipeHandle == INVALID_HANDLE_VALUE)
+        {
+            printf("failed to create pipe (%lu)\n", GetLastError());
+            break;
+        }
+
+        if (!ConnectNamedPipe(pipeHandle, NULL) &&
+            (GetLastError() != ERROR_PIPE_CONNECTED))
+        {
+            CloseHandle(pipeHandle);
+            continue;
+        }
+
+        threadHandle = CreateThread(NULL,
+                                    0,
+                                    SymSrvClientThread,
+                                    pipeHandle,
+                                    0,
+                                    NULL);
+        if (!threadHandle)
+        {
+            printf("failed to create client thread (%lu)\n", GetLastError());
+            DisconnectNamedPipe(pipeHandle);
+            CloseHandle(pipeHandle);
+            continue;
+        }
+
+        CloseHandle(threadHandle);
+    }
+
+    SymCleanup(SymSrvContext.Process);
+
+    DeleteCriticalSection(&SymSrvContext.CriticalSection);
+
+    return 0;
+}